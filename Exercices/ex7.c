@@ -7,13 +7,14 @@
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <nom_vm> <dest_uri>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <nom_vm> <dest_uri> [bande_passante_MiB/s]\n", argv[0]);
         return 1;
     }
 
     const char *targetVM = argv[1];   // Nom de la VM à migrer 
     const char *destURI  = argv[2];   // URI de l'hôte destination
+    unsigned long long bandwidth = argc == 4 ? strtoull(argv[3], NULL, 10) : 0;
 
     virConnectPtr srcConn = NULL;
     virConnectPtr destConn = NULL;
@@ -47,10 +48,20 @@ int main(int argc, char *argv[])
 
     printf("Migration de la VM '%s' vers %s (mode UNSAFE)...\n", targetVM, destURI);
 
-    int flags = VIR_MIGRATE_LIVE | VIR_MIGRATE_UNSAFE |
-                VIR_MIGRATE_UNDEFINE_SOURCE | VIR_MIGRATE_PERSIST_DEST;
+    /* Auto-converge : la migration d'une VM très active finit par converger */
+    unsigned int flags = VIR_MIGRATE_LIVE | VIR_MIGRATE_UNSAFE |
+                         VIR_MIGRATE_UNDEFINE_SOURCE | VIR_MIGRATE_PERSIST_DEST |
+                         VIR_MIGRATE_AUTO_CONVERGE;
 
-    virDomainPtr newDom = virDomainMigrate(dom, destConn, flags, NULL, NULL, 0);
+    /* Plafond de bande passante passé en paramètre typé */
+    virTypedParameterPtr params = NULL;
+    int nparams = 0, maxparams = 0;
+    if (bandwidth)
+        virTypedParamsAddULLong(&params, &nparams, &maxparams,
+                                VIR_MIGRATE_PARAM_BANDWIDTH, bandwidth);
+
+    virDomainPtr newDom = virDomainMigrate3(dom, destConn, params, nparams, flags);
+    virTypedParamsFree(params, nparams);
 
     if (newDom) {
         printf("Migration réussie vers %s.\n", destURI);
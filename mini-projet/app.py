@@ -1,10 +1,10 @@
-from flask import Flask, jsonify, render_template, request
+from flask import Flask, Response, jsonify, render_template, request
 import ctypes
 import os
 import libvirt
 import json
-UPLOAD_FOLDER = "/var/lib/libvirt/images/"
-os.makedirs(UPLOAD_FOLDER, exist_ok=True)
+import threading
+import time
 
 app = Flask(__name__)
 
@@ -12,7 +12,31 @@ lib = ctypes.CDLL("./libvirt_api.so")
 
 # SIGNATURES C
 lib.list_vms.argtypes = [ctypes.c_char_p]
-lib.list_vms.restype = ctypes.c_char_p
+lib.list_vms.restype = ctypes.c_void_p
+
+lib.list_vms_ex.argtypes = [ctypes.c_char_p, ctypes.c_uint]
+lib.list_vms_ex.restype  = ctypes.c_void_p
+
+lib.list_vms_since.argtypes = [ctypes.c_char_p, ctypes.c_ulonglong]
+lib.list_vms_since.restype  = ctypes.c_void_p
+
+lib.list_vms_bin.argtypes = [ctypes.c_char_p, ctypes.c_uint, ctypes.c_void_p,
+                             ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
+lib.list_vms_bin.restype  = ctypes.c_long
+
+lib.wait_events.argtypes = [ctypes.c_char_p, ctypes.c_ulonglong, ctypes.c_int]
+lib.wait_events.restype  = ctypes.c_void_p
+
+# Masque des champs de list_vms_ex (VM_FIELD_* côté C)
+CHAMPS_VM = {
+    "uuid":    1 << 0,
+    "state":   1 << 1,
+    "vcpus":   1 << 2,
+    "memory":  1 << 3,
+    "cputime": 1 << 4,
+    "block":   1 << 5,
+    "net":     1 << 6,
+}
 
 lib.create_vm.argtypes = [
     ctypes.c_char_p,  # uri
@@ -20,45 +44,239 @@ lib.create_vm.argtypes = [
     ctypes.c_char_p,  # ram
     ctypes.c_char_p,  # cpu
     ctypes.c_char_p,  # disk
-    ctypes.c_char_p   # iso
+    ctypes.c_char_p,  # iso
+    ctypes.c_char_p   # osinfo
 ]
-lib.create_vm.restype = ctypes.c_char_p
+lib.create_vm.restype = ctypes.c_void_p
 
 lib.start_vm.argtypes   = [ctypes.c_char_p, ctypes.c_char_p]
-lib.start_vm.restype    = ctypes.c_char_p
+lib.start_vm.restype    = ctypes.c_void_p
 lib.stop_vm.argtypes    = [ctypes.c_char_p, ctypes.c_char_p]
-lib.stop_vm.restype     = ctypes.c_char_p
+lib.stop_vm.restype     = ctypes.c_void_p
 lib.pause_vm.argtypes   = [ctypes.c_char_p, ctypes.c_char_p]
-lib.pause_vm.restype    = ctypes.c_char_p
+lib.pause_vm.restype    = ctypes.c_void_p
 lib.resume_vm.argtypes  = [ctypes.c_char_p, ctypes.c_char_p]
-lib.resume_vm.restype   = ctypes.c_char_p
+lib.resume_vm.restype   = ctypes.c_void_p
 lib.destroy_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
-lib.destroy_vm.restype  = ctypes.c_char_p
+lib.destroy_vm.restype  = ctypes.c_void_p
 
 lib.console_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
-lib.console_vm.restype = ctypes.c_char_p
+lib.console_vm.restype = ctypes.c_void_p
 
 lib.clone_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p]
-lib.clone_vm.restype  = ctypes.c_char_p
+lib.clone_vm.restype  = ctypes.c_void_p
+lib.clone_vm_mode.argtypes = [ctypes.c_char_p] * 4
+lib.clone_vm_mode.restype  = ctypes.c_void_p
 
 lib.migrate_vm.argtypes = [
     ctypes.c_char_p,  # srcURI
     ctypes.c_char_p,  # vmName
     ctypes.c_char_p   # destURI
 ]
-lib.migrate_vm.restype = ctypes.c_char_p
+lib.migrate_vm.restype = ctypes.c_void_p
+lib.migrate_vm_ex.argtypes = [ctypes.c_char_p] * 4
+lib.migrate_vm_ex.restype  = ctypes.c_void_p
 
 lib.restart_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
-lib.restart_vm.restype  = ctypes.c_char_p
+lib.restart_vm.restype  = ctypes.c_void_p
 
 lib.snapshot_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p]
-lib.snapshot_vm.restype  = ctypes.c_char_p
+lib.snapshot_vm.restype  = ctypes.c_void_p
 
 lib.list_snapshots.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
-lib.list_snapshots.restype  = ctypes.c_char_p
+lib.list_snapshots.restype  = ctypes.c_void_p
+
+lib.snapshot_vm_mode.argtypes = [ctypes.c_char_p] * 4
+lib.snapshot_vm_mode.restype  = ctypes.c_void_p
+lib.snapshot_commit.argtypes  = [ctypes.c_char_p, ctypes.c_char_p]
+lib.snapshot_commit.restype   = ctypes.c_void_p
+
+lib.list_snapshots_ex.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+                                  ctypes.c_longlong, ctypes.c_longlong,
+                                  ctypes.c_int, ctypes.c_int]
+lib.list_snapshots_ex.restype  = ctypes.c_void_p
 
 lib.revert_snapshot.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p]
-lib.revert_snapshot.restype  = ctypes.c_char_p
+lib.revert_snapshot.restype  = ctypes.c_void_p
+
+lib.job_submit_create.argtypes = [ctypes.c_char_p] * 7
+lib.job_submit_create.restype  = ctypes.c_int
+lib.job_submit_clone.argtypes  = [ctypes.c_char_p] * 4
+lib.job_submit_clone.restype   = ctypes.c_int
+lib.job_submit_migrate.argtypes = [ctypes.c_char_p] * 4
+lib.job_submit_migrate.restype  = ctypes.c_int
+lib.job_submit_commit.argtypes  = [ctypes.c_char_p, ctypes.c_char_p]
+lib.job_submit_commit.restype   = ctypes.c_int
+lib.job_submit_backup.argtypes  = [ctypes.c_char_p] * 4 + [ctypes.c_int]
+lib.job_submit_backup.restype   = ctypes.c_int
+lib.job_submit_restore.argtypes = [ctypes.c_char_p] * 4
+lib.job_submit_restore.restype  = ctypes.c_int
+
+lib.job_status.argtypes = [ctypes.c_int]
+lib.job_status.restype  = ctypes.c_void_p
+lib.job_list.argtypes   = []
+lib.job_list.restype    = ctypes.c_void_p
+lib.job_cancel.argtypes = [ctypes.c_int]
+lib.job_cancel.restype  = ctypes.c_void_p
+
+lib.batch_vms.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int]
+lib.batch_vms.restype  = ctypes.c_void_p
+
+lib.template_register.argtypes   = [ctypes.c_char_p, ctypes.c_char_p]
+lib.template_register.restype    = ctypes.c_void_p
+lib.template_unregister.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+lib.template_unregister.restype  = ctypes.c_void_p
+lib.template_list.argtypes       = [ctypes.c_char_p]
+lib.template_list.restype        = ctypes.c_void_p
+lib.template_instantiate.argtypes = [ctypes.c_char_p, ctypes.c_char_p,
+                                     ctypes.c_char_p, ctypes.c_int,
+                                     ctypes.c_char_p]
+lib.template_instantiate.restype  = ctypes.c_void_p
+lib.warm_pool_fill.argtypes = [ctypes.c_char_p, ctypes.c_char_p,
+                               ctypes.c_int, ctypes.c_char_p]
+lib.warm_pool_fill.restype  = ctypes.c_void_p
+lib.warm_pool_take.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+lib.warm_pool_take.restype  = ctypes.c_void_p
+
+lib.telemetry_start.argtypes   = [ctypes.c_char_p, ctypes.c_int]
+lib.telemetry_start.restype    = ctypes.c_void_p
+lib.telemetry_stop.argtypes    = [ctypes.c_char_p]
+lib.telemetry_stop.restype     = ctypes.c_void_p
+lib.telemetry_rates.argtypes   = [ctypes.c_char_p, ctypes.c_int]
+lib.telemetry_rates.restype    = ctypes.c_void_p
+lib.telemetry_history.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int]
+lib.telemetry_history.restype  = ctypes.c_void_p
+
+lib.metrics_render.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_size_t,
+                               ctypes.POINTER(ctypes.c_size_t)]
+lib.metrics_render.restype  = ctypes.c_long
+
+lib.get_api_stats.argtypes = []
+lib.get_api_stats.restype  = ctypes.c_void_p
+
+lib.iso_list.argtypes = [ctypes.c_char_p]
+lib.iso_list.restype  = ctypes.c_void_p
+lib.upload_begin.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+                             ctypes.c_ulonglong]
+lib.upload_begin.restype  = ctypes.c_void_p
+lib.upload_chunk.argtypes = [ctypes.c_int, ctypes.c_char_p, ctypes.c_size_t]
+lib.upload_chunk.restype  = ctypes.c_int
+lib.upload_finish.argtypes = [ctypes.c_int]
+lib.upload_finish.restype  = ctypes.c_void_p
+lib.upload_abort.argtypes = [ctypes.c_int]
+lib.upload_abort.restype  = ctypes.c_void_p
+
+lib.save_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int]
+lib.save_vm.restype  = ctypes.c_void_p
+lib.restore_vm.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+lib.restore_vm.restype  = ctypes.c_void_p
+lib.list_saves.argtypes = [ctypes.c_char_p]
+lib.list_saves.restype  = ctypes.c_void_p
+
+lib.sched_hosts.argtypes = [ctypes.c_char_p]
+lib.sched_hosts.restype  = ctypes.c_void_p
+lib.sched_place.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+                            ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                            ctypes.c_char_p]
+lib.sched_place.restype  = ctypes.c_void_p
+
+lib.backup_list.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+lib.backup_list.restype  = ctypes.c_void_p
+
+lib.free_result.argtypes = [ctypes.c_void_p]
+lib.free_result.restype  = None
+
+
+# Temps vu depuis Python pour chaque fonction C, appel ctypes et copie du
+# résultat compris ; comparé aux durées mesurées côté C (get_api_stats),
+# il donne le coût de la couche ctypes.
+_temps_ctypes = {}
+_verrou_temps = threading.Lock()
+
+
+def _mesurer(fonction, debut):
+    duree = time.perf_counter_ns() - debut
+    with _verrou_temps:
+        stats = _temps_ctypes.setdefault(fonction.__name__, [0, 0])
+        stats[0] += 1
+        stats[1] += duree
+
+
+def appel_c(fonction, *args):
+    """Appelle une fonction de libvirt_api.so et libère la chaîne retournée.
+
+    Chaque appel C alloue son propre résultat : les requêtes concurrentes
+    ne partagent aucun tampon.
+    """
+    debut = time.perf_counter_ns()
+    ptr = fonction(*args)
+    if not ptr:
+        return ""
+    try:
+        return ctypes.string_at(ptr).decode("utf-8")
+    finally:
+        lib.free_result(ptr)
+        _mesurer(fonction, debut)
+
+
+def reponse_c(fonction, *args, statut_erreur=200):
+    """Renvoie tel quel le JSON produit par la bibliothèque C.
+
+    Les octets sont copiés une seule fois (ctypes.string_at) puis envoyés
+    au client, sans décodage, json.loads ni jsonify. Un document
+    {"error": …} reçoit le code `statut_erreur`.
+    """
+    debut = time.perf_counter_ns()
+    ptr = fonction(*args)
+    if not ptr:
+        return jsonify({"error": "Résultat vide"}), 500
+    try:
+        corps = ctypes.string_at(ptr)
+    finally:
+        lib.free_result(ptr)
+        _mesurer(fonction, debut)
+    statut = statut_erreur if corps.startswith(b'{"error"') else 200
+    return Response(corps, status=statut, mimetype="application/json")
+
+
+# ---------- Listage binaire (list_vms_bin) ----------
+#
+# En-tête de 32 octets, enregistrements de 96 octets, puis table des
+# noms, entiers little-endian : voir struct vm_bin_header / vm_bin_record
+# dans libvirt_api.c. Le tampon est renvoyé tel quel aux clients.
+
+_tampons = threading.local()
+
+
+def appel_tampon(cle, fonction, *args):
+    """Appelle une fonction C qui écrit dans le tampon de l'appelant.
+
+    Le tampon (un par thread et par `cle`) est réutilisé d'un appel à
+    l'autre et agrandi quand la fonction répond -2. Retourne un
+    memoryview sur les octets écrits, ou None si la fonction échoue.
+    """
+    debut = time.perf_counter_ns()
+    tampon = getattr(_tampons, cle, None) or bytearray(64 * 1024)
+    besoin = ctypes.c_size_t(0)
+    while True:
+        vue_c = (ctypes.c_char * len(tampon)).from_buffer(tampon)
+        n = fonction(*args, vue_c, len(tampon), ctypes.byref(besoin))
+        del vue_c
+        if n != -2:
+            break
+        tampon = bytearray(besoin.value + besoin.value // 2)
+    setattr(_tampons, cle, tampon)
+    _mesurer(fonction, debut)
+    return memoryview(tampon)[:n] if n >= 0 else None
+
+
+def lister_vms_binaire(uri, masque):
+    """Liste les VMs au format list_vms_bin, sans copie supplémentaire."""
+    vue = appel_tampon("vms", lib.list_vms_bin, uri, masque)
+    if vue is None:
+        raise RuntimeError("Impossible de lister les VMs")
+    return vue
+
 
 @app.route("/")
 def index():
@@ -66,54 +284,175 @@ def index():
 
 @app.route("/api/list_snapshots", methods=["POST"])
 def api_list_snapshots():
+    """Arbre des snapshots ; `filter` (all, roots, leaves), `since`/`until`
+    (secondes epoch), `offset` et `limit` optionnels."""
     data = request.get_json()
-    result = lib.list_snapshots(
+    return reponse_c(
+        lib.list_snapshots_ex,
         data["uri"].encode("utf-8"),
-        data["name"].encode("utf-8")
+        data["name"].encode("utf-8"),
+        data.get("filter", "all").encode("utf-8"),
+        int(data.get("since", 0)),
+        int(data.get("until", 0)),
+        int(data.get("offset", 0)),
+        int(data.get("limit", 0)),
+        statut_erreur=400
     )
-    return jsonify(json.loads(result.decode("utf-8")))
 
 @app.route("/api/revert_snapshot", methods=["POST"])
 def api_revert_snapshot():
     data = request.get_json()
-    msg = lib.revert_snapshot(
+    msg = appel_c(
+        lib.revert_snapshot,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8"),
         data["snapshot"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 @app.route("/api/snapshot", methods=["POST"])
 def api_snapshot():
+    """`mode` : internal (défaut), disk-only ou live."""
     data = request.get_json()
-    msg = lib.snapshot_vm(
+    msg = appel_c(
+        lib.snapshot_vm_mode,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8"),
-        data["snapshot"].encode("utf-8")
+        data["snapshot"].encode("utf-8"),
+        data.get("mode", "internal").encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 @app.route("/api/restart", methods=["POST"])
 def api_restart():
     data = request.get_json()
-    msg = lib.restart_vm(
+    msg = appel_c(
+        lib.restart_vm,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 @app.route("/api/vms")
 def api_vms():
+    """Liste des VMs, JSON transmis tel quel depuis le C.
+
+    ?format=binary renvoie le tampon list_vms_bin brut
+    (application/octet-stream) pour les clients qui le décodent eux-mêmes.
+    """
     uri = request.args.get("uri", "qemu:///system").encode("utf-8")
-    result = lib.list_vms(uri)
-    return jsonify(eval(result.decode("utf-8")))
+    fields = request.args.get("fields")
+    masque = None
+    if fields:
+        masque = 0
+        for champ in fields.split(","):
+            if champ == "all":
+                masque |= sum(CHAMPS_VM.values())
+            elif champ in CHAMPS_VM:
+                masque |= CHAMPS_VM[champ]
+            else:
+                return jsonify({"error": f"Champ inconnu : {champ}"}), 400
+
+    if request.args.get("format") == "binary":
+        try:
+            vue = lister_vms_binaire(uri, masque if masque is not None else
+                                     CHAMPS_VM["uuid"] | CHAMPS_VM["state"])
+        except RuntimeError as e:
+            return jsonify({"error": str(e)}), 500
+        return Response(bytes(vue), mimetype="application/octet-stream")
+
+    if masque is not None:
+        return reponse_c(lib.list_vms_ex, uri, masque)
+    if request.args.get("since"):
+        # Deltas depuis une génération du cache d'événements
+        return reponse_c(lib.list_vms_since, uri, int(request.args["since"]))
+    return reponse_c(lib.list_vms, uri)
+
+
+@app.route("/api/events")
+def api_events():
+    """Flux SSE des changements d'état des VMs (deltas uniquement).
+
+    Le client passe la génération obtenue avec /api/vms (paramètre
+    `since` ou en-tête Last-Event-ID à la reconnexion).
+    """
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    since = request.headers.get("Last-Event-ID") or request.args.get("since", "0")
+    since = int(since)
+
+    def flux():
+        nonlocal since
+        while True:
+            # Appel bloquant côté C (le GIL est relâché par ctypes)
+            res = json.loads(appel_c(lib.wait_events, uri, since, 15000))
+            if "error" in res:
+                yield f"event: unavailable\ndata: {json.dumps(res)}\n\n"
+                return
+            if res["overflow"]:
+                yield f"id: {res['generation']}\nevent: resync\ndata: {{}}\n\n"
+            for ev in res["events"]:
+                yield f"id: {ev['gen']}\nevent: domain\ndata: {json.dumps(ev)}\n\n"
+            if not res["events"] and not res["overflow"]:
+                yield ": keepalive\n\n"
+            since = res["generation"]
+
+    return Response(flux(), mimetype="text/event-stream",
+                    headers={"Cache-Control": "no-cache",
+                             "X-Accel-Buffering": "no"})
+
+
+# ---------- Placement multi-hôtes ----------
+#
+# Une création avec uri="auto" est placée par le C sur l'un des hôtes de
+# SCHED_HOSTS (URI séparées par des virgules), selon `policy` ou
+# SCHED_POLICY ("binpack" ou "spread").
+
+HOTES_PLACEMENT = "\n".join(
+    u.strip() for u in os.environ.get("SCHED_HOSTS", "").split(",") if u.strip())
+POLITIQUE_PLACEMENT = os.environ.get("SCHED_POLICY", "binpack")
+
+
+def placer(data, reserver=True):
+    """Retourne le document de placement C pour la VM décrite par `data`."""
+    return json.loads(appel_c(
+        lib.sched_place,
+        HOTES_PLACEMENT.encode("utf-8"),
+        (data.get("policy") or POLITIQUE_PLACEMENT).encode("utf-8"),
+        (data["name"] if reserver else "").encode("utf-8"),
+        int(data["ram"]), int(data["cpu"]), int(data["disk"]),
+        (data.get("iso") or "").encode("utf-8")))
+
+
+def uri_creation(data):
+    """URI où créer la VM : celle du client, ou l'hôte choisi si "auto"."""
+    if data["uri"] != "auto":
+        return data["uri"]
+    placement = placer(data)
+    if placement.get("error"):
+        raise ValueError(placement["error"])
+    return placement["uri"]
+
+
+@app.get("/api/placement")
+def api_placement_hosts():
+    return reponse_c(lib.sched_hosts, HOTES_PLACEMENT.encode("utf-8"))
+
+
+@app.post("/api/placement")
+def api_placement():
+    """Simule un placement (ram, cpu, disk, policy, iso) sans rien réserver."""
+    placement = placer(request.get_json(), reserver=False)
+    return jsonify(placement), 409 if placement.get("error") else 200
 
 
 @app.route("/api/create", methods=["POST"])
 def api_create():
     data = request.get_json()
 
-    uri  = data["uri"].encode("utf-8")
+    try:
+        uri = uri_creation(data).encode("utf-8")
+    except ValueError as e:
+        return jsonify({"error": str(e)}), 409
     name = data["name"].encode("utf-8")
     ram  = str(data["ram"]).encode("utf-8")
     cpu  = str(data["cpu"]).encode("utf-8")
@@ -121,64 +460,146 @@ def api_create():
     iso  = data["iso"].encode("utf-8")
     osinfo = data.get("osinfo", "linux2022").encode("utf-8")
     
-    msg = lib.create_vm(uri, name, ram, cpu, disk, iso, osinfo)
-    return jsonify({"message": msg.decode("utf-8")})
+    msg = appel_c(lib.create_vm, uri, name, ram, cpu, disk, iso, osinfo)
+    return jsonify({"message": msg})
 
 
 @app.route("/api/start", methods=["POST"])
 def api_start():
     data = request.get_json()
-    msg = lib.start_vm(
+    msg = appel_c(
+        lib.start_vm,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 
 @app.route("/api/stop", methods=["POST"])
 def api_stop():
     data = request.get_json()
-    msg = lib.stop_vm(
+    msg = appel_c(
+        lib.stop_vm,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 
 @app.route("/api/destroy", methods=["POST"])
 def api_destroy():
     data = request.get_json()
-    msg = lib.destroy_vm(
+    msg = appel_c(
+        lib.destroy_vm,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 
 @app.route("/api/pause", methods=["POST"])
 def api_pause():
     data = request.get_json()
-    msg = lib.pause_vm(
+    msg = appel_c(
+        lib.pause_vm,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
 
 
 @app.route("/api/resume", methods=["POST"])
 def api_resume():
     data = request.get_json()
-    msg = lib.resume_vm(
+    msg = appel_c(
+        lib.resume_vm,
         data["uri"].encode("utf-8"),
         data["name"].encode("utf-8")
     )
-    return jsonify({"message": msg.decode("utf-8")})
+    return jsonify({"message": msg})
+
+
+# ---------- Mise en veille sur disque ----------
+#
+# L'état des VMs est écrit dans SAVE_DIR (lu côté C) ; pour en mettre
+# plusieurs en veille d'un coup : /api/batch avec l'action "save".
+
+@app.post("/api/save")
+def api_save():
+    """Met une VM en veille ; `format` (sparse, zstd...) et `channels` optionnels."""
+    data = request.get_json()
+    return reponse_c(
+        lib.save_vm,
+        data["uri"].encode("utf-8"),
+        data["name"].encode("utf-8"),
+        data.get("format", "").encode("utf-8"),
+        int(data.get("channels", 0)),
+        statut_erreur=500)
+
+
+@app.post("/api/restore")
+def api_restore():
+    data = request.get_json()
+    msg = appel_c(
+        lib.restore_vm,
+        data["uri"].encode("utf-8"),
+        data["name"].encode("utf-8")
+    )
+    return jsonify({"message": msg})
+
+
+@app.get("/api/saves")
+def api_saves():
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    return reponse_c(lib.list_saves, uri, statut_erreur=500)
+
+
+# ---------- Images ISO ----------
+#
+# Les ISO sont des volumes des pools de stockage : la liste est servie
+# par l'index C, relu seulement sur événement de pool. Le téléversement
+# écrit le corps de la requête dans un volume, bloc par bloc, sans
+# fichier temporaire ; les blocs nuls deviennent des trous côté C.
+
+BLOC_TELEVERSEMENT = 1 << 20  # multiple de UPLOAD_BLOCK (libvirt_api.c)
 
 
 @app.route("/api/iso")
 def api_iso():
-    files = [f for f in os.listdir(UPLOAD_FOLDER) if f.endswith(".iso")]
-    return jsonify(files)
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    return reponse_c(lib.iso_list, uri, statut_erreur=500)
+
+
+@app.route("/api/iso/upload", methods=["PUT", "POST"])
+def api_iso_upload():
+    """Téléverse le corps brut de la requête dans le volume `name` du pool `pool`.
+
+    Content-Length est obligatoire : il fixe la taille du volume.
+    """
+    taille = request.content_length
+    if taille is None:
+        return jsonify({"error": "Content-Length requis"}), 411
+
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    debut = json.loads(appel_c(
+        lib.upload_begin, uri,
+        request.args.get("pool", "default").encode("utf-8"),
+        request.args.get("name", "").encode("utf-8"),
+        taille))
+    if "error" in debut:
+        return jsonify(debut), 400
+
+    ident = debut["id"]
+    try:
+        while True:
+            bloc = request.stream.read(BLOC_TELEVERSEMENT)
+            if not bloc or lib.upload_chunk(ident, bloc, len(bloc)) < 0:
+                break
+    except Exception:
+        # Client déconnecté : le volume partiel est supprimé
+        appel_c(lib.upload_abort, ident)
+        raise
+    return reponse_c(lib.upload_finish, ident, statut_erreur=400)
 
 @app.route("/api/console", methods=["POST"])
 def api_console():
@@ -187,10 +608,7 @@ def api_console():
     uri  = data["uri"].encode("utf-8")
     name = data["name"].encode("utf-8")
 
-    res = lib.console_vm(uri, name).decode("utf-8")
-
-    # res est un JSON dans une chaîne de caractères
-    return jsonify(eval(res))
+    return reponse_c(lib.console_vm, uri, name)
 
 
 @app.route("/api/clone", methods=["POST"])
@@ -199,8 +617,9 @@ def api_clone():
     uri  = data["uri"].encode()
     src  = data["src"].encode()
     dst  = data["dst"].encode()
+    mode = data.get("mode", "full").encode()  # "full" ou "linked"
 
-    res = lib.clone_vm(uri, src, dst).decode()
+    res = appel_c(lib.clone_vm_mode, uri, src, dst, mode)
     return jsonify({"message": res})
 
 @app.post("/api/migrate")
@@ -220,9 +639,276 @@ def api_migrate():
     name_b = name.encode("utf-8")
     dest_b = dest.encode("utf-8")
 
-    res = lib.migrate_vm(src_b, name_b, dest_b).decode("utf-8")
+    res = appel_c(lib.migrate_vm_ex, src_b, name_b, dest_b,
+                  options_migration(data).encode("utf-8"))
     return jsonify({"message": res})
 
 
+OPTIONS_MIGRATION = ("parallel", "compression", "bandwidth",
+                     "auto_converge", "postcopy")
+
+
+def options_migration(data):
+    """Options de migrate_vm_ex ("clé=valeur,…") tirées de la requête JSON.
+
+    parallel (connexions), compression (xbzrle|zstd), bandwidth (MiB/s),
+    auto_converge (bool), postcopy (off|auto|on).
+    """
+    options = []
+    for cle in OPTIONS_MIGRATION:
+        valeur = data.get(cle)
+        if valeur is None or valeur == "":
+            continue
+        if isinstance(valeur, bool):
+            valeur = int(valeur)
+        options.append(f"{cle}={valeur}")
+    return ",".join(options)
+
+
+# ---------- Tâches asynchrones (création, clonage, migration) ----------
+
+def soumettre_tache(data):
+    """Traduit une requête JSON en appel job_submit_* ; retourne l'id."""
+    kind = data.get("kind")
+    if kind == "create":
+        return lib.job_submit_create(
+            uri_creation(data).encode("utf-8"),
+            data["name"].encode("utf-8"),
+            str(data["ram"]).encode("utf-8"),
+            str(data["cpu"]).encode("utf-8"),
+            str(data["disk"]).encode("utf-8"),
+            data["iso"].encode("utf-8"),
+            data.get("osinfo", "linux2022").encode("utf-8"))
+    if kind == "clone":
+        return lib.job_submit_clone(
+            data["uri"].encode("utf-8"),
+            data["src"].encode("utf-8"),
+            data["dst"].encode("utf-8"),
+            data.get("mode", "full").encode("utf-8"))
+    if kind == "migrate":
+        return lib.job_submit_migrate(
+            data["uri"].encode("utf-8"),
+            data["name"].encode("utf-8"),
+            data["dest"].encode("utf-8"),
+            options_migration(data).encode("utf-8"))
+    if kind == "commit":
+        return lib.job_submit_commit(
+            data["uri"].encode("utf-8"),
+            data["name"].encode("utf-8"))
+    if kind == "backup":
+        return lib.job_submit_backup(
+            data["uri"].encode("utf-8"),
+            data["name"].encode("utf-8"),
+            REPERTOIRE_SAUVEGARDES.encode("utf-8"),
+            data.get("mode", "auto").encode("utf-8"),
+            int(data.get("keep", CHAINES_CONSERVEES)))
+    if kind == "restore":
+        return lib.job_submit_restore(
+            data["uri"].encode("utf-8"),
+            data["name"].encode("utf-8"),
+            REPERTOIRE_SAUVEGARDES.encode("utf-8"),
+            data["checkpoint"].encode("utf-8"))
+    raise ValueError(f"Type de tâche inconnu : {kind}")
+
+
+@app.post("/api/jobs")
+def api_jobs_submit():
+    try:
+        job_id = soumettre_tache(request.get_json())
+    except (KeyError, ValueError) as e:
+        return jsonify({"error": f"Requête invalide : {e}"}), 400
+
+    if job_id < 0:
+        return jsonify({"error": "Trop de tâches en cours"}), 503
+    return jsonify({"id": job_id}), 202
+
+
+@app.get("/api/jobs")
+def api_jobs_list():
+    return reponse_c(lib.job_list)
+
+
+@app.get("/api/jobs/<int:job_id>")
+def api_job_status(job_id):
+    return reponse_c(lib.job_status, job_id, statut_erreur=404)
+
+
+@app.post("/api/jobs/<int:job_id>/cancel")
+def api_job_cancel(job_id):
+    return jsonify({"message": appel_c(lib.job_cancel, job_id)})
+
+
+@app.post("/api/batch")
+def api_batch():
+    """Applique une action (start, stop, pause, resume, restart, destroy)
+    à une liste de VMs, en parallèle côté C ; un résultat par VM."""
+    data = request.get_json()
+    names = data.get("names", [])
+    if any("\n" in n for n in names):
+        return jsonify({"error": "Nom de VM invalide"}), 400
+
+    return reponse_c(
+        lib.batch_vms,
+        data["uri"].encode("utf-8"),
+        data["action"].encode("utf-8"),
+        "\n".join(names).encode("utf-8"),
+        int(data.get("workers", 0)),
+        statut_erreur=400)
+
+
+# ---------- Modèles ----------
+
+@app.get("/api/templates")
+def api_templates():
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    return reponse_c(lib.template_list, uri, statut_erreur=500)
+
+
+@app.post("/api/templates")
+def api_template_register():
+    data = request.get_json()
+    msg = appel_c(lib.template_register,
+                  data["uri"].encode("utf-8"), data["name"].encode("utf-8"))
+    return jsonify({"message": msg})
+
+
+@app.delete("/api/templates/<name>")
+def api_template_unregister(name):
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    return jsonify({"message": appel_c(lib.template_unregister, uri, name.encode("utf-8"))})
+
+
+@app.post("/api/templates/<name>/instances")
+def api_template_instantiate(name):
+    """Crée `count` VMs depuis le modèle ; `user_data` (cloud-config) optionnel."""
+    data = request.get_json()
+    return reponse_c(
+        lib.template_instantiate,
+        data["uri"].encode("utf-8"),
+        name.encode("utf-8"),
+        data.get("prefix", name).encode("utf-8"),
+        int(data.get("count", 1)),
+        data.get("user_data", "").encode("utf-8"),
+        statut_erreur=400)
+
+
+@app.post("/api/templates/<name>/warm")
+def api_warm_fill(name):
+    """Complète le pool d'instances en pause jusqu'à `size`."""
+    data = request.get_json()
+    return reponse_c(
+        lib.warm_pool_fill,
+        data["uri"].encode("utf-8"),
+        name.encode("utf-8"),
+        int(data.get("size", 1)),
+        data.get("user_data", "").encode("utf-8"),
+        statut_erreur=400)
+
+
+@app.post("/api/templates/<name>/take")
+def api_warm_take(name):
+    """Reprend une instance du pool warm (quelques millisecondes)."""
+    data = request.get_json()
+    return reponse_c(lib.warm_pool_take,
+                     data["uri"].encode("utf-8"), name.encode("utf-8"),
+                     statut_erreur=409)
+
+
+# ---------- Sauvegardes ----------
+#
+# Sauvegardes complètes et incrémentales (tâches "backup" et "restore"
+# de /api/jobs). Le répertoire doit être local à l'hôte libvirt : qemu y
+# écrit directement les images.
+
+REPERTOIRE_SAUVEGARDES = os.environ.get("BACKUP_DIR", "/var/lib/libvirt/backups")
+CHAINES_CONSERVEES = int(os.environ.get("BACKUP_KEEP", "2"))
+
+
+@app.get("/api/backups/<name>")
+def api_backups(name):
+    return reponse_c(lib.backup_list,
+                     REPERTOIRE_SAUVEGARDES.encode("utf-8"), name.encode("utf-8"))
+
+
+# ---------- Télémétrie ----------
+#
+# Le collecteur C échantillonne l'hôte et les VMs en arrière-plan : ces
+# routes ne lisent que ses anneaux, sans appel à libvirtd. Il est lancé
+# à la première consultation d'une URI (période TELEMETRY_INTERVAL_MS).
+
+INTERVALLE_TELEMETRIE = int(os.environ.get("TELEMETRY_INTERVAL_MS", "0"))
+
+
+@app.get("/api/telemetry")
+def api_telemetry():
+    """Débits par VM et charge de l'hôte sur `window` secondes."""
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    appel_c(lib.telemetry_start, uri, INTERVALLE_TELEMETRIE)
+    return reponse_c(lib.telemetry_rates, uri,
+                     int(request.args.get("window", 0)), statut_erreur=503)
+
+
+@app.get("/api/telemetry/host")
+def api_telemetry_host():
+    """Séries CPU/mémoire de l'hôte pour les graphes."""
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    return reponse_c(lib.telemetry_history, uri, b"",
+                     int(request.args.get("window", 0)), statut_erreur=404)
+
+
+@app.get("/api/telemetry/vms/<name>")
+def api_telemetry_vm(name):
+    """Séries CPU, IOPS et octets/s d'une VM pour les graphes."""
+    uri = request.args.get("uri", "qemu:///system").encode("utf-8")
+    return reponse_c(lib.telemetry_history, uri, name.encode("utf-8"),
+                     int(request.args.get("window", 0)), statut_erreur=404)
+
+
+@app.post("/api/telemetry")
+def api_telemetry_control():
+    """Démarre le collecteur (`interval_ms`) ou l'arrête (`stop`: true)."""
+    data = request.get_json()
+    uri = data["uri"].encode("utf-8")
+    if data.get("stop"):
+        msg = appel_c(lib.telemetry_stop, uri)
+    else:
+        msg = appel_c(lib.telemetry_start, uri, int(data.get("interval_ms", 0)))
+    return jsonify({"message": msg})
+
+
+
+# ---------- Prometheus ----------
+
+URI_METRIQUES = os.environ.get("METRICS_URI", "qemu:///system")
+
+
+@app.get("/metrics")
+def metrics():
+    """Exposition Prometheus : domaines, hôte et statistiques de l'API.
+
+    Le texte est écrit par le C dans un tampon réutilisé par thread.
+    """
+    uri = request.args.get("uri", URI_METRIQUES).encode("utf-8")
+    vue = appel_tampon("metriques", lib.metrics_render, uri)
+    if vue is None:
+        return Response("Métriques indisponibles\n", status=503,
+                        mimetype="text/plain; charset=utf-8")
+    return Response(bytes(vue), mimetype="text/plain; version=0.0.4; charset=utf-8")
+
+
+@app.get("/api/stats")
+def api_stats():
+    """Histogrammes de latence par fonction C et par phase (connect,
+    lookup, operation, serialize), avec le temps vu depuis Python."""
+    stats = json.loads(appel_c(lib.get_api_stats))
+    with _verrou_temps:
+        vus = {nom: list(v) for nom, v in _temps_ctypes.items()}
+    for f in stats.get("functions", []):
+        if f["name"] in vus:
+            appels, ns = vus[f["name"]]
+            f["python"] = {"calls": appels, "sum_ms": round(ns / 1e6, 3)}
+    return jsonify(stats)
+
+
 if __name__ == "__main__":
-    app.run(host="0.0.0.0", port=8080, debug=True)
+    app.run(host="0.0.0.0", port=8080, debug=True, threaded=True)
@@ -0,0 +1,515 @@
+/*
+ * Banc d'essai des points d'entrée de libvirt_api.so.
+ *
+ * Les fonctions exportées sont appelées contre le pilote de test de
+ * libvirt (test:///default par défaut), sans hyperviseur. Le banc peuple
+ * le pilote avec N domaines démarrés, puis mesure pour chaque opération :
+ * débit (ops/s), latences (p50, p90, p99, max) et allocations par appel.
+ * Avec -t, chaque opération est exécutée simultanément par plusieurs
+ * threads, chacun sur sa propre tranche de domaines.
+ *
+ *   gcc -O2 -pthread bench_api.c -o bench_api ./libvirt_api.so -lvirt \
+ *       -Wl,-rpath,'$ORIGIN'
+ *   ./bench_api -n 2000 -i 500 -t 8
+ *
+ * Les allocations sont comptées en interposant malloc/calloc/realloc
+ * (glibc) : seules celles du thread appelant sont attribuées à l'appel,
+ * pas celles du thread de la boucle d'événements de libvirt.
+ *
+ * -S mesure la sérialisation JSON seule : list_vms est servi depuis le
+ * cache d'événements, sans RPC, pour 100 à N domaines. Un coût par
+ * domaine constant montre un passage à l'échelle linéaire.
+ */
+
+#include <libvirt/libvirt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ---------- Points d'entrée de libvirt_api.so ---------- */
+
+void  free_result(char *result);
+char* list_vms(const char *uri);
+char* list_vms_ex(const char *uri, unsigned int fields);
+char* list_vms_since(const char *uri, unsigned long long since);
+char* wait_events(const char *uri, unsigned long long since, int timeout_ms);
+char* list_snapshots(const char *uri, const char *name);
+char* snapshot_vm(const char *uri, const char *name, const char *snapname);
+char* revert_snapshot(const char *uri, const char *name, const char *snapname);
+char* restart_vm(const char *uri, const char *name);
+char* create_vm(const char *uri, const char *name, const char *ram,
+                const char *cpu, const char *disk, const char *iso,
+                const char *osinfo);
+char* start_vm(const char *uri, const char *name);
+char* stop_vm(const char *uri, const char *name);
+char* pause_vm(const char *uri, const char *name);
+char* resume_vm(const char *uri, const char *name);
+char* destroy_vm(const char *uri, const char *name);
+char* batch_vms(const char *uri, const char *action, const char *names, int workers);
+char* console_vm(const char *uri, const char *name);
+char* template_register(const char *uri, const char *name);
+char* template_unregister(const char *uri, const char *name);
+char* template_list(const char *uri);
+char* job_list(void);
+
+#define VM_FIELD_ALL 0x7f
+
+/* ---------- Comptage des allocations ---------- */
+
+static __thread unsigned long tl_allocs;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    tl_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    tl_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    tl_allocs++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOCS_COUNTED 1
+#else
+#define ALLOCS_COUNTED 0
+#endif
+
+/* ---------- Opérations mesurées ---------- */
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_SLICE_MAX   16   /* domaines par appel de batch_vms */
+
+struct ctx {
+    const char *uri;
+    int thread;
+    int first;          /* premier domaine de la tranche du thread */
+    int count;          /* taille de la tranche */
+    long iter;
+    char name[64];      /* domaine de l'itération */
+    char aux[128];      /* nom de snapshot, de VM créée, liste… */
+};
+
+/* Domaine de la tranche du thread ; `step` fait tourner les domaines. */
+static void ctx_domain(struct ctx *c, long step) {
+    snprintf(c->name, sizeof(c->name), "bench-%ld", c->first + step % c->count);
+}
+
+static char *op_list_vms(struct ctx *c)      { return list_vms(c->uri); }
+static char *op_list_vms_ex(struct ctx *c)   { return list_vms_ex(c->uri, VM_FIELD_ALL); }
+static char *op_list_vms_since(struct ctx *c) { return list_vms_since(c->uri, 0); }
+static char *op_wait_events(struct ctx *c)   { return wait_events(c->uri, 0, 0); }
+static char *op_template_list(struct ctx *c) { return template_list(c->uri); }
+static char *op_job_list(struct ctx *c)      { (void)c; return job_list(); }
+
+static char *op_list_snapshots(struct ctx *c) {
+    ctx_domain(c, c->iter);
+    return list_snapshots(c->uri, c->name);
+}
+
+static char *op_console(struct ctx *c) {
+    ctx_domain(c, c->iter);
+    return console_vm(c->uri, c->name);
+}
+
+static char *op_restart(struct ctx *c) {
+    ctx_domain(c, c->iter);
+    return restart_vm(c->uri, c->name);
+}
+
+/* Paires d'opérations : itération paire puis impaire sur le même domaine. */
+static char *op_pause_resume(struct ctx *c) {
+    ctx_domain(c, c->iter / 2);
+    return c->iter % 2 ? resume_vm(c->uri, c->name) : pause_vm(c->uri, c->name);
+}
+
+static char *op_stop_start(struct ctx *c) {
+    ctx_domain(c, c->iter / 2);
+    return c->iter % 2 ? start_vm(c->uri, c->name) : stop_vm(c->uri, c->name);
+}
+
+static char *op_snapshot_revert(struct ctx *c) {
+    ctx_domain(c, c->iter / 2);
+    snprintf(c->aux, sizeof(c->aux), "snap-%d-%ld", c->thread, c->iter / 2);
+    return c->iter % 2 ? revert_snapshot(c->uri, c->name, c->aux)
+                       : snapshot_vm(c->uri, c->name, c->aux);
+}
+
+static char *op_template_cycle(struct ctx *c) {
+    ctx_domain(c, c->iter / 2);
+    return c->iter % 2 ? template_unregister(c->uri, c->name)
+                       : template_register(c->uri, c->name);
+}
+
+/* Le pilote de test n'accepte que type='test' : create_vm (type='kvm')
+ * y mesure le chemin d'erreur, compté dans la colonne "err". */
+static char *op_create_destroy(struct ctx *c) {
+    snprintf(c->aux, sizeof(c->aux), "bench-new-%d-%ld", c->thread, c->iter / 2);
+    return c->iter % 2 ? destroy_vm(c->uri, c->aux)
+                       : create_vm(c->uri, c->aux, "256", "1", "1",
+                                   "/var/lib/libvirt/images/none.iso", "linux2022");
+}
+
+static char *op_batch_pause_resume(struct ctx *c) {
+    size_t len = 0;
+    int n = c->count < BENCH_SLICE_MAX ? c->count : BENCH_SLICE_MAX;
+    char list[BENCH_SLICE_MAX * 24];
+    for (int i = 0; i < n; i++)
+        len += snprintf(list + len, sizeof(list) - len, "bench-%d\n", c->first + i);
+    return batch_vms(c->uri, c->iter % 2 ? "resume" : "pause", list, 0);
+}
+
+struct bench {
+    const char *name;
+    char *(*op)(struct ctx *c);
+    int mutates;        /* modifie l'état des domaines */
+};
+
+static const struct bench benches[] = {
+    { "list_vms",             op_list_vms,           0 },
+    { "list_vms_ex(all)",     op_list_vms_ex,        0 },
+    { "list_vms_since(0)",    op_list_vms_since,     0 },
+    { "wait_events(0ms)",     op_wait_events,        0 },
+    { "list_snapshots",       op_list_snapshots,     0 },
+    { "template_list",        op_template_list,      0 },
+    { "job_list",             op_job_list,           0 },
+    { "console_vm",           op_console,            0 },
+    { "pause_vm/resume_vm",   op_pause_resume,       1 },
+    { "stop_vm/start_vm",     op_stop_start,         1 },
+    { "restart_vm",           op_restart,            1 },
+    { "snapshot_vm/revert",   op_snapshot_revert,    1 },
+    { "template_reg/unreg",   op_template_cycle,     1 },
+    { "create_vm/destroy_vm", op_create_destroy,     1 },
+    { "batch_vms(16)",        op_batch_pause_resume, 1 },
+};
+
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+/* ---------- Exécution ---------- */
+
+struct worker {
+    pthread_t tid;
+    const struct bench *b;
+    struct ctx ctx;
+    long iters;
+    unsigned long long *lat_ns;
+    unsigned long allocs;
+    long errors;
+};
+
+static pthread_barrier_t start_barrier;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int is_error(const char *res) {
+    return !res || strncmp(res, "Erreur", 6) == 0 || strstr(res, "\"error\"");
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    pthread_barrier_wait(&start_barrier);
+
+    for (long i = 0; i < w->iters; i++) {
+        w->ctx.iter = i;
+        unsigned long a0 = tl_allocs;
+        unsigned long long t0 = now_ns();
+        char *res = w->b->op(&w->ctx);
+        w->lat_ns[i] = now_ns() - t0;
+        w->errors += is_error(res);
+        free_result(res);
+        w->allocs += tl_allocs - a0;
+    }
+    return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(const unsigned long long *sorted, long n, double p) {
+    long i = (long)(p * (n - 1));
+    return sorted[i] / 1000.0;
+}
+
+static void run_bench(const struct bench *b, const char *uri, int ndoms,
+                      int nthreads, long iters, int json) {
+    struct worker w[BENCH_MAX_THREADS];
+    int per = ndoms / nthreads;
+
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (int t = 0; t < nthreads; t++) {
+        memset(&w[t], 0, sizeof(w[t]));
+        w[t].b = b;
+        w[t].iters = iters;
+        w[t].lat_ns = malloc(iters * sizeof(*w[t].lat_ns));
+        w[t].ctx.uri = uri;
+        w[t].ctx.thread = t;
+        w[t].ctx.first = per ? t * per : 0;
+        w[t].ctx.count = per ? per : ndoms;
+        pthread_create(&w[t].tid, NULL, worker_run, &w[t]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    unsigned long long t0 = now_ns();
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(w[t].tid, NULL);
+    double wall_s = (now_ns() - t0) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    long total = iters * nthreads;
+    unsigned long long *all = malloc(total * sizeof(*all));
+    unsigned long allocs = 0;
+    long errors = 0;
+    for (int t = 0; t < nthreads; t++) {
+        memcpy(all + t * iters, w[t].lat_ns, iters * sizeof(*all));
+        allocs += w[t].allocs;
+        errors += w[t].errors;
+        free(w[t].lat_ns);
+    }
+    qsort(all, total, sizeof(*all), cmp_ull);
+
+    double ops = total / wall_s;
+    double apc = (double)allocs / total;
+    if (json)
+        printf("{\"op\":\"%s\",\"threads\":%d,\"domains\":%d,\"calls\":%ld,"
+               "\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+               "\"p99_us\":%.1f,\"max_us\":%.1f,\"allocs_per_call\":%.1f,"
+               "\"errors\":%ld}\n",
+               b->name, nthreads, ndoms, total, ops,
+               pct_us(all, total, 0.50), pct_us(all, total, 0.90),
+               pct_us(all, total, 0.99), all[total - 1] / 1000.0,
+               ALLOCS_COUNTED ? apc : -1.0, errors);
+    else
+        printf("%-22s %8ld %10.0f %9.1f %9.1f %9.1f %10.1f %9.1f %6ld\n",
+               b->name, total, ops,
+               pct_us(all, total, 0.50), pct_us(all, total, 0.90),
+               pct_us(all, total, 0.99), all[total - 1] / 1000.0,
+               ALLOCS_COUNTED ? apc : -1.0, errors);
+    fflush(stdout);
+    free(all);
+}
+
+/* ---------- Peuplement du pilote de test ---------- */
+
+static const char *DOMAIN_XML =
+    "<domain type='test'>"
+    "  <name>bench-%d</name>"
+    "  <memory unit='MiB'>512</memory>"
+    "  <vcpu>1</vcpu>"
+    "  <os><type arch='i686'>hvm</type></os>"
+    "  <devices>"
+    "    <disk type='file' device='disk'>"
+    "      <source file='/guest/bench-%d.img'/>"
+    "      <target dev='hda'/>"
+    "    </disk>"
+    "    <graphics type='vnc' port='%d'/>"
+    "  </devices>"
+    "</domain>";
+
+/*
+ * Définit et démarre les domaines bench-0…bench-(n-1) manquants. Le
+ * pilote test:///default partage son état entre toutes les connexions
+ * du processus : les connexions du pool de libvirt_api.so les voient.
+ */
+static int populate(const char *uri, int n) {
+    virConnectPtr conn = virConnectOpen(uri);
+    if (!conn) {
+        fprintf(stderr, "Erreur : connexion à %s impossible\n", uri);
+        return -1;
+    }
+
+    char xml[1024], name[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "bench-%d", i);
+        virDomainPtr dom = virDomainLookupByName(conn, name);
+        if (!dom) {
+            snprintf(xml, sizeof(xml), DOMAIN_XML, i, i, 5900 + i % 60000);
+            dom = virDomainDefineXML(conn, xml);
+        }
+        if (!dom) {
+            fprintf(stderr, "Erreur : définition de %s impossible\n", name);
+            virConnectClose(conn);
+            return -1;
+        }
+        if (virDomainIsActive(dom) != 1)
+            virDomainCreate(dom);
+        virDomainFree(dom);
+    }
+
+    /* La connexion reste ouverte : fermer la dernière connexion à
+     * test:///default effacerait les domaines créés. */
+    return 0;
+}
+
+/*
+ * Écrit un fichier pour le pilote de test (URI test:///chemin) avec `n`
+ * domaines et un pool "default". Chaque connexion à un tel fichier a son
+ * propre état : à réserver aux opérations en lecture seule (-r).
+ */
+static int write_test_xml(const char *path, int n) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+
+    fprintf(f, "<node>\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, DOMAIN_XML, i, i, 5900 + i % 60000);
+        fprintf(f, "\n");
+    }
+    fprintf(f,
+        "<pool type='dir'>"
+        "  <name>default</name>"
+        "  <capacity>1099511627776</capacity>"
+        "  <allocation>0</allocation>"
+        "  <available>1099511627776</available>"
+        "  <target><path>/default-pool</path></target>"
+        "</pool>\n"
+        "</node>\n");
+    return fclose(f);
+}
+
+/* ---------- Passage à l'échelle de la sérialisation ---------- */
+
+static int count_domains(const char *json) {
+    int n = 0;
+    for (const char *p = json; p && (p = strstr(p, "\"name\":")); p++)
+        n++;
+    return n;
+}
+
+static void run_scaling(const char *uri, int max, long iters) {
+    static const int sizes[] = { 100, 1000, 2500, 5000, 10000, 25000, 50000 };
+    unsigned long long *lat = malloc(iters * sizeof(*lat));
+
+    printf("list_vms (cache) : %ld appels par taille\n"
+           "%8s %12s %10s %10s %12s %8s\n",
+           iters, "domaines", "octets", "p50 µs", "p99 µs", "ns/domaine", "allocs");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s] < max ? sizes[s] : max;
+        if (s > 0 && sizes[s - 1] >= max)
+            break;
+        if (populate(uri, n) < 0)
+            break;
+
+        /* Attendre que le cache ait reçu les événements des nouveaux domaines */
+        char *res = NULL;
+        for (int tries = 0; tries < 500; tries++) {
+            free_result(res);
+            res = list_vms(uri);
+            if (count_domains(res) >= n)
+                break;
+            usleep(10000);
+        }
+        size_t bytes = res ? strlen(res) : 0;
+        free_result(res);
+
+        unsigned long a0 = tl_allocs;
+        for (long i = 0; i < iters; i++) {
+            unsigned long long t0 = now_ns();
+            free_result(list_vms(uri));
+            lat[i] = now_ns() - t0;
+        }
+        double allocs = (double)(tl_allocs - a0) / iters;
+        qsort(lat, iters, sizeof(*lat), cmp_ull);
+
+        printf("%8d %12zu %10.1f %10.1f %12.1f %8.1f\n",
+               n, bytes, pct_us(lat, iters, 0.50), pct_us(lat, iters, 0.99),
+               (double)lat[iters / 2] / n, ALLOCS_COUNTED ? allocs : -1.0);
+        fflush(stdout);
+    }
+    free(lat);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -u URI    URI libvirt (défaut test:///default)\n"
+        "  -n N      domaines bench-N à créer (défaut 100)\n"
+        "  -i N      appels par thread et par opération (défaut 200)\n"
+        "  -t N      threads simultanés (défaut 1, max %d)\n"
+        "  -f MOTIF  seulement les opérations dont le nom contient MOTIF\n"
+        "  -r        opérations en lecture seule uniquement\n"
+        "  -j        une ligne JSON par opération (suivi des régressions)\n"
+        "  -S        passage à l'échelle de list_vms de 100 à N domaines\n"
+        "  -g FICHIER  écrit un XML de pilote de test avec N domaines et quitte\n",
+        prog, BENCH_MAX_THREADS);
+}
+
+int main(int argc, char *argv[]) {
+    const char *uri = "test:///default";
+    const char *filter = NULL;
+    const char *gen = NULL;
+    int ndoms = 100, nthreads = 1, readonly = 0, json = 0, scaling = 0;
+    long iters = 200;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:n:i:t:f:rjSg:h")) != -1) {
+        switch (opt) {
+        case 'u': uri = optarg; break;
+        case 'n': ndoms = atoi(optarg); break;
+        case 'i': iters = atol(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'r': readonly = 1; break;
+        case 'j': json = 1; break;
+        case 'S': scaling = 1; break;
+        case 'g': gen = optarg; break;
+        default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (ndoms < 1 || iters < 2 || nthreads < 1 || nthreads > BENCH_MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (gen) {
+        if (write_test_xml(gen, ndoms) < 0) {
+            perror(gen);
+            return 1;
+        }
+        printf("test://%s%s\n", gen[0] == '/' ? "" : "/", gen);
+        return 0;
+    }
+
+    if (scaling) {
+        run_scaling(uri, ndoms, iters);
+        return 0;
+    }
+
+    /* Un fichier XML fournit déjà ses domaines */
+    if (strcmp(uri, "test:///default") == 0 && populate(uri, ndoms) < 0)
+        return 1;
+
+    if (!json)
+        printf("%s, %d domaines, %d thread(s), %ld appels/thread\n"
+               "%-22s %8s %10s %9s %9s %9s %10s %9s %6s\n",
+               uri, ndoms, nthreads, iters,
+               "opération", "appels", "ops/s", "p50 µs", "p90 µs", "p99 µs",
+               "max µs", "allocs", "err");
+
+    for (int i = 0; i < NBENCHES; i++) {
+        if (filter && !strstr(benches[i].name, filter))
+            continue;
+        if (readonly && benches[i].mutates)
+            continue;
+        run_bench(&benches[i], uri, ndoms, nthreads, iters, json);
+    }
+    return 0;
+}
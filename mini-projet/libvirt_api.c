@@ -1,4 +1,7 @@
 #include <libvirt/libvirt.h>
+#include <endian.h>   // htole32
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,668 +10,8975 @@
 
 #include <sys/types.h>  // pid_t
 #include <sys/wait.h>   // waitpid
+#include <signal.h>
+#include <fcntl.h>    // open
+#include <sys/stat.h>
+#include <dirent.h>   // opendir
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>  // SYS_gettid
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
 
-const char* list_snapshots(const char *uri, const char *name) {
-    static char buffer[65536];
-    buffer[0] = '\0';
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>    // sondes USDT
+#define API_PROBE_CALL(func, ns, failed) \
+    DTRACE_PROBE3(libvirt_api, call, func, ns, failed)
+#define API_PROBE_PHASE(func, phase, ns) \
+    DTRACE_PROBE3(libvirt_api, phase, func, phase, ns)
+#endif
+#endif
 
+#ifndef API_PROBE_CALL
+#define API_PROBE_CALL(func, ns, failed)  ((void)0)
+#define API_PROBE_PHASE(func, phase, ns)  ((void)0)
+#endif
+
+/* ---------- Statistiques et traces de l'API ----------
+ *
+ * Chaque point d'entrée exporté ouvre une portée API_SCOPE() : à la
+ * sortie de la fonction, quel que soit le return emprunté, l'appel est
+ * compté et sa durée rangée dans l'histogramme de la fonction. Un appel
+ * est en échec s'il a produit un message « Erreur : … » (result_error) ou
+ * un {"error":…} (json_error). Seule la portée la plus externe compte :
+ * list_vms() appelant list_vms_since() n'est compté qu'une fois.
+ *
+ * La durée est aussi découpée en phases : connexion (pool_acquire),
+ * recherche du domaine (lookup_domain), opération, sérialisation (du
+ * premier jw_object_begin/jw_array_begin d'un document à jw_finish).
+ * Chaque phase a son propre histogramme par fonction.
+ *
+ * Les compteurs sont propres à chaque thread et n'ont qu'un écrivain :
+ * aucun verrou ni instruction atomique coûteuse sur le chemin chaud.
+ * get_api_stats() et /metrics additionnent les threads vivants et le
+ * cumul des threads terminés.
+ *
+ * Avec LIBVIRT_API_TRACE=<fichier>, chaque appel et chaque phase sont
+ * aussi écrits au format Chrome trace-event (chrome://tracing, Perfetto).
+ * Si <sys/sdt.h> est disponible, les sondes USDT libvirt_api:call et
+ * libvirt_api:phase sont compilées (bpftrace, perf, SystemTap) ; elles ne
+ * coûtent rien tant qu'aucun traceur n'y est attaché.
+ */
+
+#define API_FUNCTIONS(X) \
+    X(list_snapshots) X(list_snapshots_ex) X(revert_snapshot) X(snapshot_vm) \
+    X(snapshot_vm_mode) X(snapshot_commit) X(job_submit_commit) \
+    X(restart_vm) X(list_vms) X(list_vms_ex) X(list_vms_bin) X(list_vms_since) \
+    X(wait_events) X(telemetry_start) X(telemetry_stop) X(telemetry_rates) \
+    X(telemetry_history) X(metrics_render) X(get_api_stats) X(create_vm) \
+    X(start_vm) X(stop_vm) X(pause_vm) X(resume_vm) X(destroy_vm) \
+    X(batch_vms) X(console_vm) X(clone_vm) X(clone_vm_mode) \
+    X(template_register) X(template_unregister) X(template_list) \
+    X(template_instantiate) X(warm_pool_fill) X(warm_pool_take) \
+    X(migrate_vm) X(migrate_vm_ex) X(job_submit_create) X(job_submit_clone) \
+    X(job_submit_migrate) X(job_status) X(job_list) X(job_cancel) \
+    X(iso_list) X(upload_begin) X(upload_chunk) X(upload_finish) X(upload_abort) \
+    X(backup_run) X(backup_restore) X(backup_list) X(job_submit_backup) \
+    X(job_submit_restore) X(save_vm) X(restore_vm) X(list_saves) \
+    X(sched_hosts) X(sched_place)
+
+enum api_func {
+#define API_ENUM(name) API_##name,
+    API_FUNCTIONS(API_ENUM)
+#undef API_ENUM
+    API_COUNT
+};
+
+static const char *const api_names[API_COUNT] = {
+#define API_NAME(name) #name,
+    API_FUNCTIONS(API_NAME)
+#undef API_NAME
+};
+
+enum api_phase {
+    PH_CONNECT,
+    PH_LOOKUP,
+    PH_OPERATION,
+    PH_SERIALIZE,
+    PH_COUNT
+};
+
+static const char *const api_phase_names[PH_COUNT] = {
+    "connect", "lookup", "operation", "serialize"
+};
+
+/* Bornes supérieures des classes de latence, en microsecondes */
+static const unsigned long long api_buckets_us[] = {
+    10, 50, 100, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+#define API_NBUCKETS (int)(sizeof(api_buckets_us) / sizeof(api_buckets_us[0]))
+
+struct api_hist {
+    unsigned long long sum_ns;
+    unsigned long long buckets[API_NBUCKETS + 1];   /* dernière : +Inf */
+};
+
+struct api_stat {
+    unsigned long long errors;
+    struct api_hist total;
+    struct api_hist phases[PH_COUNT];
+};
+
+/* Compteurs d'un thread : écrits par lui seul, lus par les agrégations. */
+struct api_thread {
+    struct api_stat stats[API_COUNT];
+    struct api_thread *next;
+};
+
+struct api_scope {
+    int func;               /* -1 : portée imbriquée, non comptée */
+    unsigned long long t0;
+};
+
+static struct api_thread *api_threads;          /* threads vivants */
+static struct api_stat api_retired[API_COUNT];  /* cumul des threads terminés */
+static int api_nthreads;
+static pthread_mutex_t api_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t api_once = PTHREAD_ONCE_INIT;
+static pthread_key_t api_key;
+
+static FILE *api_trace;                         /* LIBVIRT_API_TRACE */
+static pthread_mutex_t api_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct api_thread *api_self;
+static __thread int api_depth;
+static __thread int api_failed;
+static __thread int api_func;
+static __thread int api_phase_cur;
+static __thread unsigned long long api_phase_t0;
+static __thread unsigned long long api_phase_ns[PH_COUNT];
+static __thread unsigned int api_phase_seen;
+static __thread long api_tid;
+
+static unsigned long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void api_stat_add(struct api_stat *dst, const struct api_stat *src) {
+    const unsigned long long *s = (const unsigned long long *)src;
+    unsigned long long *d = (unsigned long long *)dst;
+
+    for (size_t i = 0; i < sizeof(*src) / sizeof(*s); i++)
+        d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+/* Fin d'un thread : ses compteurs rejoignent le cumul. */
+static void api_thread_exit(void *arg) {
+    struct api_thread *t = arg;
+
+    pthread_mutex_lock(&api_lock);
+    for (struct api_thread **p = &api_threads; *p; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    for (int f = 0; f < API_COUNT; f++)
+        api_stat_add(&api_retired[f], &t->stats[f]);
+    api_nthreads--;
+    pthread_mutex_unlock(&api_lock);
+    free(t);
+}
+
+static void api_trace_close(void) {
+    pthread_mutex_lock(&api_trace_lock);
+    fprintf(api_trace, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                       "\"args\":{\"name\":\"libvirt_api\"}}\n]\n", (int)getpid());
+    fclose(api_trace);
+    api_trace = NULL;
+    pthread_mutex_unlock(&api_trace_lock);
+}
+
+static void api_init(void) {
+    pthread_key_create(&api_key, api_thread_exit);
+
+    const char *path = getenv("LIBVIRT_API_TRACE");
+    if (path && path[0] && (api_trace = fopen(path, "w"))) {
+        fputs("[\n", api_trace);
+        atexit(api_trace_close);
+    }
+}
+
+static struct api_thread *api_thread_get(void) {
+    if (api_self)
+        return api_self;
+
+    pthread_once(&api_once, api_init);
+    struct api_thread *t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    pthread_setspecific(api_key, t);
+    api_tid = (long)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&api_lock);
+    t->next = api_threads;
+    api_threads = t;
+    api_nthreads++;
+    pthread_mutex_unlock(&api_lock);
+    return api_self = t;
+}
+
+/* Écrivain unique : lecture et écriture simples, sans verrou. */
+static void api_hist_record(struct api_hist *h, unsigned long long ns) {
+    int b = 0;
+    while (b < API_NBUCKETS && ns > api_buckets_us[b] * 1000)
+        b++;
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+}
+
+static void api_trace_event(const char *name, const char *cat,
+                            unsigned long long t0, unsigned long long t1, int failed) {
+    pthread_mutex_lock(&api_trace_lock);
+    if (api_trace)
+        fprintf(api_trace, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                           "\"dur\":%.3f,\"pid\":%d,\"tid\":%ld%s},\n",
+                name, cat, t0 / 1e3, (t1 - t0) / 1e3, (int)getpid(), api_tid,
+                failed ? ",\"args\":{\"error\":true}" : "");
+    pthread_mutex_unlock(&api_trace_lock);
+}
+
+/* Clôt le segment de la phase courante à l'instant `now`. */
+static void api_phase_flush(unsigned long long now) {
+    api_phase_ns[api_phase_cur] += now - api_phase_t0;
+    api_phase_seen |= 1u << api_phase_cur;
+    if (api_trace)
+        api_trace_event(api_phase_names[api_phase_cur], api_names[api_func],
+                        api_phase_t0, now, 0);
+    api_phase_t0 = now;
+}
+
+/*
+ * Passe l'appel en cours dans la phase `phase` et retourne la phase
+ * quittée, à rétablir ensuite. Sans portée ouverte (threads de tâches),
+ * ne fait rien.
+ */
+static int api_phase_set(int phase) {
+    int prev = api_phase_cur;
+    if (api_depth == 0 || phase == prev)
+        return prev;
+
+    api_phase_flush(mono_ns());
+    api_phase_cur = phase;
+    return prev;
+}
+
+static struct api_scope api_scope_begin(int func) {
+    struct api_scope s = { -1, 0 };
+
+    if (api_depth++ == 0) {
+        api_thread_get();
+        s.func = func;
+        s.t0 = mono_ns();
+        api_failed = 0;
+        api_func = func;
+        api_phase_cur = PH_OPERATION;
+        api_phase_t0 = s.t0;
+        api_phase_seen = 0;
+        memset(api_phase_ns, 0, sizeof(api_phase_ns));
+    }
+    return s;
+}
+
+static void api_scope_end(struct api_scope *s) {
+    if (s->func < 0) {
+        api_depth--;
+        return;
+    }
+
+    unsigned long long end = mono_ns();
+    unsigned long long ns = end - s->t0;
+    api_phase_flush(end);
+    api_depth--;
+
+    struct api_thread *t = api_self;
+    if (t) {
+        struct api_stat *st = &t->stats[s->func];
+        api_hist_record(&st->total, ns);
+        for (int p = 0; p < PH_COUNT; p++) {
+            if (api_phase_seen & (1u << p))
+                api_hist_record(&st->phases[p], api_phase_ns[p]);
+        }
+        if (api_failed)
+            __atomic_store_n(&st->errors, st->errors + 1, __ATOMIC_RELAXED);
+    }
+
+    for (int p = 0; p < PH_COUNT; p++) {
+        if (api_phase_seen & (1u << p))
+            API_PROBE_PHASE(api_names[s->func], api_phase_names[p], api_phase_ns[p]);
+    }
+    API_PROBE_CALL(api_names[s->func], ns, api_failed);
+    if (api_trace)
+        api_trace_event(api_names[s->func], "api", s->t0, end, api_failed);
+}
+
+#define API_SCOPE(name) \
+    struct api_scope api_scope_ __attribute__((cleanup(api_scope_end))) = \
+        api_scope_begin(API_##name)
+
+/* Somme des compteurs de tous les threads ; `out` : API_COUNT entrées. */
+static int api_stats_collect(struct api_stat *out) {
+    pthread_mutex_lock(&api_lock);
+    memcpy(out, api_retired, sizeof(api_retired));
+    for (struct api_thread *t = api_threads; t; t = t->next) {
+        for (int f = 0; f < API_COUNT; f++)
+            api_stat_add(&out[f], &t->stats[f]);
+    }
+    int threads = api_nthreads;
+    pthread_mutex_unlock(&api_lock);
+    return threads;
+}
+
+static unsigned long long api_hist_count(const struct api_hist *h) {
+    unsigned long long n = 0;
+    for (int b = 0; b <= API_NBUCKETS; b++)
+        n += h->buckets[b];
+    return n;
+}
+
+/* ---------- XML libvirt ----------
+ *
+ * Les XML de domaine, de volume et de snapshot sont lus et réécrits en
+ * arbre DOM avec libxml2 (dont libvirt dépend déjà) : recherche XPath,
+ * échappement et taille sont laissés à la bibliothèque. Un chemin XPath
+ * est évalué depuis `ctx` s'il est fourni, sinon depuis le document.
+ * Les XML générés partent d'un squelette constant complété par XPath.
+ */
+
+static pthread_once_t xml_once = PTHREAD_ONCE_INIT;
+
+static void xml_init(void) {
+    xmlInitParser();
+}
+
+/* Analyse un XML. NULL s'il est absent ou mal formé. */
+static xmlDocPtr xml_parse(const char *text) {
+    pthread_once(&xml_once, xml_init);
+    if (!text)
+        return NULL;
+    return xmlReadMemory(text, (int)strlen(text), NULL, NULL,
+                         XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+}
+
+/* Élément racine sérialisé, sans déclaration XML (chaîne allouée). */
+static char *xml_dump(xmlDocPtr doc) {
+    xmlBufferPtr buf = xmlBufferCreate();
+    if (!buf)
+        return NULL;
+    char *out = NULL;
+    if (xmlNodeDump(buf, doc, xmlDocGetRootElement(doc), 0, 0) >= 0)
+        out = strdup((const char *)xmlBufferContent(buf));
+    xmlBufferFree(buf);
+    return out;
+}
+
+/*
+ * Nœuds désignés par `xpath` dans un tableau alloué (NULL s'il n'y en a
+ * aucun). Retourne leur nombre, -1 si l'expression est invalide.
+ */
+static int xml_find(xmlDocPtr doc, xmlNodePtr ctx, const char *xpath,
+                    xmlNodePtr **out) {
+    *out = NULL;
+    xmlXPathContextPtr xc = xmlXPathNewContext(doc);
+    if (!xc)
+        return -1;
+    if (ctx)
+        xc->node = ctx;
+
+    int n = -1;
+    xmlXPathObjectPtr obj = xmlXPathEvalExpression((const xmlChar *)xpath, xc);
+    if (obj && obj->type == XPATH_NODESET) {
+        n = obj->nodesetval ? obj->nodesetval->nodeNr : 0;
+        if (n > 0) {
+            *out = malloc(n * sizeof(**out));
+            if (*out)
+                memcpy(*out, obj->nodesetval->nodeTab, n * sizeof(**out));
+            else
+                n = -1;
+        }
+    }
+    xmlXPathFreeObject(obj);
+    xmlXPathFreeContext(xc);
+    return n;
+}
+
+static xmlNodePtr xml_first(xmlDocPtr doc, xmlNodePtr ctx, const char *xpath) {
+    xmlNodePtr *nodes;
+    int n = xml_find(doc, ctx, xpath, &nodes);
+    xmlNodePtr node = n > 0 ? nodes[0] : NULL;
+    free(nodes);
+    return node;
+}
+
+/* Texte d'un élément ou valeur d'un attribut (chaîne allouée, NULL si vide). */
+static char *xml_get(xmlDocPtr doc, xmlNodePtr ctx, const char *xpath) {
+    xmlNodePtr node = xml_first(doc, ctx, xpath);
+    xmlChar *value = node ? xmlNodeGetContent(node) : NULL;
+    char *out = value && value[0] ? strdup((const char *)value) : NULL;
+    xmlFree(value);
+    return out;
+}
+
+/* Remplace le texte du premier élément désigné par `xpath`. */
+static int xml_set_text(xmlDocPtr doc, xmlNodePtr ctx, const char *xpath,
+                        const char *value) {
+    xmlNodePtr node = xml_first(doc, ctx, xpath);
+    if (!node)
+        return -1;
+    xmlNodeSetContent(node, NULL);
+    xmlNodeAddContent(node, (const xmlChar *)value);
+    return 0;
+}
+
+/* Fixe l'attribut `attr` du premier élément désigné par `xpath`. */
+static int xml_set_attr(xmlDocPtr doc, xmlNodePtr ctx, const char *xpath,
+                        const char *attr, const char *value) {
+    xmlNodePtr node = xml_first(doc, ctx, xpath);
+    if (!node || !xmlSetProp(node, (const xmlChar *)attr, (const xmlChar *)value))
+        return -1;
+    return 0;
+}
+
+/* Supprime tous les nœuds désignés par `xpath`. */
+static void xml_remove(xmlDocPtr doc, xmlNodePtr ctx, const char *xpath) {
+    xmlNodePtr *nodes;
+    int n = xml_find(doc, ctx, xpath, &nodes);
+    for (int i = 0; i < n; i++) {
+        xmlUnlinkNode(nodes[i]);
+        xmlFreeNode(nodes[i]);
+    }
+    free(nodes);
+}
+
+/* Premier enfant `name` de `parent`, ajouté s'il manque. */
+static xmlNodePtr xml_child(xmlNodePtr parent, const char *name) {
+    for (xmlNodePtr c = parent->children; c; c = c->next) {
+        if (c->type == XML_ELEMENT_NODE && xmlStrEqual(c->name, (const xmlChar *)name))
+            return c;
+    }
+    return xmlNewChild(parent, NULL, (const xmlChar *)name, NULL);
+}
+
+/* Disque d'un domaine (<devices>/<disk>). */
+struct xml_disk {
+    xmlNodePtr node;
+    char *path;      /* source/@file, NULL si pas de fichier (réseau, lecteur vide) */
+    char *target;    /* target/@dev */
+    int writable;    /* disque propre à la VM : ni CD-ROM, ni lecture seule, ni partagé */
+};
+
+/* Disques de `doc`, dans l'ordre du XML. Retourne leur nombre ou -1. */
+static int xml_disks(xmlDocPtr doc, struct xml_disk **out) {
+    xmlNodePtr *nodes;
+    int n = xml_find(doc, NULL, "/domain/devices/disk", &nodes);
+    *out = NULL;
+    if (n <= 0)
+        return n;
+
+    struct xml_disk *disks = calloc(n, sizeof(*disks));
+    if (!disks) {
+        free(nodes);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        struct xml_disk *d = &disks[i];
+        char *device = xml_get(doc, nodes[i], "@device");
+        d->node = nodes[i];
+        d->path = xml_get(doc, nodes[i], "source/@file");
+        d->target = xml_get(doc, nodes[i], "target/@dev");
+        d->writable = d->path && (!device || strcmp(device, "disk") == 0) &&
+                      !xml_first(doc, nodes[i], "readonly|shareable");
+        free(device);
+    }
+    free(nodes);
+    *out = disks;
+    return n;
+}
+
+static void xml_disks_free(struct xml_disk *disks, int n) {
+    for (int i = 0; i < n; i++) {
+        free(disks[i].path);
+        free(disks[i].target);
+    }
+    free(disks);
+}
+
+/*
+ * XML d'un volume de `capacity` octets au format `format`, en overlay de
+ * `backing` (au format `backing_format`) si fourni. Chaîne allouée.
+ */
+static char *volume_xml(const char *name, unsigned long long capacity,
+                        const char *format, const char *backing,
+                        const char *backing_format) {
+    xmlDocPtr doc = xml_parse(
+        "<volume>"
+        "<name/>"
+        "<capacity unit='bytes'/>"
+        "<allocation unit='bytes'>0</allocation>"
+        "<target><format/></target>"
+        "</volume>");
+    if (!doc)
+        return NULL;
+
+    char cap[32];
+    snprintf(cap, sizeof(cap), "%llu", capacity);
+    xml_set_text(doc, NULL, "/volume/name", name);
+    xml_set_text(doc, NULL, "/volume/capacity", cap);
+    xml_set_attr(doc, NULL, "/volume/target/format", "type", format);
+    if (backing) {
+        xmlNodePtr store = xml_child(xmlDocGetRootElement(doc), "backingStore");
+        xmlNodeAddContent(xml_child(store, "path"), (const xmlChar *)backing);
+        xmlSetProp(xml_child(store, "format"), (const xmlChar *)"type",
+                   (const xmlChar *)backing_format);
+    }
+
+    char *xml = xml_dump(doc);
+    xmlFreeDoc(doc);
+    return xml;
+}
+
+/* ---------- Pool de connexions libvirt ----------
+ *
+ * Chaque point d'entrée emprunte une connexion au pool au lieu d'ouvrir
+ * la sienne : le handshake (coûteux en qemu+ssh://) n'est payé qu'une
+ * fois par URI. Les connexions libvirt sont thread-safe, un même slot
+ * peut donc servir plusieurs appelants ; on n'en ouvre un nouveau que si
+ * tous les slots existants sont occupés et que la limite n'est pas
+ * atteinte. Le keepalive et le callback de fermeture nécessitent une
+ * boucle d'événements, lancée une seule fois dans un thread dédié.
+ *
+ * Chaque slot mémorise aussi les domaines déjà résolus (handle et XML
+ * analysé), indexés par UUID : une action répétée sur la même VM
+ * ne refait ni virDomainLookupByName ni virDomainGetXMLDesc. Le nom est
+ * résolu par le cache d'événements, et un XML n'est resservi que si la
+ * génération du domaine n'a pas bougé depuis sa lecture : tout événement
+ * de cycle de vie, (re)définition, reboot, périphérique ou métadonnée
+ * l'invalide. Sans cache d'événements pour l'URI, on interroge libvirt.
+ * Les métadonnées des snapshots y sont gardées aussi, par nom : elles ne
+ * changent pas, sauf le parent quand celui-ci est supprimé.
+ */
+
+#define POOL_MAX_URIS       16  /* URI distinctes gardées ouvertes */
+#define POOL_MAX_CONN        4  /* connexions par URI */
+#define POOL_KEEPALIVE_INT   5  /* secondes entre deux keepalive */
+#define POOL_KEEPALIVE_CNT   3  /* keepalive sans réponse avant coupure */
+#define POOL_MAX_HANDLES    64  /* domaines mémorisés par connexion */
+
+/* XML analysé d'un domaine : courant ([0]) ou inactif ([1]). */
+struct pool_desc {
+    xmlDocPtr doc;
+    unsigned long long gen;      /* génération du domaine à la lecture */
+};
+
+/* Métadonnées d'un snapshot, lues dans son XML. */
+struct snap_meta {
+    char *name;
+    char *parent;                /* NULL : racine */
+    long long created;           /* creationTime, en secondes */
+    char state[24];              /* état du domaine au moment du snapshot */
+    int disk_only;
+    int external;                /* mémoire ou disque hors de l'image */
+};
+
+static void snap_metas_free(struct snap_meta *metas, int n) {
+    for (int i = 0; i < n; i++) {
+        free(metas[i].name);
+        free(metas[i].parent);
+    }
+    free(metas);
+}
+
+struct pool_handle {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    virDomainPtr dom;
+    unsigned long last_use;
+    struct pool_desc desc[2];
+    struct snap_meta *snaps;     /* snapshots déjà lus */
+    int nsnaps;
+};
+
+struct pool_slot {
+    virConnectPtr conn;
+    int users;      /* appelants utilisant la connexion */
+    int opening;    /* virConnectOpen en cours hors verrou */
+    unsigned long gen;       /* numéro de la connexion ouverte dans le slot */
+    unsigned long dead_gen;  /* numéro fermé côté libvirt (callback) */
+    struct pool_handle *handles;  /* POOL_MAX_HANDLES, alloué au besoin */
+    int nhandles;
+};
+
+struct pool_entry {
+    char uri[256];
+    unsigned long last_use;
+    struct pool_slot slots[POOL_MAX_CONN];
+};
+
+static struct pool_entry pool[POOL_MAX_URIS];
+static unsigned long pool_clock;
+static unsigned long pool_conn_gen;   /* numérote les connexions ouvertes */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_opened = PTHREAD_COND_INITIALIZER;
+static pthread_once_t event_once = PTHREAD_ONCE_INIT;
+
+static void *event_loop(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (virEventRunDefaultImpl() < 0) {
+            const virError *e = virGetLastError();
+            fprintf(stderr, "libvirt_api: boucle d'événements (%s)\n",
+                    e ? e->message : "inconnu");
+            sleep(1);
+        }
+    }
+    return NULL;
+}
+
+static void event_loop_start(void) {
+    if (virEventRegisterDefaultImpl() < 0)
+        return;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, event_loop, NULL) == 0)
+        pthread_detach(tid);
+}
+
+/*
+ * Contexte du callback de fermeture. Le callback peut arriver après que
+ * le slot a été vidé et réattribué à une autre connexion : il ne marque
+ * que le numéro de sa propre connexion, ignoré si le slot a changé.
+ */
+struct pool_close_ref {
+    struct pool_slot *slot;
+    unsigned long gen;
+};
+
+static void pool_on_close(virConnectPtr conn, int reason, void *opaque) {
+    (void)conn;
+    (void)reason;
+    struct pool_close_ref *ref = opaque;
+    __atomic_store_n(&ref->slot->dead_gen, ref->gen, __ATOMIC_RELEASE);
+}
+
+/* Connexion du slot fermée côté libvirt. Verrou `pool_lock` tenu. */
+static int pool_slot_dead(struct pool_slot *s) {
+    unsigned long gen = __atomic_load_n(&s->dead_gen, __ATOMIC_ACQUIRE);
+    return gen != 0 && gen == s->gen;
+}
+
+static void pool_handle_clear(struct pool_handle *h) {
+    virDomainFree(h->dom);
+    for (int k = 0; k < 2; k++)
+        xmlFreeDoc(h->desc[k].doc);
+    snap_metas_free(h->snaps, h->nsnaps);
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Vide un slot avant de le réutiliser ou de fermer sa connexion : les
+ * handles de domaine gardent une référence sur la connexion, qui ne
+ * serait sinon jamais fermée. Verrou `pool_lock` tenu.
+ */
+static void pool_slot_reset(struct pool_slot *s) {
+    for (int i = 0; i < s->nhandles; i++)
+        pool_handle_clear(&s->handles[i]);
+    free(s->handles);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Ferme une connexion retirée du pool (appelé hors verrou). */
+static void pool_close_conn(virConnectPtr conn) {
+    virConnectUnregisterCloseCallback(conn, pool_on_close);
+    virConnectClose(conn);
+}
+
+/* Une connexion est réutilisable si libvirt ne l'a pas fermée. */
+static int pool_slot_healthy(struct pool_slot *slot) {
+    if (pool_slot_dead(slot))
+        return 0;
+    return virConnectIsAlive(slot->conn) == 1;
+}
+
+static struct pool_entry *pool_find_entry(const char *uri) {
+    struct pool_entry *victim = NULL;
+
+    for (int i = 0; i < POOL_MAX_URIS; i++) {
+        if (pool[i].uri[0] && strcmp(pool[i].uri, uri) == 0)
+            return &pool[i];
+    }
+
+    /* Entrée libre, sinon l'URI la moins récemment utilisée et inoccupée */
+    for (int i = 0; i < POOL_MAX_URIS; i++) {
+        if (!pool[i].uri[0])
+            return &pool[i];
+
+        int busy = 0;
+        for (int j = 0; j < POOL_MAX_CONN; j++)
+            busy |= pool[i].slots[j].users || pool[i].slots[j].opening;
+        if (!busy && (!victim || pool[i].last_use < victim->last_use))
+            victim = &pool[i];
+    }
+    return victim;
+}
+
+static int pool_opening(struct pool_entry *entry, const char *uri) {
+    if (strcmp(entry->uri, uri) != 0)
+        return 0;
+    for (int j = 0; j < POOL_MAX_CONN; j++) {
+        if (entry->slots[j].opening)
+            return 1;
+    }
+    return 0;
+}
+
+static virConnectPtr pool_acquire_slot(const char *uri) {
+    if (!uri || strlen(uri) >= sizeof(pool[0].uri))
+        return virConnectOpen(uri);
+
+    pthread_once(&event_once, event_loop_start);
+
+    virConnectPtr stale[POOL_MAX_CONN + POOL_MAX_CONN];
+    int nstale = 0;
+    struct pool_entry *entry;
+    struct pool_slot *slot;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        entry = pool_find_entry(uri);
+        if (!entry) {
+            /* Toutes les URI sont occupées : connexion hors pool */
+            pthread_mutex_unlock(&pool_lock);
+            return virConnectOpen(uri);
+        }
+
+        if (strcmp(entry->uri, uri) != 0) {
+            for (int j = 0; j < POOL_MAX_CONN; j++) {
+                if (entry->slots[j].conn)
+                    stale[nstale++] = entry->slots[j].conn;
+                pool_slot_reset(&entry->slots[j]);
+            }
+            memset(entry, 0, sizeof(*entry));
+            snprintf(entry->uri, sizeof(entry->uri), "%s", uri);
+        }
+        entry->last_use = ++pool_clock;
+
+        /* Slot vivant le moins chargé ; purge des connexions mortes */
+        struct pool_slot *best = NULL, *empty = NULL;
+        int opening = 0;
+        for (int j = 0; j < POOL_MAX_CONN; j++) {
+            struct pool_slot *s = &entry->slots[j];
+            if (s->opening) {
+                opening = 1;
+                continue;
+            }
+            int healthy = s->conn && pool_slot_healthy(s);
+            if (s->conn && !healthy && s->users == 0) {
+                stale[nstale++] = s->conn;
+                pool_slot_reset(s);
+            }
+            if (!s->conn) {
+                if (!empty)
+                    empty = s;
+            } else if (healthy && (!best || s->users < best->users)) {
+                best = s;
+            }
+        }
+
+        if (best && (best->users == 0 || !empty)) {
+            best->users++;
+            pthread_mutex_unlock(&pool_lock);
+            for (int i = 0; i < nstale; i++)
+                pool_close_conn(stale[i]);
+            return best->conn;
+        }
+        if (empty) {
+            slot = empty;
+            slot->opening = 1;
+            slot->gen = ++pool_conn_gen;
+            break;
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+        for (int i = 0; i < nstale; i++)
+            pool_close_conn(stale[i]);
+        nstale = 0;
+
+        /* Toutes les connexions sont mortes mais encore empruntées */
+        if (!opening)
+            return virConnectOpen(uri);
+
+        /* Une ouverture est en cours pour cette URI : on l'attend */
+        pthread_mutex_lock(&pool_lock);
+        if (!pool_opening(entry, uri))
+            continue;
+        pthread_cond_wait(&pool_opened, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 0; i < nstale; i++)
+        pool_close_conn(stale[i]);
+
+    /* Handshake hors verrou : les autres URI restent disponibles */
     virConnectPtr conn = virConnectOpen(uri);
+    if (conn) {
+        virConnectSetKeepAlive(conn, POOL_KEEPALIVE_INT, POOL_KEEPALIVE_CNT);
+        /* Sans callback, virConnectIsAlive() détecte encore la coupure */
+        struct pool_close_ref *ref = malloc(sizeof(*ref));
+        if (ref) {
+            ref->slot = slot;
+            ref->gen = slot->gen;
+            if (virConnectRegisterCloseCallback(conn, pool_on_close, ref, free) < 0)
+                free(ref);
+        }
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    slot->opening = 0;
+    slot->conn = conn;
+    slot->users = conn ? 1 : 0;
+    pthread_cond_broadcast(&pool_opened);
+    pthread_mutex_unlock(&pool_lock);
+
+    return conn;
+}
+
+/*
+ * Emprunte une connexion vers `uri`. Retourne NULL si la connexion est
+ * impossible (virGetLastError() renseigne la cause). À rendre avec
+ * pool_release(). Le temps passé compte dans la phase « connect ».
+ */
+static virConnectPtr pool_acquire(const char *uri) {
+    int prev = api_phase_set(PH_CONNECT);
+    virConnectPtr conn = pool_acquire_slot(uri);
+    api_phase_set(prev);
+    return conn;
+}
+
+static int cache_dom_gen(const char *uri, const char *name, char *uuid,
+                         unsigned long long *gen);
+
+/*
+ * Slot du pool qui porte `conn`, verrou `pool_lock` tenu ; `uri` reçoit
+ * son URI. NULL (verrou rendu) pour une connexion ouverte hors pool.
+ */
+static struct pool_slot *pool_slot_lock(virConnectPtr conn, char *uri) {
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < POOL_MAX_URIS; i++) {
+        for (int j = 0; j < POOL_MAX_CONN; j++) {
+            struct pool_slot *s = &pool[i].slots[j];
+            if (s->conn == conn && s->users > 0) {
+                if (uri)
+                    snprintf(uri, sizeof(pool[i].uri), "%s", pool[i].uri);
+                return s;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static struct pool_handle *pool_handle_find(struct pool_slot *s, const char *uuid) {
+    for (int i = 0; i < s->nhandles; i++) {
+        if (strcmp(s->handles[i].uuid, uuid) == 0) {
+            s->handles[i].last_use = ++pool_clock;
+            return &s->handles[i];
+        }
+    }
+    return NULL;
+}
+
+/* Entrée de `dom`, créée au besoin en évinçant la moins récente. */
+static struct pool_handle *pool_handle_add(struct pool_slot *s, const char *uuid,
+                                           virDomainPtr dom) {
+    struct pool_handle *h = pool_handle_find(s, uuid);
+    if (h)
+        return h;
+
+    if (!s->handles) {
+        s->handles = calloc(POOL_MAX_HANDLES, sizeof(*s->handles));
+        if (!s->handles)
+            return NULL;
+    }
+    if (s->nhandles < POOL_MAX_HANDLES) {
+        h = &s->handles[s->nhandles++];
+    } else {
+        h = &s->handles[0];
+        for (int i = 1; i < s->nhandles; i++) {
+            if (s->handles[i].last_use < h->last_use)
+                h = &s->handles[i];
+        }
+        pool_handle_clear(h);
+    }
+
+    snprintf(h->uuid, sizeof(h->uuid), "%s", uuid);
+    virDomainRef(dom);
+    h->dom = dom;
+    h->last_use = ++pool_clock;
+    return h;
+}
+
+/*
+ * virDomainLookupByName(), compté dans la phase « lookup ». Si le cache
+ * d'événements connaît le nom, le handle déjà résolu sur cette connexion
+ * est réutilisé sans aller-retour vers libvirtd.
+ */
+static virDomainPtr lookup_domain(virConnectPtr conn, const char *name) {
+    int prev = api_phase_set(PH_LOOKUP);
+    char uri[sizeof(pool[0].uri)];
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    virDomainPtr dom = NULL;
+
+    struct pool_slot *s = pool_slot_lock(conn, uri);
+    if (s)
+        pthread_mutex_unlock(&pool_lock);
+    int known = s && cache_dom_gen(uri, name, uuid, NULL) == 0;
+
+    if (known && (s = pool_slot_lock(conn, NULL))) {
+        struct pool_handle *h = pool_handle_find(s, uuid);
+        if (h) {
+            virDomainRef(h->dom);
+            dom = h->dom;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    if (!dom) {
+        dom = virDomainLookupByName(conn, name);
+        char actual[VIR_UUID_STRING_BUFLEN];
+        if (dom && known && virDomainGetUUIDString(dom, actual) == 0 &&
+            strcmp(actual, uuid) == 0 && (s = pool_slot_lock(conn, NULL))) {
+            pool_handle_add(s, uuid, dom);
+            pthread_mutex_unlock(&pool_lock);
+        }
+    }
+
+    api_phase_set(prev);
+    return dom;
+}
+
+/*
+ * XML analysé de `dom` (flags 0 ou VIR_DOMAIN_XML_INACTIVE), resservi
+ * depuis le slot tant que le domaine n'a pas changé. Retourne une copie
+ * que l'appelant peut modifier et libère avec xmlFreeDoc(), NULL si le
+ * XML est illisible.
+ */
+static xmlDocPtr domain_doc(virConnectPtr conn, virDomainPtr dom, unsigned int flags) {
+    int k = (flags & VIR_DOMAIN_XML_INACTIVE) ? 1 : 0;
+    char uri[sizeof(pool[0].uri)];
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    unsigned long long gen = 0;
+
+    struct pool_slot *s = NULL;
+    if ((flags & ~VIR_DOMAIN_XML_INACTIVE) == 0 &&
+        virDomainGetUUIDString(dom, uuid) == 0 &&
+        (s = pool_slot_lock(conn, uri)))
+        pthread_mutex_unlock(&pool_lock);
+    int known = s && cache_dom_gen(uri, NULL, uuid, &gen) == 0;
+
+    if (known && (s = pool_slot_lock(conn, NULL))) {
+        struct pool_handle *h = pool_handle_find(s, uuid);
+        struct pool_desc *d = h ? &h->desc[k] : NULL;
+        xmlDocPtr copy = d && d->doc && d->gen == gen ? xmlCopyDoc(d->doc, 1) : NULL;
+        pthread_mutex_unlock(&pool_lock);
+        if (copy)
+            return copy;
+    }
+
+    char *text = virDomainGetXMLDesc(dom, flags);
+    xmlDocPtr doc = xml_parse(text);
+    free(text);
+    if (!doc)
+        return NULL;
+
+    /* Génération lue avant le XML : une modification concurrente le
+     * périme dès la prochaine lecture */
+    if (known && (s = pool_slot_lock(conn, NULL))) {
+        struct pool_handle *h = pool_handle_add(s, uuid, dom);
+        xmlDocPtr copy = h ? xmlCopyDoc(doc, 1) : NULL;
+        if (copy) {
+            struct pool_desc *d = &h->desc[k];
+            xmlFreeDoc(d->doc);
+            d->doc = copy;
+            d->gen = gen;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return doc;
+}
+
+/*
+ * Oublie ce que le slot sait de `dom` après une modification faite par
+ * ce processus, sans attendre l'événement correspondant.
+ */
+static void domain_forget(virConnectPtr conn, virDomainPtr dom) {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    if (virDomainGetUUIDString(dom, uuid) < 0)
+        return;
+
+    struct pool_slot *s = pool_slot_lock(conn, NULL);
+    if (!s)
+        return;
+    struct pool_handle *h = pool_handle_find(s, uuid);
+    if (h) {
+        pool_handle_clear(h);
+        *h = s->handles[--s->nhandles];
+        memset(&s->handles[s->nhandles], 0, sizeof(*h));
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Rend une connexion empruntée avec pool_acquire(). */
+static void pool_release(virConnectPtr conn) {
+    if (!conn)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < POOL_MAX_URIS; i++) {
+        for (int j = 0; j < POOL_MAX_CONN; j++) {
+            struct pool_slot *s = &pool[i].slots[j];
+            if (s->conn != conn || s->users == 0)
+                continue;
+
+            s->users--;
+            if (s->users == 0 && pool_slot_dead(s)) {
+                pool_slot_reset(s);
+                pthread_mutex_unlock(&pool_lock);
+                pool_close_conn(conn);
+                return;
+            }
+            pthread_mutex_unlock(&pool_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    /* Connexion ouverte hors pool */
+    virConnectClose(conn);
+}
+
+/* ---------- Résultats ----------
+ *
+ * Chaque point d'entrée retourne une chaîne allouée sur le tas, propre à
+ * l'appelant : plusieurs requêtes Flask peuvent appeler la bibliothèque en
+ * parallèle sans écraser leurs résultats. L'appelant libère la chaîne
+ * avec free_result().
+ */
+
+static char *result_printf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static char *result_vprintf(const char *prefix, const char *fmt, va_list ap) {
+    va_list cp;
+    size_t plen = strlen(prefix);
+
+    va_copy(cp, ap);
+    int len = vsnprintf(NULL, 0, fmt, cp);
+    va_end(cp);
+    if (len < 0) {
+        api_failed = 1;
+        return strdup("Erreur : format de message invalide");
+    }
+
+    char *msg = malloc(plen + len + 1);
+    if (!msg)
+        return NULL;
+
+    memcpy(msg, prefix, plen);
+    vsnprintf(msg + plen, len + 1, fmt, ap);
+    return msg;
+}
+
+static char *result_printf(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    char *msg = result_vprintf("", fmt, ap);
+    va_end(ap);
+    return msg;
+}
+
+/* Message « Erreur : … » ; l'appel en cours est compté en échec. */
+static char *result_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static char *result_error(const char *fmt, ...) {
+    va_list ap;
+
+    api_failed = 1;
+    va_start(ap, fmt);
+    char *msg = result_vprintf("Erreur : ", fmt, ap);
+    va_end(ap);
+    return msg;
+}
+
+void free_result(char *result) {
+    free(result);
+}
+
+/* Tampon extensible : ajout en fin de chaîne sans recopie ni limite.
+ * Après un échec d'allocation, `failed` est levé, les ajouts suivants
+ * sont ignorés et sb_steal() retourne NULL. */
+struct strbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+static int sb_reserve(struct strbuf *sb, size_t extra) {
+    if (sb->failed)
+        return -1;
+    if (sb->len + extra + 1 <= sb->cap)
+        return 0;
+
+    size_t cap = sb->cap ? sb->cap : 1024;
+    while (cap < sb->len + extra + 1)
+        cap *= 2;
+
+    char *data = realloc(sb->data, cap);
+    if (!data) {
+        sb->failed = 1;
+        return -1;
+    }
+    sb->data = data;
+    sb->cap = cap;
+    return 0;
+}
+
+static void sb_printf(struct strbuf *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void sb_printf(struct strbuf *sb, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+
+    if (sb_reserve(sb, len) < 0)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, len + 1, fmt, ap);
+    va_end(ap);
+    sb->len += len;
+}
+
+/* Transfère la chaîne construite à l'appelant (à libérer avec free). */
+static char *sb_steal(struct strbuf *sb) {
+    char *data = NULL;
+    if (sb_reserve(sb, 0) == 0) {
+        sb->data[sb->len] = '\0';
+        data = sb->data;
+    } else {
+        free(sb->data);
+    }
+    memset(sb, 0, sizeof(*sb));
+    return data;
+}
+
+static void sb_append(struct strbuf *sb, const char *s, size_t len) {
+    if (sb_reserve(sb, len) < 0)
+        return;
+    memcpy(sb->data + sb->len, s, len);
+    sb->len += len;
+}
+
+static void sb_putc(struct strbuf *sb, char c) {
+    if (sb_reserve(sb, 1) < 0)
+        return;
+    sb->data[sb->len++] = c;
+}
+
+/* ---------- Écriture JSON ----------
+ *
+ * Toutes les sorties JSON passent par ce writer : il ajoute en fin de
+ * tampon (coût linéaire, sans limite de taille), échappe les chaînes et
+ * place les virgules selon le niveau d'imbrication. Un nom de VM
+ * contenant un guillemet ou un retour à la ligne produit donc toujours
+ * un JSON valide.
+ *
+ *   struct jw w = {0};
+ *   jw_object_begin(&w);
+ *   jw_kstr(&w, "name", name);
+ *   jw_key(&w, "vms");
+ *   jw_array_begin(&w);
+ *   …
+ *   jw_array_end(&w);
+ *   jw_object_end(&w);
+ *   return jw_finish(&w);
+ */
+
+#define JW_MAX_DEPTH 32
+
+struct jw {
+    struct strbuf sb;
+    int depth;
+    int too_deep;                           /* plus de JW_MAX_DEPTH niveaux */
+    int after_key;                          /* valeur attendue après une clé */
+    unsigned char nonempty[JW_MAX_DEPTH];   /* virgule requise à ce niveau */
+};
+
+/* Virgule avant un élément, sauf s'il suit une clé ou ouvre un niveau. */
+static void jw_sep(struct jw *w) {
+    if (w->after_key) {
+        w->after_key = 0;
+        return;
+    }
+    if (w->depth > 0 && w->depth <= JW_MAX_DEPTH) {
+        if (w->nonempty[w->depth - 1])
+            sb_putc(&w->sb, ',');
+        w->nonempty[w->depth - 1] = 1;
+    }
+}
+
+static void jw_escape(struct strbuf *sb, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+
+    sb_putc(sb, '"');
+    while (*s) {
+        /* Plus longue suite de caractères sans échappement, copiée d'un bloc */
+        const char *run = s;
+        while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20)
+            s++;
+        if (s > run)
+            sb_append(sb, run, s - run);
+        if (!*s)
+            break;
+
+        unsigned char c = *s++;
+        switch (c) {
+        case '"':  sb_append(sb, "\\\"", 2); break;
+        case '\\': sb_append(sb, "\\\\", 2); break;
+        case '\n': sb_append(sb, "\\n", 2); break;
+        case '\r': sb_append(sb, "\\r", 2); break;
+        case '\t': sb_append(sb, "\\t", 2); break;
+        default: {
+            char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            sb_append(sb, u, sizeof(u));
+        }
+        }
+    }
+    sb_putc(sb, '"');
+}
+
+static void jw_open(struct jw *w, char c) {
+    if (w->depth == 0 && w->sb.len == 0)
+        api_phase_set(PH_SERIALIZE);
+    jw_sep(w);
+    sb_putc(&w->sb, c);
+    if (w->depth < JW_MAX_DEPTH)
+        w->nonempty[w->depth] = 0;
+    else
+        w->too_deep = 1;
+    w->depth++;
+}
+
+static void jw_close(struct jw *w, char c) {
+    if (w->depth > 0)
+        w->depth--;
+    else
+        w->too_deep = 1;
+    sb_putc(&w->sb, c);
+}
+
+static void jw_object_begin(struct jw *w) { jw_open(w, '{'); }
+static void jw_object_end(struct jw *w)   { jw_close(w, '}'); }
+static void jw_array_begin(struct jw *w)  { jw_open(w, '['); }
+static void jw_array_end(struct jw *w)    { jw_close(w, ']'); }
+
+static void jw_key(struct jw *w, const char *key) {
+    jw_sep(w);
+    jw_escape(&w->sb, key);
+    sb_putc(&w->sb, ':');
+    w->after_key = 1;
+}
+
+/* Chaîne échappée ; NULL donne null. */
+static void jw_str(struct jw *w, const char *s) {
+    jw_sep(w);
+    if (s)
+        jw_escape(&w->sb, s);
+    else
+        sb_append(&w->sb, "null", 4);
+}
+
+static void jw_strf(struct jw *w, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void jw_strf(struct jw *w, const char *fmt, ...) {
+    char tmp[256], *s = tmp;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0, tmp[0] = '\0';
+    if ((size_t)len >= sizeof(tmp) && (s = malloc(len + 1))) {
+        va_start(ap, fmt);
+        vsnprintf(s, len + 1, fmt, ap);
+        va_end(ap);
+    }
+    jw_str(w, s ? s : tmp);
+    if (s != tmp)
+        free(s);
+}
+
+static void jw_int(struct jw *w, long long v) {
+    jw_sep(w);
+    sb_printf(&w->sb, "%lld", v);
+}
+
+static void jw_uint(struct jw *w, unsigned long long v) {
+    jw_sep(w);
+    sb_printf(&w->sb, "%llu", v);
+}
+
+/* Réel à `decimals` décimales (null si non fini). */
+static void jw_double(struct jw *w, double v, int decimals) {
+    jw_sep(w);
+    if (v != v || v > 1e308 || v < -1e308)
+        sb_append(&w->sb, "null", 4);
+    else
+        sb_printf(&w->sb, "%.*f", decimals, v);
+}
+
+static void jw_bool(struct jw *w, int v) {
+    jw_sep(w);
+    if (v)
+        sb_append(&w->sb, "true", 4);
+    else
+        sb_append(&w->sb, "false", 5);
+}
+
+/* Raccourcis clé + valeur */
+static void jw_kstr(struct jw *w, const char *k, const char *v)  { jw_key(w, k); jw_str(w, v); }
+static void jw_kint(struct jw *w, const char *k, long long v)    { jw_key(w, k); jw_int(w, v); }
+static void jw_kuint(struct jw *w, const char *k, unsigned long long v) { jw_key(w, k); jw_uint(w, v); }
+static void jw_kbool(struct jw *w, const char *k, int v)         { jw_key(w, k); jw_bool(w, v); }
+static void jw_kdouble(struct jw *w, const char *k, double v, int decimals) {
+    jw_key(w, k);
+    jw_double(w, v, decimals);
+}
+
+static char *json_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/* Transfère le document à l'appelant (à libérer avec free_result).
+ * Mémoire épuisée ou imbrication invalide : document d'erreur à la
+ * place (NULL si même celui-ci ne peut être alloué). */
+static char *jw_finish(struct jw *w) {
+    api_phase_set(PH_OPERATION);
+    int failed = w->sb.failed, too_deep = w->too_deep;
+    char *doc = sb_steal(&w->sb);
+    if (!failed && !too_deep)
+        return doc;
+    free(doc);
+    if (!failed)
+        return json_error("Document JSON trop imbriqué (plus de %d niveaux)", JW_MAX_DEPTH);
+    /* Pas de json_error() ici : il repasse par jw_finish() */
+    api_failed = 1;
+    return strdup("{\"error\":\"Mémoire insuffisante pour le résultat\"}");
+}
+
+/* {"error":"…"} avec message formaté et échappé. */
+static char *json_error(const char *fmt, ...) {
+    va_list ap;
+
+    api_failed = 1;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *msg = malloc(len > 0 ? len + 1 : 1);
+    if (!msg)
+        return NULL;
+    msg[0] = '\0';
+    if (len > 0) {
+        va_start(ap, fmt);
+        vsnprintf(msg, len + 1, fmt, ap);
+        va_end(ap);
+    }
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kstr(&w, "error", msg);
+    jw_object_end(&w);
+    free(msg);
+    return jw_finish(&w);
+}
+
+/* ---------- Snapshots ----------
+ *
+ * L'arbre des snapshots est lu en un seul appel (virDomainListAllSnapshots) ;
+ * le XML de chaque snapshot (parent, date, état) n'est demandé qu'une
+ * fois puis gardé dans le slot du pool. Les XML manquants sont lus en
+ * parallèle : une VM à plusieurs centaines de snapshots automatiques se
+ * liste sans troncature ni tampon fixe.
+ */
+
+static void parallel_for(int n, void (*fn)(void *ctx, int i), void *ctx);
+
+/* Remplit `m` depuis le XML d'un snapshot ; -1 si illisible. */
+static int snap_meta_parse(const char *xml, struct snap_meta *m) {
+    xmlDocPtr doc = xml_parse(xml);
+    if (!doc)
+        return -1;
+
+    m->name = xml_get(doc, NULL, "/domainsnapshot/name");
+    m->parent = xml_get(doc, NULL, "/domainsnapshot/parent/name");
+    char *created = xml_get(doc, NULL, "/domainsnapshot/creationTime");
+    char *state = xml_get(doc, NULL, "/domainsnapshot/state");
+    m->created = created ? atoll(created) : 0;
+    snprintf(m->state, sizeof(m->state), "%s", state ? state : "");
+    m->disk_only = state && strcmp(state, "disk-snapshot") == 0;
+    m->external = xml_first(doc, NULL,
+                            "/domainsnapshot/memory[@snapshot='external'] | "
+                            "/domainsnapshot/disks/disk[@snapshot='external']") != NULL;
+    free(created);
+    free(state);
+    xmlFreeDoc(doc);
+    return m->name ? 0 : -1;
+}
+
+static void snap_meta_copy(struct snap_meta *dst, const struct snap_meta *src) {
+    *dst = *src;
+    dst->name = strdup(src->name);
+    dst->parent = src->parent ? strdup(src->parent) : NULL;
+}
+
+static int snap_index(const struct snap_meta *metas, int n, const char *name) {
+    for (int i = 0; name && i < n; i++) {
+        if (metas[i].name && strcmp(metas[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+struct snap_fetch {
+    virDomainSnapshotPtr *snaps;
+    struct snap_meta *metas;
+    const int *todo;             /* indices des snapshots à lire */
+};
+
+static void snap_fetch_run(void *ctx, int i) {
+    struct snap_fetch *f = ctx;
+    int k = f->todo[i];
+    struct snap_meta *m = &f->metas[k];
+    free(m->name);               /* copie périmée reprise du slot */
+    free(m->parent);
+    memset(m, 0, sizeof(*m));
+
+    char *xml = virDomainSnapshotGetXMLDesc(f->snaps[k], 0);
+    if (!xml || snap_meta_parse(xml, m) < 0) {
+        /* Sans XML on garde au moins le nom : l'entrée reste listée */
+        free(m->name);
+        free(m->parent);
+        memset(m, 0, sizeof(*m));
+        m->name = strdup(virDomainSnapshotGetName(f->snaps[k]));
+    }
+    free(xml);
+}
+
+/*
+ * Métadonnées des `n` snapshots de `dom`, dans l'ordre de `snaps`.
+ * Reprises du slot quand elles y sont ; un snapshot dont le parent a
+ * disparu a été rattaché ailleurs et est relu.
+ */
+static struct snap_meta *snap_metas_load(virConnectPtr conn, virDomainPtr dom,
+                                         virDomainSnapshotPtr *snaps, int n) {
+    struct snap_meta *metas = calloc(n ? n : 1, sizeof(*metas));
+    int *todo = calloc(n ? n : 1, sizeof(int));
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    int cacheable = virDomainGetUUIDString(dom, uuid) == 0;
+    struct pool_slot *s;
+
+    if (cacheable && (s = pool_slot_lock(conn, NULL))) {
+        struct pool_handle *h = pool_handle_find(s, uuid);
+        for (int i = 0; h && i < n; i++) {
+            int j = snap_index(h->snaps, h->nsnaps, virDomainSnapshotGetName(snaps[i]));
+            if (j >= 0)
+                snap_meta_copy(&metas[i], &h->snaps[j]);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    int ntodo = 0;
+    for (int i = 0; i < n; i++) {
+        if (!metas[i].name) {
+            todo[ntodo++] = i;
+        } else if (metas[i].parent) {
+            int found = 0;
+            for (int j = 0; j < n && !found; j++)
+                found = strcmp(virDomainSnapshotGetName(snaps[j]), metas[i].parent) == 0;
+            if (!found)
+                todo[ntodo++] = i;
+        }
+    }
+    struct snap_fetch f = { snaps, metas, todo };
+    parallel_for(ntodo, snap_fetch_run, &f);
+    free(todo);
+
+    if (ntodo && cacheable && (s = pool_slot_lock(conn, NULL))) {
+        struct pool_handle *h = pool_handle_add(s, uuid, dom);
+        struct snap_meta *copy = h ? calloc(n ? n : 1, sizeof(*copy)) : NULL;
+        if (copy) {
+            for (int i = 0; i < n; i++)
+                snap_meta_copy(&copy[i], &metas[i]);
+            snap_metas_free(h->snaps, h->nsnaps);
+            h->snaps = copy;
+            h->nsnaps = n;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return metas;
+}
+
+static int snap_meta_cmp(const void *a, const void *b) {
+    const struct snap_meta *x = a, *y = b;
+    if (x->created != y->created)
+        return x->created < y->created ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+enum snap_filter { SNAP_ALL, SNAP_ROOTS, SNAP_LEAVES };
+
+/*
+ * Arbre des snapshots de `name`, trié par date de création :
+ * {"total", "offset", "current", "snapshots": [{"name", "parent",
+ * "children", "depth", "created", "state", "disk_only", "external",
+ * "current"}, …]}. `filter` vaut "all", "roots" ou "leaves" ;
+ * `since`/`until` bornent la date de création (0 : sans borne) ;
+ * `limit` 0 renvoie tout à partir de `offset`. "total" compte les
+ * snapshots retenus avant pagination.
+ */
+static char *do_list_snapshots(const char *uri, const char *name, const char *filter,
+                               long long since, long long until, int offset, int limit) {
+    enum snap_filter mode = SNAP_ALL;
+    if (filter && strcmp(filter, "roots") == 0)
+        mode = SNAP_ROOTS;
+    else if (filter && strcmp(filter, "leaves") == 0)
+        mode = SNAP_LEAVES;
+    else if (filter && filter[0] && strcmp(filter, "all") != 0)
+        return json_error("Filtre %s inconnu (all, roots, leaves)", filter);
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        pool_release(conn);
+        return json_error("VM %s introuvable", name);
+    }
+
+    virDomainSnapshotPtr *snaps = NULL;
+    int n = virDomainListAllSnapshots(dom, &snaps, 0);
+    if (n < 0) {
+        virDomainFree(dom);
+        pool_release(conn);
+        return json_error("Impossible de lister les snapshots");
+    }
+
+    struct snap_meta *metas = snap_metas_load(conn, dom, snaps, n);
+    for (int i = 0; i < n; i++)
+        virDomainSnapshotFree(snaps[i]);
+    free(snaps);
+
+    char *current = NULL;
+    virDomainSnapshotPtr cur = virDomainSnapshotCurrent(dom, 0);
+    if (cur) {
+        current = strdup(virDomainSnapshotGetName(cur));
+        virDomainSnapshotFree(cur);
+    }
+    virDomainFree(dom);
+    pool_release(conn);
+
+    /* Liens parent/enfant et profondeur */
+    qsort(metas, n, sizeof(*metas), snap_meta_cmp);
+    int *parent = calloc(n ? n : 1, sizeof(int));
+    int *nchildren = calloc(n ? n : 1, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        parent[i] = snap_index(metas, n, metas[i].parent);
+        if (parent[i] >= 0)
+            nchildren[parent[i]]++;
+    }
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "snapshots");
+    jw_array_begin(&w);
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        const struct snap_meta *m = &metas[i];
+        if ((mode == SNAP_ROOTS && parent[i] >= 0) ||
+            (mode == SNAP_LEAVES && nchildren[i] > 0) ||
+            (since && m->created < since) || (until && m->created > until))
+            continue;
+        total++;
+        if (total <= offset || (limit > 0 && total > offset + limit))
+            continue;
+
+        int depth = 0;
+        for (int p = parent[i]; p >= 0 && depth < n; p = parent[p])
+            depth++;
+
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", m->name);
+        jw_kstr(&w, "parent", m->parent);
+        jw_key(&w, "children");
+        jw_array_begin(&w);
+        for (int j = 0; j < n && nchildren[i]; j++) {
+            if (parent[j] == i)
+                jw_str(&w, metas[j].name);
+        }
+        jw_array_end(&w);
+        jw_kint(&w, "depth", depth);
+        jw_kint(&w, "created", m->created);
+        jw_kstr(&w, "state", m->state);
+        jw_kbool(&w, "disk_only", m->disk_only);
+        jw_kbool(&w, "external", m->external);
+        jw_kbool(&w, "current", current && strcmp(current, m->name) == 0);
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    jw_kint(&w, "total", total);
+    jw_kint(&w, "offset", offset);
+    jw_kstr(&w, "current", current);
+    jw_object_end(&w);
+
+    free(parent);
+    free(nchildren);
+    free(current);
+    snap_metas_free(metas, n);
+    return jw_finish(&w);
+}
+
+char* list_snapshots(const char *uri, const char *name) {
+    API_SCOPE(list_snapshots);
+    return do_list_snapshots(uri, name, NULL, 0, 0, 0, 0);
+}
+
+/* Liste filtrée et paginée : voir do_list_snapshots(). */
+char* list_snapshots_ex(const char *uri, const char *name, const char *filter,
+                        long long since, long long until, int offset, int limit) {
+    API_SCOPE(list_snapshots_ex);
+    return do_list_snapshots(uri, name, filter, since, until, offset, limit);
+}
+
+char* revert_snapshot(const char *uri, const char *name, const char *snapname) {
+    API_SCOPE(revert_snapshot);
+    char *msg;
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn) {
+        msg = result_error("impossible de se connecter à %s", uri);
+        return msg;
+    }
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        msg = result_error("VM %s introuvable", name);
+        pool_release(conn);
+        return msg;
+    }
+
+    virDomainSnapshotPtr snap = virDomainSnapshotLookupByName(dom, snapname, 0);
+    if (!snap) {
+        msg = result_error("snapshot %s introuvable", snapname);
+        virDomainFree(dom);
+        pool_release(conn);
+        return msg;
+    }
+
+    if (virDomainRevertToSnapshot(snap, 0) < 0) {
+        msg = result_error("impossible de restaurer le snapshot %s", snapname);
+        virDomainSnapshotFree(snap);
+        virDomainFree(dom);
+        pool_release(conn);
+        return msg;
+    }
+
+    msg = result_printf("Snapshot %s restauré pour la VM %s.", snapname, name);
+
+    virDomainSnapshotFree(snap);
+    virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+/*
+ * Modes de snapshot :
+ *  - "internal" : RAM et disques écrits dans l'image qcow2 ; la VM est
+ *    suspendue pendant toute l'écriture, d'autant plus longue que
+ *    l'image est grosse.
+ *  - "disk-only" : chaque disque inscriptible reçoit un overlay externe,
+ *    sans la RAM ; les écritures en vol sont gelées par l'agent invité
+ *    (QUIESCE) le temps de basculer, quelques millisecondes.
+ *  - "live" : overlays externes et RAM écrite dans un fichier à côté du
+ *    premier disque pendant que la VM tourne.
+ * Les overlays se refusionnent par snapshot_commit().
+ */
+enum snap_mode { SNAP_INTERNAL, SNAP_DISK_ONLY, SNAP_LIVE };
+
+static int snap_mode_parse(const char *mode) {
+    if (!mode || !mode[0] || strcmp(mode, "internal") == 0)
+        return SNAP_INTERNAL;
+    if (strcmp(mode, "disk-only") == 0)
+        return SNAP_DISK_ONLY;
+    if (strcmp(mode, "live") == 0)
+        return SNAP_LIVE;
+    return -1;
+}
+
+/*
+ * XML de snapshot externe : overlay pour chaque disque inscriptible,
+ * rien pour les autres ; RAM dans `memfile` ou pas de RAM si NULL.
+ * NULL si la VM n'a aucun disque inscriptible.
+ */
+static char *snap_external_xml(xmlDocPtr dom_doc, const char *snapname,
+                               const char *memfile) {
+    struct xml_disk *disks = NULL;
+    int ndisks = xml_disks(dom_doc, &disks);
+    xmlDocPtr doc = xml_parse("<domainsnapshot><name/><memory/><disks/></domainsnapshot>");
+    if (ndisks <= 0 || !doc) {
+        xml_disks_free(disks, ndisks);
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+
+    xml_set_text(doc, NULL, "/domainsnapshot/name", snapname);
+    xml_set_attr(doc, NULL, "/domainsnapshot/memory", "snapshot", memfile ? "external" : "no");
+    if (memfile)
+        xml_set_attr(doc, NULL, "/domainsnapshot/memory", "file", memfile);
+
+    xmlNodePtr list = xml_first(doc, NULL, "/domainsnapshot/disks");
+    int nwritable = 0;
+    for (int i = 0; i < ndisks; i++) {
+        if (!disks[i].target)
+            continue;
+        xmlNodePtr d = xmlNewChild(list, NULL, (const xmlChar *)"disk", NULL);
+        xmlSetProp(d, (const xmlChar *)"name", (const xmlChar *)disks[i].target);
+        xmlSetProp(d, (const xmlChar *)"snapshot",
+                   (const xmlChar *)(disks[i].writable ? "external" : "no"));
+        nwritable += disks[i].writable;
+    }
+
+    char *xml = nwritable ? xml_dump(doc) : NULL;
+    xmlFreeDoc(doc);
+    xml_disks_free(disks, ndisks);
+    return xml;
+}
+
+static char *do_snapshot_vm(const char *uri, const char *name, const char *snapname,
+                            const char *mode_name) {
+    int mode = snap_mode_parse(mode_name);
+    if (mode < 0)
+        return result_error("mode de snapshot %s inconnu "
+                            "(internal, disk-only, live)", mode_name);
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("impossible de se connecter à %s", uri);
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        pool_release(conn);
+        return result_error("VM %s introuvable", name);
+    }
+
+    char *msg = NULL;
+    char *xml = NULL;
+    int active = virDomainIsActive(dom) == 1;
+    unsigned int flags = 0;
+
+    if (mode == SNAP_INTERNAL) {
+        xmlDocPtr doc = xml_parse("<domainsnapshot><name/></domainsnapshot>");
+        if (doc && xml_set_text(doc, NULL, "/domainsnapshot/name", snapname) == 0)
+            xml = xml_dump(doc);
+        xmlFreeDoc(doc);
+    } else if (mode == SNAP_LIVE && !active) {
+        msg = result_error("la VM %s doit être démarrée pour un snapshot live", name);
+    } else {
+        xmlDocPtr doc = domain_doc(conn, dom, 0);
+        char memfile[4096] = "";
+        if (doc && mode == SNAP_LIVE) {
+            /* RAM sauvegardée à côté du premier disque */
+            char *first = xml_get(doc, NULL, "/domain/devices/disk[@device='disk']/source/@file");
+            const char *slash = first ? strrchr(first, '/') : NULL;
+            if (slash)
+                snprintf(memfile, sizeof(memfile), "%.*s/%s-%s.mem",
+                         (int)(slash - first), first, name, snapname);
+            free(first);
+        }
+        if (doc && (mode == SNAP_DISK_ONLY || memfile[0]))
+            xml = snap_external_xml(doc, snapname, memfile[0] ? memfile : NULL);
+        xmlFreeDoc(doc);
+        if (!xml)
+            msg = result_error("aucun disque de %s ne peut recevoir d'overlay", name);
+
+        flags = VIR_DOMAIN_SNAPSHOT_CREATE_ATOMIC;
+        if (mode == SNAP_LIVE)
+            flags |= VIR_DOMAIN_SNAPSHOT_CREATE_LIVE;
+        else
+            flags |= VIR_DOMAIN_SNAPSHOT_CREATE_DISK_ONLY;
+    }
+
+    if (msg) {
+        free(xml);
+        virDomainFree(dom);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* Gel des systèmes de fichiers invités si l'agent répond ; sinon
+     * snapshot cohérent au crash seulement. Toute autre erreur (disque
+     * plein, overlay existant…) est rapportée telle quelle. */
+    int quiesce = mode == SNAP_DISK_ONLY && active;
+    unsigned long long t0 = mono_ns();
+    virDomainSnapshotPtr snap = NULL;
+    int retry = xml != NULL;
+    if (xml && quiesce) {
+        snap = virDomainSnapshotCreateXML(dom, xml, flags | VIR_DOMAIN_SNAPSHOT_CREATE_QUIESCE);
+        const virError *e = snap ? NULL : virGetLastError();
+        retry = e && (e->code == VIR_ERR_AGENT_UNRESPONSIVE ||
+                      e->code == VIR_ERR_OPERATION_UNSUPPORTED ||
+                      e->code == VIR_ERR_ARGUMENT_UNSUPPORTED);
+    }
+    if (retry && !snap) {
+        quiesce = 0;
+        snap = virDomainSnapshotCreateXML(dom, xml, flags);
+    }
+    unsigned long long elapsed_ms = (mono_ns() - t0) / 1000000;
+
+    if (!snap) {
+        const virError *e = virGetLastError();
+        msg = result_error("snapshot impossible (%s)", e ? e->message : "inconnu");
+    } else {
+        /* Les disques pointent maintenant vers les overlays */
+        if (mode != SNAP_INTERNAL)
+            domain_forget(conn, dom);
+        msg = result_printf("Snapshot %s (%s) créé pour la VM %s en %llu ms%s.",
+                            snapname, mode_name && mode_name[0] ? mode_name : "internal",
+                            name, elapsed_ms,
+                            mode == SNAP_DISK_ONLY && active && !quiesce
+                                ? ", sans gel (agent invité indisponible)" : "");
+        virDomainSnapshotFree(snap);
+    }
+
+    free(xml);
+    virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+char* snapshot_vm(const char *uri, const char *name, const char *snapname) {
+    API_SCOPE(snapshot_vm);
+    return do_snapshot_vm(uri, name, snapname, "internal");
+}
+
+/* Snapshot dans le mode `mode` : "internal", "disk-only" ou "live". */
+char* snapshot_vm_mode(const char *uri, const char *name, const char *snapname,
+                       const char *mode) {
+    API_SCOPE(snapshot_vm_mode);
+    return do_snapshot_vm(uri, name, snapname, mode);
+}
+
+char* restart_vm(const char *uri, const char *name) {
+    API_SCOPE(restart_vm);
+    char *msg;
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn) {
+        msg = result_error("impossible de se connecter à %s", uri);
+        return msg;
+    }
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        msg = result_error("VM %s introuvable", name);
+        pool_release(conn);
+        return msg;
+    }
+
+    if (virDomainReboot(dom, 0) < 0) {
+        const virError *e = virGetLastError();
+        msg = result_error("échec reboot %s (%s)", name, e ? e->message : "unknown");
+        virDomainFree(dom);
+        pool_release(conn);
+        return msg;
+    }
+
+    msg = result_printf("VM %s redémarrée.", name);
+
+    virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+/* ---------- Listage des domaines ----------
+ *
+ * Un seul appel virConnectGetAllDomainStats() ramène tous les domaines,
+ * actifs comme inactifs, avec les statistiques demandées : le nom et
+ * l'UUID sont lus localement sur le virDomainPtr retourné, sans RPC
+ * supplémentaire. Le masque `fields` limite les groupes de statistiques
+ * demandés à libvirtd.
+ */
+
+#define VM_FIELD_UUID     (1u << 0)
+#define VM_FIELD_STATE    (1u << 1)
+#define VM_FIELD_VCPUS    (1u << 2)
+#define VM_FIELD_MEMORY   (1u << 3)
+#define VM_FIELD_CPUTIME  (1u << 4)
+#define VM_FIELD_BLOCK    (1u << 5)
+#define VM_FIELD_NET      (1u << 6)
+#define VM_FIELD_ALL      0x7fu
+
+#define VM_FIELDS_DEFAULT (VM_FIELD_UUID | VM_FIELD_STATE)
+
+struct vm_record {
+    char *name;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    int state;
+    unsigned int vcpus;
+    unsigned int max_vcpus;
+    unsigned long long memory_kib;
+    unsigned long long max_memory_kib;
+    unsigned long long cpu_time_ns;
+    unsigned long long block_rd_bytes;
+    unsigned long long block_wr_bytes;
+    unsigned long long net_rx_bytes;
+    unsigned long long net_tx_bytes;
+};
+
+static const char *state_name(int state) {
+    switch (state) {
+        case VIR_DOMAIN_RUNNING:     return "running";
+        case VIR_DOMAIN_BLOCKED:     return "blocked";
+        case VIR_DOMAIN_PAUSED:      return "paused";
+        case VIR_DOMAIN_SHUTDOWN:    return "shutdown";
+        case VIR_DOMAIN_SHUTOFF:     return "shutoff";
+        case VIR_DOMAIN_CRASHED:     return "crashed";
+        case VIR_DOMAIN_PMSUSPENDED: return "pmsuspended";
+    }
+    return "unknown";
+}
+
+static unsigned int vm_fields_to_stats(unsigned int fields) {
+    unsigned int stats = 0;
+
+    if (fields & VM_FIELD_STATE)   stats |= VIR_DOMAIN_STATS_STATE;
+    if (fields & VM_FIELD_VCPUS)   stats |= VIR_DOMAIN_STATS_VCPU;
+    if (fields & VM_FIELD_MEMORY)  stats |= VIR_DOMAIN_STATS_BALLOON;
+    if (fields & VM_FIELD_CPUTIME) stats |= VIR_DOMAIN_STATS_CPU_TOTAL;
+    if (fields & VM_FIELD_BLOCK)   stats |= VIR_DOMAIN_STATS_BLOCK;
+    if (fields & VM_FIELD_NET)     stats |= VIR_DOMAIN_STATS_INTERFACE;
+
+    /* Sans groupe demandé, l'état reste le plus léger pour lister */
+    return stats ? stats : VIR_DOMAIN_STATS_STATE;
+}
+
+/* Somme "<prefix>.<i>.<suffix>" sur les `<prefix>.count` périphériques. */
+static unsigned long long stats_sum(virTypedParameterPtr params, int nparams,
+                                    const char *prefix, const char *suffix) {
+    char key[VIR_TYPED_PARAM_FIELD_LENGTH];
+    unsigned int count = 0;
+    unsigned long long total = 0;
+
+    snprintf(key, sizeof(key), "%s.count", prefix);
+    if (virTypedParamsGetUInt(params, nparams, key, &count) <= 0)
+        return 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned long long value = 0;
+        snprintf(key, sizeof(key), "%s.%u.%s", prefix, i, suffix);
+        if (virTypedParamsGetULLong(params, nparams, key, &value) > 0)
+            total += value;
+    }
+    return total;
+}
+
+static void vm_record_fill(struct vm_record *rec, virDomainPtr dom,
+                           virTypedParameterPtr params, int nparams) {
+    memset(rec, 0, sizeof(*rec));
+    rec->name = strdup(virDomainGetName(dom));
+    rec->state = VIR_DOMAIN_NOSTATE;
+    if (virDomainGetUUIDString(dom, rec->uuid) < 0)
+        rec->uuid[0] = '\0';
+    if (!params)
+        return;
+
+    virTypedParamsGetInt(params, nparams, "state.state", &rec->state);
+    virTypedParamsGetUInt(params, nparams, "vcpu.current", &rec->vcpus);
+    virTypedParamsGetUInt(params, nparams, "vcpu.maximum", &rec->max_vcpus);
+    virTypedParamsGetULLong(params, nparams, "balloon.current", &rec->memory_kib);
+    virTypedParamsGetULLong(params, nparams, "balloon.maximum", &rec->max_memory_kib);
+    virTypedParamsGetULLong(params, nparams, "cpu.time", &rec->cpu_time_ns);
+
+    rec->block_rd_bytes = stats_sum(params, nparams, "block", "rd.bytes");
+    rec->block_wr_bytes = stats_sum(params, nparams, "block", "wr.bytes");
+    rec->net_rx_bytes   = stats_sum(params, nparams, "net", "rx.bytes");
+    rec->net_tx_bytes   = stats_sum(params, nparams, "net", "tx.bytes");
+}
+
+/* Repli pour les pilotes sans virConnectGetAllDomainStats (une RPC par VM). */
+static int vm_records_collect_slow(virConnectPtr conn, struct vm_record **out) {
+    virDomainPtr *doms = NULL;
+    int n = virConnectListAllDomains(conn, &doms, 0);
+    if (n < 0)
+        return -1;
+
+    struct vm_record *recs = calloc(n ? n : 1, sizeof(*recs));
+    if (!recs) {
+        for (int i = 0; i < n; i++)
+            virDomainFree(doms[i]);
+        free(doms);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        vm_record_fill(&recs[i], doms[i], NULL, 0);
+
+        virDomainInfo info;
+        if (virDomainGetInfo(doms[i], &info) == 0) {
+            recs[i].state = info.state;
+            recs[i].vcpus = info.nrVirtCpu;
+            recs[i].max_vcpus = info.nrVirtCpu;
+            recs[i].memory_kib = info.memory;
+            recs[i].max_memory_kib = info.maxMem;
+            recs[i].cpu_time_ns = info.cpuTime;
+        }
+        virDomainFree(doms[i]);
+    }
+    free(doms);
+
+    *out = recs;
+    return n;
+}
+
+/*
+ * Remplit `*out` avec un enregistrement par domaine. Retourne le nombre
+ * de domaines, ou -1 (virGetLastError() renseigne la cause).
+ */
+static int vm_records_collect(virConnectPtr conn, unsigned int fields,
+                              struct vm_record **out) {
+    virDomainStatsRecordPtr *stats = NULL;
+    int n = virConnectGetAllDomainStats(conn, vm_fields_to_stats(fields), &stats, 0);
+    if (n < 0) {
+        const virError *e = virGetLastError();
+        if (e && e->code == VIR_ERR_NO_SUPPORT)
+            return vm_records_collect_slow(conn, out);
+        return -1;
+    }
+
+    struct vm_record *recs = calloc(n ? n : 1, sizeof(*recs));
+    if (!recs) {
+        virDomainStatsRecordListFree(stats);
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+        vm_record_fill(&recs[i], stats[i]->dom, stats[i]->params, stats[i]->nparams);
+    virDomainStatsRecordListFree(stats);
+
+    *out = recs;
+    return n;
+}
+
+static void vm_records_free(struct vm_record *recs, int n) {
+    for (int i = 0; i < n; i++)
+        free(recs[i].name);
+    free(recs);
+}
+
+static void vm_record_json(struct jw *w, const struct vm_record *rec,
+                           unsigned int fields) {
+    jw_object_begin(w);
+    jw_kstr(w, "name", rec->name ? rec->name : "");
+
+    if (fields & VM_FIELD_UUID)
+        jw_kstr(w, "uuid", rec->uuid);
+    if (fields & VM_FIELD_STATE)
+        jw_kstr(w, "state", state_name(rec->state));
+    if (fields & VM_FIELD_VCPUS) {
+        jw_kuint(w, "vcpus", rec->vcpus);
+        jw_kuint(w, "max_vcpus", rec->max_vcpus);
+    }
+    if (fields & VM_FIELD_MEMORY) {
+        jw_kuint(w, "memory_kib", rec->memory_kib);
+        jw_kuint(w, "max_memory_kib", rec->max_memory_kib);
+    }
+    if (fields & VM_FIELD_CPUTIME)
+        jw_kuint(w, "cpu_time_ns", rec->cpu_time_ns);
+    if (fields & VM_FIELD_BLOCK) {
+        jw_kuint(w, "block_rd_bytes", rec->block_rd_bytes);
+        jw_kuint(w, "block_wr_bytes", rec->block_wr_bytes);
+    }
+    if (fields & VM_FIELD_NET) {
+        jw_kuint(w, "net_rx_bytes", rec->net_rx_bytes);
+        jw_kuint(w, "net_tx_bytes", rec->net_tx_bytes);
+    }
+
+    jw_object_end(w);
+}
+
+static int cache_generation(const char *uri, unsigned long long *gen);
+
+/*
+ * Liste tous les domaines avec les champs VM_FIELD_* demandés. Si le
+ * cache d'événements suit cette URI, sa génération (lue avant le
+ * listage) est jointe pour que le client puisse s'abonner aux deltas.
+ */
+char* list_vms_ex(const char *uri, unsigned int fields) {
+    API_SCOPE(list_vms_ex);
+    unsigned long long gen = 0;
+    int has_gen = cache_generation(uri, &gen) == 0;
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Failed to connect to %s", uri);
+
+    struct vm_record *recs = NULL;
+    int n = vm_records_collect(conn, fields, &recs);
+    if (n < 0) {
+        const virError *e = virGetLastError();
+        char *err = json_error("Impossible de lister les VMs (%s)",
+                               e ? e->message : "inconnu");
+        pool_release(conn);
+        return err;
+    }
+    pool_release(conn);
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    if (has_gen)
+        jw_kuint(&w, "generation", gen);
+    jw_key(&w, "vms");
+    jw_array_begin(&w);
+    for (int i = 0; i < n; i++)
+        vm_record_json(&w, &recs[i], fields);
+    jw_array_end(&w);
+    jw_object_end(&w);
+
+    vm_records_free(recs, n);
+    return jw_finish(&w);
+}
+
+/* ---------- Listage binaire ----------
+ *
+ * list_vms_bin() écrit la liste dans un tampon fourni par l'appelant :
+ * un en-tête, un tableau d'enregistrements de taille fixe puis la table
+ * des noms (UTF-8, sans terminateur). Côté Python, un memoryview sur le
+ * tampon suffit pour lire les champs (struct.iter_unpack) : ni chaîne
+ * intermédiaire, ni JSON à analyser. Tous les entiers sont écrits en
+ * little-endian (htole32/htole64), quel que soit l'hôte.
+ */
+
+#define VM_BIN_MAGIC   "VMB1"
+
+struct vm_bin_header {          /* 32 octets */
+    char     magic[4];
+    uint32_t record_size;
+    uint32_t count;
+    uint32_t fields;            /* VM_FIELD_* renseignés */
+    uint64_t generation;        /* 0 si le cache ne suit pas l'URI */
+    uint64_t names_size;
+};
+
+struct vm_bin_record {          /* 96 octets */
+    uint32_t name_off;          /* depuis le début de la table des noms */
+    uint32_t name_len;
+    uint8_t  uuid[16];
+    uint32_t state;             /* virDomainState */
+    uint32_t vcpus;
+    uint32_t max_vcpus;
+    uint32_t reserved;
+    uint64_t memory_kib;
+    uint64_t max_memory_kib;
+    uint64_t cpu_time_ns;
+    uint64_t block_rd_bytes;
+    uint64_t block_wr_bytes;
+    uint64_t net_rx_bytes;
+    uint64_t net_tx_bytes;
+};
+
+_Static_assert(sizeof(struct vm_bin_header) == 32, "en-tête binaire");
+_Static_assert(sizeof(struct vm_bin_record) == 96, "enregistrement binaire");
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void uuid_to_bytes(const char *s, uint8_t out[16]) {
+    memset(out, 0, 16);
+    for (int i = 0; i < 16 && *s; ) {
+        if (*s == '-') {
+            s++;
+            continue;
+        }
+        int hi = hex_nibble(s[0]), lo = hi < 0 ? -1 : hex_nibble(s[1]);
+        if (lo < 0)
+            return;
+        out[i++] = hi << 4 | lo;
+        s += 2;
+    }
+}
+
+/*
+ * Écrit la liste dans `buf` (`cap` octets). Retourne le nombre d'octets
+ * écrits ; -2 si le tampon est trop petit (*needed donne la taille
+ * requise, à réessayer), -1 en cas d'erreur libvirt.
+ */
+long list_vms_bin(const char *uri, unsigned int fields, void *buf, size_t cap,
+                  size_t *needed) {
+    API_SCOPE(list_vms_bin);
+    unsigned long long gen = 0;
+    cache_generation(uri, &gen);
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn) {
+        api_failed = 1;
+        return -1;
+    }
+
+    struct vm_record *recs = NULL;
+    int n = vm_records_collect(conn, fields, &recs);
+    pool_release(conn);
+    if (n < 0) {
+        api_failed = 1;
+        return -1;
+    }
+
+    api_phase_set(PH_SERIALIZE);
+    size_t names = 0;
+    for (int i = 0; i < n; i++)
+        names += recs[i].name ? strlen(recs[i].name) : 0;
+    size_t total = sizeof(struct vm_bin_header) + n * sizeof(struct vm_bin_record) + names;
+    if (needed)
+        *needed = total;
+    if (total > cap) {
+        vm_records_free(recs, n);
+        return -2;
+    }
+
+    struct vm_bin_header *hdr = buf;
+    memcpy(hdr->magic, VM_BIN_MAGIC, 4);
+    hdr->record_size = htole32(sizeof(struct vm_bin_record));
+    hdr->count = htole32(n);
+    hdr->fields = htole32(fields);
+    hdr->generation = htole64(gen);
+    hdr->names_size = htole64(names);
+
+    struct vm_bin_record *out = (struct vm_bin_record *)(hdr + 1);
+    char *table = (char *)(out + n);
+    size_t off = 0;
+    for (int i = 0; i < n; i++) {
+        const struct vm_record *r = &recs[i];
+        size_t len = r->name ? strlen(r->name) : 0;
+
+        memset(&out[i], 0, sizeof(out[i]));
+        out[i].name_off = htole32(off);
+        out[i].name_len = htole32(len);
+        memcpy(table + off, r->name, len);
+        off += len;
+
+        uuid_to_bytes(r->uuid, out[i].uuid);
+        out[i].state = htole32(r->state);
+        out[i].vcpus = htole32(r->vcpus);
+        out[i].max_vcpus = htole32(r->max_vcpus);
+        out[i].memory_kib = htole64(r->memory_kib);
+        out[i].max_memory_kib = htole64(r->max_memory_kib);
+        out[i].cpu_time_ns = htole64(r->cpu_time_ns);
+        out[i].block_rd_bytes = htole64(r->block_rd_bytes);
+        out[i].block_wr_bytes = htole64(r->block_wr_bytes);
+        out[i].net_rx_bytes = htole64(r->net_rx_bytes);
+        out[i].net_tx_bytes = htole64(r->net_tx_bytes);
+    }
+
+    vm_records_free(recs, n);
+    return total;
+}
+
+/* ---------- Cache d'état des domaines ----------
+ *
+ * Pour chaque URI, une connexion dédiée reste abonnée aux événements
+ * libvirt (cycle de vie, reboot, ajout/retrait de périphérique) et tient
+ * à jour en mémoire l'état de chaque domaine. list_vms() est servi depuis
+ * ce cache sans solliciter libvirtd. Chaque modification reçoit un numéro
+ * de génération croissant : list_vms_since() ne renvoie que ce qui a
+ * changé depuis une génération donnée. Les domaines supprimés restent
+ * quelques temps comme « tombes » pour que les clients voient la
+ * suppression.
+ *
+ * Chaque modification est aussi conservée dans un anneau d'événements
+ * (CACHE_RING entrées) : wait_events() bloque jusqu'à ce qu'un événement
+ * plus récent qu'une génération donnée arrive, ce qui permet de pousser
+ * les deltas aux navigateurs (SSE) sans aucun polling.
+ *
+ * La même connexion suit les pools de stockage (cycle de vie,
+ * rafraîchissement) : `vol_gen` avance à chaque événement et invalide
+ * l'index des volumes tenu par la section « Images et téléversement ».
+ */
+
+#define CACHE_MAX_URIS       8
+#define CACHE_MAX_TOMBSTONES 256
+#define CACHE_RETRY_DELAY    30  /* secondes avant de réessayer un amorçage */
+#define CACHE_RING           1024
+
+enum {
+    CACHE_CB_LIFECYCLE,
+    CACHE_CB_REBOOT,
+    CACHE_CB_DEVICE_ADDED,
+    CACHE_CB_DEVICE_REMOVED,
+    CACHE_CB_METADATA,
+    CACHE_CB_POOL_LIFECYCLE,     /* événements de pool de stockage */
+    CACHE_CB_POOL_REFRESH,
+    CACHE_CB_COUNT
+};
+
+struct cache_dom {
+    char *name;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    int state;
+    int persistent;
+    int removed;
+    int seen;                    /* présent dans le dernier amorçage */
+    unsigned long long gen;      /* génération de la dernière modification */
+};
+
+struct cache_event {
+    unsigned long long gen;
+    const char *event;
+    char *reason;
+    char *name;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    int state;
+    int removed;
+};
+
+struct dom_cache {
+    char uri[256];
+    virConnectPtr conn;          /* connexion réservée aux événements */
+    int callbacks[CACHE_CB_COUNT];
+    int valid;                   /* amorcé et abonné */
+    int priming;                 /* amorçage en cours hors verrou */
+    int dead;                    /* connexion fermée côté libvirt */
+    int lost;                    /* mise à jour abandonnée depuis l'amorçage */
+    struct cache_dom *doms;
+    int ndoms;
+    int cap;
+    int ntombstones;
+    unsigned long long gen;
+    unsigned long long purged_gen;  /* tombes antérieures oubliées */
+    unsigned long long vol_gen;  /* génération des pools de stockage */
+    time_t retry_after;          /* amorçage en échec : pas avant */
+    struct cache_event ring[CACHE_RING];  /* indexé par gen % CACHE_RING */
+};
+
+static struct dom_cache caches[CACHE_MAX_URIS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_primed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cache_event_cond = PTHREAD_COND_INITIALIZER;
+
+static struct cache_dom *cache_find(struct dom_cache *c, const char *uuid) {
+    for (int i = 0; i < c->ndoms; i++) {
+        if (strcmp(c->doms[i].uuid, uuid) == 0)
+            return &c->doms[i];
+    }
+    return NULL;
+}
+
+/* Cache devenu faux (mise à jour perdue) : le prochain appel le
+ * réamorce depuis libvirt, les attentes de wait_events() se terminent. */
+static void cache_invalidate(struct dom_cache *c) {
+    c->valid = 0;
+    c->lost = 1;
+    pthread_cond_broadcast(&cache_event_cond);
+}
+
+/* NULL si la mémoire manque : la mise à jour est abandonnée et le cache
+ * invalidé. */
+static struct cache_dom *cache_add(struct dom_cache *c, const char *uuid,
+                                   const char *name) {
+    char *dup = strdup(name);
+    if (dup && c->ndoms == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 64;
+        struct cache_dom *doms = realloc(c->doms, cap * sizeof(*doms));
+        if (doms) {
+            c->doms = doms;
+            c->cap = cap;
+        }
+    }
+    if (!dup || c->ndoms == c->cap) {
+        free(dup);
+        cache_invalidate(c);
+        return NULL;
+    }
+
+    struct cache_dom *d = &c->doms[c->ndoms++];
+    memset(d, 0, sizeof(*d));
+    snprintf(d->uuid, sizeof(d->uuid), "%s", uuid);
+    d->name = dup;
+    d->state = VIR_DOMAIN_SHUTOFF;
+    d->persistent = 1;
+    return d;
+}
+
+static void cache_set_name(struct dom_cache *c, struct cache_dom *d,
+                           const char *name) {
+    if (d->name && strcmp(d->name, name) == 0)
+        return;
+    char *dup = strdup(name);
+    if (!dup) {
+        cache_invalidate(c);     /* ancien nom conservé */
+        return;
+    }
+    free(d->name);
+    d->name = dup;
+}
+
+/* Nouvelle génération pour `d`, publiée dans l'anneau d'événements. */
+static void cache_changed(struct dom_cache *c, struct cache_dom *d,
+                          const char *event, const char *reason) {
+    d->gen = ++c->gen;
+
+    struct cache_event *ev = &c->ring[d->gen % CACHE_RING];
+    free(ev->reason);
+    free(ev->name);
+    ev->gen = d->gen;
+    ev->event = event;
+    ev->reason = reason ? strdup(reason) : NULL;
+    ev->name = d->name ? strdup(d->name) : NULL;
+    snprintf(ev->uuid, sizeof(ev->uuid), "%s", d->uuid);
+    ev->state = d->state;
+    ev->removed = d->removed;
+
+    pthread_cond_broadcast(&cache_event_cond);
+}
+
+static void cache_mark_removed(struct dom_cache *c, struct cache_dom *d,
+                               const char *event, const char *reason) {
+    if (d->removed)
+        return;
+    d->removed = 1;
+    c->ntombstones++;
+    cache_changed(c, d, event, reason);
+}
+
+static const char *lifecycle_event_name(int event) {
+    static const char *const names[] = {
+        "defined", "undefined", "started", "suspended", "resumed",
+        "stopped", "shutdown", "pmsuspended", "crashed",
+    };
+    if (event < 0 || event >= (int)(sizeof(names) / sizeof(names[0])))
+        return "unknown";
+    return names[event];
+}
+
+/* Détail libvirt (VIR_DOMAIN_EVENT_*_*) d'un événement de cycle de vie. */
+static const char *lifecycle_reason(int event, int detail) {
+    static const char *const defined[] = {
+        "added", "updated", "renamed", "from_snapshot" };
+    static const char *const undefined[] = { "removed", "renamed" };
+    static const char *const started[] = {
+        "booted", "migrated", "restored", "from_snapshot", "wakeup" };
+    static const char *const suspended[] = {
+        "paused", "migrated", "ioerror", "watchdog", "restored",
+        "from_snapshot", "api_error", "postcopy", "postcopy_failed" };
+    static const char *const resumed[] = {
+        "unpaused", "migrated", "from_snapshot", "postcopy", "postcopy_failed" };
+    static const char *const stopped[] = {
+        "shutdown", "destroyed", "crashed", "migrated", "saved", "failed",
+        "from_snapshot" };
+    static const char *const shutdown[] = { "finished", "guest", "host" };
+    static const char *const pmsuspended[] = { "memory", "disk" };
+    static const char *const crashed[] = { "panicked", "crashloaded" };
+
+#define REASON(table) \
+    (detail >= 0 && detail < (int)(sizeof(table) / sizeof(table[0])) ? \
+     table[detail] : NULL)
+
+    switch (event) {
+        case VIR_DOMAIN_EVENT_DEFINED:     return REASON(defined);
+        case VIR_DOMAIN_EVENT_UNDEFINED:   return REASON(undefined);
+        case VIR_DOMAIN_EVENT_STARTED:     return REASON(started);
+        case VIR_DOMAIN_EVENT_SUSPENDED:   return REASON(suspended);
+        case VIR_DOMAIN_EVENT_RESUMED:     return REASON(resumed);
+        case VIR_DOMAIN_EVENT_STOPPED:     return REASON(stopped);
+        case VIR_DOMAIN_EVENT_SHUTDOWN:    return REASON(shutdown);
+        case VIR_DOMAIN_EVENT_PMSUSPENDED: return REASON(pmsuspended);
+        case VIR_DOMAIN_EVENT_CRASHED:     return REASON(crashed);
+    }
+    return NULL;
+#undef REASON
+}
+
+/* Oublie les tombes les plus anciennes au-delà de CACHE_MAX_TOMBSTONES. */
+static void cache_purge_tombstones(struct dom_cache *c) {
+    if (c->ntombstones <= CACHE_MAX_TOMBSTONES)
+        return;
+
+    int j = 0;
+    for (int i = 0; i < c->ndoms; i++) {
+        if (c->doms[i].removed) {
+            if (c->doms[i].gen > c->purged_gen)
+                c->purged_gen = c->doms[i].gen;
+            free(c->doms[i].name);
+            continue;
+        }
+        c->doms[j++] = c->doms[i];
+    }
+    c->ndoms = j;
+    c->ntombstones = 0;
+}
+
+/* Domaine concerné par un événement, créé s'il est encore inconnu. */
+static struct cache_dom *cache_event_dom(struct dom_cache *c, virDomainPtr dom) {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    if (virDomainGetUUIDString(dom, uuid) < 0)
+        return NULL;
+
+    const char *name = virDomainGetName(dom);
+    struct cache_dom *d = cache_find(c, uuid);
+    if (!d)
+        return cache_add(c, uuid, name);
+
+    cache_set_name(c, d, name);
+    if (d->removed) {
+        d->removed = 0;
+        c->ntombstones--;
+    }
+    return d;
+}
+
+static void cache_on_lifecycle(virConnectPtr conn, virDomainPtr dom,
+                               int event, int detail, void *opaque) {
+    (void)conn;
+    struct dom_cache *c = opaque;
+    const char *name = lifecycle_event_name(event);
+    const char *reason = lifecycle_reason(event, detail);
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_dom *d = cache_event_dom(c, dom);
+    if (!d) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    switch (event) {
+        case VIR_DOMAIN_EVENT_DEFINED:
+            d->persistent = 1;
+            break;
+        case VIR_DOMAIN_EVENT_UNDEFINED:
+            /* Un domaine actif devient transitoire, sinon il disparaît */
+            d->persistent = 0;
+            if (d->state == VIR_DOMAIN_SHUTOFF) {
+                cache_mark_removed(c, d, name, reason);
+                goto out;
+            }
+            break;
+        case VIR_DOMAIN_EVENT_STARTED:
+        case VIR_DOMAIN_EVENT_RESUMED:
+            d->state = VIR_DOMAIN_RUNNING;
+            break;
+        case VIR_DOMAIN_EVENT_SUSPENDED:
+            d->state = VIR_DOMAIN_PAUSED;
+            break;
+        case VIR_DOMAIN_EVENT_SHUTDOWN:
+            d->state = VIR_DOMAIN_SHUTDOWN;
+            break;
+        case VIR_DOMAIN_EVENT_STOPPED:
+            d->state = VIR_DOMAIN_SHUTOFF;
+            if (!d->persistent) {
+                cache_mark_removed(c, d, name, reason);
+                goto out;
+            }
+            break;
+        case VIR_DOMAIN_EVENT_PMSUSPENDED:
+            d->state = VIR_DOMAIN_PMSUSPENDED;
+            break;
+        case VIR_DOMAIN_EVENT_CRASHED:
+            d->state = VIR_DOMAIN_CRASHED;
+            break;
+    }
+    cache_changed(c, d, name, reason);
+
+out:
+    cache_purge_tombstones(c);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Reboot, périphérique ou métadonnée modifiés : l'état ne change pas
+ * mais les clients doivent relire le domaine. */
+static void cache_touch(struct dom_cache *c, virDomainPtr dom,
+                        const char *event, const char *reason) {
+    pthread_mutex_lock(&cache_lock);
+    struct cache_dom *d = cache_event_dom(c, dom);
+    if (d)
+        cache_changed(c, d, event, reason);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_on_reboot(virConnectPtr conn, virDomainPtr dom, void *opaque) {
+    (void)conn;
+    cache_touch(opaque, dom, "reboot", NULL);
+}
+
+static void cache_on_device_added(virConnectPtr conn, virDomainPtr dom,
+                                  const char *alias, void *opaque) {
+    (void)conn;
+    cache_touch(opaque, dom, "device-added", alias);
+}
+
+static void cache_on_device_removed(virConnectPtr conn, virDomainPtr dom,
+                                    const char *alias, void *opaque) {
+    (void)conn;
+    cache_touch(opaque, dom, "device-removed", alias);
+}
+
+static void cache_on_metadata(virConnectPtr conn, virDomainPtr dom, int type,
+                              const char *nsuri, void *opaque) {
+    (void)conn;
+    (void)type;
+    cache_touch(opaque, dom, "metadata", nsuri);
+}
+
+/* Pool démarré, arrêté, (dé)défini ou rafraîchi : les volumes ont pu
+ * changer. */
+static void cache_on_pool(virConnectPtr conn, virStoragePoolPtr pool, void *opaque) {
+    (void)conn;
+    (void)pool;
+    struct dom_cache *c = opaque;
+    pthread_mutex_lock(&cache_lock);
+    c->vol_gen++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_on_close(virConnectPtr conn, int reason, void *opaque) {
+    (void)conn;
+    (void)reason;
+    struct dom_cache *c = opaque;
+    __atomic_store_n(&c->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void cache_disconnect(virConnectPtr conn, const int *callbacks) {
+    for (int i = 0; i < CACHE_CB_COUNT; i++) {
+        if (callbacks[i] < 0)
+            continue;
+        if (i >= CACHE_CB_POOL_LIFECYCLE)
+            virConnectStoragePoolEventDeregisterAny(conn, callbacks[i]);
+        else
+            virConnectDomainEventDeregisterAny(conn, callbacks[i]);
+    }
+    virConnectUnregisterCloseCallback(conn, cache_on_close);
+    virConnectClose(conn);
+}
+
+/* Ouvre la connexion d'événements de `c` et s'abonne. */
+static virConnectPtr cache_connect(struct dom_cache *c, int *callbacks) {
+    virConnectPtr conn = virConnectOpen(c->uri);
+    if (!conn)
+        return NULL;
+
+    virConnectSetKeepAlive(conn, POOL_KEEPALIVE_INT, POOL_KEEPALIVE_CNT);
+    virConnectRegisterCloseCallback(conn, cache_on_close, c, NULL);
+
+    callbacks[CACHE_CB_LIFECYCLE] = virConnectDomainEventRegisterAny(
+        conn, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+        VIR_DOMAIN_EVENT_CALLBACK(cache_on_lifecycle), c, NULL);
+    callbacks[CACHE_CB_REBOOT] = virConnectDomainEventRegisterAny(
+        conn, NULL, VIR_DOMAIN_EVENT_ID_REBOOT,
+        VIR_DOMAIN_EVENT_CALLBACK(cache_on_reboot), c, NULL);
+    callbacks[CACHE_CB_DEVICE_ADDED] = virConnectDomainEventRegisterAny(
+        conn, NULL, VIR_DOMAIN_EVENT_ID_DEVICE_ADDED,
+        VIR_DOMAIN_EVENT_CALLBACK(cache_on_device_added), c, NULL);
+    callbacks[CACHE_CB_DEVICE_REMOVED] = virConnectDomainEventRegisterAny(
+        conn, NULL, VIR_DOMAIN_EVENT_ID_DEVICE_REMOVED,
+        VIR_DOMAIN_EVENT_CALLBACK(cache_on_device_removed), c, NULL);
+    callbacks[CACHE_CB_METADATA] = virConnectDomainEventRegisterAny(
+        conn, NULL, VIR_DOMAIN_EVENT_ID_METADATA_CHANGE,
+        VIR_DOMAIN_EVENT_CALLBACK(cache_on_metadata), c, NULL);
+    callbacks[CACHE_CB_POOL_LIFECYCLE] = virConnectStoragePoolEventRegisterAny(
+        conn, NULL, VIR_STORAGE_POOL_EVENT_ID_LIFECYCLE,
+        VIR_STORAGE_POOL_EVENT_CALLBACK(cache_on_pool), c, NULL);
+    callbacks[CACHE_CB_POOL_REFRESH] = virConnectStoragePoolEventRegisterAny(
+        conn, NULL, VIR_STORAGE_POOL_EVENT_ID_REFRESH,
+        VIR_STORAGE_POOL_EVENT_CALLBACK(cache_on_pool), c, NULL);
+
+    /* Sans événements de cycle de vie, le cache serait faux */
+    if (callbacks[CACHE_CB_LIFECYCLE] < 0) {
+        cache_disconnect(conn, callbacks);
+        return NULL;
+    }
+    return conn;
+}
+
+/*
+ * Amorce `c` : abonnement d'abord, puis listage complet. Un événement
+ * reçu pendant le listage est plus récent que lui et l'emporte.
+ */
+static int cache_prime(struct dom_cache *c, unsigned long long prime_gen) {
+    int callbacks[CACHE_CB_COUNT];
+    for (int i = 0; i < CACHE_CB_COUNT; i++)
+        callbacks[i] = -1;
+
+    virConnectPtr conn = cache_connect(c, callbacks);
+    if (!conn)
+        return -1;
+
+    struct vm_record *recs = NULL;
+    int n = vm_records_collect(conn, VM_FIELD_UUID | VM_FIELD_STATE, &recs);
+    if (n < 0) {
+        cache_disconnect(conn, callbacks);
+        return -1;
+    }
+
+    virDomainPtr *transient = NULL;
+    int ntransient = virConnectListAllDomains(conn, &transient,
+                                              VIR_CONNECT_LIST_DOMAINS_TRANSIENT);
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < c->ndoms; i++)
+        c->doms[i].seen = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct cache_dom *d = cache_find(c, recs[i].uuid);
+        if (!d) {
+            d = cache_add(c, recs[i].uuid, recs[i].name);
+            if (!d)
+                continue;
+            d->state = recs[i].state;
+            cache_changed(c, d, "resync", NULL);
+        } else if (d->gen <= prime_gen &&
+                   (d->removed || d->state != recs[i].state ||
+                    strcmp(d->name, recs[i].name) != 0)) {
+            if (d->removed) {
+                d->removed = 0;
+                c->ntombstones--;
+            }
+            cache_set_name(c, d, recs[i].name);
+            d->state = recs[i].state;
+            cache_changed(c, d, "resync", NULL);
+        }
+        d->persistent = 1;
+        d->seen = 1;
+    }
+
+    for (int i = 0; i < ntransient; i++) {
+        char uuid[VIR_UUID_STRING_BUFLEN];
+        if (virDomainGetUUIDString(transient[i], uuid) == 0) {
+            struct cache_dom *d = cache_find(c, uuid);
+            if (d)
+                d->persistent = 0;
+        }
+        virDomainFree(transient[i]);
+    }
+    free(transient);
+
+    for (int i = 0; i < c->ndoms; i++) {
+        struct cache_dom *d = &c->doms[i];
+        if (!d->seen && d->gen <= prime_gen)
+            cache_mark_removed(c, d, "resync", NULL);
+    }
+    cache_purge_tombstones(c);
+
+    /* Mise à jour perdue pendant l'amorçage (mémoire) : connexion gardée
+     * pour le prochain essai, cache laissé invalide */
+    c->conn = conn;
+    memcpy(c->callbacks, callbacks, sizeof(callbacks));
+    c->valid = !c->lost;
+    c->vol_gen++;                /* événements de pool manqués */
+    pthread_mutex_unlock(&cache_lock);
+
+    vm_records_free(recs, n);
+    return c->valid ? 0 : -1;
+}
+
+/*
+ * Retourne le cache de `uri`, amorcé, verrou `cache_lock` tenu. NULL si
+ * le cache n'est pas utilisable (pilote sans événements, table pleine) :
+ * l'appelant interroge alors libvirt directement.
+ */
+static struct dom_cache *cache_lock_uri(const char *uri) {
+    if (!uri || strlen(uri) >= sizeof(caches[0].uri))
+        return NULL;
+
+    pthread_once(&event_once, event_loop_start);
+
+    pthread_mutex_lock(&cache_lock);
+    for (;;) {
+        struct dom_cache *c = NULL;
+        for (int i = 0; i < CACHE_MAX_URIS && !c; i++) {
+            if (strcmp(caches[i].uri, uri) == 0)
+                c = &caches[i];
+        }
+        for (int i = 0; i < CACHE_MAX_URIS && !c; i++) {
+            if (!caches[i].uri[0]) {
+                c = &caches[i];
+                snprintf(c->uri, sizeof(c->uri), "%s", uri);
+            }
+        }
+        if (!c) {
+            pthread_mutex_unlock(&cache_lock);
+            return NULL;
+        }
+
+        if (c->priming) {
+            pthread_cond_wait(&cache_primed, &cache_lock);
+            continue;
+        }
+
+        int dead = __atomic_load_n(&c->dead, __ATOMIC_ACQUIRE);
+        if (c->valid && !dead && virConnectIsAlive(c->conn) == 1)
+            return c;
+        if (!c->valid && time(NULL) < c->retry_after) {
+            pthread_mutex_unlock(&cache_lock);
+            return NULL;
+        }
+
+        /* Connexion perdue ou jamais ouverte : on (ré)amorce */
+        virConnectPtr old = c->conn;
+        int callbacks[CACHE_CB_COUNT];
+        memcpy(callbacks, c->callbacks, sizeof(callbacks));
+        c->conn = NULL;
+        c->valid = 0;
+        c->dead = 0;
+        c->lost = 0;
+        c->priming = 1;
+        unsigned long long prime_gen = c->gen;
+        pthread_mutex_unlock(&cache_lock);
+
+        if (old)
+            cache_disconnect(old, callbacks);
+        int ret = cache_prime(c, prime_gen);
+
+        pthread_mutex_lock(&cache_lock);
+        c->priming = 0;
+        pthread_cond_broadcast(&cache_primed);
+        if (ret < 0) {
+            c->retry_after = time(NULL) + CACHE_RETRY_DELAY;
+            pthread_mutex_unlock(&cache_lock);
+            return NULL;
+        }
+    }
+}
+
+static int cache_generation(const char *uri, unsigned long long *gen) {
+    struct dom_cache *c = cache_lock_uri(uri);
+    if (!c)
+        return -1;
+    *gen = c->gen;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/*
+ * Génération des pools de stockage de `uri`. -1 si le cache est
+ * inutilisable ou si le pilote n'émet pas d'événements de pool.
+ */
+static int cache_vol_generation(const char *uri, unsigned long long *gen) {
+    struct dom_cache *c = cache_lock_uri(uri);
+    if (!c)
+        return -1;
+    int ret = -1;
+    if (c->callbacks[CACHE_CB_POOL_LIFECYCLE] >= 0) {
+        *gen = c->vol_gen;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+/* Signale un volume créé ou supprimé par nous-mêmes : libvirt n'émet pas
+ * d'événement de pool pour les volumes. */
+static void cache_vol_changed(const char *uri) {
+    struct dom_cache *c = cache_lock_uri(uri);
+    if (!c)
+        return;
+    c->vol_gen++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Génération du domaine `name` (ou, si `name` est NULL, de celui dont
+ * l'UUID est `uuid`) ; `uuid` reçoit alors son UUID et `gen` peut être
+ * NULL. -1 si le domaine est inconnu ou le cache inutilisable.
+ */
+static int cache_dom_gen(const char *uri, const char *name, char *uuid,
+                         unsigned long long *gen) {
+    struct dom_cache *c = cache_lock_uri(uri);
+    if (!c)
+        return -1;
+
+    struct cache_dom *d = NULL;
+    if (!name) {
+        d = cache_find(c, uuid);
+    } else {
+        for (int i = 0; i < c->ndoms && !d; i++) {
+            if (!c->doms[i].removed && c->doms[i].name &&
+                strcmp(c->doms[i].name, name) == 0)
+                d = &c->doms[i];
+        }
+    }
+
+    int ret = -1;
+    if (d && !d->removed) {
+        if (name)
+            snprintf(uuid, VIR_UUID_STRING_BUFLEN, "%s", d->uuid);
+        if (gen)
+            *gen = d->gen;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static void cache_dom_json(struct jw *w, const struct cache_dom *d) {
+    jw_object_begin(w);
+    jw_kstr(w, "name", d->name ? d->name : "");
+    jw_kstr(w, "uuid", d->uuid);
+    jw_kstr(w, "state", state_name(d->state));
+    if (d->removed)
+        jw_kbool(w, "removed", 1);
+    jw_object_end(w);
+}
+
+/*
+ * Domaines modifiés depuis la génération `since` (0 : tous). Si des
+ * tombes postérieures à `since` ont été oubliées, la liste complète est
+ * renvoyée avec "full":true et le client doit remplacer sa vue.
+ */
+char* list_vms_since(const char *uri, unsigned long long since) {
+    API_SCOPE(list_vms_since);
+    struct dom_cache *c = cache_lock_uri(uri);
+    if (!c)
+        return list_vms_ex(uri, VM_FIELDS_DEFAULT);
+
+    int full = since == 0 || since < c->purged_gen;
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kuint(&w, "generation", c->gen);
+    jw_kbool(&w, "full", full);
+    jw_key(&w, "vms");
+    jw_array_begin(&w);
+    for (int i = 0; i < c->ndoms; i++) {
+        const struct cache_dom *d = &c->doms[i];
+        if (full ? d->removed : d->gen <= since)
+            continue;
+        cache_dom_json(&w, d);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    jw_array_end(&w);
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
+
+char* list_vms(const char *uri) {
+    API_SCOPE(list_vms);
+    return list_vms_since(uri, 0);
+}
+
+/*
+ * Attend jusqu'à `timeout_ms` un événement de génération > `since` et
+ * renvoie les événements disponibles. "overflow":true signale que des
+ * événements ont été écrasés dans l'anneau, ou que `since` dépasse la
+ * génération courante (autre processus) : le client doit relire la
+ * liste complète (list_vms).
+ */
+char* wait_events(const char *uri, unsigned long long since, int timeout_ms) {
+    API_SCOPE(wait_events);
+    struct dom_cache *c = cache_lock_uri(uri);
+    if (!c)
+        return json_error("Événements indisponibles pour %s", uri);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    /* Génération venue d'un autre processus (redémarrage, autre worker) :
+     * rien à attendre, le client doit tout relire */
+    int overflow = since > c->gen;
+    while (!overflow && c->gen <= since && c->valid) {
+        if (pthread_cond_timedwait(&cache_event_cond, &cache_lock, &deadline) != 0)
+            break;
+    }
+
+    unsigned long long first = since + 1;
+    if (c->gen >= CACHE_RING && first <= c->gen - CACHE_RING) {
+        first = c->gen - CACHE_RING + 1;
+        overflow = 1;
+    }
+    if (since > c->gen)
+        first = c->gen + 1;
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kuint(&w, "generation", c->gen);
+    jw_kbool(&w, "overflow", overflow);
+    jw_key(&w, "events");
+    jw_array_begin(&w);
+    for (unsigned long long gen = first; gen <= c->gen; gen++) {
+        const struct cache_event *ev = &c->ring[gen % CACHE_RING];
+        if (ev->gen != gen)
+            continue;
+        jw_object_begin(&w);
+        jw_kuint(&w, "gen", ev->gen);
+        jw_kstr(&w, "event", ev->event);
+        jw_kstr(&w, "name", ev->name ? ev->name : "");
+        jw_kstr(&w, "uuid", ev->uuid);
+        jw_kstr(&w, "state", state_name(ev->state));
+        if (ev->reason)
+            jw_kstr(&w, "reason", ev->reason);
+        if (ev->removed)
+            jw_kbool(&w, "removed", 1);
+        jw_object_end(&w);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    jw_array_end(&w);
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
+
+/* ---------- Télémétrie ----------
+ *
+ * Un thread collecteur par URI échantillonne à intervalle réglable l'hôte
+ * (virNodeGetCPUStats, virNodeGetMemoryStats) et tous les domaines actifs
+ * en un seul virConnectGetAllDomainStats (CPU, ballon, disques,
+ * interfaces). Les compteurs bruts sont rangés dans des anneaux de
+ * TELEM_RING échantillons, une colonne contiguë par métrique (structure
+ * de tableaux) : un débit sur une fenêtre ne lit que les deux cases
+ * utiles de la colonne concernée. telemetry_rates() et
+ * telemetry_history() en dérivent CPU %, IOPS et octets/s sans
+ * solliciter libvirtd.
+ *
+ * Les échantillons sont numérotés (tick, à partir de 1) et rangés en
+ * tick % TELEM_RING. Chaque domaine garde le tick de ses propres cases :
+ * une VM absente d'un échantillon (arrêtée, pas encore créée) n'y a pas
+ * de valeur et aucun débit n'est calculé à travers ce trou.
+ */
+
+#define TELEM_MAX_URIS      4
+#define TELEM_MAX_VMS       512
+#define TELEM_RING          360      /* échantillons gardés (1 h à 10 s) */
+#define TELEM_INTERVAL_MS   5000     /* période par défaut */
+#define TELEM_MIN_INTERVAL  250
+#define TELEM_MAX_INTERVAL  3600000
+#define TELEM_WINDOW_S      60       /* fenêtre par défaut des débits */
+
+/* Colonnes par domaine (compteurs cumulés, sauf la mémoire) */
+enum {
+    TM_CPU_NS,
+    TM_RD_REQS,
+    TM_WR_REQS,
+    TM_RD_BYTES,
+    TM_WR_BYTES,
+    TM_RX_BYTES,
+    TM_TX_BYTES,
+    TM_MEM_KIB,
+    TM_DOM_COUNT
+};
+
+/* Colonnes de l'hôte */
+enum {
+    TH_CPU_BUSY_NS,     /* kernel + user */
+    TH_CPU_IDLE_NS,
+    TH_CPU_IOWAIT_NS,
+    TH_MEM_TOTAL_KIB,
+    TH_MEM_FREE_KIB,
+    TH_MEM_CACHE_KIB,   /* buffers + cached */
+    TH_COUNT
+};
+
+/* Débits publiés pour chaque domaine, en unités par seconde. */
+static const struct {
+    const char *key;
+    int col;
+} telem_rate_keys[] = {
+    { "rd_iops", TM_RD_REQS  },
+    { "wr_iops", TM_WR_REQS  },
+    { "rd_bps",  TM_RD_BYTES },
+    { "wr_bps",  TM_WR_BYTES },
+    { "rx_bps",  TM_RX_BYTES },
+    { "tx_bps",  TM_TX_BYTES },
+};
+
+#define TELEM_NRATES (int)(sizeof(telem_rate_keys) / sizeof(telem_rate_keys[0]))
+
+struct telem_dom {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    char name[256];
+    unsigned int vcpus;
+    unsigned long long last_tick;
+    unsigned long long tick[TELEM_RING];               /* 0 : case vide */
+    unsigned long long col[TM_DOM_COUNT][TELEM_RING];
+};
+
+struct telemetry {
+    char uri[256];
+    int running;            /* thread collecteur vivant */
+    int stopping;           /* arrêt demandé */
+    int interval_ms;
+    unsigned long long ticks;                       /* dernier échantillon */
+    unsigned long long t_ns[TELEM_RING];            /* CLOCK_MONOTONIC */
+    unsigned long long host[TH_COUNT][TELEM_RING];
+    struct telem_dom *doms[TELEM_MAX_VMS];
+    int ndoms;
+    char error[256];        /* dernière erreur d'échantillonnage */
+};
+
+/* Valeurs d'un domaine lues hors verrou, avant rangement. */
+struct telem_sample {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    char name[256];
+    unsigned int vcpus;
+    unsigned long long v[TM_DOM_COUNT];
+};
+
+static struct telemetry telems[TELEM_MAX_URIS];
+static pthread_mutex_t telem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t telem_wake = PTHREAD_COND_INITIALIZER;
+
+/* Entrée de `uri` ; avec `create`, une entrée libre ou arrêtée est prise. */
+static struct telemetry *telem_find(const char *uri, int create) {
+    struct telemetry *free_slot = NULL;
+
+    if (!uri || strlen(uri) >= sizeof(telems[0].uri))
+        return NULL;
+    for (int i = 0; i < TELEM_MAX_URIS; i++) {
+        if (strcmp(telems[i].uri, uri) == 0)
+            return &telems[i];
+        if (!telems[i].running && (!free_slot || !telems[i].uri[0]))
+            free_slot = &telems[i];
+    }
+    if (!create || !free_slot)
+        return NULL;
+
+    for (int i = 0; i < free_slot->ndoms; i++)
+        free(free_slot->doms[i]);
+    memset(free_slot, 0, sizeof(*free_slot));
+    snprintf(free_slot->uri, sizeof(free_slot->uri), "%s", uri);
+    return free_slot;
+}
+
+static void telem_sample_host(virConnectPtr conn, unsigned long long *host) {
+    int n = 0;
+
+    if (virNodeGetCPUStats(conn, VIR_NODE_CPU_STATS_ALL_CPUS, NULL, &n, 0) == 0 && n > 0) {
+        virNodeCPUStats *p = calloc(n, sizeof(*p));
+        if (p && virNodeGetCPUStats(conn, VIR_NODE_CPU_STATS_ALL_CPUS, p, &n, 0) == 0) {
+            for (int i = 0; i < n; i++) {
+                if (strcmp(p[i].field, VIR_NODE_CPU_STATS_KERNEL) == 0 ||
+                    strcmp(p[i].field, VIR_NODE_CPU_STATS_USER) == 0)
+                    host[TH_CPU_BUSY_NS] += p[i].value;
+                else if (strcmp(p[i].field, VIR_NODE_CPU_STATS_IDLE) == 0)
+                    host[TH_CPU_IDLE_NS] = p[i].value;
+                else if (strcmp(p[i].field, VIR_NODE_CPU_STATS_IOWAIT) == 0)
+                    host[TH_CPU_IOWAIT_NS] = p[i].value;
+            }
+        }
+        free(p);
+    }
+
+    n = 0;
+    if (virNodeGetMemoryStats(conn, VIR_NODE_MEMORY_STATS_ALL_CELLS, NULL, &n, 0) == 0 && n > 0) {
+        virNodeMemoryStats *p = calloc(n, sizeof(*p));
+        if (p && virNodeGetMemoryStats(conn, VIR_NODE_MEMORY_STATS_ALL_CELLS, p, &n, 0) == 0) {
+            for (int i = 0; i < n; i++) {
+                if (strcmp(p[i].field, VIR_NODE_MEMORY_STATS_TOTAL) == 0)
+                    host[TH_MEM_TOTAL_KIB] = p[i].value;
+                else if (strcmp(p[i].field, VIR_NODE_MEMORY_STATS_FREE) == 0)
+                    host[TH_MEM_FREE_KIB] = p[i].value;
+                else if (strcmp(p[i].field, VIR_NODE_MEMORY_STATS_BUFFERS) == 0 ||
+                         strcmp(p[i].field, VIR_NODE_MEMORY_STATS_CACHED) == 0)
+                    host[TH_MEM_CACHE_KIB] += p[i].value;
+            }
+        }
+        free(p);
+    }
+}
+
+/* Un enregistrement par domaine actif, ou -1 (virGetLastError()). */
+static int telem_sample_doms(virConnectPtr conn, struct telem_sample **out) {
+    virDomainStatsRecordPtr *stats = NULL;
+    unsigned int groups = VIR_DOMAIN_STATS_CPU_TOTAL | VIR_DOMAIN_STATS_BALLOON |
+                          VIR_DOMAIN_STATS_VCPU | VIR_DOMAIN_STATS_BLOCK |
+                          VIR_DOMAIN_STATS_INTERFACE;
+
+    int n = virConnectGetAllDomainStats(conn, groups, &stats,
+                                        VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE);
+    if (n < 0)
+        return -1;
+
+    struct telem_sample *s = calloc(n ? n : 1, sizeof(*s));
+    for (int i = 0; s && i < n; i++) {
+        virTypedParameterPtr params = stats[i]->params;
+        int np = stats[i]->nparams;
+
+        snprintf(s[i].name, sizeof(s[i].name), "%s", virDomainGetName(stats[i]->dom));
+        if (virDomainGetUUIDString(stats[i]->dom, s[i].uuid) < 0)
+            snprintf(s[i].uuid, sizeof(s[i].uuid), "%s", s[i].name);
+        virTypedParamsGetUInt(params, np, "vcpu.current", &s[i].vcpus);
+        virTypedParamsGetULLong(params, np, "cpu.time", &s[i].v[TM_CPU_NS]);
+        virTypedParamsGetULLong(params, np, "balloon.current", &s[i].v[TM_MEM_KIB]);
+        s[i].v[TM_RD_REQS]  = stats_sum(params, np, "block", "rd.reqs");
+        s[i].v[TM_WR_REQS]  = stats_sum(params, np, "block", "wr.reqs");
+        s[i].v[TM_RD_BYTES] = stats_sum(params, np, "block", "rd.bytes");
+        s[i].v[TM_WR_BYTES] = stats_sum(params, np, "block", "wr.bytes");
+        s[i].v[TM_RX_BYTES] = stats_sum(params, np, "net", "rx.bytes");
+        s[i].v[TM_TX_BYTES] = stats_sum(params, np, "net", "tx.bytes");
+    }
+    virDomainStatsRecordListFree(stats);
+
+    *out = s;
+    return s ? n : -1;
+}
+
+/*
+ * Historique du domaine `uuid`, créé au besoin. `*hint` mémorise la
+ * position trouvée : l'ordre des domaines change rarement d'un
+ * échantillon à l'autre, la recherche est alors immédiate. Sans place
+ * libre, l'historique le plus anciennement mis à jour est recyclé.
+ */
+static struct telem_dom *telem_dom_slot(struct telemetry *t, const char *uuid,
+                                        int *hint) {
+    if (*hint < t->ndoms && strcmp(t->doms[*hint]->uuid, uuid) == 0)
+        return t->doms[*hint];
+    for (int i = 0; i < t->ndoms; i++) {
+        if (strcmp(t->doms[i]->uuid, uuid) == 0) {
+            *hint = i;
+            return t->doms[i];
+        }
+    }
+
+    struct telem_dom *d = NULL;
+    if (t->ndoms < TELEM_MAX_VMS) {
+        d = calloc(1, sizeof(*d));
+        if (!d)
+            return NULL;
+        *hint = t->ndoms;
+        t->doms[t->ndoms++] = d;
+    } else {
+        int oldest = -1;
+        for (int i = 0; i < t->ndoms; i++) {
+            if (t->doms[i]->last_tick != t->ticks &&
+                (oldest < 0 || t->doms[i]->last_tick < t->doms[oldest]->last_tick))
+                oldest = i;
+        }
+        if (oldest < 0)
+            return NULL;
+        d = t->doms[oldest];
+        memset(d, 0, sizeof(*d));
+        *hint = oldest;
+    }
+    snprintf(d->uuid, sizeof(d->uuid), "%s", uuid);
+    return d;
+}
+
+static void telem_collect(struct telemetry *t, const char *uri) {
+    unsigned long long host[TH_COUNT] = {0};
+    struct telem_sample *samples = NULL;
+    int n = -1;
+    char error[256] = "";
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (conn) {
+        telem_sample_host(conn, host);
+        n = telem_sample_doms(conn, &samples);
+        if (n < 0) {
+            const virError *e = virGetLastError();
+            snprintf(error, sizeof(error), "%s", e ? e->message : "statistiques indisponibles");
+        }
+        pool_release(conn);
+    } else {
+        const virError *e = virGetLastError();
+        snprintf(error, sizeof(error), "%s", e ? e->message : "connexion impossible");
+    }
+    unsigned long long now = mono_ns();
+
+    pthread_mutex_lock(&telem_lock);
+    snprintf(t->error, sizeof(t->error), "%s", error);
+    if (conn) {
+        unsigned long long tick = ++t->ticks;
+        int slot = tick % TELEM_RING;
+
+        t->t_ns[slot] = now;
+        for (int k = 0; k < TH_COUNT; k++)
+            t->host[k][slot] = host[k];
+
+        int hint = 0;
+        for (int i = 0; i < n; i++) {
+            struct telem_dom *d = telem_dom_slot(t, samples[i].uuid, &hint);
+            if (!d)
+                continue;
+            snprintf(d->name, sizeof(d->name), "%s", samples[i].name);
+            d->vcpus = samples[i].vcpus;
+            d->last_tick = tick;
+            d->tick[slot] = tick;
+            for (int k = 0; k < TM_DOM_COUNT; k++)
+                d->col[k][slot] = samples[i].v[k];
+            hint++;
+        }
+    }
+    pthread_mutex_unlock(&telem_lock);
+
+    free(samples);
+}
+
+static void *telem_run(void *arg) {
+    struct telemetry *t = arg;
+    char uri[256];
+
+    pthread_mutex_lock(&telem_lock);
+    snprintf(uri, sizeof(uri), "%s", t->uri);
+    pthread_mutex_unlock(&telem_lock);
+
+    for (;;) {
+        struct timespec started;
+        clock_gettime(CLOCK_REALTIME, &started);
+        telem_collect(t, uri);
+
+        /* Attente de la période ; réveil anticipé si elle change ou à l'arrêt */
+        pthread_mutex_lock(&telem_lock);
+        while (!t->stopping) {
+            struct timespec deadline = started;
+            deadline.tv_sec += t->interval_ms / 1000;
+            deadline.tv_nsec += (long)(t->interval_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&telem_wake, &telem_lock, &deadline) != 0)
+                break;
+        }
+        if (t->stopping) {
+            t->stopping = 0;
+            t->running = 0;
+            pthread_mutex_unlock(&telem_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&telem_lock);
+    }
+}
+
+/* Premier tick de la fenêtre de `window_s` secondes se terminant au dernier. */
+static unsigned long long telem_window_start(const struct telemetry *t, int window_s) {
+    unsigned long long last = t->ticks, first = last;
+    unsigned long long span = (unsigned long long)window_s * 1000000000ull;
+
+    while (first > 1 && last - first + 1 < TELEM_RING &&
+           t->t_ns[last % TELEM_RING] - t->t_ns[(first - 1) % TELEM_RING] <= span)
+        first--;
+    return first;
+}
+
+/* Débit par seconde d'un compteur cumulé ; 0 s'il a été remis à zéro. */
+static double telem_rate(unsigned long long from, unsigned long long to, double dt_s) {
+    return to >= from && dt_s > 0 ? (double)(to - from) / dt_s : 0;
+}
+
+static double telem_seconds(const struct telemetry *t, unsigned long long from,
+                            unsigned long long to) {
+    return (double)(t->t_ns[to % TELEM_RING] - t->t_ns[from % TELEM_RING]) / 1e9;
+}
+
+/* Part (%) de la colonne CPU `col` dans le temps CPU total de l'hôte. */
+static double telem_host_cpu(const struct telemetry *t, int col,
+                             unsigned long long from, unsigned long long to) {
+    int a = from % TELEM_RING, b = to % TELEM_RING;
+    unsigned long long total = 0;
+
+    for (int k = TH_CPU_BUSY_NS; k <= TH_CPU_IOWAIT_NS; k++) {
+        if (t->host[k][b] < t->host[k][a])
+            return 0;
+        total += t->host[k][b] - t->host[k][a];
+    }
+    return total ? 100.0 * (double)(t->host[col][b] - t->host[col][a]) / total : 0;
+}
+
+static double telem_host_mem_used(const struct telemetry *t, unsigned long long tick) {
+    int s = tick % TELEM_RING;
+    unsigned long long total = t->host[TH_MEM_TOTAL_KIB][s];
+    unsigned long long avail = t->host[TH_MEM_FREE_KIB][s] + t->host[TH_MEM_CACHE_KIB][s];
+
+    return total && avail <= total ? 100.0 * (double)(total - avail) / total : 0;
+}
+
+/* CPU % d'un domaine, rapporté à ses vCPU (100 % : tous occupés). */
+static double telem_dom_cpu(const struct telemetry *t, const struct telem_dom *d,
+                            unsigned long long from, unsigned long long to) {
+    double rate = telem_rate(d->col[TM_CPU_NS][from % TELEM_RING],
+                             d->col[TM_CPU_NS][to % TELEM_RING],
+                             telem_seconds(t, from, to));
+    return rate / 1e7 / (d->vcpus ? d->vcpus : 1);
+}
+
+/* Domaine nommé `name` ; le plus récent si le nom a été réutilisé. */
+static const struct telem_dom *telem_dom_by_name(const struct telemetry *t,
+                                                 const char *name) {
+    const struct telem_dom *found = NULL;
+
+    for (int i = 0; i < t->ndoms; i++) {
+        if (strcmp(t->doms[i]->name, name) == 0 &&
+            (!found || t->doms[i]->last_tick > found->last_tick))
+            found = t->doms[i];
+    }
+    return found;
+}
+
+/*
+ * Démarre le collecteur de `uri`, ou change sa période s'il tourne déjà.
+ * `interval_ms` <= 0 garde la période courante (TELEM_INTERVAL_MS au
+ * premier démarrage). L'historique est conservé d'un arrêt à l'autre.
+ */
+char* telemetry_start(const char *uri, int interval_ms) {
+    API_SCOPE(telemetry_start);
+    if (interval_ms > 0 && (interval_ms < TELEM_MIN_INTERVAL || interval_ms > TELEM_MAX_INTERVAL))
+        return result_error("période invalide (%d à %d ms)",
+                            TELEM_MIN_INTERVAL, TELEM_MAX_INTERVAL);
+
+    pthread_mutex_lock(&telem_lock);
+    struct telemetry *t = telem_find(uri, 1);
+    if (!t) {
+        pthread_mutex_unlock(&telem_lock);
+        return result_error("plus de collecteur disponible pour %s", uri ? uri : "");
+    }
+
+    if (interval_ms > 0)
+        t->interval_ms = interval_ms;
+    else if (!t->interval_ms)
+        t->interval_ms = TELEM_INTERVAL_MS;
+    interval_ms = t->interval_ms;
+
+    if (t->running) {
+        /* Un arrêt demandé mais pas encore effectif est annulé */
+        t->stopping = 0;
+        pthread_cond_broadcast(&telem_wake);
+        pthread_mutex_unlock(&telem_lock);
+        return result_printf("Collecteur actif pour %s (%d ms)", uri, interval_ms);
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, telem_run, t) != 0) {
+        pthread_mutex_unlock(&telem_lock);
+        return result_error("impossible de lancer le collecteur");
+    }
+    pthread_detach(tid);
+    t->running = 1;
+    pthread_mutex_unlock(&telem_lock);
+
+    return result_printf("Collecteur démarré pour %s (%d ms)", uri, interval_ms);
+}
+
+char* telemetry_stop(const char *uri) {
+    API_SCOPE(telemetry_stop);
+    pthread_mutex_lock(&telem_lock);
+    struct telemetry *t = telem_find(uri, 0);
+    if (!t || !t->running) {
+        pthread_mutex_unlock(&telem_lock);
+        return result_error("aucun collecteur actif pour %s", uri ? uri : "");
+    }
+    t->stopping = 1;
+    pthread_cond_broadcast(&telem_wake);
+    pthread_mutex_unlock(&telem_lock);
+
+    return result_printf("Collecteur arrêté pour %s", uri);
+}
+
+/*
+ * Débits sur les `window_s` dernières secondes : CPU et mémoire de
+ * l'hôte, puis pour chaque domaine présent dans le dernier échantillon
+ * CPU %, IOPS et octets/s en lecture, écriture, réception, émission.
+ */
+char* telemetry_rates(const char *uri, int window_s) {
+    API_SCOPE(telemetry_rates);
+    if (window_s <= 0)
+        window_s = TELEM_WINDOW_S;
+
+    pthread_mutex_lock(&telem_lock);
+    struct telemetry *t = telem_find(uri, 0);
+    if (!t || !t->ticks) {
+        pthread_mutex_unlock(&telem_lock);
+        return json_error("Aucun échantillon pour %s", uri ? uri : "");
+    }
+
+    unsigned long long last = t->ticks;
+    unsigned long long first = telem_window_start(t, window_s);
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kstr(&w, "uri", t->uri);
+    jw_kbool(&w, "running", t->running && !t->stopping);
+    jw_kint(&w, "interval_ms", t->interval_ms);
+    jw_kuint(&w, "samples", last < TELEM_RING ? last : TELEM_RING);
+    jw_kdouble(&w, "window_s", telem_seconds(t, first, last), 1);
+    if (t->error[0])
+        jw_kstr(&w, "last_error", t->error);
+
+    int s = last % TELEM_RING;
+    jw_key(&w, "host");
+    jw_object_begin(&w);
+    if (first < last) {
+        jw_kdouble(&w, "cpu_percent", telem_host_cpu(t, TH_CPU_BUSY_NS, first, last), 1);
+        jw_kdouble(&w, "iowait_percent", telem_host_cpu(t, TH_CPU_IOWAIT_NS, first, last), 1);
+    }
+    jw_kuint(&w, "mem_total_kib", t->host[TH_MEM_TOTAL_KIB][s]);
+    jw_kuint(&w, "mem_free_kib", t->host[TH_MEM_FREE_KIB][s]);
+    jw_kdouble(&w, "mem_used_percent", telem_host_mem_used(t, last), 1);
+    jw_object_end(&w);
+
+    jw_key(&w, "vms");
+    jw_array_begin(&w);
+    for (int i = 0; i < t->ndoms; i++) {
+        const struct telem_dom *d = t->doms[i];
+        if (d->tick[s] != last)
+            continue;
+
+        /* Début de la dernière suite ininterrompue d'échantillons du
+         * domaine dans la fenêtre : pas de débit à travers un arrêt */
+        unsigned long long from = last;
+        while (from > first && d->tick[(from - 1) % TELEM_RING] == from - 1)
+            from--;
+
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", d->name);
+        jw_kstr(&w, "uuid", d->uuid);
+        jw_kuint(&w, "vcpus", d->vcpus);
+        jw_kuint(&w, "memory_kib", d->col[TM_MEM_KIB][s]);
+        if (from < last) {
+            double dt = telem_seconds(t, from, last);
+            jw_kdouble(&w, "cpu_percent", telem_dom_cpu(t, d, from, last), 1);
+            for (int k = 0; k < TELEM_NRATES; k++) {
+                int col = telem_rate_keys[k].col;
+                jw_kdouble(&w, telem_rate_keys[k].key,
+                           telem_rate(d->col[col][from % TELEM_RING], d->col[col][s], dt), 1);
+            }
+        }
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    pthread_mutex_unlock(&telem_lock);
+
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
+
+/*
+ * Séries pour les graphes : un point par intervalle entre deux
+ * échantillons consécutifs des `window_s` dernières secondes, en
+ * colonnes ("age_s", puis une liste par métrique). `name` NULL ou vide
+ * désigne l'hôte.
+ */
+char* telemetry_history(const char *uri, const char *name, int window_s) {
+    API_SCOPE(telemetry_history);
+    static unsigned long long points[TELEM_RING];   /* protégé par telem_lock */
+    int host = !name || !name[0];
+
+    if (window_s <= 0)
+        window_s = TELEM_WINDOW_S;
+
+    pthread_mutex_lock(&telem_lock);
+    struct telemetry *t = telem_find(uri, 0);
+    const struct telem_dom *d = t && !host ? telem_dom_by_name(t, name) : NULL;
+    if (!t || !t->ticks || (!host && !d)) {
+        pthread_mutex_unlock(&telem_lock);
+        return json_error("Aucun échantillon pour %s", host ? (uri ? uri : "") : name);
+    }
+
+    unsigned long long last = t->ticks;
+    int npoints = 0;
+    for (unsigned long long tick = telem_window_start(t, window_s) + 1; tick <= last; tick++) {
+        if (host || (d->tick[tick % TELEM_RING] == tick &&
+                     d->tick[(tick - 1) % TELEM_RING] == tick - 1))
+            points[npoints++] = tick;
+    }
+    unsigned long long now = mono_ns();
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kstr(&w, "name", host ? "" : d->name);
+    jw_kint(&w, "interval_ms", t->interval_ms);
+
+    jw_key(&w, "age_s");
+    jw_array_begin(&w);
+    for (int i = 0; i < npoints; i++)
+        jw_double(&w, (double)(now - t->t_ns[points[i] % TELEM_RING]) / 1e9, 1);
+    jw_array_end(&w);
+
+    jw_key(&w, "cpu_percent");
+    jw_array_begin(&w);
+    for (int i = 0; i < npoints; i++)
+        jw_double(&w, host ? telem_host_cpu(t, TH_CPU_BUSY_NS, points[i] - 1, points[i])
+                           : telem_dom_cpu(t, d, points[i] - 1, points[i]), 1);
+    jw_array_end(&w);
+
+    if (host) {
+        jw_key(&w, "iowait_percent");
+        jw_array_begin(&w);
+        for (int i = 0; i < npoints; i++)
+            jw_double(&w, telem_host_cpu(t, TH_CPU_IOWAIT_NS, points[i] - 1, points[i]), 1);
+        jw_array_end(&w);
+
+        jw_key(&w, "mem_used_percent");
+        jw_array_begin(&w);
+        for (int i = 0; i < npoints; i++)
+            jw_double(&w, telem_host_mem_used(t, points[i]), 1);
+        jw_array_end(&w);
+    } else {
+        for (int k = 0; k < TELEM_NRATES; k++) {
+            int col = telem_rate_keys[k].col;
+            jw_key(&w, telem_rate_keys[k].key);
+            jw_array_begin(&w);
+            for (int i = 0; i < npoints; i++) {
+                unsigned long long tick = points[i];
+                jw_double(&w, telem_rate(d->col[col][(tick - 1) % TELEM_RING],
+                                         d->col[col][tick % TELEM_RING],
+                                         telem_seconds(t, tick - 1, tick)), 1);
+            }
+            jw_array_end(&w);
+        }
+    }
+    pthread_mutex_unlock(&telem_lock);
+
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
+
+/* ---------- Exposition Prometheus ----------
+ *
+ * metrics_render() écrit le format texte de Prometheus directement dans
+ * le tampon de l'appelant, réutilisé d'un scrape à l'autre : aucune
+ * chaîne intermédiaire n'est allouée par métrique. Un seul
+ * virConnectGetAllDomainStats ramène les compteurs de tous les domaines ;
+ * chaque paramètre est classé une seule fois vers sa famille de
+ * métriques, puis les échantillons sont regroupés par famille (tri par
+ * comptage) comme l'exige le format. Viennent ensuite l'hôte et les
+ * statistiques de l'API (appels, échecs, histogramme de latence par
+ * fonction exportée).
+ */
+
+enum metric_unit {
+    MU_RAW,
+    MU_NS,      /* nanosecondes publiées en secondes */
+    MU_KIB,     /* Kio publiés en octets */
+};
+
+/*
+ * Familles alimentées par les statistiques de domaine. Dans `key`, '*'
+ * remplace le numéro du périphérique ; `label` nomme le libellé qui le
+ * distingue (nom du disque ou de l'interface, numéro de vCPU).
+ */
+static const struct metric_family {
+    const char *name;
+    const char *type;
+    const char *help;
+    const char *key;
+    const char *label;
+    int unit;
+} metric_families[] = {
+    { "libvirt_domain_state", "gauge",
+      "État du domaine (virDomainState)", "state.state", NULL, MU_RAW },
+    { "libvirt_domain_vcpus", "gauge",
+      "vCPU en service", "vcpu.current", NULL, MU_RAW },
+    { "libvirt_domain_cpu_time_seconds_total", "counter",
+      "Temps CPU consommé par le domaine", "cpu.time", NULL, MU_NS },
+    { "libvirt_domain_vcpu_time_seconds_total", "counter",
+      "Temps CPU par vCPU", "vcpu.*.time", "vcpu", MU_NS },
+    { "libvirt_domain_memory_current_bytes", "gauge",
+      "Mémoire allouée (ballon)", "balloon.current", NULL, MU_KIB },
+    { "libvirt_domain_memory_maximum_bytes", "gauge",
+      "Mémoire maximale", "balloon.maximum", NULL, MU_KIB },
+    { "libvirt_domain_memory_rss_bytes", "gauge",
+      "Mémoire résidente du processus QEMU", "balloon.rss", NULL, MU_KIB },
+    { "libvirt_domain_block_read_bytes_total", "counter",
+      "Octets lus par disque", "block.*.rd.bytes", "device", MU_RAW },
+    { "libvirt_domain_block_write_bytes_total", "counter",
+      "Octets écrits par disque", "block.*.wr.bytes", "device", MU_RAW },
+    { "libvirt_domain_block_read_requests_total", "counter",
+      "Lectures par disque", "block.*.rd.reqs", "device", MU_RAW },
+    { "libvirt_domain_block_write_requests_total", "counter",
+      "Écritures par disque", "block.*.wr.reqs", "device", MU_RAW },
+    { "libvirt_domain_net_receive_bytes_total", "counter",
+      "Octets reçus par interface", "net.*.rx.bytes", "interface", MU_RAW },
+    { "libvirt_domain_net_transmit_bytes_total", "counter",
+      "Octets émis par interface", "net.*.tx.bytes", "interface", MU_RAW },
+    { "libvirt_domain_net_receive_packets_total", "counter",
+      "Paquets reçus par interface", "net.*.rx.pkts", "interface", MU_RAW },
+    { "libvirt_domain_net_transmit_packets_total", "counter",
+      "Paquets émis par interface", "net.*.tx.pkts", "interface", MU_RAW },
+};
+
+#define METRIC_NFAMILIES (int)(sizeof(metric_families) / sizeof(metric_families[0]))
+#define METRIC_MAX_DEVS  64     /* disques ou interfaces nommés par domaine */
+
+struct metric_sample {
+    int family;
+    int dom;
+    unsigned int dev;
+    const char *label;      /* nom du périphérique, NULL : numéro `dev` */
+    unsigned long long value;
+};
+
+/*
+ * Écriture bornée dans le tampon de l'appelant : au-delà de `cap`, plus
+ * rien n'est copié mais `len` continue de compter la taille nécessaire.
+ */
+struct mbuf {
+    char *data;
+    size_t cap;
+    size_t len;
+};
+
+static void mb_write(struct mbuf *m, const char *s, size_t n) {
+    if (m->len + n <= m->cap)
+        memcpy(m->data + m->len, s, n);
+    m->len += n;
+}
+
+static void mb_str(struct mbuf *m, const char *s) {
+    mb_write(m, s, strlen(s));
+}
+
+static void mb_uint(struct mbuf *m, unsigned long long v) {
+    char tmp[24];
+    int i = sizeof(tmp);
+
+    do {
+        tmp[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    mb_write(m, tmp + i, sizeof(tmp) - i);
+}
+
+/* Valeur d'un échantillon : entier, ou secondes exactes depuis des ns. */
+static void mb_value(struct mbuf *m, unsigned long long v, int unit) {
+    if (unit == MU_NS) {
+        char tmp[32];
+        int n = snprintf(tmp, sizeof(tmp), "%llu.%09llu", v / 1000000000ull, v % 1000000000ull);
+        mb_write(m, tmp, n);
+    } else {
+        mb_uint(m, unit == MU_KIB ? v * 1024 : v);
+    }
+}
+
+/* Valeur de libellé : \, " et saut de ligne échappés. */
+static void mb_label(struct mbuf *m, const char *name, const char *value) {
+    mb_str(m, name);
+    mb_write(m, "=\"", 2);
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\')
+            mb_write(m, "\\\\", 2);
+        else if (*p == '"')
+            mb_write(m, "\\\"", 2);
+        else if (*p == '\n')
+            mb_write(m, "\\n", 2);
+        else
+            mb_write(m, p, 1);
+    }
+    mb_write(m, "\"", 1);
+}
+
+static void mb_family(struct mbuf *m, const char *name, const char *type,
+                      const char *help) {
+    mb_str(m, "# HELP ");
+    mb_str(m, name);
+    mb_write(m, " ", 1);
+    mb_str(m, help);
+    mb_str(m, "\n# TYPE ");
+    mb_str(m, name);
+    mb_write(m, " ", 1);
+    mb_str(m, type);
+    mb_write(m, "\n", 1);
+}
+
+/* `key` correspond-il à `pattern` ? '*' y capture un numéro dans *dev. */
+static int metric_match(const char *pattern, const char *key, unsigned int *dev) {
+    while (*pattern) {
+        if (*pattern == '*') {
+            if (*key < '0' || *key > '9')
+                return 0;
+            *dev = 0;
+            while (*key >= '0' && *key <= '9')
+                *dev = *dev * 10 + (*key++ - '0');
+            pattern++;
+        } else if (*pattern++ != *key++) {
+            return 0;
+        }
+    }
+    return *key == '\0';
+}
+
+static unsigned long long metric_param_value(const virTypedParameter *p) {
+    switch (p->type) {
+        case VIR_TYPED_PARAM_INT:    return p->value.i < 0 ? 0 : p->value.i;
+        case VIR_TYPED_PARAM_UINT:   return p->value.ui;
+        case VIR_TYPED_PARAM_LLONG:  return p->value.l < 0 ? 0 : p->value.l;
+        case VIR_TYPED_PARAM_ULLONG: return p->value.ul;
+    }
+    return 0;
+}
+
+/*
+ * Range les paramètres d'un domaine dans `out` ; retourne le nombre
+ * d'échantillons. Les noms de disques et d'interfaces ("block.N.name",
+ * "net.N.name") sont relevés d'abord pour servir de libellés.
+ */
+static int metric_classify(const virDomainStatsRecord *rec, int dom,
+                           struct metric_sample *out) {
+    const char *block_names[METRIC_MAX_DEVS] = {0};
+    const char *net_names[METRIC_MAX_DEVS] = {0};
+    unsigned int dev;
+    int n = 0;
+
+    for (int i = 0; i < rec->nparams; i++) {
+        const virTypedParameter *p = &rec->params[i];
+        if (p->type != VIR_TYPED_PARAM_STRING)
+            continue;
+        if (metric_match("block.*.name", p->field, &dev) && dev < METRIC_MAX_DEVS)
+            block_names[dev] = p->value.s;
+        else if (metric_match("net.*.name", p->field, &dev) && dev < METRIC_MAX_DEVS)
+            net_names[dev] = p->value.s;
+    }
+
+    for (int i = 0; i < rec->nparams; i++) {
+        const virTypedParameter *p = &rec->params[i];
+        if (p->type == VIR_TYPED_PARAM_STRING)
+            continue;
+
+        for (int f = 0; f < METRIC_NFAMILIES; f++) {
+            const struct metric_family *mf = &metric_families[f];
+            dev = 0;
+            if (mf->key[0] != p->field[0] || !metric_match(mf->key, p->field, &dev))
+                continue;
+
+            const char *label = NULL;
+            if (mf->label && mf->key[0] != 'v') {
+                const char **names = mf->key[0] == 'b' ? block_names : net_names;
+                if (dev >= METRIC_MAX_DEVS || !names[dev])
+                    break;
+                label = names[dev];
+            }
+            out[n].family = f;
+            out[n].dom = dom;
+            out[n].dev = dev;
+            out[n].label = label;
+            out[n].value = metric_param_value(p);
+            n++;
+            break;
+        }
+    }
+    return n;
+}
+
+static void metrics_render_domains(struct mbuf *m, virDomainStatsRecordPtr *stats, int ndoms) {
+    int total = 0;
+    for (int d = 0; d < ndoms; d++)
+        total += stats[d]->nparams;
+
+    struct metric_sample *samples = malloc((total ? total : 1) * sizeof(*samples));
+    struct metric_sample *sorted = malloc((total ? total : 1) * sizeof(*sorted));
+    const char **names = malloc((ndoms ? ndoms : 1) * sizeof(*names));
+    if (!samples || !sorted || !names) {
+        free(samples);
+        free(sorted);
+        free(names);
+        return;
+    }
+
+    int n = 0;
+    for (int d = 0; d < ndoms; d++) {
+        names[d] = virDomainGetName(stats[d]->dom);
+        n += metric_classify(stats[d], d, samples + n);
+    }
+
+    /* Regroupement par famille, ordre des domaines conservé */
+    int start[METRIC_NFAMILIES + 1] = {0};
+    for (int i = 0; i < n; i++)
+        start[samples[i].family + 1]++;
+    for (int f = 0; f < METRIC_NFAMILIES; f++)
+        start[f + 1] += start[f];
+    int fill[METRIC_NFAMILIES];
+    memcpy(fill, start, sizeof(fill));
+    for (int i = 0; i < n; i++)
+        sorted[fill[samples[i].family]++] = samples[i];
+
+    for (int f = 0; f < METRIC_NFAMILIES; f++) {
+        const struct metric_family *mf = &metric_families[f];
+        if (start[f] == start[f + 1])
+            continue;
+
+        mb_family(m, mf->name, mf->type, mf->help);
+        for (int i = start[f]; i < start[f + 1]; i++) {
+            const struct metric_sample *s = &sorted[i];
+            mb_str(m, mf->name);
+            mb_write(m, "{", 1);
+            mb_label(m, "domain", names[s->dom]);
+            if (mf->label) {
+                mb_write(m, ",", 1);
+                if (s->label) {
+                    mb_label(m, mf->label, s->label);
+                } else {
+                    mb_str(m, mf->label);
+                    mb_write(m, "=\"", 2);
+                    mb_uint(m, s->dev);
+                    mb_write(m, "\"", 1);
+                }
+            }
+            mb_write(m, "} ", 2);
+            mb_value(m, s->value, mf->unit);
+            mb_write(m, "\n", 1);
+        }
+    }
+
+    free(samples);
+    free(sorted);
+    free(names);
+}
+
+static void metrics_render_host(struct mbuf *m, virConnectPtr conn) {
+    int n = 0;
+
+    if (virNodeGetCPUStats(conn, VIR_NODE_CPU_STATS_ALL_CPUS, NULL, &n, 0) == 0 && n > 0) {
+        virNodeCPUStats *p = calloc(n, sizeof(*p));
+        if (p && virNodeGetCPUStats(conn, VIR_NODE_CPU_STATS_ALL_CPUS, p, &n, 0) == 0) {
+            mb_family(m, "libvirt_node_cpu_seconds_total", "counter",
+                      "Temps CPU de l'hôte par mode");
+            for (int i = 0; i < n; i++) {
+                mb_str(m, "libvirt_node_cpu_seconds_total{");
+                mb_label(m, "mode", p[i].field);
+                mb_write(m, "} ", 2);
+                mb_value(m, p[i].value, MU_NS);
+                mb_write(m, "\n", 1);
+            }
+        }
+        free(p);
+    }
+
+    n = 0;
+    if (virNodeGetMemoryStats(conn, VIR_NODE_MEMORY_STATS_ALL_CELLS, NULL, &n, 0) == 0 && n > 0) {
+        virNodeMemoryStats *p = calloc(n, sizeof(*p));
+        if (p && virNodeGetMemoryStats(conn, VIR_NODE_MEMORY_STATS_ALL_CELLS, p, &n, 0) == 0) {
+            mb_family(m, "libvirt_node_memory_bytes", "gauge",
+                      "Mémoire de l'hôte par type");
+            for (int i = 0; i < n; i++) {
+                mb_str(m, "libvirt_node_memory_bytes{");
+                mb_label(m, "type", p[i].field);
+                mb_write(m, "} ", 2);
+                mb_value(m, p[i].value, MU_KIB);
+                mb_write(m, "\n", 1);
+            }
+        }
+        free(p);
+    }
+}
+
+static void metrics_render_api(struct mbuf *m) {
+    static const char *requests = "mini_hyperviseur_api_requests_total";
+    static const char *duration = "mini_hyperviseur_api_request_duration_seconds";
+    static const char *phases = "mini_hyperviseur_api_phase_seconds_total";
+    struct api_stat *snap = calloc(API_COUNT, sizeof(*snap));
+    unsigned long long calls[API_COUNT];
+
+    if (!snap)
+        return;
+    api_stats_collect(snap);
+    for (int f = 0; f < API_COUNT; f++) {
+        calls[f] = api_hist_count(&snap[f].total);
+        if (snap[f].errors > calls[f])
+            snap[f].errors = calls[f];
+    }
+
+    /* Les fonctions jamais appelées sont omises */
+    mb_family(m, requests, "counter", "Appels des fonctions exportées par résultat");
+    for (int f = 0; f < API_COUNT; f++) {
+        if (!calls[f])
+            continue;
+        for (int ok = 1; ok >= 0; ok--) {
+            mb_str(m, requests);
+            mb_write(m, "{", 1);
+            mb_label(m, "function", api_names[f]);
+            mb_str(m, ok ? ",result=\"ok\"} " : ",result=\"error\"} ");
+            mb_uint(m, ok ? calls[f] - snap[f].errors : snap[f].errors);
+            mb_write(m, "\n", 1);
+        }
+    }
+
+    mb_family(m, duration, "histogram", "Durée des appels des fonctions exportées");
+    for (int f = 0; f < API_COUNT; f++) {
+        unsigned long long cumul = 0;
+        if (!calls[f])
+            continue;
+        for (int b = 0; b <= API_NBUCKETS; b++) {
+            char le[24];
+            cumul += snap[f].total.buckets[b];
+            if (b < API_NBUCKETS)
+                snprintf(le, sizeof(le), "%g", api_buckets_us[b] / 1e6);
+            else
+                snprintf(le, sizeof(le), "+Inf");
+
+            mb_str(m, duration);
+            mb_str(m, "_bucket{");
+            mb_label(m, "function", api_names[f]);
+            mb_write(m, ",", 1);
+            mb_label(m, "le", le);
+            mb_write(m, "} ", 2);
+            mb_uint(m, cumul);
+            mb_write(m, "\n", 1);
+        }
+        mb_str(m, duration);
+        mb_str(m, "_sum{");
+        mb_label(m, "function", api_names[f]);
+        mb_write(m, "} ", 2);
+        mb_value(m, snap[f].total.sum_ns, MU_NS);
+        mb_str(m, "\n");
+        mb_str(m, duration);
+        mb_str(m, "_count{");
+        mb_label(m, "function", api_names[f]);
+        mb_write(m, "} ", 2);
+        mb_uint(m, calls[f]);
+        mb_write(m, "\n", 1);
+    }
+
+    mb_family(m, phases, "counter",
+              "Temps passé par phase (connect, lookup, operation, serialize)");
+    for (int f = 0; f < API_COUNT; f++) {
+        for (int p = 0; calls[f] && p < PH_COUNT; p++) {
+            if (!api_hist_count(&snap[f].phases[p]))
+                continue;
+            mb_str(m, phases);
+            mb_write(m, "{", 1);
+            mb_label(m, "function", api_names[f]);
+            mb_write(m, ",", 1);
+            mb_label(m, "phase", api_phase_names[p]);
+            mb_write(m, "} ", 2);
+            mb_value(m, snap[f].phases[p].sum_ns, MU_NS);
+            mb_write(m, "\n", 1);
+        }
+    }
+    free(snap);
+}
+
+/*
+ * Écrit l'exposition Prometheus de `uri` dans `buf` (`cap` octets).
+ * Retourne le nombre d'octets écrits, ou -2 si le tampon est trop petit
+ * (*needed donne la taille requise, à réessayer). Si libvirtd ne répond
+ * pas, libvirt_up vaut 0 et seules les statistiques de l'API suivent.
+ */
+long metrics_render(const char *uri, void *buf, size_t cap, size_t *needed) {
+    API_SCOPE(metrics_render);
+    struct mbuf m = { buf, cap, 0 };
+    virDomainStatsRecordPtr *stats = NULL;
+    int ndoms = -1;
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (conn) {
+        unsigned int groups = VIR_DOMAIN_STATS_STATE | VIR_DOMAIN_STATS_CPU_TOTAL |
+                              VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_VCPU |
+                              VIR_DOMAIN_STATS_BLOCK | VIR_DOMAIN_STATS_INTERFACE;
+        ndoms = virConnectGetAllDomainStats(conn, groups, &stats, 0);
+    }
+
+    mb_family(&m, "libvirt_up", "gauge", "1 si libvirtd a répondu au dernier scrape");
+    mb_str(&m, ndoms >= 0 ? "libvirt_up 1\n" : "libvirt_up 0\n");
+
+    /* Les compteurs de l'hôte sont lus au fil de l'écriture */
+    if (conn)
+        metrics_render_host(&m, conn);
+    api_phase_set(PH_SERIALIZE);
+    if (ndoms >= 0) {
+        metrics_render_domains(&m, stats, ndoms);
+        virDomainStatsRecordListFree(stats);
+    }
+    pool_release(conn);
+
+    metrics_render_api(&m);
+
+    if (needed)
+        *needed = m.len;
+    return m.len <= cap ? (long)m.len : -2;
+}
+
+/* Borne (ms) de la classe contenant le quantile `q` ; -1 : au-delà. */
+static double api_hist_quantile(const struct api_hist *h, double q) {
+    unsigned long long total = api_hist_count(h), cumul = 0;
+    if (!total)
+        return 0;
+    for (int b = 0; b < API_NBUCKETS; b++) {
+        cumul += h->buckets[b];
+        if (cumul >= q * total)
+            return api_buckets_us[b] / 1e3;
+    }
+    return -1;
+}
+
+static void api_hist_json(struct jw *w, const struct api_hist *h) {
+    jw_kuint(w, "calls", api_hist_count(h));
+    jw_kdouble(w, "sum_ms", h->sum_ns / 1e6, 3);
+    jw_kdouble(w, "p50_ms", api_hist_quantile(h, 0.50), 3);
+    jw_kdouble(w, "p90_ms", api_hist_quantile(h, 0.90), 3);
+    jw_kdouble(w, "p99_ms", api_hist_quantile(h, 0.99), 3);
+    jw_key(w, "counts");
+    jw_array_begin(w);
+    for (int b = 0; b <= API_NBUCKETS; b++)
+        jw_uint(w, h->buckets[b]);
+    jw_array_end(w);
+}
+
+/*
+ * Histogrammes agrégés de toutes les fonctions appelées, au total et par
+ * phase. "counts" a une case par borne de "buckets_us" plus une pour
+ * +Inf ; les quantiles pXX_ms sont la borne de leur classe (-1 : +Inf).
+ */
+char* get_api_stats(void) {
+    API_SCOPE(get_api_stats);
+    struct api_stat *snap = calloc(API_COUNT, sizeof(*snap));
+    if (!snap)
+        return json_error("Mémoire insuffisante");
+    int threads = api_stats_collect(snap);
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kint(&w, "threads", threads);
+    jw_kbool(&w, "tracing", api_trace != NULL);
+    jw_key(&w, "buckets_us");
+    jw_array_begin(&w);
+    for (int b = 0; b < API_NBUCKETS; b++)
+        jw_uint(&w, api_buckets_us[b]);
+    jw_array_end(&w);
+
+    jw_key(&w, "functions");
+    jw_array_begin(&w);
+    for (int f = 0; f < API_COUNT; f++) {
+        if (!api_hist_count(&snap[f].total))
+            continue;
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", api_names[f]);
+        jw_kuint(&w, "errors", snap[f].errors);
+        api_hist_json(&w, &snap[f].total);
+        jw_key(&w, "phases");
+        jw_object_begin(&w);
+        for (int p = 0; p < PH_COUNT; p++) {
+            if (!api_hist_count(&snap[f].phases[p]))
+                continue;
+            jw_key(&w, api_phase_names[p]);
+            jw_object_begin(&w);
+            api_hist_json(&w, &snap[f].phases[p]);
+            jw_object_end(&w);
+        }
+        jw_object_end(&w);
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    jw_object_end(&w);
+
+    free(snap);
+    return jw_finish(&w);
+}
+
+/* ---------- Tâches asynchrones ----------
+ *
+ * Création, clonage, migration, fusion d'overlays, sauvegarde et
+ * restauration peuvent durer des minutes : plutôt que de bloquer le
+ * worker Flask, elles sont soumises comme tâches à un petit pool de
+ * threads. Chaque tâche a un identifiant, un état, une progression
+ * (octets copiés ou transférés) et peut être annulée. Le code des
+ * opérations reçoit la tâche en paramètre (NULL en appel synchrone)
+ * pour publier sa progression et tester l'annulation. Un message final
+ * commençant par « Erreur » marque la tâche en échec.
+ */
+
+#define JOB_MAX      256
+#define JOB_WORKERS  4
+#define JOB_NARGS    7
+#define PAR_WORKERS  4  /* disques traités en parallèle par une tâche */
+
+enum job_kind { JOB_CREATE, JOB_CLONE, JOB_MIGRATE, JOB_COMMIT, JOB_BACKUP, JOB_RESTORE };
+enum job_state { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED };
+
+/* Dernier échantillon de virDomainGetJobStats pendant une migration. */
+struct migrate_stats {
+    unsigned long long data_total;
+    unsigned long long data_processed;
+    unsigned long long data_remaining;
+    unsigned long long bps;            /* débit mémoire, octets/s */
+    unsigned long long dirty_bps;      /* pages salies, octets/s */
+    unsigned long long iteration;
+    unsigned long long downtime_ms;    /* estimé, puis réel */
+    int throttle;                      /* % de ralentissement auto-converge */
+    int postcopy;                      /* bascule post-copy effectuée */
+    unsigned long samples;
+};
+
+struct job {
+    int id;                       /* 0 : emplacement libre */
+    enum job_kind kind;
+    enum job_state state;
+    char *args[JOB_NARGS];
+    char *result;
+    unsigned long long done;
+    unsigned long long total;
+    int cancel;
+    pid_t pids[PAR_WORKERS];      /* copies de disque en cours */
+    virDomainPtr dom;             /* domaine en migration ou sauvegarde */
+    struct migrate_stats mig;
+    time_t created;
+    time_t started;
+    time_t finished;
+    struct job *next;             /* file d'attente */
+};
+
+static struct job jobs[JOB_MAX];
+static int job_next_id = 1;
+static struct job *job_head;
+static struct job *job_tail;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+static pthread_once_t job_once = PTHREAD_ONCE_INIT;
+
+static void job_progress(struct job *job, unsigned long long done,
+                         unsigned long long total) {
+    if (!job)
+        return;
+    pthread_mutex_lock(&job_lock);
+    job->done = done;
+    job->total = total;
+    pthread_mutex_unlock(&job_lock);
+}
+
+static int job_cancelled(struct job *job) {
+    return job && __atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Processus fils à tuer si la tâche est annulée : `old` (0 : aucun) est
+ * remplacé par `pid` (0 : retrait).
+ */
+static void job_set_pid(struct job *job, pid_t old, pid_t pid) {
+    if (!job)
+        return;
+    pthread_mutex_lock(&job_lock);
+    for (int i = 0; i < PAR_WORKERS; i++) {
+        if (job->pids[i] == old) {
+            job->pids[i] = pid;
+            break;
+        }
+    }
+    int cancel = job->cancel;
+    pthread_mutex_unlock(&job_lock);
+    if (pid > 0 && cancel)
+        kill(pid, SIGTERM);
+}
+
+/* Domaine dont le job libvirt est suivi et annulable (NULL : aucun). */
+static void job_set_domain(struct job *job, virDomainPtr dom) {
+    if (!job)
+        return;
+    if (dom)
+        virDomainRef(dom);
+    pthread_mutex_lock(&job_lock);
+    virDomainPtr old = job->dom;
+    job->dom = dom;
+    pthread_mutex_unlock(&job_lock);
+    if (old)
+        virDomainFree(old);
+}
+
+static void job_migrate_stats(struct job *job, const struct migrate_stats *s) {
+    if (!job)
+        return;
+    pthread_mutex_lock(&job_lock);
+    job->mig = *s;
+    job->done = s->data_processed;
+    job->total = s->data_total;
+    pthread_mutex_unlock(&job_lock);
+}
+
+struct par_run {
+    void (*fn)(void *ctx, int i);
+    void *ctx;
+    int n;
+    int next;
+};
+
+static void *par_worker(void *arg) {
+    struct par_run *r = arg;
+    for (;;) {
+        int i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+        if (i >= r->n)
+            break;
+        r->fn(r->ctx, i);
+    }
+    return NULL;
+}
+
+/*
+ * Appelle fn(ctx, i) pour i de 0 à n-1 sur au plus PAR_WORKERS threads,
+ * dont l'appelant ; chaque thread prend l'élément suivant dès qu'il est
+ * libre. Retourne quand tous sont traités.
+ */
+static void parallel_for(int n, void (*fn)(void *ctx, int i), void *ctx) {
+    struct par_run r = { fn, ctx, n, 0 };
+    pthread_t tids[PAR_WORKERS - 1];
+    int started = 0;
+
+    for (int i = 0; i < PAR_WORKERS - 1 && i < n - 1; i++) {
+        if (pthread_create(&tids[started], NULL, par_worker, &r) == 0)
+            started++;
+    }
+    par_worker(&r);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+}
+
+static char *do_create_vm(const char *uri, const char *name,
+                          const char *ram, const char *cpu,
+                          const char *disk, const char *iso,
+                          const char *osinfo, struct job *job)
+{
+    char *msg;
+    (void)osinfo;
+
+    int ram_mb   = atoi(ram);
+    int vcpu     = atoi(cpu);
+    int size_gb  = atoi(disk);
+
+    /* Connexion libvirt */
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn) {
+        msg = result_error(
+                "impossible de se connecter à %s", uri);
+        return msg;
+    }
+
+    /* ---------- Créer le disque QCOW2 via libvirt ---------- */
+    virStoragePoolPtr pool = virStoragePoolLookupByName(conn, "default");
+    if (!pool) {
+        msg = result_error("pool 'default' introuvable");
+        pool_release(conn);
+        return msg;
+    }
+
+    char vol_name[300];
+    snprintf(vol_name, sizeof(vol_name), "%s.qcow2", name);
+    char *vol_xml = volume_xml(vol_name, (unsigned long long)size_gb << 30,
+                               "qcow2", NULL, NULL);
+
+    virStorageVolPtr vol = vol_xml ? virStorageVolCreateXML(pool, vol_xml, 0) : NULL;
+    free(vol_xml);
+    if (!vol) {
+        msg = result_error("création du volume QCOW2");
+        virStoragePoolFree(pool);
+        pool_release(conn);
+        return msg;
+    }
+
+    char *disk_path = virStorageVolGetPath(vol);
+    cache_vol_changed(uri);
+    job_progress(job, 1, 3);
+
+    if (job_cancelled(job)) {
+        msg = result_error("création de %s annulée", name);
+        virStorageVolDelete(vol, 0);
+        virStorageVolFree(vol);
+        virStoragePoolFree(pool);
+        free(disk_path);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* ---------- Générer le XML de la VM ---------- */
+
+    xmlDocPtr doc = xml_parse(
+        "<domain type='kvm'>"
+        "  <name/>"
+        "  <memory unit='MiB'/>"
+        "  <currentMemory unit='MiB'/>"
+        "  <vcpu/>"
+        "  <os>"
+        "    <type arch='x86_64'>hvm</type>"
+        "    <boot dev='cdrom'/>"
+        "  </os>"
+        "  <devices>"
+        "    <disk type='file' device='disk'>"
+        "      <driver name='qemu' type='qcow2'/>"
+        "      <source/>"
+        "      <target dev='vda' bus='virtio'/>"
+        "    </disk>"
+        "    <disk type='file' device='cdrom'>"
+        "      <source/>"
+        "      <target dev='hda' bus='ide'/>"
+        "    </disk>"
+        "    <graphics type='vnc' port='-1' listen='0.0.0.0'/>"
+        "    <interface type='bridge'>"
+        "      <source bridge='br0'/>"
+        "      <model type='virtio'/>"
+        "    </interface>"
+        "  </devices>"
+        "</domain>");
+
+    char mem[16], cpus[16];
+    snprintf(mem, sizeof(mem), "%d", ram_mb);
+    snprintf(cpus, sizeof(cpus), "%d", vcpu);
+    char *xml = NULL;
+    if (doc) {
+        xml_set_text(doc, NULL, "/domain/name", name);
+        xml_set_text(doc, NULL, "/domain/memory", mem);
+        xml_set_text(doc, NULL, "/domain/currentMemory", mem);
+        xml_set_text(doc, NULL, "/domain/vcpu", cpus);
+        xml_set_attr(doc, NULL, "/domain/devices/disk[@device='disk']/source",
+                     "file", disk_path ? disk_path : "");
+        xml_set_attr(doc, NULL, "/domain/devices/disk[@device='cdrom']/source",
+                     "file", iso);
+        xml = xml_dump(doc);
+        xmlFreeDoc(doc);
+    }
+    free(disk_path);
+
+    /* ---------- Définir la VM ---------- */
+
+    virDomainPtr dom = xml ? virDomainDefineXML(conn, xml) : NULL;
+    free(xml);
+    if (!dom) {
+        msg = result_error("defineXML a échoué");
+        virStorageVolDelete(vol, 0);
+        virStorageVolFree(vol);
+        virStoragePoolFree(pool);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* ---------- Démarrer la VM ---------- */
+
+    job_progress(job, 2, 3);
+    if (job_cancelled(job) || virDomainCreate(dom) < 0) {
+        msg = result_error("impossible de démarrer la VM");
+        virDomainUndefine(dom);
+        virStorageVolDelete(vol, 0);
+        virStorageVolFree(vol);
+        virStoragePoolFree(pool);
+        pool_release(conn);
+        return msg;
+    }
+
+    job_progress(job, 3, 3);
+    msg = result_printf(
+             "VM %s créée avec succès (RAM=%dMB, CPU=%d, DISK=%dG)",
+             name, ram_mb, vcpu, size_gb);
+
+    /* Libération */
+    virDomainFree(dom);
+    virStorageVolFree(vol);
+    virStoragePoolFree(pool);
+    pool_release(conn);
+
+    return msg;
+}
+
+char* create_vm(const char *uri, const char *name,
+                      const char *ram, const char *cpu,
+                      const char *disk, const char *iso, const char *osinfo)
+{
+    API_SCOPE(create_vm);
+    return do_create_vm(uri, name, ram, cpu, disk, iso, osinfo, NULL);
+}
+
+
+/* ---------- Mise en veille sur disque (save/restore) ----------
+ *
+ * Une VM mise en pause garde sa RAM sur l'hôte. state_save() écrit
+ * l'état complet (RAM et périphériques) dans <SAVE_DIR>/<vm>.save
+ * puis arrête la VM ; state_restore() la relance depuis ce fichier,
+ * supprimé une fois la VM reprise. virDomainSaveParams permet
+ * d'écrire la RAM sur plusieurs canaux en parallèle (format "sparse"
+ * de qemu, une position fixe par page), choisir la compression, et
+ * contourner le cache de pages de l'hôte (BYPASS_CACHE) : l'image
+ * n'évince pas la RAM que l'on cherche justement à libérer. Les
+ * paramètres de chaque image sont notés dans <vm>.save.info pour la
+ * restaurer de la même façon.
+ *
+ * Les paramètres et drapeaux sont testés par leurs macros : avec une
+ * libvirt plus ancienne, on retombe sur un seul canal, puis sur
+ * virDomainSaveFlags (format de qemu.conf).
+ *
+ * Comme pour managedsave, démarrer une VM qui a une image la reprend
+ * depuis celle-ci. Une image dont un disque a été modifié après son
+ * écriture (démarrage hors de l'application, retour à une sauvegarde…)
+ * est périmée : la reprendre remettrait en mémoire des caches de
+ * systèmes de fichiers qui ne correspondent plus aux disques. Elle est
+ * refusée par state_restore(), et supprimée par un démarrage.
+ *
+ * SAVE_DIR est distinct de /var/lib/libvirt/qemu/save, où libvirt range
+ * ses propres images (managedsave) sous le même nom. Il doit être local
+ * à l'hôte libvirt : libvirt y écrit l'image, et nous y lisons les
+ * fichiers .info. Les URI distantes sont donc refusées.
+ */
+
+#define SAVE_DIR_DEFAULT "/var/lib/libvirt/mini-hyperviseur/save"
+#define SAVE_CHANNELS    4   /* canaux par défaut */
+#define SAVE_MAX_CHANNELS 16
+
+struct save_info {
+    char format[16];         /* "" : format de qemu.conf */
+    int channels;
+    long long created;
+    long long elapsed_ms;
+};
+
+static const char *save_dir(void) {
+    const char *dir = getenv("SAVE_DIR");
+    return dir && dir[0] ? dir : SAVE_DIR_DEFAULT;
+}
+
+/* Vrai si `uri` désigne l'hôte local (pas de nom d'hôte après "://"). */
+static int uri_is_local(const char *uri) {
+    const char *p = uri ? strstr(uri, "://") : NULL;
+    return p && (p[3] == '/' || p[3] == '\0');
+}
+
+/* Crée `path` et ses parents manquants. */
+static int mkdir_parents(const char *path, mode_t mode) {
+    char buf[4096];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return mkdir(buf, mode) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+static void save_path(char *buf, size_t len, const char *name, const char *suffix) {
+    snprintf(buf, len, "%s/%s.save%s", save_dir(), name, suffix);
+}
+
+/* Nom utilisable dans SAVE_DIR : pas de '/' ni de '.' initial. Les noms
+ * de domaines libvirt le sont toujours. */
+static int save_name_ok(const char *name) {
+    return name && name[0] && name[0] != '.' && !strchr(name, '/');
+}
+
+/*
+ * Vrai si l'image `img` ne vaut plus pour `dom` : VM démarrée, ou disque
+ * inscriptible modifié après l'écriture de l'image.
+ */
+static int save_stale(virConnectPtr conn, virDomainPtr dom, const struct stat *img) {
+    if (virDomainIsActive(dom) == 1)
+        return 1;
+
+    xmlDocPtr doc = domain_doc(conn, dom, VIR_DOMAIN_XML_INACTIVE);
+    struct xml_disk *disks = NULL;
+    int ndisks = doc ? xml_disks(doc, &disks) : 0;
+    int stale = 0;
+    for (int i = 0; i < ndisks && !stale; i++) {
+        struct stat st;
+        if (!disks[i].writable || stat(disks[i].path, &st) < 0)
+            continue;
+        stale = st.st_mtim.tv_sec > img->st_mtim.tv_sec ||
+                (st.st_mtim.tv_sec == img->st_mtim.tv_sec &&
+                 st.st_mtim.tv_nsec > img->st_mtim.tv_nsec);
+    }
+    xml_disks_free(disks, ndisks);
+    xmlFreeDoc(doc);
+    return stale;
+}
+
+static int save_info_read(const char *name, struct save_info *info) {
+    char path[4096];
+    save_path(path, sizeof(path), name, ".info");
+    memset(info, 0, sizeof(*info));
+    info->channels = 1;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    int n = fscanf(f, "%15s %d %lld %lld", info->format, &info->channels,
+                   &info->created, &info->elapsed_ms);
+    fclose(f);
+    if (strcmp(info->format, "-") == 0)
+        info->format[0] = '\0';
+    return n == 4 ? 0 : -1;
+}
+
+static int save_info_write(const char *name, const struct save_info *info) {
+    char path[4096];
+    save_path(path, sizeof(path), name, ".info");
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "%s %d %lld %lld\n", info->format[0] ? info->format : "-",
+            info->channels, info->created, info->elapsed_ms);
+    return fclose(f);
+}
+
+static void save_remove(const char *name) {
+    char path[4096];
+    save_path(path, sizeof(path), name, "");
+    unlink(path);
+    save_path(path, sizeof(path), name, ".info");
+    unlink(path);
+}
+
+/*
+ * Écrit l'état de `dom` dans son fichier de sauvegarde et arrête la VM.
+ * `format` vide : "sparse" en parallèle, sinon celui de qemu.conf ; un
+ * autre format que "sparse" n'a qu'un canal ; `channels` <= 0 :
+ * SAVE_CHANNELS. En cas d'échec hors libvirt, *why
+ * explique pourquoi. Retourne 0 en cas de succès.
+ */
+static int state_save(virDomainPtr dom, const char *name, const char *format,
+                      int channels, struct save_info *info, const char **why) {
+    char path[4096];
+    if (!save_name_ok(name)) {
+        *why = "nom de VM invalide";
+        return -1;
+    }
+    if (mkdir_parents(save_dir(), 0700) < 0) {
+        *why = "répertoire de sauvegarde inaccessible";
+        return -1;
+    }
+    save_path(path, sizeof(path), name, "");
+
+    memset(info, 0, sizeof(*info));
+    if (channels <= 0)
+        channels = SAVE_CHANNELS;
+    if (channels > SAVE_MAX_CHANNELS)
+        channels = SAVE_MAX_CHANNELS;
+#ifndef VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS
+    channels = 1;
+#endif
+    if ((!format || !format[0]) && channels > 1)
+        format = "sparse";   /* seul format accepté en parallèle */
+    else if (format && format[0] && strcmp(format, "sparse") != 0)
+        channels = 1;        /* zstd, lzop… : un seul canal */
+#ifndef VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT
+    format = NULL;
+#endif
+    snprintf(info->format, sizeof(info->format), "%s", format ? format : "");
+    info->channels = channels;
+    info->created = time(NULL);
+
+    unsigned long long t0 = mono_ns();
+    int rc;
+#ifdef VIR_DOMAIN_SAVE_PARAM_FILE
+    virTypedParameterPtr params = NULL;
+    int nparams = 0, maxparams = 0;
+    unsigned int flags = VIR_DOMAIN_SAVE_BYPASS_CACHE;
+    virTypedParamsAddString(&params, &nparams, &maxparams,
+                            VIR_DOMAIN_SAVE_PARAM_FILE, path);
+#ifdef VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT
+    if (info->format[0])
+        virTypedParamsAddString(&params, &nparams, &maxparams,
+                                VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT, info->format);
+#endif
+#ifdef VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS
+    if (channels > 1) {
+        virTypedParamsAddInt(&params, &nparams, &maxparams,
+                             VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS, channels);
+        flags |= VIR_DOMAIN_SAVE_PARALLEL;
+    }
+#endif
+    rc = virDomainSaveParams(dom, params, nparams, flags);
+    virTypedParamsFree(params, nparams);
+#else
+    rc = virDomainSaveFlags(dom, path, NULL, VIR_DOMAIN_SAVE_BYPASS_CACHE);
+#endif
+    info->elapsed_ms = (long long)((mono_ns() - t0) / 1000000);
+    if (rc < 0) {
+        unlink(path);
+        return -1;
+    }
+    if (save_info_write(name, info) < 0)
+        *why = "VM arrêtée, mais paramètres de l'image non enregistrés";
+    return 0;
+}
+
+/*
+ * Relance `dom` depuis son fichier de sauvegarde, avec les canaux
+ * utilisés à l'écriture, puis supprime l'image : la reprendre une
+ * seconde fois ramènerait les disques en arrière. Une image périmée est
+ * refusée.
+ */
+static int state_restore(virConnectPtr conn, virDomainPtr dom,
+                         struct save_info *info, const char **why) {
+    char path[4096];
+    struct stat st;
+    const char *name = virDomainGetName(dom);
+    memset(info, 0, sizeof(*info));
+    if (!save_name_ok(name)) {
+        *why = "nom de VM invalide";
+        return -1;
+    }
+    save_path(path, sizeof(path), name, "");
+    if (stat(path, &st) < 0) {
+        *why = "aucune sauvegarde d'état";
+        return -1;
+    }
+    if (save_stale(conn, dom, &st)) {
+        *why = virDomainIsActive(dom) == 1
+             ? "la VM est démarrée"
+             : "image périmée, disques modifiés depuis la mise en veille";
+        return -1;
+    }
+    save_info_read(name, info);
+
+    unsigned long long t0 = mono_ns();
+    int rc;
+#ifdef VIR_DOMAIN_SAVE_PARAM_FILE
+    virTypedParameterPtr params = NULL;
+    int nparams = 0, maxparams = 0;
+    unsigned int flags = VIR_DOMAIN_SAVE_BYPASS_CACHE;
+    virTypedParamsAddString(&params, &nparams, &maxparams,
+                            VIR_DOMAIN_SAVE_PARAM_FILE, path);
+#ifdef VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS
+    if (info->channels > 1) {
+        virTypedParamsAddInt(&params, &nparams, &maxparams,
+                             VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS, info->channels);
+        flags |= VIR_DOMAIN_SAVE_PARALLEL;
+    }
+#endif
+    rc = virDomainRestoreParams(conn, params, nparams, flags);
+    virTypedParamsFree(params, nparams);
+#else
+    rc = virDomainRestoreFlags(conn, path, NULL, VIR_DOMAIN_SAVE_BYPASS_CACHE);
+#endif
+    info->elapsed_ms = (long long)((mono_ns() - t0) / 1000000);
+    if (rc == 0)
+        save_remove(name);
+    return rc;
+}
+
+static char *action_error(const char *what, const char *name, const char *why) {
+    const virError *e = virGetLastError();
+    return result_error("%s %s (%s)", what, name,
+                        why ? why : e ? e->message : "inconnu");
+}
+
+/* Met `name` en veille sur disque : {"message","file","format","channels","bytes","elapsed_ms"}
+ * ou {"error"}. */
+char* save_vm(const char *uri, const char *name, const char *format, int channels) {
+    API_SCOPE(save_vm);
+    if (!uri_is_local(uri))
+        return json_error("Mise en veille impossible sur %s : SAVE_DIR doit être local", uri);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        pool_release(conn);
+        return json_error("VM %s introuvable", name);
+    }
+
+    struct save_info info;
+    const char *why = NULL;
+    char path[4096];
+    struct stat st;
+    int rc = state_save(dom, name, format, channels, &info, &why);
+    virDomainFree(dom);
+    pool_release(conn);
+    if (rc < 0) {
+        const virError *e = virGetLastError();
+        return json_error("Mise en veille de %s impossible (%s)", name,
+                          why ? why : e ? e->message : "inconnu");
+    }
+
+    save_path(path, sizeof(path), name, "");
+    unsigned long long bytes = stat(path, &st) == 0 ? (unsigned long long)st.st_blocks * 512 : 0;
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "message");
+    jw_strf(&w, "VM %s mise en veille en %lld ms (%llu MiB, %d canal%s)%s%s", name,
+            info.elapsed_ms, bytes >> 20, info.channels, info.channels > 1 ? "aux" : "",
+            why ? " : " : ".", why ? why : "");
+    jw_kstr(&w, "file", path);
+    jw_kstr(&w, "format", info.format[0] ? info.format : NULL);
+    jw_kint(&w, "channels", info.channels);
+    jw_kuint(&w, "bytes", bytes);
+    jw_kint(&w, "elapsed_ms", info.elapsed_ms);
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
+
+/* Reprend `name` depuis sa sauvegarde d'état. */
+char* restore_vm(const char *uri, const char *name) {
+    API_SCOPE(restore_vm);
+    if (!uri_is_local(uri))
+        return result_error("reprise impossible sur %s : SAVE_DIR doit être local", uri);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("impossible de se connecter à %s", uri);
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        pool_release(conn);
+        return result_error("VM %s introuvable", name);
+    }
+
+    struct save_info info;
+    const char *why = NULL;
+    char *msg;
+    if (state_restore(conn, dom, &info, &why) < 0)
+        msg = action_error("restore", name, why);
+    else
+        msg = result_printf("VM %s reprise en %lld ms (%d canal%s).", name,
+                            info.elapsed_ms, info.channels, info.channels > 1 ? "aux" : "");
+    virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+/*
+ * Sauvegardes d'état présentes dans SAVE_DIR :
+ * {"saves":[{"name","file","format","channels","bytes","created","elapsed_ms","stale"}]}.
+ * `stale` : la VM est démarrée, n'existe plus, ou ses disques ont été
+ * modifiés depuis l'image ; reprendre cette image n'a plus de sens.
+ */
+char* list_saves(const char *uri) {
+    API_SCOPE(list_saves);
+    if (!uri_is_local(uri))
+        return json_error("SAVE_DIR n'est lisible que pour une URI locale (%s)", uri);
+    DIR *d = opendir(save_dir());
+    virConnectPtr conn = pool_acquire(uri);
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "saves");
+    jw_array_begin(&w);
+    struct dirent *ent;
+    while (d && (ent = readdir(d))) {
+        size_t len = strlen(ent->d_name);
+        if (len <= 5 || strcmp(ent->d_name + len - 5, ".save") != 0)
+            continue;
+        char name[256], path[4096];
+        struct stat st;
+        snprintf(name, sizeof(name), "%.*s", (int)(len - 5), ent->d_name);
+        save_path(path, sizeof(path), name, "");
+        if (stat(path, &st) < 0)
+            continue;
+
+        struct save_info info;
+        save_info_read(name, &info);
+        virDomainPtr dom = conn ? lookup_domain(conn, name) : NULL;
+        int stale = conn && (!dom || save_stale(conn, dom, &st));
+        if (dom)
+            virDomainFree(dom);
+
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", name);
+        jw_kstr(&w, "file", path);
+        jw_kstr(&w, "format", info.format[0] ? info.format : NULL);
+        jw_kint(&w, "channels", info.channels);
+        jw_kuint(&w, "bytes", (unsigned long long)st.st_blocks * 512);
+        jw_kint(&w, "created", info.created ? info.created : (long long)st.st_mtime);
+        jw_kint(&w, "elapsed_ms", info.elapsed_ms);
+        jw_kbool(&w, "stale", stale);
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    jw_object_end(&w);
+    if (d)
+        closedir(d);
+    if (conn)
+        pool_release(conn);
+    return jw_finish(&w);
+}
+
+
+/* ---------- Actions sur une VM ----------
+ *
+ * Démarrer, arrêter, mettre en pause, reprendre, redémarrer, supprimer,
+ * mettre en veille sur disque ou en revenir passent tous par
+ * vm_action_apply() : l'appel unitaire et le lot (batch_vms) partagent
+ * le même code et les mêmes messages.
+ */
+
+enum vm_action {
+    VM_START, VM_STOP, VM_PAUSE, VM_RESUME, VM_RESTART, VM_DESTROY, VM_SAVE,
+    VM_RESTORE, VM_ACTION_COUNT
+};
+
+static const struct {
+    const char *name;
+    const char *done;
+} vm_actions[VM_ACTION_COUNT] = {
+    [VM_START]   = { "start",   "démarrée" },
+    [VM_STOP]    = { "stop",    "arrêtée" },
+    [VM_PAUSE]   = { "pause",   "mise en pause" },
+    [VM_RESUME]  = { "resume",  "reprise" },
+    [VM_RESTART] = { "restart", "redémarrée" },
+    [VM_DESTROY] = { "destroy", "supprimée" },
+    [VM_SAVE]    = { "save",    "mise en veille sur disque" },
+    [VM_RESTORE] = { "restore", "reprise depuis le disque" },
+};
+
+static int vm_action_parse(const char *s) {
+    for (int i = 0; i < VM_ACTION_COUNT; i++)
+        if (s && strcmp(s, vm_actions[i].name) == 0)
+            return i;
+    return -1;
+}
+
+struct delete_run {
+    virConnectPtr conn;
+    const struct xml_disk *disks;
+};
+
+static void delete_disk_run(void *ctx, int i) {
+    struct delete_run *run = ctx;
+    if (!run->disks[i].writable)
+        return;
+    virStorageVolPtr vol = virStorageVolLookupByPath(run->conn, run->disks[i].path);
+    if (vol) {
+        virStorageVolDelete(vol, 0);
+        virStorageVolFree(vol);
+    }
+}
+
+static const char *instance_seed(virDomainPtr dom, const struct xml_disk *disks,
+                                 int ndisks);
+static void instance_seed_delete(virConnectPtr conn, const char *path);
+
+/*
+ * Arrête, retire la définition et supprime en parallèle les disques
+ * propres au domaine (les CD-ROM et disques partagés sont conservés,
+ * sauf l'ISO cloud-init d'une instance de modèle).
+ */
+static int domain_delete(virConnectPtr conn, virDomainPtr dom) {
+    // Lire le XML (souvent déjà en cache) pour identifier les disques
+    xmlDocPtr doc = domain_doc(conn, dom, 0);
+    struct xml_disk *disks = NULL;
+    int ndisks = doc ? xml_disks(doc, &disks) : 0;
+    int rc = -1;
+
+    // Métadonnées illisibles une fois la définition retirée
+    const char *seed = instance_seed(dom, disks, ndisks);
+
+    // Stopper la VM (échoue sans conséquence si elle est déjà éteinte)
+    if (virDomainIsActive(dom) == 1 && virDomainDestroy(dom) < 0)
+        goto out;
+
+    if (virDomainUndefine(dom) < 0)
+        goto out;
+    domain_forget(conn, dom);
+
+    // Supprimer les disques qui existent
+    struct delete_run run = { conn, disks };
+    parallel_for(ndisks, delete_disk_run, &run);
+    if (seed)
+        instance_seed_delete(conn, seed);
+    rc = 0;
+
+out:
+    xml_disks_free(disks, ndisks);
+    xmlFreeDoc(doc);
+    return rc;
+}
+
+/*
+ * Démarre `dom`, depuis son image de mise en veille s'il en a une
+ * (URI locale). Une image périmée est supprimée et la VM démarrée
+ * normalement : elle ne doit plus pouvoir être reprise.
+ */
+static int vm_start(virConnectPtr conn, const char *uri, virDomainPtr dom,
+                    struct save_info *info, const char **why) {
+    const char *name = virDomainGetName(dom);
+    char path[4096];
+    struct stat st;
+    if (!uri_is_local(uri) || !save_name_ok(name))
+        return virDomainCreate(dom);
+
+    save_path(path, sizeof(path), name, "");
+    if (stat(path, &st) < 0)
+        return virDomainCreate(dom);
+    if (virDomainIsActive(dom) != 1 && !save_stale(conn, dom, &st))
+        return state_restore(conn, dom, info, why);
+
+    int rc = virDomainCreate(dom);
+    if (rc == 0)
+        save_remove(name);
+    return rc;
+}
+
+/*
+ * Applique l'action à la VM `name`. Retourne un message alloué ; *ok
+ * vaut 1 en cas de succès.
+ */
+static char *vm_action_apply(virConnectPtr conn, const char *uri, const char *name,
+                             enum vm_action act, int *ok) {
+    *ok = 0;
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom)
+        return result_error("VM %s introuvable", name);
+
+    struct save_info info;
+    const char *why = NULL;
+    int rc;
+    switch (act) {
+    case VM_START:   rc = vm_start(conn, uri, dom, &info, &why); break;
+    case VM_STOP:    rc = virDomainDestroy(dom); break;
+    case VM_PAUSE:   rc = virDomainSuspend(dom); break;
+    case VM_RESUME:  rc = virDomainResume(dom); break;
+    case VM_RESTART: rc = virDomainReboot(dom, 0); break;
+    case VM_DESTROY: rc = domain_delete(conn, dom); break;
+    case VM_SAVE:    rc = state_save(dom, name, NULL, 0, &info, &why); break;
+    case VM_RESTORE: rc = state_restore(conn, dom, &info, &why); break;
+    default:         rc = -1; break;
+    }
+
+    char *msg;
+    if (rc < 0) {
+        msg = action_error(vm_actions[act].name, name, why);
+    } else {
+        msg = result_printf("VM %s %s.", name, vm_actions[act].done);
+        *ok = 1;
+    }
+    virDomainFree(dom);
+    return msg;
+}
+
+static char *vm_action_single(const char *uri, const char *name, enum vm_action act) {
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("impossible de se connecter à %s", uri);
+
+    int ok;
+    char *msg = vm_action_apply(conn, uri, name, act, &ok);
+    pool_release(conn);
+    return msg;
+}
+
+char* start_vm(const char *uri, const char *name) {
+    API_SCOPE(start_vm);
+    return vm_action_single(uri, name, VM_START);
+}
+
+char* stop_vm(const char *uri, const char *name) {
+    API_SCOPE(stop_vm);
+    return vm_action_single(uri, name, VM_STOP);
+}
+
+char* pause_vm(const char *uri, const char *name) {
+    API_SCOPE(pause_vm);
+    return vm_action_single(uri, name, VM_PAUSE);
+}
+
+char* resume_vm(const char *uri, const char *name) {
+    API_SCOPE(resume_vm);
+    return vm_action_single(uri, name, VM_RESUME);
+}
+
+char* destroy_vm(const char *uri, const char *name) {
+    API_SCOPE(destroy_vm);
+    return vm_action_single(uri, name, VM_DESTROY);
+}
+
+/* ---------- Actions par lot ----------
+ *
+ * batch_vms() applique une action à une liste de VMs avec un nombre
+ * borné de threads. Chaque thread emprunte sa propre connexion au pool
+ * (jusqu'à POOL_MAX_CONN par URI, partagées au-delà) et prend les noms
+ * suivants dans la liste jusqu'à épuisement.
+ */
+
+#define BATCH_WORKERS      8   /* threads par défaut */
+#define BATCH_MAX_WORKERS 32
+#define BATCH_MAX_VMS   4096  /* au-delà, le lot est refusé */
+
+struct batch_item {
+    const char *name;
+    char *msg;
+    int ok;
+};
+
+struct batch {
+    const char *uri;
+    enum vm_action act;
+    struct batch_item *items;
+    int count;
+    int next;       /* prochain élément à traiter (atomique) */
+};
+
+static void *batch_worker(void *arg) {
+    struct batch *b = arg;
+    virConnectPtr conn = pool_acquire(b->uri);
+
+    int i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        struct batch_item *it = &b->items[i];
+        if (conn)
+            it->msg = vm_action_apply(conn, b->uri, it->name, b->act, &it->ok);
+        else
+            it->msg = result_error("impossible de se connecter à %s", b->uri);
+    }
+
+    if (conn)
+        pool_release(conn);
+    return NULL;
+}
+
+/*
+ * `names` : noms séparés par des retours à la ligne. `workers` <= 0
+ * utilise BATCH_WORKERS.
+ * {"action","total","ok","failed","elapsed_ms","results":[{"name","ok","message"}]}
+ */
+char* batch_vms(const char *uri, const char *action, const char *names, int workers) {
+    API_SCOPE(batch_vms);
+    int act = vm_action_parse(action);
+    if (act < 0)
+        return json_error("Action inconnue : %s", action ? action : "");
+    if ((act == VM_SAVE || act == VM_RESTORE) && !uri_is_local(uri))
+        return json_error("Action %s impossible sur %s : SAVE_DIR doit être local",
+                          action, uri);
+
+    /* Compter les noms avant tout : une liste trop longue est refusée
+     * plutôt que tronquée, une liste vide ne prend aucune connexion */
+    int n = 0;
+    for (const char *p = names ? names : ""; *p; ) {
+        const char *eol = strchr(p, '\n');
+        size_t len = eol ? (size_t)(eol - p) : strlen(p);
+        n += len > 0;
+        p += len + (eol != NULL);
+    }
+    if (n > BATCH_MAX_VMS)
+        return json_error("Trop de VMs : %d (au plus %d par lot)", n, BATCH_MAX_VMS);
+    if (n == 0) {
+        struct jw w = {0};
+        jw_object_begin(&w);
+        jw_kstr(&w, "action", vm_actions[act].name);
+        jw_kint(&w, "total", 0);
+        jw_kint(&w, "ok", 0);
+        jw_kint(&w, "failed", 0);
+        jw_kint(&w, "elapsed_ms", 0);
+        jw_key(&w, "results");
+        jw_array_begin(&w);
+        jw_array_end(&w);
+        jw_object_end(&w);
+        return jw_finish(&w);
+    }
+
+    char *list = strdup(names);
+    struct batch b = { uri, act, NULL, 0, 0 };
+    b.items = calloc(n, sizeof(*b.items));
+    if (!list || !b.items) {
+        free(list);
+        free(b.items);
+        return json_error("Mémoire insuffisante pour %d VMs", n);
+    }
+
+    char *save = NULL;
+    for (char *tok = strtok_r(list, "\n", &save); tok && b.count < n;
+         tok = strtok_r(NULL, "\n", &save))
+        if (tok[0])
+            b.items[b.count++].name = tok;
+
+    if (workers <= 0)
+        workers = BATCH_WORKERS;
+    if (workers > BATCH_MAX_WORKERS)
+        workers = BATCH_MAX_WORKERS;
+    if (workers > b.count)
+        workers = b.count;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pthread_t tids[BATCH_MAX_WORKERS];
+    int started = 0;
+    for (; started < workers; started++)
+        if (pthread_create(&tids[started], NULL, batch_worker, &b) != 0)
+            break;
+    if (started == 0)
+        batch_worker(&b);   /* aucun thread : traitement en série */
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long elapsed_ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+
+    int ok = 0;
+    for (int i = 0; i < b.count; i++)
+        ok += b.items[i].ok;
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kstr(&w, "action", vm_actions[act].name);
+    jw_kint(&w, "total", b.count);
+    jw_kint(&w, "ok", ok);
+    jw_kint(&w, "failed", b.count - ok);
+    jw_kint(&w, "elapsed_ms", elapsed_ms);
+    jw_key(&w, "results");
+    jw_array_begin(&w);
+    for (int i = 0; i < b.count; i++) {
+        struct batch_item *it = &b.items[i];
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", it->name);
+        jw_kbool(&w, "ok", it->ok);
+        jw_kstr(&w, "message", it->msg ? it->msg : "");
+        jw_object_end(&w);
+        free(it->msg);
+    }
+    jw_array_end(&w);
+    jw_object_end(&w);
+
+    free(b.items);
+    free(list);
+    return jw_finish(&w);
+}
+
+char* console_vm(const char *uri, const char *name) {
+    API_SCOPE(console_vm);
+    char *msg;
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn) {
+        msg = json_error("Impossible de se connecter à %s", uri);
+        return msg;
+    }
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        msg = json_error("VM %s introuvable", name);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* Vérifier l'état */
+    int state, reason;
+    if (virDomainGetState(dom, &state, &reason, 0) < 0) {
+        msg = json_error("Impossible de lire l'état");
+        virDomainFree(dom);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* Démarrer la VM si nécessaire */
+    if (state != VIR_DOMAIN_RUNNING) {
+        if (virDomainCreate(dom) < 0) {
+            msg = json_error("Impossible de démarrer %s", name);
+            virDomainFree(dom);
+            pool_release(conn);
+            return msg;
+        }
+    }
+
+    /* Lance virt-viewer dans un process fils */
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("virt-viewer", "virt-viewer", "--connect", uri, name, NULL);
+        exit(1);  // si execlp échoue
+    }
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "message");
+    jw_strf(&w, "Console ouverte pour %s", name);
+    jw_kstr(&w, "url", "");
+    jw_object_end(&w);
+    msg = jw_finish(&w);
+
+    virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+
+/* ---------- Clonage ----------
+ *
+ * Deux modes :
+ *  - "linked" : le disque du clone est un overlay qcow2 dont le
+ *    <backingStore> est le disque source ; créé instantanément, il ne
+ *    stocke que les écritures du clone. La source doit rester éteinte
+ *    tant que des clones liés l'utilisent.
+ *  - "full" : copie complète réalisée par le pool de stockage lui-même
+ *    (virStorageVolCreateXMLFrom), sans shell ; à défaut, par flux
+ *    libvirt creux qui ne transportent que les blocs alloués.
+ * Chaque disque inscriptible est cloné dans le pool de son disque
+ * source, jusqu'à PAR_WORKERS disques à la fois : un clone de VM à
+ * quatre disques dure autant que la copie du plus gros.
+ */
+
+enum clone_mode { CLONE_FULL, CLONE_LINKED };
+
+static int clone_mode_parse(const char *mode) {
+    if (!mode || !mode[0] || strcmp(mode, "full") == 0)
+        return CLONE_FULL;
+    if (strcmp(mode, "linked") == 0)
+        return CLONE_LINKED;
+    return -1;
+}
+
+/* Format d'un volume (qcow2, raw…) lu dans son XML. */
+static void vol_format(virStorageVolPtr vol, char *fmt, size_t len) {
+    char *text = virStorageVolGetXMLDesc(vol, 0);
+    xmlDocPtr doc = xml_parse(text);
+    char *value = doc ? xml_get(doc, NULL, "/volume/target/format/@type") : NULL;
+    snprintf(fmt, len, "%s", value ? value : "raw");
+    free(value);
+    xmlFreeDoc(doc);
+    free(text);
+}
+
+#define STREAM_CHUNK  (1 << 20)  /* octets lus ou écrits par appel de flux */
+
+struct clone_run;
+
+/* Copie d'un disque inscriptible de la VM source. */
+struct clone_disk {
+    const struct xml_disk *src;
+    char base[300];             /* nom de la copie, sans extension */
+    char format[16];            /* format de la copie (qcow2, raw…) */
+    char *path;                 /* chemin de la copie */
+    virStorageVolPtr vol;       /* NULL si copiée hors pool */
+    char *err;                  /* message d'échec alloué */
+    unsigned long long done;    /* progression de cette copie */
+    unsigned long long total;
+    struct clone_run *run;
+};
+
+/* Copies d'un clonage, réparties entre PAR_WORKERS threads. */
+struct clone_run {
+    virConnectPtr conn;
+    enum clone_mode mode;
+    struct job *job;
+    struct clone_disk *copies;
+    int n;
+    int failed;                 /* une copie a échoué : ne plus en lancer */
+};
+
+/* Progression d'une copie ; la tâche voit la somme de toutes. */
+static void clone_progress(struct clone_disk *c, unsigned long long done,
+                           unsigned long long total) {
+    struct clone_run *run = c->run;
+    if (!run->job)
+        return;
+
+    __atomic_store_n(&c->done, done, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->total, total, __ATOMIC_RELAXED);
+    unsigned long long sum_done = 0, sum_total = 0;
+    for (int i = 0; i < run->n; i++) {
+        sum_done += __atomic_load_n(&run->copies[i].done, __ATOMIC_RELAXED);
+        sum_total += __atomic_load_n(&run->copies[i].total, __ATOMIC_RELAXED);
+    }
+    job_progress(run->job, sum_done, sum_total);
+}
+
+/* Suivi de la copie faite par le pool : allocation du volume en cours. */
+struct vol_watch {
+    virStoragePoolPtr pool;
+    const char *name;
+    unsigned long long total;
+    struct clone_disk *copy;
+    int stop;
+};
+
+static void *vol_watch_run(void *arg) {
+    struct vol_watch *w = arg;
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+        usleep(500000);
+        virStorageVolPtr vol = virStorageVolLookupByName(w->pool, w->name);
+        if (!vol)
+            continue;
+        virStorageVolInfo info;
+        if (virStorageVolGetInfo(vol, &info) == 0)
+            clone_progress(w->copy, info.allocation < w->total ? info.allocation : w->total,
+                           w->total);
+        virStorageVolFree(vol);
+    }
+    return NULL;
+}
+
+/*
+ * Copie octet pour octet `src` dans `dst` (même format) par deux flux
+ * libvirt creux : les trous de la source sont transmis comme tels, sans
+ * être lus ni écrits. Retourne 0 en cas de succès.
+ */
+static int stream_copy(struct clone_disk *c, virStorageVolPtr src,
+                       virStorageVolPtr dst, unsigned long long capacity) {
+    virConnectPtr conn = c->run->conn;
+    virStreamPtr in = virStreamNew(conn, 0);
+    virStreamPtr out = virStreamNew(conn, 0);
+    char *buf = malloc(STREAM_CHUNK);
+    unsigned long long pos = 0;
+    int rc = -1;
+
+    if (!in || !out || !buf ||
+        virStorageVolDownload(src, in, 0, 0, VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM) < 0)
+        goto out;
+    if (virStorageVolUpload(dst, out, 0, 0, VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM) < 0) {
+        virStreamAbort(in);
+        goto out;
+    }
+
+    for (;;) {
+        if (job_cancelled(c->run->job))
+            break;
+
+        int n = virStreamRecvFlags(in, buf, STREAM_CHUNK, VIR_STREAM_RECV_STOP_AT_HOLE);
+        if (n == -3) {
+            /* Trou : seule sa longueur traverse les flux */
+            long long hole;
+            if (virStreamRecvHole(in, &hole, 0) < 0 || virStreamSendHole(out, hole, 0) < 0)
+                break;
+            pos += hole;
+            continue;
+        }
+        if (n < 0)
+            break;
+        if (n == 0) {
+            rc = 0;
+            break;
+        }
+
+        int sent = 0;
+        while (sent < n) {
+            int w = virStreamSend(out, buf + sent, n - sent);
+            if (w < 0)
+                break;
+            sent += w;
+        }
+        if (sent < n)
+            break;
+        pos += n;
+        clone_progress(c, pos < capacity ? pos : capacity, capacity);
+    }
+
+    if (rc == 0 && (virStreamFinish(in) < 0 || virStreamFinish(out) < 0))
+        rc = -1;
+    if (rc < 0) {
+        virStreamAbort(in);
+        virStreamAbort(out);
+    }
+
+out:
+    if (in)
+        virStreamFree(in);
+    if (out)
+        virStreamFree(out);
+    free(buf);
+    return rc;
+}
+
+/*
+ * Crée la copie de `srcVol` dans son pool, en overlay lié ou en copie
+ * complète. La copie complète est faite par le pool lui-même (les
+ * données ne quittent pas l'hôte, qemu-img saute les blocs non alloués) ;
+ * si le pool ne sait pas le faire, par flux creux dans un volume du même
+ * format. Retourne le nouveau volume, NULL en cas d'échec.
+ */
+static virStorageVolPtr clone_volume(struct clone_disk *c, virStorageVolPtr srcVol) {
+    enum clone_mode mode = c->run->mode;
+    virStoragePoolPtr pool = virStoragePoolLookupByVolume(srcVol);
+    if (!pool)
+        return NULL;
+
+    virStorageVolInfo info;
+    if (virStorageVolGetInfo(srcVol, &info) < 0) {
+        virStoragePoolFree(pool);
+        return NULL;
+    }
+
+    char fmt[32];
+    vol_format(srcVol, fmt, sizeof(fmt));
+
+    char volName[320];
+    snprintf(volName, sizeof(volName), "%s.qcow2", c->base);
+    snprintf(c->format, sizeof(c->format), "qcow2");
+
+    char *vol_xml = volume_xml(volName, info.capacity, "qcow2",
+                               mode == CLONE_LINKED ? c->src->path : NULL, fmt);
+    if (!vol_xml) {
+        virStoragePoolFree(pool);
+        return NULL;
+    }
+
+    virStorageVolPtr vol;
+    if (mode == CLONE_LINKED) {
+        vol = virStorageVolCreateXML(pool, vol_xml, 0);
+        clone_progress(c, 1, 1);
+    } else {
+        struct vol_watch w = { pool, volName, info.allocation, c, 0 };
+        pthread_t tid;
+        int watching = c->run->job &&
+                       pthread_create(&tid, NULL, vol_watch_run, &w) == 0;
+
+        vol = virStorageVolCreateXMLFrom(pool, vol_xml, srcVol, 0);
+
+        if (watching) {
+            __atomic_store_n(&w.stop, 1, __ATOMIC_RELEASE);
+            pthread_join(tid, NULL);
+        }
+
+        if (!vol && !job_cancelled(c->run->job)) {
+            /* Copie par flux : volume vide au format de la source */
+            snprintf(volName, sizeof(volName), "%s.%s", c->base,
+                     strcmp(fmt, "qcow2") == 0 ? "qcow2" : "img");
+            snprintf(c->format, sizeof(c->format), "%s", fmt);
+            free(vol_xml);
+            vol_xml = volume_xml(volName, info.capacity, fmt, NULL, NULL);
+            vol = vol_xml ? virStorageVolCreateXML(pool, vol_xml, 0) : NULL;
+            if (vol && stream_copy(c, srcVol, vol, info.capacity) < 0) {
+                virStorageVolDelete(vol, 0);
+                virStorageVolFree(vol);
+                vol = NULL;
+            }
+        }
+        if (vol)
+            clone_progress(c, info.allocation, info.allocation);
+    }
+
+    free(vol_xml);
+    virStoragePoolFree(pool);
+    return vol;
+}
+
+/*
+ * Copie un disque hors pool avec `qemu-img convert -p` (qui saute les
+ * blocs nuls), sans passer par un shell. La progression affichée par
+ * qemu-img est convertie en octets sur la base de la taille du fichier
+ * source. Retourne 0 en cas de succès.
+ */
+static int copy_disk(struct clone_disk *c, const char *src, const char *dst) {
+    struct job *job = c->run->job;
+    struct stat st;
+    unsigned long long total = stat(src, &st) == 0 ? (unsigned long long)st.st_size : 0;
+
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execlp("qemu-img", "qemu-img", "convert", "-p", "-O", "qcow2",
+               src, dst, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    job_set_pid(job, 0, pid);
+
+    /* qemu-img écrit "    (12.34/100%)\r" à chaque avancée */
+    FILE *out = fdopen(fds[0], "r");
+    char line[64];
+    size_t len = 0;
+    int ch;
+    while (out && (ch = fgetc(out)) != EOF) {
+        if (ch != '\r' && ch != '\n') {
+            if (len < sizeof(line) - 1)
+                line[len++] = ch;
+            continue;
+        }
+        line[len] = '\0';
+        len = 0;
+
+        double pct;
+        char *open = strchr(line, '(');
+        if (open && sscanf(open, "(%lf/100%%)", &pct) == 1)
+            clone_progress(c, (unsigned long long)(pct / 100.0 * total), total);
+    }
+    if (out)
+        fclose(out);
+    else
+        close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    job_set_pid(job, pid, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || job_cancelled(job)) {
+        unlink(dst);
+        return -1;
+    }
+    clone_progress(c, total, total);
+    return 0;
+}
+
+/* Libère les copies ; `remove` supprime aussi leurs fichiers. */
+static void clone_disks_free(struct clone_disk *copies, int n, int remove) {
+    for (int i = 0; i < n; i++) {
+        if (copies[i].vol) {
+            if (remove)
+                virStorageVolDelete(copies[i].vol, 0);
+            virStorageVolFree(copies[i].vol);
+        } else if (remove && copies[i].path) {
+            unlink(copies[i].path);
+        }
+        free(copies[i].path);
+        free(copies[i].err);
+    }
+    free(copies);
+}
+
+/* Copie du disque `i` (exécutée par un thread de parallel_for). */
+static void clone_disk_run(void *ctx, int i) {
+    struct clone_run *run = ctx;
+    struct clone_disk *c = &run->copies[i];
+    const struct xml_disk *d = c->src;
+
+    if (__atomic_load_n(&run->failed, __ATOMIC_ACQUIRE) || job_cancelled(run->job))
+        return;
+
+    virStorageVolPtr srcVol = virStorageVolLookupByPath(run->conn, d->path);
+    if (srcVol) {
+        c->vol = clone_volume(c, srcVol);
+        virStorageVolFree(srcVol);
+        c->path = c->vol ? virStorageVolGetPath(c->vol) : NULL;
+        if (!c->path) {
+            const virError *e = virGetLastError();
+            c->err = job_cancelled(run->job)
+                   ? result_error("clonage annulé")
+                   : result_error("création du disque clone (%s)",
+                                  e ? e->message : "inconnu");
+        }
+    } else if (run->mode == CLONE_FULL) {
+        /* Disque hors de tout pool : copie directe par qemu-img, dans le
+         * répertoire du disque source */
+        char dir[4096], path[4096];
+        struct stat st;
+        snprintf(dir, sizeof(dir), "%s", d->path);
+        char *slash = strrchr(dir, '/');
+        if (slash)
+            *slash = '\0';
+        snprintf(path, sizeof(path), "%s/%s.qcow2", slash ? dir : ".", c->base);
+        snprintf(c->format, sizeof(c->format), "qcow2");
+        if (stat(path, &st) == 0)
+            c->err = result_error("%s existe déjà", path);
+        else if (copy_disk(c, d->path, path) == 0)
+            c->path = strdup(path);
+        else
+            c->err = result_error("%s", job_cancelled(run->job)
+                                        ? "clonage annulé"
+                                        : "copie du disque impossible");
+    } else {
+        c->err = result_error("clone lié impossible, %s n'appartient à aucun pool",
+                              d->path);
+    }
+
+    if (c->err)
+        __atomic_store_n(&run->failed, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copie chaque disque inscriptible de `disks`, jusqu'à PAR_WORKERS à la
+ * fois : le premier devient `dstName`.qcow2, les suivants
+ * `dstName`-<cible>.qcow2, dans le pool de leur source (hors pool : dans
+ * le répertoire de la source). Retourne NULL et les copies dans `*out`,
+ * ou un message d'erreur alloué après avoir supprimé les copies déjà
+ * faites.
+ */
+static char *clone_disks(virConnectPtr conn, const struct xml_disk *disks, int ndisks,
+                         const char *dstName, enum clone_mode mode, struct job *job,
+                         struct clone_disk **out, int *nout) {
+    struct clone_disk *copies = calloc(ndisks > 0 ? ndisks : 1, sizeof(*copies));
+    if (!copies)
+        return result_error("mémoire insuffisante");
+
+    struct clone_run run = { conn, mode, job, copies, 0, 0 };
+    for (int i = 0; i < ndisks; i++) {
+        const struct xml_disk *d = &disks[i];
+        if (!d->writable)
+            continue;
+
+        struct clone_disk *c = &copies[run.n];
+        c->src = d;
+        c->run = &run;
+        if (run.n == 0)
+            snprintf(c->base, sizeof(c->base), "%s", dstName);
+        else if (d->target)
+            snprintf(c->base, sizeof(c->base), "%s-%s", dstName, d->target);
+        else
+            snprintf(c->base, sizeof(c->base), "%s-disk%d", dstName, run.n);
+        run.n++;
+    }
+
+    if (run.n == 0) {
+        free(copies);
+        return result_error("disque source introuvable dans XML");
+    }
+
+    parallel_for(run.n, clone_disk_run, &run);
+
+    char *msg = NULL;
+    for (int i = 0; i < run.n && !msg; i++) {
+        if (copies[i].err) {
+            /* Message produit par un autre thread : échec à reporter ici */
+            api_failed = 1;
+            msg = copies[i].err;
+            copies[i].err = NULL;
+        }
+    }
+    if (!msg && job_cancelled(job))
+        msg = result_error("clonage annulé");
+    if (msg) {
+        clone_disks_free(copies, run.n, 1);
+        return msg;
+    }
+
+    for (int i = 0; i < run.n; i++)
+        copies[i].run = NULL;
+    *out = copies;
+    *nout = run.n;
+    return NULL;
+}
+
+/*
+ * Pointe chaque disque copié vers sa copie, au format de celle-ci ;
+ * l'ancienne chaîne <backingStore> ne vaut plus.
+ */
+static void clone_disks_apply(xmlDocPtr doc, const struct clone_disk *copies, int n) {
+    for (int i = 0; i < n; i++) {
+        xmlNodePtr disk = copies[i].src->node;
+        xml_set_attr(doc, disk, "source", "file", copies[i].path);
+        xmlSetProp(xml_child(disk, "driver"), (const xmlChar *)"type",
+                   (const xmlChar *)copies[i].format);
+        xml_remove(doc, disk, "backingStore");
+    }
+}
+
+static char *do_clone_vm(const char *uri, const char *srcName,
+                         const char *dstName, const char *modeName,
+                         struct job *job) {
+    char *msg;
+
+    int mode = clone_mode_parse(modeName);
+    if (mode < 0)
+        return result_error("mode de clonage inconnu (%s)", modeName);
+
+    virConnectPtr conn = pool_acquire(uri);
     if (!conn) {
-        snprintf(buffer, sizeof(buffer), "{\"error\":\"Impossible de se connecter à %s\"}", uri);
-        return buffer;
+        msg = result_error("connexion libvirt");
+        return msg;
+    }
+
+    virDomainPtr srcDom = lookup_domain(conn, srcName);
+    if (!srcDom) {
+        msg = result_error("VM source introuvable");
+        pool_release(conn);
+        return msg;
+    }
+
+    if (mode == CLONE_LINKED && virDomainIsActive(srcDom) == 1) {
+        msg = result_error("la VM source doit être éteinte pour un clone lié");
+        virDomainFree(srcDom);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* Lire le XML complet de la VM source (souvent déjà en cache) */
+    xmlDocPtr doc = domain_doc(conn, srcDom, VIR_DOMAIN_XML_INACTIVE);
+    if (!doc) {
+        msg = result_error("impossible de lire XML source");
+        virDomainFree(srcDom);
+        pool_release(conn);
+        return msg;
+    }
+
+    /* Nouveaux disques, chacun dans le pool de son disque source */
+    struct xml_disk *disks = NULL;
+    struct clone_disk *copies = NULL;
+    int ncopies = 0;
+    int ndisks = xml_disks(doc, &disks);
+    msg = clone_disks(conn, disks, ndisks, dstName, mode, job, &copies, &ncopies);
+    if (msg)
+        goto out;
+
+    /* Nouveau nom, sans UUID ni MAC : libvirt en génère */
+    xml_set_text(doc, NULL, "/domain/name", dstName);
+    xml_remove(doc, NULL, "/domain/uuid");
+    xml_remove(doc, NULL, "/domain/devices/interface/mac");
+    clone_disks_apply(doc, copies, ncopies);
+
+    /* Définir la nouvelle VM */
+    char *newXML = xml_dump(doc);
+    virDomainPtr newDom = newXML ? virDomainDefineXML(conn, newXML) : NULL;
+    free(newXML);
+    if (!newDom) {
+        msg = result_error("impossible de créer VM clone");
+        clone_disks_free(copies, ncopies, 1);
+        copies = NULL;
+        ncopies = 0;
+        goto out;
+    }
+
+    /* Lancer la VM clonée ; en cas d'échec le clone reste défini */
+    if (virDomainCreate(newDom) < 0) {
+        const virError *e = virGetLastError();
+        msg = result_error("clone %s créé mais impossible à démarrer (%s)",
+                           dstName, e ? e->message : "inconnu");
+    } else {
+        msg = result_printf(
+                 "Clone %s créé avec succès : %s → %s (%d disque%s)",
+                 mode == CLONE_LINKED ? "lié" : "complet", srcName, dstName,
+                 ncopies, ncopies > 1 ? "s" : "");
+    }
+    virDomainFree(newDom);
+
+out:
+    clone_disks_free(copies, ncopies, 0);
+    xml_disks_free(disks, ndisks);
+    xmlFreeDoc(doc);
+    virDomainFree(srcDom);
+    pool_release(conn);
+
+    return msg;
+}
+
+char* clone_vm(const char *uri, const char *srcName, const char *dstName) {
+    API_SCOPE(clone_vm);
+    return do_clone_vm(uri, srcName, dstName, "full", NULL);
+}
+
+/* Clone en mode "full" (copie) ou "linked" (overlay qcow2). */
+char* clone_vm_mode(const char *uri, const char *srcName, const char *dstName,
+                    const char *mode) {
+    API_SCOPE(clone_vm_mode);
+    return do_clone_vm(uri, srcName, dstName, mode, NULL);
+}
+
+/* ---------- Images et téléversement ----------
+ *
+ * La liste des ISO proposées à la création d'une VM vient des pools de
+ * stockage actifs (virStoragePoolListAllVolumes), et non plus d'un
+ * répertoire fixe. Elle est gardée en mémoire par URI et n'est relue que
+ * si la génération des pools, avancée par les événements de pool que
+ * suit le cache d'état, a bougé depuis.
+ *
+ * Le téléversement écrit le corps de la requête HTTP directement dans un
+ * volume par virStorageVolUpload, sans fichier temporaire : Flask lit le
+ * corps par blocs de taille fixe et les passe à upload_chunk(). Les blocs
+ * entièrement nuls ne traversent pas le flux : ils partent en trous
+ * (virStreamSendHole) et le volume reste creux sur l'hôte.
+ */
+
+#define UPLOAD_MAX     8          /* téléversements simultanés */
+#define UPLOAD_BLOCK   (64 << 10) /* granularité de détection des zéros */
+
+struct iso_entry {
+    char *name;
+    char *path;
+    char pool[64];
+    unsigned long long capacity;
+    unsigned long long allocation;
+};
+
+struct iso_index {
+    char uri[256];
+    int valid;
+    unsigned long long gen;      /* génération des pools à la lecture */
+    struct iso_entry *isos;
+    int n;
+};
+
+static struct iso_index iso_indexes[CACHE_MAX_URIS];
+static pthread_mutex_t iso_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static void iso_entries_free(struct iso_entry *isos, int n) {
+    for (int i = 0; i < n; i++) {
+        free(isos[i].name);
+        free(isos[i].path);
+    }
+    free(isos);
+}
+
+static int iso_cmp(const void *a, const void *b) {
+    return strcmp(((const struct iso_entry *)a)->name,
+                  ((const struct iso_entry *)b)->name);
+}
+
+/* Volumes .iso de tous les pools actifs, triés par nom. -1 en cas d'échec. */
+static int iso_collect(virConnectPtr conn, struct iso_entry **out) {
+    virStoragePoolPtr *pools = NULL;
+    int npools = virConnectListAllStoragePools(conn, &pools,
+                                               VIR_CONNECT_LIST_STORAGE_POOLS_ACTIVE);
+    if (npools < 0)
+        return -1;
+
+    struct iso_entry *isos = NULL;
+    int n = 0, cap = 0, failed = 0;
+    for (int i = 0; i < npools; i++) {
+        virStorageVolPtr *vols = NULL;
+        int nvols = virStoragePoolListAllVolumes(pools[i], &vols, 0);
+        for (int j = 0; j < nvols; j++) {
+            const char *name = virStorageVolGetName(vols[j]);
+            virStorageVolInfo info;
+            char *path = NULL;
+            if (!failed && name && has_suffix(name, ".iso") &&
+                virStorageVolGetInfo(vols[j], &info) == 0 &&
+                (path = virStorageVolGetPath(vols[j]))) {
+                if (n == cap) {
+                    struct iso_entry *grown = realloc(isos, (cap ? cap * 2 : 16) * sizeof(*isos));
+                    if (!grown) {
+                        // Finir de libérer les volumes et pools, puis échouer
+                        free(path);
+                        failed = 1;
+                        virStorageVolFree(vols[j]);
+                        continue;
+                    }
+                    isos = grown;
+                    cap = cap ? cap * 2 : 16;
+                }
+                struct iso_entry *e = &isos[n++];
+                e->name = strdup(name);
+                e->path = path;
+                snprintf(e->pool, sizeof(e->pool), "%s",
+                         virStoragePoolGetName(pools[i]));
+                e->capacity = info.capacity;
+                e->allocation = info.allocation;
+            }
+            virStorageVolFree(vols[j]);
+        }
+        free(vols);
+        virStoragePoolFree(pools[i]);
+    }
+    free(pools);
+    if (failed) {
+        iso_entries_free(isos, n);
+        return -1;
+    }
+
+    if (n > 1)
+        qsort(isos, n, sizeof(*isos), iso_cmp);
+    *out = isos;
+    return n;
+}
+
+static char *iso_json(const struct iso_entry *isos, int n) {
+    struct jw w = {0};
+    jw_array_begin(&w);
+    for (int i = 0; i < n; i++) {
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", isos[i].name);
+        jw_kstr(&w, "path", isos[i].path);
+        jw_kstr(&w, "pool", isos[i].pool);
+        jw_kuint(&w, "capacity", isos[i].capacity);
+        jw_kuint(&w, "allocation", isos[i].allocation);
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    return jw_finish(&w);
+}
+
+/* Index de `uri`, créé au besoin ; NULL si la table est pleine.
+ * Appelé avec iso_lock tenu. */
+static struct iso_index *iso_index_find(const char *uri) {
+    if (strlen(uri) >= sizeof(iso_indexes[0].uri))
+        return NULL;
+    for (int i = 0; i < CACHE_MAX_URIS; i++) {
+        if (strcmp(iso_indexes[i].uri, uri) == 0)
+            return &iso_indexes[i];
+    }
+    for (int i = 0; i < CACHE_MAX_URIS; i++) {
+        if (!iso_indexes[i].uri[0]) {
+            snprintf(iso_indexes[i].uri, sizeof(iso_indexes[i].uri), "%s", uri);
+            return &iso_indexes[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Liste JSON des ISO des pools actifs :
+ * [{"name", "path", "pool", "capacity", "allocation"}, …].
+ * Servie depuis l'index tant qu'aucun événement de pool n'est arrivé ;
+ * sans événements de pool pour l'URI, les pools sont relus à chaque appel.
+ */
+char* iso_list(const char *uri) {
+    API_SCOPE(iso_list);
+    unsigned long long gen = 0;
+    int tracked = cache_vol_generation(uri, &gen) == 0;
+
+    pthread_mutex_lock(&iso_lock);
+    struct iso_index *idx = tracked ? iso_index_find(uri) : NULL;
+    if (idx && idx->valid && idx->gen == gen) {
+        char *json = iso_json(idx->isos, idx->n);
+        pthread_mutex_unlock(&iso_lock);
+        return json;
+    }
+    pthread_mutex_unlock(&iso_lock);
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
+
+    struct iso_entry *isos = NULL;
+    int n = iso_collect(conn, &isos);
+    pool_release(conn);
+    if (n < 0)
+        return json_error("Impossible de lister les pools de stockage");
+
+    char *json = iso_json(isos, n);
+    if (!idx) {
+        iso_entries_free(isos, n);
+        return json;
+    }
+
+    /* `gen` a été lu avant le listage : un événement arrivé entretemps
+     * fera relire les pools au prochain appel. */
+    pthread_mutex_lock(&iso_lock);
+    iso_entries_free(idx->isos, idx->n);
+    idx->isos = isos;
+    idx->n = n;
+    idx->gen = gen;
+    idx->valid = 1;
+    pthread_mutex_unlock(&iso_lock);
+    return json;
+}
+
+struct upload {
+    int id;                      /* 0 : emplacement libre */
+    int busy;                    /* un appel est en cours sur ce flux */
+    char uri[256];
+    virConnectPtr conn;
+    virStoragePoolPtr pool;
+    virStorageVolPtr vol;
+    virStreamPtr st;
+    unsigned long long size;     /* longueur annoncée */
+    unsigned long long received;
+    unsigned long long hole;     /* zéros reçus, pas encore envoyés */
+    unsigned long long sparse;   /* octets envoyés en trous */
+    char err[256];               /* premier échec, rendu par upload_finish */
+};
+
+static struct upload uploads[UPLOAD_MAX];
+static pthread_mutex_t upload_lock = PTHREAD_MUTEX_INITIALIZER;
+static int upload_next_id = 1;
+
+/* Réserve le téléversement `id` pour l'appelant ; NULL s'il est inconnu
+ * ou déjà utilisé par un autre appel. */
+static struct upload *upload_get(int id) {
+    struct upload *u = NULL;
+    pthread_mutex_lock(&upload_lock);
+    for (int i = 0; i < UPLOAD_MAX && !u; i++) {
+        if (id > 0 && uploads[i].id == id && !uploads[i].busy)
+            u = &uploads[i];
+    }
+    if (u)
+        u->busy = 1;
+    pthread_mutex_unlock(&upload_lock);
+    return u;
+}
+
+static void upload_put(struct upload *u) {
+    pthread_mutex_lock(&upload_lock);
+    u->busy = 0;
+    pthread_mutex_unlock(&upload_lock);
+}
+
+/* Libère le flux et, si `remove`, le volume à moitié écrit. */
+static void upload_close(struct upload *u, int remove) {
+    if (u->st) {
+        if (remove)
+            virStreamAbort(u->st);
+        virStreamFree(u->st);
+    }
+    if (u->vol) {
+        if (remove)
+            virStorageVolDelete(u->vol, 0);
+        virStorageVolFree(u->vol);
+    }
+    if (u->pool)
+        virStoragePoolFree(u->pool);
+    if (u->conn)
+        pool_release(u->conn);
+
+    pthread_mutex_lock(&upload_lock);
+    memset(u, 0, sizeof(*u));
+    pthread_mutex_unlock(&upload_lock);
+}
+
+static void upload_fail(struct upload *u, const char *what) {
+    if (!u->err[0])
+        snprintf(u->err, sizeof(u->err), "%s après %llu octets", what, u->received);
+}
+
+static int upload_send(struct upload *u, const char *data, size_t len) {
+    if (u->hole) {
+        if (virStreamSendHole(u->st, (long long)u->hole, 0) < 0)
+            return -1;
+        u->sparse += u->hole;
+        u->hole = 0;
+    }
+    size_t sent = 0;
+    while (sent < len) {
+        int w = virStreamSend(u->st, data + sent, len - sent);
+        if (w < 0)
+            return -1;
+        sent += w;
+    }
+    return 0;
+}
+
+static int block_is_zero(const char *p, size_t len) {
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+/*
+ * Commence le téléversement de `size` octets dans un nouveau volume
+ * `name` du pool `pool` (format déduit de l'extension : iso, qcow2 ou
+ * raw). Retourne {"id": n}, à passer à upload_chunk puis upload_finish.
+ */
+char* upload_begin(const char *uri, const char *pool, const char *name,
+                   unsigned long long size) {
+    API_SCOPE(upload_begin);
+    if (!name || !name[0] || strchr(name, '/') || name[0] == '.')
+        return json_error("Nom de volume invalide");
+    if (!uri || strlen(uri) >= sizeof(uploads[0].uri))
+        return json_error("URI invalide");
+    if (!pool || !pool[0])
+        pool = "default";
+
+    struct upload *u = NULL;
+    pthread_mutex_lock(&upload_lock);
+    for (int i = 0; i < UPLOAD_MAX && !u; i++) {
+        if (!uploads[i].id)
+            u = &uploads[i];
+    }
+    if (u) {
+        u->id = upload_next_id++;
+        u->busy = 1;
+    }
+    pthread_mutex_unlock(&upload_lock);
+    if (!u)
+        return json_error("Trop de téléversements en cours (%d)", UPLOAD_MAX);
+
+    snprintf(u->uri, sizeof(u->uri), "%s", uri);
+    u->size = size;
+    char *msg = NULL;
+
+    u->conn = pool_acquire(uri);
+    if (!u->conn) {
+        msg = json_error("Impossible de se connecter à %s", uri);
+        goto fail;
+    }
+    u->pool = virStoragePoolLookupByName(u->conn, pool);
+    if (!u->pool) {
+        msg = json_error("Pool de stockage %s introuvable", pool);
+        goto fail;
+    }
+
+    const char *format = has_suffix(name, ".iso") ? "iso" :
+                         has_suffix(name, ".qcow2") ? "qcow2" : "raw";
+    char *vol_xml = volume_xml(name, size, format, NULL, NULL);
+    u->vol = vol_xml ? virStorageVolCreateXML(u->pool, vol_xml, 0) : NULL;
+    free(vol_xml);
+    if (!u->vol) {
+        msg = json_error("Impossible de créer le volume %s (existe-t-il déjà ?)", name);
+        goto fail;
+    }
+
+    u->st = virStreamNew(u->conn, 0);
+    if (!u->st || virStorageVolUpload(u->vol, u->st, 0, size,
+                                      VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM) < 0) {
+        msg = json_error("Impossible d'ouvrir le flux vers %s", name);
+        goto fail;
+    }
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kint(&w, "id", u->id);
+    jw_object_end(&w);
+    msg = jw_finish(&w);
+    upload_put(u);
+    return msg;
+
+fail:
+    upload_close(u, 1);
+    return msg;
+}
+
+/*
+ * Envoie les `len` octets suivants. Le bloc est découpé aux multiples de
+ * UPLOAD_BLOCK (position absolue) : les morceaux nuls s'accumulent en un
+ * trou, les autres sont envoyés d'un seul virStreamSend par plage
+ * contiguë. 0 si tout va bien, -1 sinon (l'erreur est rendue par
+ * upload_finish, qui supprime alors le volume).
+ */
+int upload_chunk(int id, const char *buf, size_t len) {
+    API_SCOPE(upload_chunk);
+    struct upload *u = upload_get(id);
+    if (!u)
+        return -1;
+    if (u->err[0]) {
+        upload_put(u);
+        return -1;
+    }
+    if (len > u->size - u->received) {
+        upload_fail(u, "Données au-delà de la taille annoncée");
+        upload_put(u);
+        return -1;
+    }
+
+    int rc = 0;
+    size_t off = 0, data = 0;    /* plage non nulle en attente : [data, off) */
+    while (off < len && rc == 0) {
+        size_t blk = UPLOAD_BLOCK - (u->received + off) % UPLOAD_BLOCK;
+        if (blk > len - off)
+            blk = len - off;
+        if (block_is_zero(buf + off, blk)) {
+            if (off > data)
+                rc = upload_send(u, buf + data, off - data);
+            u->hole += blk;
+            data = off + blk;
+        }
+        off += blk;
+    }
+    if (rc == 0 && len > data)
+        rc = upload_send(u, buf + data, len - data);
+
+    if (rc < 0)
+        upload_fail(u, "Échec d'écriture dans le flux");
+    else
+        u->received += len;
+    upload_put(u);
+    return rc;
+}
+
+/*
+ * Termine le téléversement `id` : envoie le trou final, ferme le flux et
+ * rafraîchit le pool. Si un bloc a échoué ou si la taille annoncée n'a
+ * pas été atteinte, le volume est supprimé.
+ */
+char* upload_finish(int id) {
+    API_SCOPE(upload_finish);
+    struct upload *u = upload_get(id);
+    if (!u)
+        return json_error("Téléversement %d inconnu ou occupé", id);
+
+    if (!u->err[0] && u->received < u->size)
+        snprintf(u->err, sizeof(u->err), "Téléversement incomplet : %llu/%llu octets",
+                 u->received, u->size);
+    if (!u->err[0] && u->hole && virStreamSendHole(u->st, (long long)u->hole, 0) < 0)
+        upload_fail(u, "Échec d'écriture dans le flux");
+    if (!u->err[0]) {
+        u->sparse += u->hole;
+        u->hole = 0;
+        if (virStreamFinish(u->st) < 0)
+            upload_fail(u, "Échec de finalisation du flux");
+    }
+    if (u->err[0]) {
+        char *msg = json_error("%s", u->err);
+        upload_close(u, 1);
+        return msg;
+    }
+
+    /* Le pool relit le volume (format réel, allocation) ; le rafraîchir
+     * émet aussi l'événement qui invalide l'index des ISO. */
+    virStoragePoolRefresh(u->pool, 0);
+    cache_vol_changed(u->uri);
+
+    char *path = virStorageVolGetPath(u->vol);
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "message");
+    jw_strf(&w, "Image %s téléversée (%llu Mo, dont %llu Mo de zéros non transférés)",
+            virStorageVolGetName(u->vol), u->size >> 20, u->sparse >> 20);
+    jw_kstr(&w, "path", path ? path : "");
+    jw_kuint(&w, "size", u->size);
+    jw_kuint(&w, "sparse", u->sparse);
+    jw_object_end(&w);
+    free(path);
+    upload_close(u, 0);
+    return jw_finish(&w);
+}
+
+/* Interrompt le téléversement `id` et supprime le volume partiel. */
+char* upload_abort(int id) {
+    API_SCOPE(upload_abort);
+    struct upload *u = upload_get(id);
+    if (!u)
+        return json_error("Téléversement %d inconnu ou occupé", id);
+    upload_close(u, 1);
+    return result_printf("Téléversement %d annulé", id);
+}
+
+/* ---------- Modèles et pool d'instances préchauffées ----------
+ *
+ * Un modèle est une VM éteinte, déjà installée, marquée par une
+ * métadonnée libvirt : l'état vit dans la définition du domaine, il
+ * survit donc aux redémarrages de l'application. Chaque instance reçoit
+ * un overlay qcow2 sur le disque du modèle (clone lié), un UUID et une
+ * MAC générés, et éventuellement un ISO cloud-init "cidata" construit
+ * localement. Le pool "warm" garde des instances démarrées en pause :
+ * les reprendre ne coûte qu'un virDomainResume.
+ */
+
+#define TMPL_NS      "https://github.com/Moradbezzazi/mini-hyperviseur/template"
+#define INSTANCE_NS  "https://github.com/Moradbezzazi/mini-hyperviseur/instance"
+#define TMPL_MAX_INSTANCES 64   /* instances créées par appel, pool warm compris */
+
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Élément <instance template="…" warm="…"/> des métadonnées d'une
+ * instance ; libxml2 échappe le nom du modèle. */
+static char *instance_meta(const char *tmpl_name, int warm) {
+    xmlDocPtr doc = xmlNewDoc((const xmlChar *)"1.0");
+    if (!doc)
+        return NULL;
+    xmlNodePtr root = xmlNewNode(NULL, (const xmlChar *)"instance");
+    xmlDocSetRootElement(doc, root);
+    xmlSetProp(root, (const xmlChar *)"template", (const xmlChar *)tmpl_name);
+    xmlSetProp(root, (const xmlChar *)"warm", (const xmlChar *)(warm ? "yes" : "no"));
+    char *out = xml_dump(doc);
+    xmlFreeDoc(doc);
+    return out;
+}
+
+static int random_bytes(unsigned char *buf, size_t len) {
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f)
+        return -1;
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    return n == len ? 0 : -1;
+}
+
+/* UUID version 4 (aléatoire), forme textuelle. */
+static int generate_uuid(char *out, size_t len) {
+    unsigned char b[16];
+    if (random_bytes(b, sizeof(b)) < 0)
+        return -1;
+    b[6] = (b[6] & 0x0f) | 0x40;
+    b[8] = (b[8] & 0x3f) | 0x80;
+    snprintf(out, len,
+             "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+             b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+    return 0;
+}
+
+/* MAC dans le préfixe QEMU/KVM 52:54:00. */
+static int generate_mac(char *out, size_t len) {
+    unsigned char b[3];
+    if (random_bytes(b, sizeof(b)) < 0)
+        return -1;
+    snprintf(out, len, "52:54:00:%02x:%02x:%02x", b[0], b[1], b[2]);
+    return 0;
+}
+
+/* Valeur d'un attribut de l'élément racine d'un fragment XML (métadonnée). */
+static int xml_attr(const char *xml, const char *attr, char *out, size_t len) {
+    xmlDocPtr doc = xml_parse(xml);
+    xmlChar *value = doc ? xmlGetProp(xmlDocGetRootElement(doc), (const xmlChar *)attr)
+                         : NULL;
+    if (value)
+        snprintf(out, len, "%s", (const char *)value);
+    xmlFree(value);
+    xmlFreeDoc(doc);
+    return value ? 0 : -1;
+}
+
+/* Remplace la <mac> de chaque <interface> par une adresse générée. */
+static void xml_set_macs(xmlDocPtr doc, char *first_mac, size_t len) {
+    xmlNodePtr *ifaces;
+    int n = xml_find(doc, NULL, "/domain/devices/interface", &ifaces);
+
+    first_mac[0] = '\0';
+    xml_remove(doc, NULL, "/domain/devices/interface/mac");
+    for (int i = 0; i < n; i++) {
+        char mac[18];
+        generate_mac(mac, sizeof(mac));
+        if (!first_mac[0])
+            snprintf(first_mac, len, "%s", mac);
+        xmlSetProp(xml_child(ifaces[i], "mac"), (const xmlChar *)"address",
+                   (const xmlChar *)mac);
+    }
+    free(ifaces);
+}
+
+/* Place `iso` dans le premier lecteur CD-ROM, ajouté s'il n'y en a pas. */
+static void xml_set_cdrom(xmlDocPtr doc, const char *iso) {
+    xmlNodePtr cd = xml_first(doc, NULL, "/domain/devices/disk[@device='cdrom']");
+    if (!cd) {
+        xmlNodePtr devices = xml_first(doc, NULL, "/domain/devices");
+        if (!devices)
+            return;
+        cd = xmlNewChild(devices, NULL, (const xmlChar *)"disk", NULL);
+        xmlSetProp(cd, (const xmlChar *)"device", (const xmlChar *)"cdrom");
+        xmlNodePtr driver = xml_child(cd, "driver");
+        xmlSetProp(driver, (const xmlChar *)"name", (const xmlChar *)"qemu");
+        xmlSetProp(driver, (const xmlChar *)"type", (const xmlChar *)"raw");
+        xmlNodePtr target = xml_child(cd, "target");
+        xmlSetProp(target, (const xmlChar *)"dev", (const xmlChar *)"hdc");
+        xmlSetProp(target, (const xmlChar *)"bus", (const xmlChar *)"ide");
+        xml_child(cd, "readonly");
+    }
+    xmlSetProp(cd, (const xmlChar *)"type", (const xmlChar *)"file");
+    xmlSetProp(xml_child(cd, "source"), (const xmlChar *)"file", (const xmlChar *)iso);
+}
+
+static int write_file(const char *path, const char *data) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    int ok = fputs(data, f) >= 0;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/*
+ * Construit l'ISO NoCloud (volume "cidata") avec user-data et meta-data,
+ * via genisoimage ou, à défaut, mkisofs.
+ */
+static int build_seed_iso(const char *iso, const char *name, const char *uuid,
+                          const char *user_data) {
+    char dir[] = "/tmp/mini-hyperviseur-seed-XXXXXX";
+    if (!mkdtemp(dir))
+        return -1;
+
+    char ud[64], md[64], meta[600];
+    snprintf(ud, sizeof(ud), "%s/user-data", dir);
+    snprintf(md, sizeof(md), "%s/meta-data", dir);
+    snprintf(meta, sizeof(meta), "instance-id: %s\nlocal-hostname: %s\n", uuid, name);
+
+    int rc = -1;
+    if (write_file(ud, user_data) == 0 && write_file(md, meta) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) {
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+            }
+            execlp("genisoimage", "genisoimage", "-output", iso, "-volid", "cidata",
+                   "-joliet", "-rock", ud, md, (char *)NULL);
+            execlp("mkisofs", "mkisofs", "-output", iso, "-volid", "cidata",
+                   "-joliet", "-rock", ud, md, (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        if (pid > 0 && waitpid(pid, &status, 0) == pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            rc = 0;
+    }
+
+    unlink(ud);
+    unlink(md);
+    rmdir(dir);
+    return rc;
+}
+
+/* Modèle : domaine éteint, marqué, et ses disques dans un pool. */
+struct tmpl {
+    virDomainPtr dom;
+    xmlDocPtr doc;
+};
+
+static void tmpl_free(struct tmpl *t) {
+    if (t->dom)
+        virDomainFree(t->dom);
+    xmlFreeDoc(t->doc);
+}
+
+static char *tmpl_open(virConnectPtr conn, const char *name, struct tmpl *t) {
+    memset(t, 0, sizeof(*t));
+
+    t->dom = lookup_domain(conn, name);
+    if (!t->dom)
+        return result_error("modèle %s introuvable", name);
+
+    char *meta = virDomainGetMetadata(t->dom, VIR_DOMAIN_METADATA_ELEMENT, TMPL_NS, 0);
+    if (!meta)
+        return result_error("%s n'est pas un modèle", name);
+    free(meta);
+
+    t->doc = domain_doc(conn, t->dom, VIR_DOMAIN_XML_INACTIVE);
+    struct xml_disk *disks = NULL;
+    int ndisks = t->doc ? xml_disks(t->doc, &disks) : 0;
+    char *err = NULL;
+    int found = 0;
+    for (int i = 0; i < ndisks && !err; i++) {
+        if (!disks[i].writable)
+            continue;
+        found = 1;
+        virStorageVolPtr vol = virStorageVolLookupByPath(conn, disks[i].path);
+        if (vol)
+            virStorageVolFree(vol);
+        else
+            err = result_error("le disque %s n'appartient à aucun pool",
+                               disks[i].path);
+    }
+    xml_disks_free(disks, ndisks);
+
+    if (!err && !found)
+        err = result_error("disque du modèle %s introuvable", name);
+    return err;
+}
+
+struct instance {
+    char name[256];
+    char uuid[37];
+    char mac[18];
+    char seed[600];
+};
+
+/*
+ * Crée une instance du modèle : overlay, XML personnalisé, ISO
+ * cloud-init si `user_data` est fourni. Démarrée normalement ou en pause
+ * (warm). Retourne un message d'erreur alloué, NULL en cas de succès.
+ */
+static char *instance_create(virConnectPtr conn, const char *tmpl_name,
+                             struct tmpl *t, struct instance *inst,
+                             const char *user_data, int warm) {
+    if (generate_uuid(inst->uuid, sizeof(inst->uuid)) < 0)
+        return result_error("génération d'UUID impossible");
+
+    /* Un overlay par disque du modèle, dans une copie de son XML */
+    xmlDocPtr doc = xmlCopyDoc(t->doc, 1);
+    struct xml_disk *disks = NULL;
+    struct clone_disk *copies = NULL;
+    int ncopies = 0;
+    int ndisks = doc ? xml_disks(doc, &disks) : 0;
+    char *err = clone_disks(conn, disks, ndisks, inst->name, CLONE_LINKED, NULL,
+                            &copies, &ncopies);
+    if (err) {
+        xml_disks_free(disks, ndisks);
+        xmlFreeDoc(doc);
+        return err;
+    }
+    const char *overlay = copies[0].path;
+
+    inst->seed[0] = '\0';
+    if (user_data && user_data[0]) {
+        /* ISO à côté du premier overlay, dans le répertoire du pool */
+        const char *slash = strrchr(overlay, '/');
+        snprintf(inst->seed, sizeof(inst->seed), "%.*s/%s-seed.iso",
+                 slash ? (int)(slash - overlay) : 1, slash ? overlay : ".", inst->name);
+        if (build_seed_iso(inst->seed, inst->name, inst->uuid, user_data) < 0) {
+            char *msg = result_error("ISO cloud-init de %s", inst->name);
+            clone_disks_free(copies, ncopies, 1);
+            xml_disks_free(disks, ndisks);
+            xmlFreeDoc(doc);
+            return msg;
+        }
+    }
+
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    xml_set_text(doc, root, "name", inst->name);
+    xml_child(root, "uuid");
+    xml_set_text(doc, root, "uuid", inst->uuid);
+    xml_remove(doc, NULL, "/domain/metadata");
+    xml_set_macs(doc, inst->mac, sizeof(inst->mac));
+    xmlNodePtr *boots;
+    int nboots = xml_find(doc, NULL, "/domain/os/boot[@dev='cdrom']", &boots);
+    for (int i = 0; i < nboots; i++)
+        xmlSetProp(boots[i], (const xmlChar *)"dev", (const xmlChar *)"hd");
+    free(boots);
+    clone_disks_apply(doc, copies, ncopies);
+    if (inst->seed[0])
+        xml_set_cdrom(doc, inst->seed);
+    char *xml = xml_dump(doc);
+    xml_disks_free(disks, ndisks);
+    xmlFreeDoc(doc);
+
+    char *msg = NULL;
+    virDomainPtr dom = virDomainDefineXML(conn, xml);
+    free(xml);
+    if (!dom) {
+        msg = result_error("définition de %s", inst->name);
+    } else {
+        /* Domaine encore inactif : la config suffit, le démarrage la
+         * recopie dans la définition live */
+        char *meta = instance_meta(tmpl_name, warm);
+        int rc = meta ? virDomainSetMetadata(dom, VIR_DOMAIN_METADATA_ELEMENT, meta, "mh",
+                                             INSTANCE_NS, VIR_DOMAIN_AFFECT_CONFIG) : -1;
+        free(meta);
+
+        if (rc < 0) {
+            msg = result_error("métadonnées de %s", inst->name);
+            virDomainUndefine(dom);
+        } else if (virDomainCreateWithFlags(dom, warm ? VIR_DOMAIN_START_PAUSED : 0) < 0) {
+            msg = result_error("démarrage de %s", inst->name);
+            virDomainUndefine(dom);
+        }
+        virDomainFree(dom);
+    }
+
+    if (msg && inst->seed[0])
+        unlink(inst->seed);
+    clone_disks_free(copies, ncopies, msg != NULL);
+    return msg;
+}
+
+/*
+ * ISO cloud-init de `dom` parmi ses disques : CD-ROM <nom>-seed.iso d'une
+ * instance de modèle. NULL pour tout autre domaine.
+ */
+static const char *instance_seed(virDomainPtr dom, const struct xml_disk *disks,
+                                 int ndisks) {
+    char *meta = virDomainGetMetadata(dom, VIR_DOMAIN_METADATA_ELEMENT, INSTANCE_NS, 0);
+    if (!meta)
+        return NULL;
+    free(meta);
+
+    char suffix[300];
+    snprintf(suffix, sizeof(suffix), "/%s-seed.iso", virDomainGetName(dom));
+    for (int i = 0; i < ndisks; i++) {
+        if (!disks[i].writable && disks[i].path && has_suffix(disks[i].path, suffix))
+            return disks[i].path;
+    }
+    return NULL;
+}
+
+/* Supprime l'ISO, par son pool s'il en connaît le volume. */
+static void instance_seed_delete(virConnectPtr conn, const char *path) {
+    virStorageVolPtr vol = virStorageVolLookupByPath(conn, path);
+    if (vol) {
+        virStorageVolDelete(vol, 0);
+        virStorageVolFree(vol);
+    } else {
+        unlink(path);
+    }
+}
+
+/* Premier nom `prefix`-N libre. */
+static void instance_pick_name(virConnectPtr conn, const char *prefix,
+                               int *next, char *out, size_t len) {
+    for (;; (*next)++) {
+        snprintf(out, len, "%s-%d", prefix, *next);
+        virDomainPtr d = lookup_domain(conn, out);
+        if (!d)
+            break;
+        virDomainFree(d);
+    }
+    (*next)++;
+}
+
+static void instance_json(struct jw *w, const struct instance *inst,
+                          const char *err) {
+    jw_object_begin(w);
+    jw_kstr(w, "name", inst->name);
+    jw_kstr(w, "uuid", inst->uuid);
+    jw_kstr(w, "mac", inst->mac);
+    jw_kstr(w, "seed", inst->seed);
+    jw_kbool(w, "ok", !err);
+    if (err)
+        jw_kstr(w, "error", err);
+    jw_object_end(w);
+}
+
+/* Marque un domaine éteint comme modèle. */
+char* template_register(const char *uri, const char *name) {
+    API_SCOPE(template_register);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("connexion à %s", uri);
+
+    char *msg;
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        msg = result_error("VM %s introuvable", name);
+    } else if (virDomainIsActive(dom) == 1) {
+        msg = result_error("%s doit être éteinte pour servir de modèle", name);
+    } else if (virDomainSetMetadata(dom, VIR_DOMAIN_METADATA_ELEMENT,
+                                    "<template/>", "mh", TMPL_NS,
+                                    VIR_DOMAIN_AFFECT_CONFIG) < 0) {
+        msg = result_error("impossible de marquer %s", name);
+    } else {
+        msg = result_printf("Modèle %s enregistré", name);
+        domain_forget(conn, dom);
+    }
+
+    if (dom)
+        virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+char* template_unregister(const char *uri, const char *name) {
+    API_SCOPE(template_unregister);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("connexion à %s", uri);
+
+    char *msg;
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        msg = result_error("VM %s introuvable", name);
+    } else if (virDomainSetMetadata(dom, VIR_DOMAIN_METADATA_ELEMENT, NULL, NULL,
+                                    TMPL_NS, VIR_DOMAIN_AFFECT_CONFIG) < 0) {
+        msg = result_error("impossible de retirer le modèle %s", name);
+    } else {
+        msg = result_printf("Modèle %s retiré", name);
+        domain_forget(conn, dom);
+    }
+
+    if (dom)
+        virDomainFree(dom);
+    pool_release(conn);
+    return msg;
+}
+
+/*
+ * Modèles et leurs instances :
+ * {"templates":[{"name","uuid","instances","warm"}]}
+ * "warm" compte les instances en pause encore disponibles.
+ */
+char* template_list(const char *uri) {
+    API_SCOPE(template_list);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
+
+    virDomainPtr *doms = NULL;
+    int n = virConnectListAllDomains(conn, &doms, 0);
+    if (n < 0) {
+        pool_release(conn);
+        return json_error("Impossible de lister les VMs");
+    }
+
+    /* Pour chaque domaine : modèle ou instance (template, warm) */
+    char (*owner)[256] = calloc(n ? n : 1, sizeof(*owner));
+    int *is_tmpl = calloc(n ? n : 1, sizeof(int));
+    int *is_warm = calloc(n ? n : 1, sizeof(int));
+
+    for (int i = 0; i < n; i++) {
+        char *meta = virDomainGetMetadata(doms[i], VIR_DOMAIN_METADATA_ELEMENT, TMPL_NS, 0);
+        if (meta) {
+            is_tmpl[i] = 1;
+            free(meta);
+            continue;
+        }
+        meta = virDomainGetMetadata(doms[i], VIR_DOMAIN_METADATA_ELEMENT, INSTANCE_NS, 0);
+        if (meta) {
+            char warm[8] = "";
+            xml_attr(meta, "template", owner[i], sizeof(owner[i]));
+            xml_attr(meta, "warm", warm, sizeof(warm));
+            int state;
+            is_warm[i] = strcmp(warm, "yes") == 0 &&
+                         virDomainGetState(doms[i], &state, NULL, 0) == 0 &&
+                         state == VIR_DOMAIN_PAUSED;
+            free(meta);
+        }
     }
 
-    virDomainPtr dom = virDomainLookupByName(conn, name);
-    if (!dom) {
-        snprintf(buffer, sizeof(buffer), "{\"error\":\"VM %s introuvable\"}", name);
-        virConnectClose(conn);
-        return buffer;
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "templates");
+    jw_array_begin(&w);
+    for (int i = 0; i < n; i++) {
+        if (!is_tmpl[i])
+            continue;
+        const char *name = virDomainGetName(doms[i]);
+        char uuid[VIR_UUID_STRING_BUFLEN] = "";
+        virDomainGetUUIDString(doms[i], uuid);
+
+        int instances = 0, warm = 0;
+        for (int j = 0; j < n; j++) {
+            if (strcmp(owner[j], name) == 0) {
+                instances++;
+                warm += is_warm[j];
+            }
+        }
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", name);
+        jw_kstr(&w, "uuid", uuid);
+        jw_kint(&w, "instances", instances);
+        jw_kint(&w, "warm", warm);
+        jw_object_end(&w);
     }
+    jw_array_end(&w);
+    jw_object_end(&w);
 
-    unsigned int num = virDomainSnapshotNum(dom, 0);
-    if (num == 0) {
-        strcat(buffer, "{\"snapshots\":[]}");
-        virDomainFree(dom);
-        virConnectClose(conn);
-        return buffer;
+    for (int i = 0; i < n; i++)
+        virDomainFree(doms[i]);
+    free(doms);
+    free(owner);
+    free(is_tmpl);
+    free(is_warm);
+    pool_release(conn);
+    return jw_finish(&w);
+}
+
+/*
+ * Crée et démarre `count` instances `prefix`-N du modèle. `user_data`
+ * (cloud-config) est optionnel : s'il est fourni, chaque instance reçoit
+ * son ISO cloud-init avec son nom d'hôte et son instance-id.
+ * {"template":…,"instances":[{"name","uuid","mac","seed","ok","error"}]}
+ */
+char* template_instantiate(const char *uri, const char *tmpl_name,
+                           const char *prefix, int count, const char *user_data) {
+    API_SCOPE(template_instantiate);
+    if (count < 1 || count > TMPL_MAX_INSTANCES)
+        return json_error("Nombre d'instances invalide : %d (1 à %d)", count,
+                          TMPL_MAX_INSTANCES);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
+
+    struct tmpl t;
+    char *err = tmpl_open(conn, tmpl_name, &t);
+    if (err) {
+        char *json = json_error("%s", err);
+        free(err);
+        tmpl_free(&t);
+        pool_release(conn);
+        return json;
     }
 
-    char **names = malloc(sizeof(char*) * num);
-    if (virDomainSnapshotListNames(dom, names, num, 0) < 0) {
-        snprintf(buffer, sizeof(buffer), "{\"error\":\"Impossible de lister les snapshots\"}");
-        free(names);
-        virDomainFree(dom);
-        virConnectClose(conn);
-        return buffer;
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kstr(&w, "template", tmpl_name);
+    jw_key(&w, "instances");
+    jw_array_begin(&w);
+
+    int next = 1;
+    for (int i = 0; i < count; i++) {
+        struct instance inst = {0};
+        api_phase_set(PH_OPERATION);
+        instance_pick_name(conn, prefix && prefix[0] ? prefix : tmpl_name,
+                           &next, inst.name, sizeof(inst.name));
+        err = instance_create(conn, tmpl_name, &t, &inst, user_data, 0);
+        api_phase_set(PH_SERIALIZE);
+        instance_json(&w, &inst, err);
+        free(err);
+    }
+    jw_array_end(&w);
+    jw_object_end(&w);
+
+    tmpl_free(&t);
+    pool_release(conn);
+    return jw_finish(&w);
+}
+
+/*
+ * Complète le pool warm du modèle jusqu'à `size` instances en pause
+ * (`modèle`-warm-N). {"template","size","created":[…]}
+ */
+char* warm_pool_fill(const char *uri, const char *tmpl_name, int size,
+                     const char *user_data) {
+    API_SCOPE(warm_pool_fill);
+    if (size < 0 || size > TMPL_MAX_INSTANCES)
+        return json_error("Taille de pool invalide : %d (0 à %d)", size,
+                          TMPL_MAX_INSTANCES);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
+
+    struct tmpl t;
+    char *err = tmpl_open(conn, tmpl_name, &t);
+    if (err) {
+        char *json = json_error("%s", err);
+        free(err);
+        tmpl_free(&t);
+        pool_release(conn);
+        return json;
     }
 
-    strcat(buffer, "{\"snapshots\":[");
-    for (unsigned int i = 0; i < num; i++) {
-        if (i > 0) strcat(buffer, ",");
-        char tmp[256];
-        snprintf(tmp, sizeof(tmp), "\"%s\"", names[i]);
-        strcat(buffer, tmp);
+    /* Instances warm encore en pause ; compter et compléter sous le même
+     * verrou, sinon deux remplissages voient le même manque */
+    pthread_mutex_lock(&warm_lock);
+    int available = 0;
+    virDomainPtr *doms = NULL;
+    int n = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_PAUSED);
+    for (int i = 0; i < n; i++) {
+        char *meta = virDomainGetMetadata(doms[i], VIR_DOMAIN_METADATA_ELEMENT, INSTANCE_NS, 0);
+        char owner[256] = "", warm[8] = "";
+        xml_attr(meta, "template", owner, sizeof(owner));
+        xml_attr(meta, "warm", warm, sizeof(warm));
+        if (strcmp(owner, tmpl_name) == 0 && strcmp(warm, "yes") == 0)
+            available++;
+        free(meta);
+        virDomainFree(doms[i]);
     }
-    strcat(buffer, "]}");
+    free(doms);
 
-    free(names);
-    virDomainFree(dom);
-    virConnectClose(conn);
-    return buffer;
+    char prefix[280];
+    snprintf(prefix, sizeof(prefix), "%s-warm", tmpl_name);
+
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_kstr(&w, "template", tmpl_name);
+    jw_key(&w, "created");
+    jw_array_begin(&w);
+    int next = 1;
+    for (; available < size; available++) {
+        struct instance inst = {0};
+        api_phase_set(PH_OPERATION);
+        instance_pick_name(conn, prefix, &next, inst.name, sizeof(inst.name));
+        err = instance_create(conn, tmpl_name, &t, &inst, user_data, 1);
+        api_phase_set(PH_SERIALIZE);
+        instance_json(&w, &inst, err);
+        if (err) {
+            free(err);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&warm_lock);
+    jw_array_end(&w);
+    jw_kint(&w, "size", available);
+    jw_object_end(&w);
+
+    tmpl_free(&t);
+    pool_release(conn);
+    return jw_finish(&w);
 }
 
-const char* revert_snapshot(const char *uri, const char *name, const char *snapname) {
-    static char msg[512];
+/*
+ * Prend une instance warm du modèle et la reprend : elle sort du pool
+ * (warm='no') et tourne en quelques millisecondes. {"name","uuid"}
+ */
+char* warm_pool_take(const char *uri, const char *tmpl_name) {
+    API_SCOPE(warm_pool_take);
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return json_error("Impossible de se connecter à %s", uri);
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(msg, sizeof(msg), "Erreur : impossible de se connecter à %s", uri);
-        return msg;
+    virDomainPtr *doms = NULL;
+    virDomainPtr taken = NULL;
+
+    /* Deux appels concurrents ne doivent pas prendre la même instance */
+    pthread_mutex_lock(&warm_lock);
+    int n = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_PAUSED);
+    for (int i = 0; i < n; i++) {
+        char *meta = taken ? NULL
+                   : virDomainGetMetadata(doms[i], VIR_DOMAIN_METADATA_ELEMENT, INSTANCE_NS, 0);
+        char owner[256] = "", warm[8] = "";
+        xml_attr(meta, "template", owner, sizeof(owner));
+        xml_attr(meta, "warm", warm, sizeof(warm));
+        free(meta);
+
+        if (!taken && strcmp(owner, tmpl_name) == 0 && strcmp(warm, "yes") == 0) {
+            /* Live et config : les lectures (flags 0) voient la
+             * définition live d'un domaine actif */
+            char *value = instance_meta(tmpl_name, 0);
+            int rc = value ? virDomainSetMetadata(doms[i], VIR_DOMAIN_METADATA_ELEMENT, value,
+                                                  "mh", INSTANCE_NS,
+                                                  VIR_DOMAIN_AFFECT_LIVE |
+                                                  VIR_DOMAIN_AFFECT_CONFIG) : -1;
+            free(value);
+            if (rc == 0) {
+                taken = doms[i];
+                continue;
+            }
+        }
+        virDomainFree(doms[i]);
+    }
+    free(doms);
+    pthread_mutex_unlock(&warm_lock);
+
+    char *msg;
+    if (!taken) {
+        msg = json_error("Aucune instance warm disponible pour %s", tmpl_name);
+    } else if (virDomainResume(taken) < 0) {
+        msg = json_error("Reprise de %s impossible", virDomainGetName(taken));
+    } else {
+        char uuid[VIR_UUID_STRING_BUFLEN] = "";
+        virDomainGetUUIDString(taken, uuid);
+        struct jw w = {0};
+        jw_object_begin(&w);
+        jw_kstr(&w, "name", virDomainGetName(taken));
+        jw_kstr(&w, "uuid", uuid);
+        jw_object_end(&w);
+        msg = jw_finish(&w);
+    }
+
+    if (taken)
+        virDomainFree(taken);
+    pool_release(conn);
+    return msg;
+}
+
+/* ---------- Migration ----------
+ *
+ * virDomainMigrate3 avec paramètres typés, réglés par une chaîne
+ * d'options "clé=valeur,…" :
+ *   parallel=N        connexions multifd (VIR_MIGRATE_PARALLEL)
+ *   compression=M     xbzrle (cache de pages) ou zstd (multifd seulement)
+ *   bandwidth=N       plafond en MiB/s
+ *   auto_converge=1   ralentit les vCPU si la migration ne converge pas
+ *   postcopy=auto     bascule en post-copy quand les pages salies vont
+ *                     plus vite que le lien ; "on" bascule dès la fin du
+ *                     premier passage ; "off" (défaut) jamais
+ * Un thread de suivi échantillonne virDomainGetJobStats pendant le
+ * transfert : débit, taux de pages salies, reste, itérations.
+ */
+
+#define MIG_SAMPLE_US        500000  /* période d'échantillonnage */
+#define MIG_POSTCOPY_ITER    3       /* passages avant bascule automatique */
+#define MIG_POSTCOPY_SAMPLES 2       /* échantillons « non convergents » requis */
+
+enum { MIG_POSTCOPY_OFF, MIG_POSTCOPY_AUTO, MIG_POSTCOPY_ON };
+
+struct migrate_opts {
+    int parallel;
+    char compression[16];
+    unsigned long long bandwidth;   /* MiB/s, 0 : illimité */
+    int auto_converge;
+    int postcopy;
+};
+
+/* Valeur de `key` dans une chaîne "k=v,k=v" ; -1 si absente. */
+static int opt_get(const char *opts, const char *key, char *out, size_t len) {
+    size_t klen = strlen(key);
+    for (const char *p = opts; p && *p; ) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n > klen && strncmp(p, key, klen) == 0 && p[klen] == '=') {
+            snprintf(out, len, "%.*s", (int)(n - klen - 1), p + klen + 1);
+            return 0;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return -1;
+}
+
+static char *migrate_opts_parse(const char *opts, struct migrate_opts *o) {
+    char v[32];
+    memset(o, 0, sizeof(*o));
+
+    if (opt_get(opts, "parallel", v, sizeof(v)) == 0)
+        o->parallel = atoi(v);
+    if (opt_get(opts, "bandwidth", v, sizeof(v)) == 0)
+        o->bandwidth = strtoull(v, NULL, 10);
+    if (opt_get(opts, "auto_converge", v, sizeof(v)) == 0)
+        o->auto_converge = atoi(v) != 0;
+
+    if (opt_get(opts, "compression", o->compression, sizeof(o->compression)) == 0 &&
+        strcmp(o->compression, "xbzrle") != 0 && strcmp(o->compression, "zstd") != 0)
+        return result_error("compression inconnue (%s)", o->compression);
+    /* zstd n'existe qu'en multifd */
+    if (strcmp(o->compression, "zstd") == 0 && o->parallel < 2)
+        o->parallel = 2;
+
+    if (opt_get(opts, "postcopy", v, sizeof(v)) == 0) {
+        if (strcmp(v, "auto") == 0)
+            o->postcopy = MIG_POSTCOPY_AUTO;
+        else if (strcmp(v, "on") == 0)
+            o->postcopy = MIG_POSTCOPY_ON;
+        else if (strcmp(v, "off") != 0)
+            return result_error("mode post-copy inconnu (%s)", v);
+    }
+    return NULL;
+}
+
+/* Suivi du job de migration côté source. */
+struct migrate_watch {
+    virDomainPtr dom;
+    const struct migrate_opts *opts;
+    struct job *job;
+    struct migrate_stats stats;     /* dernier échantillon */
+    int stop;
+};
+
+static void migrate_sample(virDomainPtr dom, struct migrate_stats *s, unsigned int flags) {
+    int type, nparams = 0;
+    virTypedParameterPtr params = NULL;
+    if (virDomainGetJobStats(dom, &type, &params, &nparams, flags) < 0)
+        return;
+    if (type == VIR_DOMAIN_JOB_NONE) {
+        virTypedParamsFree(params, nparams);
+        return;
+    }
+
+    unsigned long long page_size = 4096, dirty_pages = 0;
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DATA_TOTAL, &s->data_total);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DATA_PROCESSED, &s->data_processed);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DATA_REMAINING, &s->data_remaining);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_MEMORY_BPS, &s->bps);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_MEMORY_DIRTY_RATE, &dirty_pages);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_MEMORY_PAGE_SIZE, &page_size);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_MEMORY_ITERATION, &s->iteration);
+    virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DOWNTIME, &s->downtime_ms);
+    virTypedParamsGetInt(params, nparams, VIR_DOMAIN_JOB_AUTO_CONVERGE_THROTTLE, &s->throttle);
+    s->dirty_bps = dirty_pages * page_size;
+    s->samples++;
+    virTypedParamsFree(params, nparams);
+}
+
+static void *migrate_watch_run(void *arg) {
+    struct migrate_watch *w = arg;
+    int stalled = 0;
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+        usleep(MIG_SAMPLE_US);
+        struct migrate_stats s = w->stats;
+        migrate_sample(w->dom, &s, 0);
+
+        /* Bascule post-copy : la pré-copie ne rattrapera plus les écritures */
+        if (!s.postcopy && w->opts->postcopy != MIG_POSTCOPY_OFF && s.iteration >= 1) {
+            if (w->opts->postcopy == MIG_POSTCOPY_AUTO)
+                stalled = s.iteration >= MIG_POSTCOPY_ITER && s.dirty_bps >= s.bps
+                        ? stalled + 1 : 0;
+            if ((w->opts->postcopy == MIG_POSTCOPY_ON || stalled >= MIG_POSTCOPY_SAMPLES) &&
+                virDomainMigrateStartPostCopy(w->dom, 0) == 0)
+                s.postcopy = 1;
+        }
+
+        w->stats = s;
+        job_migrate_stats(w->job, &s);
+    }
+    return NULL;
+}
+
+static char *do_migrate_vm(const char *src_uri, const char *name,
+                           const char *dest_uri, const char *options,
+                           struct job *job)
+{
+    virConnectPtr src = NULL;
+    virConnectPtr dest = NULL;
+    virDomainPtr dom = NULL;
+    virDomainPtr newDom = NULL;
+
+    struct migrate_opts o;
+    char *err = migrate_opts_parse(options, &o);
+    if (err)
+        return err;
+
+    /* Connexion source */
+    src = pool_acquire(src_uri);
+    if (!src) {
+        const virError *e = virGetLastError();
+        return result_error("impossible de se connecter à la source (%s)",
+                            e ? e->message : src_uri);
+    }
+
+    /* Connexion destination */
+    dest = pool_acquire(dest_uri);
+    if (!dest) {
+        const virError *e = virGetLastError();
+        pool_release(src);
+        return result_error("impossible de se connecter à la destination (%s)",
+                            e ? e->message : dest_uri);
     }
 
-    virDomainPtr dom = virDomainLookupByName(conn, name);
+    /* Recherche de la VM */
+    dom = lookup_domain(src, name);
     if (!dom) {
-        snprintf(msg, sizeof(msg), "Erreur : VM %s introuvable", name);
-        virConnectClose(conn);
-        return msg;
+        const virError *e = virGetLastError();
+        pool_release(dest);
+        pool_release(src);
+        return result_error("VM %s introuvable (%s)",
+                            name, e ? e->message : "inconnu");
     }
 
-    virDomainSnapshotPtr snap = virDomainSnapshotLookupByName(dom, snapname, 0);
-    if (!snap) {
-        snprintf(msg, sizeof(msg), "Erreur : snapshot %s introuvable", snapname);
+    /* Flags de l'exercice 7, complétés par les options */
+    unsigned int flags = VIR_MIGRATE_LIVE |
+                         VIR_MIGRATE_UNSAFE |
+                         VIR_MIGRATE_UNDEFINE_SOURCE |
+                         VIR_MIGRATE_PERSIST_DEST;
+
+    virTypedParameterPtr params = NULL;
+    int nparams = 0, maxparams = 0;
+
+    if (o.parallel > 1) {
+        flags |= VIR_MIGRATE_PARALLEL;
+        virTypedParamsAddInt(&params, &nparams, &maxparams,
+                             VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS, o.parallel);
+    }
+    if (o.compression[0]) {
+        flags |= VIR_MIGRATE_COMPRESSED;
+        virTypedParamsAddString(&params, &nparams, &maxparams,
+                                VIR_MIGRATE_PARAM_COMPRESSION, o.compression);
+    }
+    if (o.bandwidth)
+        virTypedParamsAddULLong(&params, &nparams, &maxparams,
+                                VIR_MIGRATE_PARAM_BANDWIDTH, o.bandwidth);
+    if (o.auto_converge)
+        flags |= VIR_MIGRATE_AUTO_CONVERGE;
+    if (o.postcopy != MIG_POSTCOPY_OFF)
+        flags |= VIR_MIGRATE_POSTCOPY;
+
+    /* Migration CONNECT-TO-CONNECT, suivie par un thread d'échantillonnage */
+    struct migrate_watch w = { dom, &o, job, {0}, 0 };
+    pthread_t tid;
+    int watching = pthread_create(&tid, NULL, migrate_watch_run, &w) == 0;
+
+    job_set_domain(job, dom);
+    newDom = virDomainMigrate3(dom, dest, params, nparams, flags);
+    job_set_domain(job, NULL);
+
+    if (watching) {
+        __atomic_store_n(&w.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(tid, NULL);
+    }
+    virTypedParamsFree(params, nparams);
+
+    char *msg;
+    if (!newDom) {
+        const virError *e = virGetLastError();
+        msg = result_error("migration impossible (%s)",
+                           e ? e->message : "inconnu");
         virDomainFree(dom);
-        virConnectClose(conn);
+        pool_release(dest);
+        pool_release(src);
         return msg;
     }
 
-    if (virDomainRevertToSnapshot(snap, 0) < 0) {
-        snprintf(msg, sizeof(msg), "Erreur : impossible de restaurer le snapshot %s", snapname);
-        virDomainSnapshotFree(snap);
+    /* Succès : statistiques finales (transmises à la destination) */
+    struct migrate_stats *s = &w.stats;
+    migrate_sample(newDom, s, VIR_DOMAIN_JOB_STATS_COMPLETED);
+    job_migrate_stats(job, s);
+    msg = result_printf("Migration effectuée avec succès "
+                        "(%llu MiB transférés, %llu MiB/s, %llu itération(s), "
+                        "downtime %llu ms%s)",
+                        s->data_processed >> 20, s->bps >> 20, s->iteration,
+                        s->downtime_ms, s->postcopy ? ", post-copy" : "");
+
+    virDomainFree(newDom);
+    virDomainFree(dom);
+    pool_release(dest);
+    pool_release(src);
+
+    return msg;
+}
+
+char* migrate_vm(const char* src_uri, const char* name, const char* dest_uri)
+{
+    API_SCOPE(migrate_vm);
+    return do_migrate_vm(src_uri, name, dest_uri, "", NULL);
+}
+
+/* Migration réglée par `options` (voir plus haut). */
+char* migrate_vm_ex(const char *src_uri, const char *name, const char *dest_uri,
+                    const char *options)
+{
+    API_SCOPE(migrate_vm_ex);
+    return do_migrate_vm(src_uri, name, dest_uri, options, NULL);
+}
+
+/* ---------- Fusion des overlays (block-commit) ----------
+ *
+ * snapshot_commit() refusionne dans leur image de base les overlays
+ * créés par les snapshots externes ("disk-only", "live"), VM démarrée :
+ * qemu recopie les blocs des overlays (block-commit actif), puis le
+ * disque bascule sur la base (pivot) sans arrêt de la VM. Seules les
+ * images enregistrées par un snapshot sont fusionnées : un clone lié ou
+ * une instance n'écrit jamais dans l'image de son modèle. Les snapshots
+ * fusionnés ne désignent plus rien : leurs métadonnées et leurs fichiers
+ * d'overlay sont supprimés.
+ */
+
+#define COMMIT_POLL_US 100000  /* suivi des block-jobs */
+
+/* Overlay créé par un snapshot externe. */
+struct snap_overlay {
+    char *snap;
+    char *path;
+    int merged;
+};
+
+struct commit_disk {
+    char *target;
+    char *base;                  /* première image hors snapshot */
+    int started;
+    int pivoted;
+};
+
+/* Overlays des snapshots externes de `dom`. Retourne leur nombre. */
+static int snap_overlays(virDomainPtr dom, struct snap_overlay **out) {
+    virDomainSnapshotPtr *snaps = NULL;
+    int nsnaps = virDomainListAllSnapshots(dom, &snaps, 0);
+    struct snap_overlay *ov = NULL;
+    int n = 0;
+
+    for (int i = 0; i < nsnaps; i++) {
+        char *text = virDomainSnapshotGetXMLDesc(snaps[i], 0);
+        xmlDocPtr doc = xml_parse(text);
+        free(text);
+        xmlNodePtr *nodes = NULL;
+        int k = doc ? xml_find(doc, NULL, "/domainsnapshot/disks/disk"
+                               "[@snapshot='external']/source/@file", &nodes) : 0;
+        if (k > 0)
+            ov = realloc(ov, (n + k) * sizeof(*ov));
+        for (int j = 0; j < k; j++) {
+            xmlChar *path = xmlNodeGetContent(nodes[j]);
+            ov[n].snap = strdup(virDomainSnapshotGetName(snaps[i]));
+            ov[n].path = strdup((const char *)path);
+            ov[n].merged = 0;
+            n++;
+            xmlFree(path);
+        }
+        free(nodes);
+        xmlFreeDoc(doc);
+        virDomainSnapshotFree(snaps[i]);
+    }
+    free(snaps);
+    *out = ov;
+    return n;
+}
+
+static struct snap_overlay *overlay_find(struct snap_overlay *ov, int n, const char *path) {
+    for (int i = 0; path && i < n; i++) {
+        if (strcmp(ov[i].path, path) == 0)
+            return &ov[i];
+    }
+    return NULL;
+}
+
+/*
+ * Supprime le volume `path`. Un overlay créé par qemu n'est pas encore
+ * connu du pool de `base` : on rafraîchit celui-ci puis on réessaie.
+ */
+static int overlay_delete(virConnectPtr conn, const char *path, const char *base) {
+    virStorageVolPtr vol = virStorageVolLookupByPath(conn, path);
+    if (!vol) {
+        virStorageVolPtr base_vol = virStorageVolLookupByPath(conn, base);
+        virStoragePoolPtr pool = base_vol ? virStoragePoolLookupByVolume(base_vol) : NULL;
+        if (pool && virStoragePoolRefresh(pool, 0) == 0)
+            vol = virStorageVolLookupByPath(conn, path);
+        if (pool)
+            virStoragePoolFree(pool);
+        if (base_vol)
+            virStorageVolFree(base_vol);
+    }
+    if (!vol)
+        return -1;
+    int ret = virStorageVolDelete(vol, 0);
+    virStorageVolFree(vol);
+    return ret;
+}
+
+static char *do_snapshot_commit(const char *uri, const char *name, struct job *job) {
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("impossible de se connecter à %s", uri);
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        pool_release(conn);
+        return result_error("VM %s introuvable", name);
+    }
+    if (virDomainIsActive(dom) != 1) {
         virDomainFree(dom);
-        virConnectClose(conn);
-        return msg;
+        pool_release(conn);
+        return result_error("la VM %s doit être démarrée pour fusionner ses overlays",
+                            name);
     }
 
-    snprintf(msg, sizeof(msg), "Snapshot %s restauré pour la VM %s.", snapname, name);
+    char *msg = NULL;
+    struct snap_overlay *ov = NULL;
+    int nov = snap_overlays(dom, &ov);
+    xmlDocPtr doc = domain_doc(conn, dom, 0);
+    struct xml_disk *disks = NULL;
+    int ndisks = doc ? xml_disks(doc, &disks) : -1;
+    struct commit_disk *cd = calloc(ndisks > 0 ? ndisks : 1, sizeof(*cd));
+    int ncd = 0;
 
-    virDomainSnapshotFree(snap);
+    /* Pour chaque disque : remonter la chaîne tant que les images sont
+     * des overlays de snapshot ; la première autre image est la base. */
+    for (int i = 0; i < ndisks; i++) {
+        if (!disks[i].writable || !overlay_find(ov, nov, disks[i].path))
+            continue;
+        xmlNodePtr node = disks[i].node;
+        char *base = NULL;
+        for (;;) {
+            node = xml_first(doc, node, "backingStore");
+            base = node ? xml_get(doc, node, "source/@file") : NULL;
+            if (!base || !overlay_find(ov, nov, base))
+                break;
+            free(base);
+        }
+        if (!base)
+            continue;
+        cd[ncd].target = strdup(disks[i].target);
+        cd[ncd].base = base;
+        ncd++;
+    }
+
+    if (ndisks < 0) {
+        msg = result_error("XML de la VM %s illisible", name);
+        goto out;
+    }
+    if (ncd == 0) {
+        msg = result_printf("Aucun overlay de snapshot à fusionner pour la VM %s.", name);
+        goto out;
+    }
+
+    for (int i = 0; i < ncd && !msg; i++) {
+        if (virDomainBlockCommit(dom, cd[i].target, cd[i].base, NULL, 0,
+                                 VIR_DOMAIN_BLOCK_COMMIT_ACTIVE) < 0) {
+            const virError *e = virGetLastError();
+            msg = result_error("fusion de %s impossible (%s)",
+                               cd[i].target, e ? e->message : "inconnu");
+        } else {
+            cd[i].started = 1;
+        }
+    }
+
+    /* Tous les commits tournent en parallèle dans qemu ; chacun bascule
+     * sur sa base dès que l'overlay est entièrement recopié. */
+    int pending = msg ? 0 : ncd;
+    while (pending > 0 && !msg) {
+        if (job_cancelled(job)) {
+            msg = result_error("fusion annulée");
+            break;
+        }
+        unsigned long long done = 0, total = 0;
+        for (int i = 0; i < ncd && !msg; i++) {
+            if (cd[i].pivoted)
+                continue;
+            virDomainBlockJobInfo info;
+            int r = virDomainGetBlockJobInfo(dom, cd[i].target, &info, 0);
+            if (r <= 0) {
+                msg = result_error("fusion de %s interrompue", cd[i].target);
+                cd[i].started = 0;
+                break;
+            }
+            done += info.cur;
+            total += info.end;
+            if (info.end && info.cur == info.end) {
+                if (virDomainBlockJobAbort(dom, cd[i].target,
+                                           VIR_DOMAIN_BLOCK_JOB_ABORT_PIVOT) < 0) {
+                    msg = result_error("bascule de %s impossible", cd[i].target);
+                    break;
+                }
+                cd[i].pivoted = 1;
+                pending--;
+            }
+        }
+        job_progress(job, done, total);
+        if (pending > 0 && !msg)
+            usleep(COMMIT_POLL_US);
+    }
+
+    /* Échec ou annulation : les commits restants sont abandonnés, les
+     * disques restent sur leurs overlays */
+    for (int i = 0; i < ncd; i++) {
+        if (cd[i].started && !cd[i].pivoted)
+            virDomainBlockJobAbort(dom, cd[i].target, 0);
+    }
+    domain_forget(conn, dom);
+
+    int merged = 0, removed = 0;
+    for (int i = 0; i < ncd; i++) {
+        if (!cd[i].pivoted)
+            continue;
+        merged++;
+        /* Images retirées de la chaîne : de l'ancien sommet jusqu'à la base */
+        for (int j = 0; j < ndisks; j++) {
+            if (!disks[j].target || strcmp(disks[j].target, cd[i].target) != 0)
+                continue;
+            const char *path = disks[j].path;
+            xmlNodePtr node = disks[j].node;
+            char *next = NULL;
+            while (path && strcmp(path, cd[i].base) != 0) {
+                struct snap_overlay *o = overlay_find(ov, nov, path);
+                if (o)
+                    o->merged = 1;
+                overlay_delete(conn, path, cd[i].base);
+                node = xml_first(doc, node, "backingStore");
+                free(next);
+                next = node ? xml_get(doc, node, "source/@file") : NULL;
+                path = next;
+            }
+            free(next);
+        }
+    }
+
+    /* Snapshot dont tous les overlays ont été fusionnés */
+    for (int i = 0; i < nov; i++) {
+        int all = 1;
+        for (int j = 0; j < nov; j++) {
+            if (strcmp(ov[j].snap, ov[i].snap) == 0)
+                all = all && ov[j].merged;
+        }
+        if (!all || !ov[i].merged)
+            continue;
+        virDomainSnapshotPtr snap = virDomainSnapshotLookupByName(dom, ov[i].snap, 0);
+        if (snap && virDomainSnapshotDelete(snap, VIR_DOMAIN_SNAPSHOT_DELETE_METADATA_ONLY) == 0)
+            removed++;
+        if (snap)
+            virDomainSnapshotFree(snap);
+        for (int j = 0; j < nov; j++) {
+            if (strcmp(ov[j].snap, ov[i].snap) == 0)
+                ov[j].merged = 0;  /* déjà traité */
+        }
+    }
+
+    if (!msg)
+        msg = result_printf("Overlays fusionnés pour la VM %s : %d disque%s, "
+                            "%d snapshot%s retiré%s.", name,
+                            merged, merged > 1 ? "s" : "",
+                            removed, removed > 1 ? "s" : "", removed > 1 ? "s" : "");
+
+out:
+    for (int i = 0; i < ncd; i++) {
+        free(cd[i].target);
+        free(cd[i].base);
+    }
+    free(cd);
+    xml_disks_free(disks, ndisks);
+    xmlFreeDoc(doc);
+    for (int i = 0; i < nov; i++) {
+        free(ov[i].snap);
+        free(ov[i].path);
+    }
+    free(ov);
     virDomainFree(dom);
-    virConnectClose(conn);
+    pool_release(conn);
     return msg;
 }
 
-const char* snapshot_vm(const char *uri, const char *name, const char *snapname) {
-    static char msg[512];
+char* snapshot_commit(const char *uri, const char *name) {
+    API_SCOPE(snapshot_commit);
+    return do_snapshot_commit(uri, name, NULL);
+}
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(msg, sizeof(msg), "Erreur : impossible de se connecter à %s", uri);
-        return msg;
+/* ---------- Sauvegardes incrémentales ----------
+ *
+ * backup_run() sauvegarde en mode push (virDomainBackupBegin) les
+ * disques qcow2 d'une VM démarrée, dans <dir>/<vm>/<checkpoint>/<cible>.qcow2.
+ * Chaque sauvegarde crée un checkpoint libvirt, un bitmap des blocs
+ * modifiés tenu dans l'image ; la suivante, incrémentale, ne copie que
+ * les blocs écrits depuis. Son fichier est ensuite rebasé sur la
+ * sauvegarde précédente : chaque point se lit comme une image complète.
+ * Seul le dernier checkpoint est gardé, un seul bitmap à tenir à jour.
+ *
+ * <dir>/<vm>/chain liste les sauvegardes dans l'ordre, une par ligne
+ * ("checkpoint type date octets"). La rétention garde les `keep`
+ * dernières chaînes (une complète et ses incrémentales). Le répertoire
+ * doit être local à l'hôte libvirt : qemu y écrit, et qemu-img le lit
+ * pour rebaser et restaurer.
+ */
+
+#define BACKUP_POLL_US  200000  /* suivi du job de sauvegarde */
+
+struct backup_entry {
+    char ckpt[64];
+    char kind[16];               /* "full" ou "incremental" */
+    long long created;
+    unsigned long long bytes;    /* octets alloués sur disque */
+};
+
+/* Lit <vmdir>/chain. Retourne le nombre d'entrées (0 sans fichier). */
+static int backup_chain_read(const char *vmdir, struct backup_entry **out) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/chain", vmdir);
+    *out = NULL;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    struct backup_entry *e = NULL;
+    int n = 0, cap = 0;
+    struct backup_entry cur;
+    while (fscanf(f, "%63s %15s %lld %llu", cur.ckpt, cur.kind, &cur.created, &cur.bytes) == 4) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            e = realloc(e, cap * sizeof(*e));
+        }
+        e[n++] = cur;
+    }
+    fclose(f);
+    *out = e;
+    return n;
+}
+
+/* Réécrit <vmdir>/chain d'un bloc (fichier temporaire puis rename). */
+static int backup_chain_write(const char *vmdir, const struct backup_entry *e, int n) {
+    char path[4096], tmp[4096];
+    snprintf(path, sizeof(path), "%s/chain", vmdir);
+    snprintf(tmp, sizeof(tmp), "%s/chain.tmp", vmdir);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    for (int i = 0; i < n; i++)
+        fprintf(f, "%s %s %lld %llu\n", e[i].ckpt, e[i].kind, e[i].created, e[i].bytes);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Supprime un répertoire de sauvegarde et les images qu'il contient. */
+static void backup_remove_dir(const char *path) {
+    DIR *d = opendir(path);
+    if (!d)
+        return;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        if (ent->d_name[0] == '.')
+            continue;
+        char file[4096];
+        snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+        unlink(file);
+    }
+    closedir(d);
+    rmdir(path);
+}
+
+/* Lance `argv` (sortie ignorée), tuable par l'annulation de `job`.
+ * Retourne 0 si la commande réussit. */
+static int run_cmd(struct job *job, char *const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    job_set_pid(job, 0, pid);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    job_set_pid(job, pid, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && !job_cancelled(job) ? 0 : -1;
+}
+
+/* Supprime le checkpoint `name` de `dom` s'il existe encore. */
+static void checkpoint_delete(virDomainPtr dom, const char *name) {
+    virDomainCheckpointPtr cp = virDomainCheckpointLookupByName(dom, name, 0);
+    if (cp) {
+        virDomainCheckpointDelete(cp, 0);
+        virDomainCheckpointFree(cp);
+    }
+}
+
+/* Disques sauvegardables : inscriptibles et au format qcow2 (bitmaps). */
+static int backup_disk_ok(xmlDocPtr doc, const struct xml_disk *d) {
+    if (!d->writable || !d->target)
+        return 0;
+    char *fmt = xml_get(doc, d->node, "driver/@type");
+    int ok = fmt && strcmp(fmt, "qcow2") == 0;
+    free(fmt);
+    return ok;
+}
+
+/*
+ * XML de la sauvegarde (`backup`) et du checkpoint qui l'accompagne
+ * (`checkpoint`) : chaque disque qcow2 inscriptible est copié dans
+ * `ckdir`, depuis le checkpoint `incremental` si fourni. Retourne le
+ * nombre de disques sauvegardés.
+ */
+static int backup_xml(xmlDocPtr dom_doc, const char *ckpt, const char *ckdir,
+                      const char *incremental, char **backup, char **checkpoint) {
+    struct xml_disk *disks = NULL;
+    int ndisks = xml_disks(dom_doc, &disks);
+    xmlDocPtr b = xml_parse("<domainbackup mode='push'><disks/></domainbackup>");
+    xmlDocPtr c = xml_parse("<domaincheckpoint><name/><disks/></domaincheckpoint>");
+    int n = 0;
+    *backup = *checkpoint = NULL;
+
+    if (b && c) {
+        if (incremental) {
+            xmlNodePtr inc = xmlNewChild(xmlDocGetRootElement(b), NULL,
+                                         (const xmlChar *)"incremental", NULL);
+            xmlNodeAddContent(inc, (const xmlChar *)incremental);
+        }
+        xml_set_text(c, NULL, "/domaincheckpoint/name", ckpt);
+        xmlNodePtr blist = xml_first(b, NULL, "/domainbackup/disks");
+        xmlNodePtr clist = xml_first(c, NULL, "/domaincheckpoint/disks");
+
+        for (int i = 0; i < ndisks; i++) {
+            if (!disks[i].target)
+                continue;
+            int ok = backup_disk_ok(dom_doc, &disks[i]);
+            xmlNodePtr bd = xmlNewChild(blist, NULL, (const xmlChar *)"disk", NULL);
+            xmlNodePtr cd = xmlNewChild(clist, NULL, (const xmlChar *)"disk", NULL);
+            xmlSetProp(bd, (const xmlChar *)"name", (const xmlChar *)disks[i].target);
+            xmlSetProp(cd, (const xmlChar *)"name", (const xmlChar *)disks[i].target);
+            xmlSetProp(bd, (const xmlChar *)"backup", (const xmlChar *)(ok ? "yes" : "no"));
+            xmlSetProp(cd, (const xmlChar *)"checkpoint", (const xmlChar *)(ok ? "bitmap" : "no"));
+            if (!ok)
+                continue;
+
+            char file[4096];
+            snprintf(file, sizeof(file), "%s/%s.qcow2", ckdir, disks[i].target);
+            xmlSetProp(bd, (const xmlChar *)"type", (const xmlChar *)"file");
+            xmlSetProp(xml_child(bd, "target"), (const xmlChar *)"file", (const xmlChar *)file);
+            xmlSetProp(xml_child(bd, "driver"), (const xmlChar *)"type", (const xmlChar *)"qcow2");
+            n++;
+        }
+        if (n) {
+            *backup = xml_dump(b);
+            *checkpoint = xml_dump(c);
+        }
+    }
+    xmlFreeDoc(b);
+    xmlFreeDoc(c);
+    xml_disks_free(disks, ndisks);
+    return n;
+}
+
+/* Attend la fin du job de sauvegarde de `dom` ; 0 s'il a réussi. */
+static int backup_wait(virDomainPtr dom) {
+    int type = VIR_DOMAIN_JOB_NONE;
+    for (;;) {
+        virTypedParameterPtr params = NULL;
+        int nparams = 0;
+        if (virDomainGetJobStats(dom, &type, &params, &nparams, 0) < 0)
+            return -1;
+        virTypedParamsFree(params, nparams);
+        if (type == VIR_DOMAIN_JOB_NONE)
+            break;
+        usleep(BACKUP_POLL_US);
+    }
+
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    if (virDomainGetJobStats(dom, &type, &params, &nparams,
+                             VIR_DOMAIN_JOB_STATS_COMPLETED) < 0)
+        return -1;
+    virTypedParamsFree(params, nparams);
+    return type == VIR_DOMAIN_JOB_COMPLETED ? 0 : -1;
+}
+
+/* Octets réellement alloués par les images de `ckdir`. */
+static unsigned long long backup_dir_bytes(const char *ckdir) {
+    unsigned long long bytes = 0;
+    DIR *d = opendir(ckdir);
+    if (!d)
+        return 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        char file[4096];
+        struct stat st;
+        snprintf(file, sizeof(file), "%s/%s", ckdir, ent->d_name);
+        if (ent->d_name[0] != '.' && stat(file, &st) == 0)
+            bytes += (unsigned long long)st.st_blocks * 512;
+    }
+    closedir(d);
+    return bytes;
+}
+
+/*
+ * Rebase les images incrémentales de `ckdir` sur celles de `prevdir`
+ * (métadonnées seules, qemu-img rebase -u) : les blocs non copiés sont
+ * lus dans la sauvegarde précédente.
+ */
+static int backup_rebase(struct job *job, const char *ckdir, const char *prevdir) {
+    DIR *d = opendir(ckdir);
+    if (!d)
+        return -1;
+    int rc = 0;
+    struct dirent *ent;
+    while (rc == 0 && (ent = readdir(d))) {
+        if (ent->d_name[0] == '.')
+            continue;
+        char file[4096], backing[4096];
+        snprintf(file, sizeof(file), "%s/%s", ckdir, ent->d_name);
+        snprintf(backing, sizeof(backing), "%s/%s", prevdir, ent->d_name);
+        char *argv[] = { "qemu-img", "rebase", "-u", "-f", "qcow2", "-F", "qcow2",
+                         "-b", backing, file, NULL };
+        rc = run_cmd(job, argv);
+    }
+    closedir(d);
+    return rc;
+}
+
+/* Vrai si chaque disque sauvegardable a une image dans `prevdir`. */
+static int backup_prev_complete(xmlDocPtr doc, const char *prevdir) {
+    struct xml_disk *disks = NULL;
+    int ndisks = xml_disks(doc, &disks);
+    int ok = ndisks > 0;
+    for (int i = 0; i < ndisks && ok; i++) {
+        if (!backup_disk_ok(doc, &disks[i]))
+            continue;
+        char file[4096];
+        struct stat st;
+        snprintf(file, sizeof(file), "%s/%s.qcow2", prevdir, disks[i].target);
+        ok = stat(file, &st) == 0;
+    }
+    xml_disks_free(disks, ndisks);
+    return ok;
+}
+
+/*
+ * Retire les chaînes les plus anciennes pour n'en garder que `keep`
+ * (0 : tout garder). Retourne le nombre de sauvegardes supprimées.
+ */
+static int backup_retain(const char *vmdir, struct backup_entry *e, int *n, int keep) {
+    int fulls = 0;
+    for (int i = 0; i < *n; i++)
+        fulls += strcmp(e[i].kind, "full") == 0;
+    if (keep <= 0 || fulls <= keep)
+        return 0;
+
+    /* Début de la plus ancienne chaîne conservée */
+    int first = 0, seen = 0;
+    for (int i = 0; i < *n; i++) {
+        if (strcmp(e[i].kind, "full") == 0 && ++seen == fulls - keep + 1) {
+            first = i;
+            break;
+        }
+    }
+    for (int i = 0; i < first; i++) {
+        char ckdir[4096];
+        snprintf(ckdir, sizeof(ckdir), "%s/%s", vmdir, e[i].ckpt);
+        backup_remove_dir(ckdir);
     }
+    memmove(e, e + first, (*n - first) * sizeof(*e));
+    *n -= first;
+    return first;
+}
+
+/*
+ * Sauvegarde `name` dans `dir`. `mode` : "full", "incremental" ou "auto"
+ * (incrémentale si la chaîne et son dernier checkpoint existent, sinon
+ * complète). `keep` chaînes conservées (0 : toutes).
+ */
+static char *do_backup_run(const char *uri, const char *name, const char *dir,
+                           const char *mode, int keep, struct job *job) {
+    if (!mode || !mode[0])
+        mode = "auto";
+    if (strcmp(mode, "full") != 0 && strcmp(mode, "incremental") != 0 &&
+        strcmp(mode, "auto") != 0)
+        return result_error("mode de sauvegarde %s inconnu "
+                            "(full, incremental, auto)", mode);
 
-    virDomainPtr dom = virDomainLookupByName(conn, name);
+    char vmdir[4096];
+    snprintf(vmdir, sizeof(vmdir), "%s/%s", dir, name);
+    if ((mkdir(dir, 0750) < 0 && errno != EEXIST) ||
+        (mkdir(vmdir, 0750) < 0 && errno != EEXIST))
+        return result_error("impossible de créer %s (%s)", vmdir, strerror(errno));
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("impossible de se connecter à %s", uri);
+
+    virDomainPtr dom = lookup_domain(conn, name);
     if (!dom) {
-        snprintf(msg, sizeof(msg), "Erreur : VM %s introuvable", name);
-        virConnectClose(conn);
-        return msg;
+        pool_release(conn);
+        return result_error("VM %s introuvable", name);
     }
 
-    char xml[512];
-    snprintf(xml, sizeof(xml),
-        "<domainsnapshot>"
-        "  <name>%s</name>"
-        "</domainsnapshot>",
-        snapname
-    );
+    char *msg = NULL;
+    char *backup = NULL, *checkpoint = NULL;
+    struct backup_entry *chain = NULL;
+    int nchain = backup_chain_read(vmdir, &chain);
+    xmlDocPtr doc = domain_doc(conn, dom, 0);
 
-    if (virDomainSnapshotCreateXML(dom, xml, 0) < 0) {
-        const virError *e = virGetLastError();
-        snprintf(msg, sizeof(msg), "Erreur : snapshot impossible (%s)", e ? e->message : "inconnu");
-        virDomainFree(dom);
-        virConnectClose(conn);
-        return msg;
+    if (virDomainIsActive(dom) != 1) {
+        msg = result_error("la VM %s doit être démarrée pour être sauvegardée", name);
+        goto out;
+    }
+    if (!doc) {
+        msg = result_error("XML de la VM %s illisible", name);
+        goto out;
+    }
+
+    /* Incrémentale possible : dernier checkpoint encore connu de libvirt
+     * et image précédente présente pour chaque disque */
+    const char *prev = nchain ? chain[nchain - 1].ckpt : NULL;
+    char prevdir[4096] = "";
+    if (prev)
+        snprintf(prevdir, sizeof(prevdir), "%s/%s", vmdir, prev);
+    virDomainCheckpointPtr cp = prev ? virDomainCheckpointLookupByName(dom, prev, 0) : NULL;
+    int incremental = cp && backup_prev_complete(doc, prevdir);
+    if (cp)
+        virDomainCheckpointFree(cp);
+    if (strcmp(mode, "full") == 0)
+        incremental = 0;
+    else if (strcmp(mode, "incremental") == 0 && !incremental) {
+        msg = result_error("pas de sauvegarde précédente utilisable pour %s", name);
+        goto out;
+    }
+
+    struct backup_entry e = {0};
+    e.created = time(NULL);
+    struct tm tm;
+    gmtime_r(&(time_t){ e.created }, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "bk-%Y%m%d-%H%M%S", &tm);
+    snprintf(e.kind, sizeof(e.kind), "%s", incremental ? "incremental" : "full");
+
+    /* Deux sauvegardes dans la même seconde : suffixe -2, -3… */
+    char ckdir[4096];
+    int rc = -1;
+    for (int seq = 1; rc < 0 && seq <= 100; seq++) {
+        if (seq == 1)
+            snprintf(e.ckpt, sizeof(e.ckpt), "%s", stamp);
+        else
+            snprintf(e.ckpt, sizeof(e.ckpt), "%s-%d", stamp, seq);
+        snprintf(ckdir, sizeof(ckdir), "%s/%s", vmdir, e.ckpt);
+        rc = mkdir(ckdir, 0750);
+        if (rc < 0 && errno != EEXIST)
+            break;
+    }
+    if (rc < 0) {
+        msg = result_error("impossible de créer %s (%s)", ckdir, strerror(errno));
+        goto out;
+    }
+
+    int ndisks = backup_xml(doc, e.ckpt, ckdir, incremental ? prev : NULL,
+                            &backup, &checkpoint);
+    if (ndisks == 0) {
+        msg = result_error("aucun disque qcow2 à sauvegarder pour %s", name);
+        rmdir(ckdir);
+        goto out;
+    }
+
+    unsigned long long t0 = mono_ns();
+    job_set_domain(job, dom);
+    rc = virDomainBackupBegin(dom, backup, checkpoint, 0);
+    if (rc == 0)
+        rc = backup_wait(dom);
+    job_set_domain(job, NULL);
+    if (rc == 0 && incremental)
+        rc = backup_rebase(job, ckdir, prevdir);
+
+    if (rc < 0) {
+        const virError *err = virGetLastError();
+        msg = result_error("sauvegarde de %s impossible (%s)", name,
+                           job_cancelled(job) ? "annulée" : err ? err->message : "inconnu");
+        checkpoint_delete(dom, e.ckpt);
+        backup_remove_dir(ckdir);
+        goto out;
+    }
+
+    /* Seul le nouveau checkpoint sert à la prochaine incrémentale */
+    if (prev)
+        checkpoint_delete(dom, prev);
+
+    e.bytes = backup_dir_bytes(ckdir);
+    chain = realloc(chain, (nchain + 1) * sizeof(*chain));
+    chain[nchain++] = e;
+    int removed = backup_retain(vmdir, chain, &nchain, keep);
+    if (backup_chain_write(vmdir, chain, nchain) < 0) {
+        msg = result_error("impossible d'écrire %s/chain", vmdir);
+        goto out;
     }
 
-    snprintf(msg, sizeof(msg), "Snapshot %s créé pour la VM %s.", snapname, name);
+    char retained[64] = "";
+    if (removed)
+        snprintf(retained, sizeof(retained), ", %d ancienne%s sauvegarde%s retirée%s",
+                 removed, removed > 1 ? "s" : "", removed > 1 ? "s" : "",
+                 removed > 1 ? "s" : "");
+    msg = result_printf("Sauvegarde %s %s de %s : %d disque%s, %llu MiB écrits en %llu s%s.",
+                        incremental ? "incrémentale" : "complète", e.ckpt, name,
+                        ndisks, ndisks > 1 ? "s" : "", e.bytes >> 20,
+                        (mono_ns() - t0) / 1000000000ULL, retained);
 
+out:
+    free(backup);
+    free(checkpoint);
+    free(chain);
+    xmlFreeDoc(doc);
     virDomainFree(dom);
-    virConnectClose(conn);
+    pool_release(conn);
     return msg;
 }
 
-const char* restart_vm(const char *uri, const char *name) {
-    static char msg[512];
+char* backup_run(const char *uri, const char *name, const char *dir,
+                 const char *mode, int keep) {
+    API_SCOPE(backup_run);
+    return do_backup_run(uri, name, dir, mode, keep, NULL);
+}
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(msg, sizeof(msg), "Erreur : impossible de se connecter à %s", uri);
-        return msg;
+/*
+ * Restaure `name` (éteinte) à la sauvegarde `checkpoint` : chaque disque
+ * sauvegardé est reconstruit depuis la chaîne (qemu-img convert, qui
+ * aplatit les incrémentales en une image qcow2) à côté de l'original, qu'il remplace
+ * ensuite d'un rename.
+ */
+static char *do_backup_restore(const char *uri, const char *name, const char *dir,
+                               const char *checkpoint, struct job *job) {
+    char vmdir[4096];
+    snprintf(vmdir, sizeof(vmdir), "%s/%s", dir, name);
+    struct backup_entry *chain = NULL;
+    int nchain = backup_chain_read(vmdir, &chain);
+    int found = 0;
+    for (int i = 0; i < nchain && !found; i++)
+        found = strcmp(chain[i].ckpt, checkpoint) == 0;
+    free(chain);
+    if (!found)
+        return result_error("sauvegarde %s introuvable pour %s", checkpoint, name);
+
+    virConnectPtr conn = pool_acquire(uri);
+    if (!conn)
+        return result_error("impossible de se connecter à %s", uri);
+
+    virDomainPtr dom = lookup_domain(conn, name);
+    if (!dom) {
+        pool_release(conn);
+        return result_error("VM %s introuvable", name);
+    }
+    if (virDomainIsActive(dom) != 0) {
+        virDomainFree(dom);
+        pool_release(conn);
+        return result_error("la VM %s doit être éteinte pour être restaurée", name);
+    }
+
+    char *msg = NULL;
+    xmlDocPtr doc = domain_doc(conn, dom, VIR_DOMAIN_XML_INACTIVE);
+    struct xml_disk *disks = NULL;
+    int ndisks = doc ? xml_disks(doc, &disks) : -1;
+    int restored = 0, total = 0;
+
+    for (int i = 0; i < ndisks; i++)
+        total += backup_disk_ok(doc, &disks[i]);
+
+    for (int i = 0; i < ndisks && !msg; i++) {
+        if (!backup_disk_ok(doc, &disks[i]))
+            continue;
+        char src[4096], tmp[4096];
+        struct stat st;
+        snprintf(src, sizeof(src), "%s/%s/%s.qcow2", vmdir, checkpoint, disks[i].target);
+        snprintf(tmp, sizeof(tmp), "%s.restore", disks[i].path);
+        if (stat(src, &st) < 0) {
+            msg = result_error("pas d'image de %s dans la sauvegarde %s",
+                               disks[i].target, checkpoint);
+            break;
+        }
+        char *argv[] = { "qemu-img", "convert", "-O", "qcow2", src, tmp, NULL };
+        if (run_cmd(job, argv) < 0 || rename(tmp, disks[i].path) < 0) {
+            unlink(tmp);
+            msg = result_error("restauration de %s %s", disks[i].target,
+                               job_cancelled(job) ? "annulée" : "impossible");
+            break;
+        }
+        restored++;
+        job_progress(job, restored, total);
     }
 
-    virDomainPtr dom = virDomainLookupByName(conn, name);
-    if (!dom) {
-        snprintf(msg, sizeof(msg), "Erreur : VM %s introuvable", name);
-        virConnectClose(conn);
-        return msg;
-    }
+    if (ndisks < 0)
+        msg = result_error("XML de la VM %s illisible", name);
+    if (restored) {
+        /* Les disques restaurés n'ont plus d'overlay ni de bitmap : les
+         * checkpoints ne décrivent plus rien, la prochaine sauvegarde
+         * sera complète */
+        virDomainCheckpointPtr *cps = NULL;
+        int ncps = virDomainListAllCheckpoints(dom, &cps, 0);
+        for (int i = 0; i < ncps; i++) {
+            virDomainCheckpointDelete(cps[i], VIR_DOMAIN_CHECKPOINT_DELETE_METADATA_ONLY);
+            virDomainCheckpointFree(cps[i]);
+        }
+        free(cps);
 
-    if (virDomainReboot(dom, 0) < 0) {
-        const virError *e = virGetLastError();
-        snprintf(msg, sizeof(msg), "Erreur : échec reboot %s (%s)", name, e ? e->message : "unknown");
-        virDomainFree(dom);
-        virConnectClose(conn);
-        return msg;
+        for (int i = 0; i < ndisks; i++) {
+            if (!backup_disk_ok(doc, &disks[i]))
+                continue;
+            virStorageVolPtr vol = virStorageVolLookupByPath(conn, disks[i].path);
+            virStoragePoolPtr pool = vol ? virStoragePoolLookupByVolume(vol) : NULL;
+            if (pool) {
+                virStoragePoolRefresh(pool, 0);
+                virStoragePoolFree(pool);
+            }
+            if (vol)
+                virStorageVolFree(vol);
+        }
+        cache_vol_changed(uri);
+        domain_forget(conn, dom);
     }
+    if (!msg)
+        msg = result_printf("VM %s restaurée à la sauvegarde %s (%d disque%s).",
+                            name, checkpoint, restored, restored > 1 ? "s" : "");
 
-    snprintf(msg, sizeof(msg), "VM %s redémarrée.", name);
-
+    xml_disks_free(disks, ndisks);
+    xmlFreeDoc(doc);
     virDomainFree(dom);
-    virConnectClose(conn);
+    pool_release(conn);
     return msg;
 }
 
-const char* list_vms(const char *uri) {
-    static char buffer[65536];
-    buffer[0] = '\0';
+char* backup_restore(const char *uri, const char *name, const char *dir,
+                     const char *checkpoint) {
+    API_SCOPE(backup_restore);
+    return do_backup_restore(uri, name, dir, checkpoint, NULL);
+}
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(buffer, sizeof(buffer), "{\"error\":\"Failed to connect to %s\"}", uri);
-        return buffer;
-    }
+/* Chaîne des sauvegardes de `name` dans `dir`, de la plus ancienne à la
+ * plus récente : {"backups": [{"checkpoint", "kind", "created", "bytes"}]}. */
+char* backup_list(const char *dir, const char *name) {
+    API_SCOPE(backup_list);
+    char vmdir[4096];
+    snprintf(vmdir, sizeof(vmdir), "%s/%s", dir, name);
+    struct backup_entry *chain = NULL;
+    int n = backup_chain_read(vmdir, &chain);
 
-    strcat(buffer, "{\"vms\":[");
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "backups");
+    jw_array_begin(&w);
+    for (int i = 0; i < n; i++) {
+        jw_object_begin(&w);
+        jw_kstr(&w, "checkpoint", chain[i].ckpt);
+        jw_kstr(&w, "kind", chain[i].kind);
+        jw_kint(&w, "created", chain[i].created);
+        jw_kuint(&w, "bytes", chain[i].bytes);
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    jw_object_end(&w);
+    free(chain);
+    return jw_finish(&w);
+}
 
-    int first = 1;
+/* ---------- Placement multi-hôtes ----------
+ *
+ * sched_place() choisit, parmi une liste d'URI, l'hôte d'une nouvelle
+ * VM. Chaque hôte a un modèle de capacité gardé en mémoire : mémoire
+ * libre (totale et par nœud NUMA), vCPU et mémoire engagés par les
+ * domaines actifs, place libre du pool "default" (celui de create_vm).
+ * Le modèle est rafraîchi par morceaux :
+ *  - la mémoire libre à chaque placement, depuis la télémétrie si elle
+ *    échantillonne déjà cet hôte, sinon par virNodeGetFreeMemory ;
+ *  - les engagements seulement si la génération du cache d'état a
+ *    bougé (et au moins toutes les SCHED_RECOUNT_S secondes) ;
+ *  - le pool seulement si sa génération de volumes a bougé ;
+ *  - la topologie (CPU, nœuds NUMA) une seule fois.
+ * Un placement réserve ses ressources sur l'hôte choisi jusqu'à ce que
+ * la VM apparaisse dans un recomptage : deux placements rapprochés ne
+ * visent pas la même place.
+ *
+ * Les politiques sont des fonctions de score, le plus bas gagne :
+ * "binpack" remplit d'abord les hôtes les plus chargés (les autres
+ * restent libres pour les grosses VMs), "spread" répartit la charge.
+ */
 
-    int numDomains = virConnectNumOfDomains(conn);
-    if (numDomains > 0) {
-        int *ids = malloc(sizeof(int) * numDomains);
-        virConnectListDomains(conn, ids, numDomains);
+#define SCHED_MAX_HOSTS     16
+#define SCHED_MAX_CELLS      8
+#define SCHED_MAX_RESERVED  32
+#define SCHED_VCPU_RATIO     4      /* vCPU engagés par CPU physique */
+#define SCHED_MEM_HEADROOM  (512ULL << 20)  /* laissés à l'hôte */
+#define SCHED_RECOUNT_S     60      /* recomptage des domaines au plus tard */
+#define SCHED_RESERVE_S     300     /* réservation jamais confirmée : oubliée */
 
-        for (int i = 0; i < numDomains; i++) {
-            virDomainPtr dom = virDomainLookupByID(conn, ids[i]);
-            if (!dom) continue;
+struct sched_reservation {
+    char name[256];
+    unsigned long long mem;
+    unsigned long long disk;
+    int vcpus;
+    time_t at;
+};
 
-            virDomainInfo info;
-            virDomainGetInfo(dom, &info);
+struct sched_host {
+    char uri[256];
+    pthread_mutex_t lock;
+    int online;
+    char error[256];
+    int topology;                  /* CPU et nœuds NUMA lus */
+    unsigned int cpus;             /* CPU physiques */
+    int max_vcpus;                 /* par domaine, 0 : inconnu */
+    unsigned long long mem_total;  /* octets */
+    unsigned long long mem_free;
+    int ncells;
+    unsigned long long cell_free[SCHED_MAX_CELLS];
+    int pool_known;
+    unsigned long long pool_free;
+    unsigned long long mem_committed;  /* mémoire max des domaines actifs */
+    int vcpus_committed;
+    int ndoms;
+    int counted;                   /* engagements connus */
+    unsigned long long dom_gen;
+    unsigned long long vol_gen;
+    time_t counted_at;
+    unsigned long recounts;        /* recomptages effectués */
+    struct sched_reservation res[SCHED_MAX_RESERVED];
+    int nres;
+};
 
-            const char *state = "unknown";
-            switch (info.state) {
-                case VIR_DOMAIN_RUNNING: state = "running"; break;
-                case VIR_DOMAIN_PAUSED:  state = "paused";  break;
-                case VIR_DOMAIN_SHUTOFF: state = "shutoff"; break;
-            }
+struct sched_req {
+    const char *name;
+    unsigned long long mem;
+    unsigned long long disk;
+    int vcpus;
+    const char *iso;               /* volume à trouver sur l'hôte, NULL : aucun */
+};
 
-            if (!first) strcat(buffer, ",");
-            first = 0;
+static struct sched_host sched_hosts_tab[SCHED_MAX_HOSTS];
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
 
-            char tmp[256];
-            snprintf(tmp, sizeof(tmp),
-                     "{\"name\":\"%s\",\"state\":\"%s\"}",
-                     virDomainGetName(dom), state);
+/* Entrée de `uri`, créée au besoin ; NULL si la table est pleine. */
+static struct sched_host *sched_host_get(const char *uri) {
+    struct sched_host *h = NULL;
+    if (strlen(uri) >= sizeof(sched_hosts_tab[0].uri))
+        return NULL;
 
-            strcat(buffer, tmp);
-            virDomainFree(dom);
+    pthread_mutex_lock(&sched_lock);
+    for (int i = 0; i < SCHED_MAX_HOSTS && !h; i++) {
+        if (strcmp(sched_hosts_tab[i].uri, uri) == 0)
+            h = &sched_hosts_tab[i];
+    }
+    for (int i = 0; i < SCHED_MAX_HOSTS && !h; i++) {
+        if (!sched_hosts_tab[i].uri[0]) {
+            h = &sched_hosts_tab[i];
+            pthread_mutex_init(&h->lock, NULL);
+            snprintf(h->uri, sizeof(h->uri), "%s", uri);
         }
-        free(ids);
     }
+    pthread_mutex_unlock(&sched_lock);
+    return h;
+}
 
-    int numDefined = virConnectNumOfDefinedDomains(conn);
-    if (numDefined > 0) {
-        char **names = malloc(sizeof(char*) * numDefined);
-        virConnectListDefinedDomains(conn, names, numDefined);
+/* Mémoire libre de `uri` d'après la télémétrie, si un échantillon récent
+ * existe (deux périodes au plus). */
+static int sched_telem_free(const char *uri, unsigned long long *free_bytes) {
+    int ret = -1;
+    pthread_mutex_lock(&telem_lock);
+    struct telemetry *t = telem_find(uri, 0);
+    if (t && t->running && t->ticks) {
+        int s = t->ticks % TELEM_RING;
+        unsigned long long age_ms = (mono_ns() - t->t_ns[s]) / 1000000;
+        if (age_ms <= 2ULL * t->interval_ms && t->host[TH_MEM_FREE_KIB][s]) {
+            *free_bytes = (t->host[TH_MEM_FREE_KIB][s] + t->host[TH_MEM_CACHE_KIB][s]) << 10;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&telem_lock);
+    return ret;
+}
 
-        for (int i = 0; i < numDefined; i++) {
-            if (!first) strcat(buffer, ",");
-            first = 0;
+static void sched_unreserve(struct sched_host *h, int i) {
+    h->res[i] = h->res[--h->nres];
+}
 
-            char tmp[256];
-            snprintf(tmp, sizeof(tmp),
-                     "{\"name\":\"%s\",\"state\":\"shutoff\"}", names[i]);
+/* Somme les vCPU et la mémoire des domaines actifs ; confirme les
+ * réservations des VMs désormais présentes. */
+static int sched_recount(struct sched_host *h, virConnectPtr conn) {
+    virDomainPtr *doms = NULL;
+    int n = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+    if (n < 0)
+        return -1;
 
-            strcat(buffer, tmp);
-            free(names[i]);
+    unsigned long long mem = 0;
+    int vcpus = 0;
+    for (int i = 0; i < n; i++) {
+        virDomainInfo info;
+        if (virDomainGetInfo(doms[i], &info) == 0) {
+            mem += (unsigned long long)info.maxMem << 10;
+            vcpus += info.nrVirtCpu;
         }
-        free(names);
+        const char *name = virDomainGetName(doms[i]);
+        for (int r = 0; name && r < h->nres; r++) {
+            if (strcmp(h->res[r].name, name) == 0)
+                sched_unreserve(h, r--);
+        }
+        virDomainFree(doms[i]);
     }
+    free(doms);
 
-    strcat(buffer, "]}");
-    virConnectClose(conn);
-    return buffer;
+    h->mem_committed = mem;
+    h->vcpus_committed = vcpus;
+    h->ndoms = n;
+    h->counted = 1;
+    h->counted_at = time(NULL);
+    h->recounts++;
+    return 0;
 }
 
-const char* create_vm(const char *uri, const char *name,
-                      const char *ram, const char *cpu,
-                      const char *disk, const char *iso, const char *osinfo)
-{
-    static char msg[1024];
-
-    int ram_mb   = atoi(ram);
-    int vcpu     = atoi(cpu);
-    int size_gb  = atoi(disk);
-
-    /* Connexion libvirt */
-    virConnectPtr conn = virConnectOpen(uri);
+/* Rafraîchit le modèle de `h` (verrou de l'hôte tenu). */
+static void sched_refresh(struct sched_host *h) {
+    virConnectPtr conn = pool_acquire(h->uri);
     if (!conn) {
-        snprintf(msg, sizeof(msg),
-                 "Erreur : impossible de se connecter à %s", uri);
-        return msg;
+        h->online = 0;
+        snprintf(h->error, sizeof(h->error), "connexion impossible");
+        return;
     }
+    h->online = 1;
+    h->error[0] = '\0';
 
-    /* ---------- Créer le disque QCOW2 via libvirt ---------- */
-    virStoragePoolPtr pool = virStoragePoolLookupByName(conn, "default");
-    if (!pool) {
-        snprintf(msg, sizeof(msg), "Erreur : pool 'default' introuvable");
-        virConnectClose(conn);
-        return msg;
+    if (!h->topology) {
+        virNodeInfo node;
+        if (virNodeGetInfo(conn, &node) == 0) {
+            h->cpus = node.cpus;
+            h->mem_total = (unsigned long long)node.memory << 10;
+            int max = virConnectGetMaxVcpus(conn, NULL);
+            h->max_vcpus = max > 0 ? max : 0;
+            h->topology = 1;
+        }
     }
 
-    char vol_xml[512];
-    snprintf(vol_xml, sizeof(vol_xml),
-        "<volume>"
-        "  <name>%s.qcow2</name>"
-        "  <capacity unit='G'>%d</capacity>"
-        "  <allocation unit='G'>0</allocation>"
-        "  <target>"
-        "    <format type='qcow2'/>"
-        "  </target>"
-        "</volume>",
-        name, size_gb);
-
-    virStorageVolPtr vol = virStorageVolCreateXML(pool, vol_xml, 0);
-    if (!vol) {
-        snprintf(msg, sizeof(msg), "Erreur : création du volume QCOW2");
-        virStoragePoolFree(pool);
-        virConnectClose(conn);
-        return msg;
+    int ncells = virNodeGetCellsFreeMemory(conn, h->cell_free, 0, SCHED_MAX_CELLS);
+    h->ncells = ncells > 0 ? ncells : 0;
+    if (sched_telem_free(h->uri, &h->mem_free) < 0)
+        h->mem_free = virNodeGetFreeMemory(conn);
+
+    /* Engagements : le cache d'état dit si un domaine a changé */
+    unsigned long long gen;
+    int have_gen = cache_generation(h->uri, &gen) == 0;
+    if (!h->counted || !have_gen || gen != h->dom_gen ||
+        time(NULL) - h->counted_at >= SCHED_RECOUNT_S) {
+        if (sched_recount(h, conn) < 0) {
+            const virError *e = virGetLastError();
+            snprintf(h->error, sizeof(h->error), "%s", e ? e->message : "listage impossible");
+        }
+        if (have_gen)
+            h->dom_gen = gen;
     }
 
-    char *disk_path = virStorageVolGetPath(vol);
+    /* Pool : relu seulement sur événement (ou sans événements de pool) */
+    int have_vol = cache_vol_generation(h->uri, &gen) == 0;
+    if (!h->pool_known || !have_vol || gen != h->vol_gen) {
+        virStoragePoolPtr pool = virStoragePoolLookupByName(conn, "default");
+        virStoragePoolInfo info;
+        h->pool_known = pool && virStoragePoolGetInfo(pool, &info) == 0;
+        h->pool_free = h->pool_known ? info.available : 0;
+        if (pool)
+            virStoragePoolFree(pool);
+        if (have_vol)
+            h->vol_gen = gen;
+    }
 
-    /* ---------- Générer le XML de la VM ---------- */
+    time_t now = time(NULL);
+    for (int i = 0; i < h->nres; i++) {
+        if (now - h->res[i].at >= SCHED_RESERVE_S)
+            sched_unreserve(h, i--);
+    }
+    pool_release(conn);
+}
 
-    char xml[4096];
-    snprintf(xml, sizeof(xml),
-        "<domain type='kvm'>"
-        "  <name>%s</name>"
-        "  <memory unit='MiB'>%d</memory>"
-        "  <currentMemory unit='MiB'>%d</currentMemory>"
-        "  <vcpu>%d</vcpu>"
-        "  <os>"
-        "    <type arch='x86_64'>hvm</type>"
-        "    <boot dev='cdrom'/>"
-        "  </os>"
-        "  <devices>"
-        "    <disk type='file' device='disk'>"
-        "      <driver name='qemu' type='qcow2'/>"
-        "      <source file='%s'/>"
-        "      <target dev='vda' bus='virtio'/>"
-        "    </disk>"
-        "    <disk type='file' device='cdrom'>"
-        "      <source file='%s'/>"
-        "      <target dev='hda' bus='ide'/>"
-        "    </disk>"
-        "    <graphics type='vnc' port='-1' listen='0.0.0.0'/>"
-        "    <interface type='bridge'>"
-        "      <source bridge='br0'/>"
-        "      <model type='virtio'/>"
-        "    </interface>"
-        "  </devices>"
-        "</domain>",
-        name, ram_mb, ram_mb, vcpu, disk_path, iso
-    );
+static void sched_refresh_run(void *ctx, int i) {
+    struct sched_host *h = ((struct sched_host **)ctx)[i];
+    pthread_mutex_lock(&h->lock);
+    sched_refresh(h);
+    pthread_mutex_unlock(&h->lock);
+}
 
-    /* ---------- Définir la VM ---------- */
+/* Présence de l'ISO de la requête sur chaque hôte, vérifiée en parallèle
+ * hors des verrous d'hôte : le chemin vient de la liste d'un autre hôte
+ * et create_vm l'utilise tel quel. */
+struct sched_iso_check {
+    struct sched_host **hosts;
+    const char *iso;
+    int found[SCHED_MAX_HOSTS];
+};
 
-    virDomainPtr dom = virDomainDefineXML(conn, xml);
-    if (!dom) {
-        snprintf(msg, sizeof(msg), "Erreur : defineXML a échoué");
+static void sched_iso_run(void *ctx, int i) {
+    struct sched_iso_check *chk = ctx;
+    virConnectPtr conn = pool_acquire(chk->hosts[i]->uri);
+    if (!conn)
+        return;
+    virStorageVolPtr vol = virStorageVolLookupByPath(conn, chk->iso);
+    chk->found[i] = vol != NULL;
+    if (vol)
         virStorageVolFree(vol);
-        virStoragePoolFree(pool);
-        virConnectClose(conn);
-        return msg;
-    }
-
-    /* ---------- Démarrer la VM ---------- */
+    pool_release(conn);
+}
 
-    if (virDomainCreate(dom) < 0) {
-        snprintf(msg, sizeof(msg), "Erreur : impossible de démarrer la VM");
-        virDomainUndefine(dom);
-        virStorageVolDelete(vol, 0);
-        virStorageVolFree(vol);
-        virStoragePoolFree(pool);
-        virConnectClose(conn);
-        return msg;
+/*
+ * Mémoire disponible pour une nouvelle VM. La mémoire libre ne compte
+ * pas ce que les invités n'ont pas encore touché, la mémoire engagée
+ * ignore l'hôte lui-même : on garde la plus petite des deux.
+ */
+static unsigned long long sched_mem_available(const struct sched_host *h) {
+    unsigned long long avail = h->mem_free;
+    if (h->counted && h->mem_total) {
+        unsigned long long uncommitted =
+            h->mem_total > h->mem_committed ? h->mem_total - h->mem_committed : 0;
+        if (uncommitted < avail)
+            avail = uncommitted;
     }
-
-    snprintf(msg, sizeof(msg),
-             "VM %s créée avec succès (RAM=%dMB, CPU=%d, DISK=%dG)",
-             name, ram_mb, vcpu, size_gb);
-
-    /* Libération */
-    virDomainFree(dom);
-    virStorageVolFree(vol);
-    virStoragePoolFree(pool);
-    virConnectClose(conn);
-
-    return msg;
+    for (int i = 0; i < h->nres; i++)
+        avail = avail > h->res[i].mem ? avail - h->res[i].mem : 0;
+    return avail > SCHED_MEM_HEADROOM ? avail - SCHED_MEM_HEADROOM : 0;
 }
 
+static int sched_vcpus_reserved(const struct sched_host *h) {
+    int n = h->vcpus_committed;
+    for (int i = 0; i < h->nres; i++)
+        n += h->res[i].vcpus;
+    return n;
+}
 
-const char* start_vm(const char *uri, const char *name) {
-    static char msg[512];
-    virConnectPtr conn = virConnectOpen(uri);
-    virDomainPtr dom = virDomainLookupByName(conn, name);
+static unsigned long long sched_pool_available(const struct sched_host *h) {
+    unsigned long long avail = h->pool_free;
+    for (int i = 0; i < h->nres; i++)
+        avail = avail > h->res[i].disk ? avail - h->res[i].disk : 0;
+    return avail;
+}
 
-    virDomainCreate(dom);
-    snprintf(msg, sizeof(msg), "VM %s démarrée.", name);
-    virDomainFree(dom);
-    virConnectClose(conn);
-    return msg;
+/* Vrai si la VM tient dans un seul nœud NUMA (ou si l'hôte n'en a qu'un). */
+static int sched_numa_fit(const struct sched_host *h, const struct sched_req *r) {
+    if (h->ncells <= 1)
+        return 1;
+    for (int i = 0; i < h->ncells; i++) {
+        if (h->cell_free[i] >= r->mem)
+            return 1;
+    }
+    return 0;
 }
 
-const char* stop_vm(const char *uri, const char *name) {
-    static char msg[512];
-    virConnectPtr conn = virConnectOpen(uri);
-    virDomainPtr dom = virDomainLookupByName(conn, name);
+/* Pourquoi `r` ne tient pas sur `h`, NULL s'il tient. */
+static const char *sched_reject(const struct sched_host *h, const struct sched_req *r) {
+    if (!h->online)
+        return "hôte injoignable";
+    if (!h->topology)
+        return "topologie inconnue";
+    if (sched_mem_available(h) < r->mem)
+        return "mémoire insuffisante";
+    if (h->max_vcpus && r->vcpus > h->max_vcpus)
+        return "trop de vCPU pour cet hyperviseur";
+    if (sched_vcpus_reserved(h) + r->vcpus > (int)h->cpus * SCHED_VCPU_RATIO)
+        return "vCPU déjà trop engagés";
+    if (!h->pool_known)
+        return "pool default introuvable";
+    if (sched_pool_available(h) < r->disk)
+        return "pool default trop plein";
+    return NULL;
+}
 
-    virDomainDestroy(dom);
-    snprintf(msg, sizeof(msg), "VM %s arrêtée.", name);
-    virDomainFree(dom);
-    virConnectClose(conn);
-    return msg;
+/* Part de l'hôte restant libre après placement (0 : plein, 1 : vide),
+ * moyenne de la mémoire et des vCPU. */
+static double sched_free_share(const struct sched_host *h, const struct sched_req *r) {
+    double mem = h->mem_total ?
+        ((double)sched_mem_available(h) - (double)r->mem) / h->mem_total : 0;
+    double cap = (double)h->cpus * SCHED_VCPU_RATIO;
+    double cpu = cap ? (cap - sched_vcpus_reserved(h) - r->vcpus) / cap : 0;
+    return (mem + cpu) / 2;
 }
 
-const char* pause_vm(const char *uri, const char *name) {
-    static char msg[512];
-    virConnectPtr conn = virConnectOpen(uri);
-    virDomainPtr dom = virDomainLookupByName(conn, name);
+static double sched_binpack(const struct sched_host *h, const struct sched_req *r) {
+    return sched_free_share(h, r);
+}
 
-    virDomainSuspend(dom);
-    snprintf(msg, sizeof(msg), "VM %s mise en pause.", name);
-    virDomainFree(dom);
-    virConnectClose(conn);
-    return msg;
+static double sched_spread(const struct sched_host *h, const struct sched_req *r) {
+    return -sched_free_share(h, r);
 }
 
-const char* resume_vm(const char *uri, const char *name) {
-    static char msg[512];
-    virConnectPtr conn = virConnectOpen(uri);
-    virDomainPtr dom = virDomainLookupByName(conn, name);
+static const struct {
+    const char *name;
+    double (*score)(const struct sched_host *h, const struct sched_req *r);
+} sched_policies[] = {
+    { "binpack", sched_binpack },
+    { "spread",  sched_spread  },
+};
 
-    virDomainResume(dom);
-    snprintf(msg, sizeof(msg), "VM %s reprise.", name);
-    virDomainFree(dom);
-    virConnectClose(conn);
-    return msg;
+#define SCHED_NPOLICIES (int)(sizeof(sched_policies) / sizeof(sched_policies[0]))
+
+/* Hôtes de `uris` (un par ligne), rafraîchis en parallèle. */
+static int sched_load(const char *uris, struct sched_host **hosts) {
+    char *list = strdup(uris ? uris : "");
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = list ? strtok_r(list, "\n", &save) : NULL; tok && n < SCHED_MAX_HOSTS;
+         tok = strtok_r(NULL, "\n", &save)) {
+        struct sched_host *h = tok[0] ? sched_host_get(tok) : NULL;
+        int dup = 0;
+        for (int i = 0; h && i < n; i++)
+            dup |= hosts[i] == h;
+        if (h && !dup)
+            hosts[n++] = h;
+    }
+    free(list);
+    parallel_for(n, sched_refresh_run, hosts);
+    return n;
 }
 
+static void sched_host_json(struct jw *w, const struct sched_host *h) {
+    jw_kstr(w, "uri", h->uri);
+    jw_kbool(w, "online", h->online);
+    jw_kstr(w, "error", h->error[0] ? h->error : NULL);
+    jw_kuint(w, "cpus", h->cpus);
+    jw_kint(w, "max_vcpus", h->max_vcpus);
+    jw_kint(w, "vcpus_committed", sched_vcpus_reserved(h));
+    jw_kint(w, "vcpu_capacity", (long long)h->cpus * SCHED_VCPU_RATIO);
+    jw_kuint(w, "mem_total", h->mem_total);
+    jw_kuint(w, "mem_free", h->mem_free);
+    jw_kuint(w, "mem_available", sched_mem_available(h));
+    jw_kuint(w, "pool_available", sched_pool_available(h));
+    jw_key(w, "numa_free");
+    jw_array_begin(w);
+    for (int i = 0; i < h->ncells; i++)
+        jw_uint(w, h->cell_free[i]);
+    jw_array_end(w);
+    jw_kint(w, "domains", h->ndoms);
+    jw_kint(w, "reserved", h->nres);
+    jw_kuint(w, "recounts", h->recounts);
+}
 
-const char* destroy_vm(const char *uri, const char *name) {
-    static char msg[512];
+/* Modèle de capacité des hôtes de `uris` : {"hosts":[…]}. */
+char* sched_hosts(const char *uris) {
+    API_SCOPE(sched_hosts);
+    struct sched_host *hosts[SCHED_MAX_HOSTS];
+    int n = sched_load(uris, hosts);
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(msg, sizeof(msg), "Erreur: connexion libvirt");
-        return msg;
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "hosts");
+    jw_array_begin(&w);
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&hosts[i]->lock);
+        jw_object_begin(&w);
+        sched_host_json(&w, hosts[i]);
+        jw_object_end(&w);
+        pthread_mutex_unlock(&hosts[i]->lock);
     }
+    jw_array_end(&w);
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
 
-    virDomainPtr dom = virDomainLookupByName(conn, name);
-    if (!dom) {
-        snprintf(msg, sizeof(msg), "Erreur: VM introuvable");
-        virConnectClose(conn);
-        return msg;
+/*
+ * Choisit l'hôte de la VM `name` (`ram_mb` Mio, `vcpus`, `disk_gb` Gio)
+ * parmi `uris` selon `policy` ("binpack" par défaut) et y réserve ses
+ * ressources. Si `iso` est donné, seuls les hôtes qui ont ce volume
+ * conviennent. {"uri","policy","hosts":[{…,"fits","reason","numa_fit","score"}]} ;
+ * si aucun ne convient, le document commence par "error" et "uri" est null.
+ */
+char* sched_place(const char *uris, const char *policy, const char *name,
+                  int ram_mb, int vcpus, int disk_gb, const char *iso) {
+    API_SCOPE(sched_place);
+    int p = 0;
+    if (policy && policy[0]) {
+        for (p = 0; p < SCHED_NPOLICIES; p++)
+            if (strcmp(sched_policies[p].name, policy) == 0)
+                break;
+        if (p == SCHED_NPOLICIES)
+            return json_error("Politique de placement inconnue : %s (binpack, spread)", policy);
     }
+    if (ram_mb <= 0 || vcpus <= 0 || disk_gb < 0)
+        return json_error("Ressources demandées invalides");
 
-    // Lire le XML pour identifier le disque
-    char *xml = virDomainGetXMLDesc(dom, 0);
-    char disk_path[512] = {0};
+    struct sched_req r = { name ? name : "", (unsigned long long)ram_mb << 20,
+                           (unsigned long long)disk_gb << 30, vcpus,
+                           iso && iso[0] ? iso : NULL };
+    struct sched_host *hosts[SCHED_MAX_HOSTS];
+    int n = sched_load(uris, hosts);
+    if (n == 0)
+        return json_error("Aucun hôte de placement configuré");
 
-    char *p = strstr(xml, "<source file='");
-    if (p)
-        sscanf(p, "<source file='%511[^']'", disk_path);
+    struct sched_iso_check chk = { hosts, r.iso, {0} };
+    if (r.iso)
+        parallel_for(n, sched_iso_run, &chk);
 
-    // Stopper la VM
-    virDomainDestroy(dom);
+    /* Chaque hôte reste verrouillé jusqu'à la réservation : deux
+     * placements concurrents ne voient pas la même place libre. Les
+     * verrous sont pris dans l'ordre de la table, quel que soit celui
+     * de la liste. */
+    for (int i = 0; i < SCHED_MAX_HOSTS; i++) {
+        for (int j = 0; j < n; j++)
+            if (hosts[j] == &sched_hosts_tab[i])
+                pthread_mutex_lock(&hosts[j]->lock);
+    }
 
-    // 3) Undefine
-    virDomainUndefine(dom);
+    const char *reasons[SCHED_MAX_HOSTS];
+    double scores[SCHED_MAX_HOSTS];
+    int numa[SCHED_MAX_HOSTS];
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        reasons[i] = sched_reject(hosts[i], &r);
+        if (!reasons[i] && r.iso && !chk.found[i])
+            reasons[i] = "ISO absente de cet hôte";
+        numa[i] = sched_numa_fit(hosts[i], &r);
+        /* Hors d'un nœud NUMA, la VM paie des accès mémoire distants :
+         * ces hôtes ne passent qu'après tous les autres */
+        scores[i] = sched_policies[p].score(hosts[i], &r) + (numa[i] ? 0 : 2);
+        if (!reasons[i] && (best < 0 || scores[i] < scores[best]))
+            best = i;
+    }
 
-    // Supprimer le disque s’il existe
-    if (strlen(disk_path) > 0) {
-        virStoragePoolPtr pool = virStoragePoolLookupByName(conn, "default");
-        if (pool) {
-            virStorageVolPtr vol = virStorageVolLookupByPath(conn, disk_path);
-            if (vol) {
-                virStorageVolDelete(vol, 0);
-                virStorageVolFree(vol);
-            }
-            virStoragePoolFree(pool);
+    if (best >= 0 && r.name[0]) {
+        struct sched_host *h = hosts[best];
+        if (h->nres == SCHED_MAX_RESERVED) {
+            int oldest = 0;
+            for (int i = 1; i < h->nres; i++)
+                if (h->res[i].at < h->res[oldest].at)
+                    oldest = i;
+            sched_unreserve(h, oldest);
         }
+        struct sched_reservation *res = &h->res[h->nres++];
+        snprintf(res->name, sizeof(res->name), "%s", r.name);
+        res->mem = r.mem;
+        res->disk = r.disk;
+        res->vcpus = r.vcpus;
+        res->at = time(NULL);
     }
 
-    free(xml);
-    virDomainFree(dom);
-    virConnectClose(conn);
+    struct jw w = {0};
+    jw_object_begin(&w);
+    if (best < 0) {
+        api_failed = 1;
+        jw_kstr(&w, "error", "Aucun hôte ne peut accueillir cette VM");
+    }
+    jw_kstr(&w, "uri", best >= 0 ? hosts[best]->uri : NULL);
+    jw_kstr(&w, "policy", sched_policies[p].name);
+    jw_key(&w, "hosts");
+    jw_array_begin(&w);
+    for (int i = 0; i < n; i++) {
+        jw_object_begin(&w);
+        sched_host_json(&w, hosts[i]);
+        jw_kbool(&w, "fits", !reasons[i]);
+        jw_kstr(&w, "reason", reasons[i]);
+        jw_kbool(&w, "numa_fit", numa[i]);
+        jw_kdouble(&w, "score", scores[i], 3);
+        jw_object_end(&w);
+    }
+    jw_array_end(&w);
+    jw_object_end(&w);
 
-    snprintf(msg, sizeof(msg), "VM %s supprimée.", name);
-    return msg;
+    for (int i = 0; i < n; i++)
+        pthread_mutex_unlock(&hosts[i]->lock);
+    return jw_finish(&w);
 }
 
-const char* console_vm(const char *uri, const char *name) {
-    static char msg[512];
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(msg, sizeof(msg),
-                 "{\"error\":\"Impossible de se connecter à %s\"}", uri);
-        return msg;
-    }
+/* ---------- Tâches asynchrones : file et API ---------- */
 
-    virDomainPtr dom = virDomainLookupByName(conn, name);
-    if (!dom) {
-        snprintf(msg, sizeof(msg),
-                 "{\"error\":\"VM %s introuvable\"}", name);
-        virConnectClose(conn);
-        return msg;
+static const char *job_kind_name(enum job_kind kind) {
+    switch (kind) {
+        case JOB_CREATE:  return "create";
+        case JOB_CLONE:   return "clone";
+        case JOB_MIGRATE: return "migrate";
+        case JOB_COMMIT:  return "commit";
+        case JOB_BACKUP:  return "backup";
+        case JOB_RESTORE: return "restore";
     }
+    return "unknown";
+}
 
-    /* Vérifier l'état */
-    int state, reason;
-    if (virDomainGetState(dom, &state, &reason, 0) < 0) {
-        snprintf(msg, sizeof(msg),
-                 "{\"error\":\"Impossible de lire l'état\"}");
-        virDomainFree(dom);
-        virConnectClose(conn);
-        return msg;
+static const char *job_state_name(enum job_state state) {
+    switch (state) {
+        case JOB_QUEUED:    return "queued";
+        case JOB_RUNNING:   return "running";
+        case JOB_DONE:      return "done";
+        case JOB_FAILED:    return "failed";
+        case JOB_CANCELLED: return "cancelled";
     }
+    return "unknown";
+}
 
-    /* Démarrer la VM si nécessaire */
-    if (state != VIR_DOMAIN_RUNNING) {
-        if (virDomainCreate(dom) < 0) {
-            snprintf(msg, sizeof(msg),
-                     "{\"error\":\"Impossible de démarrer %s\"}", name);
-            virDomainFree(dom);
-            virConnectClose(conn);
-            return msg;
-        }
-    }
+static char *job_run(struct job *job) {
+    char **a = job->args;
 
-    /* Lance virt-viewer dans un process fils */
-    pid_t pid = fork();
-    if (pid == 0) {
-        execlp("virt-viewer", "virt-viewer", "--connect", uri, name, NULL);
-        exit(1);  // si execlp échoue
+    switch (job->kind) {
+        case JOB_CREATE:
+            return do_create_vm(a[0], a[1], a[2], a[3], a[4], a[5], a[6], job);
+        case JOB_CLONE:
+            return do_clone_vm(a[0], a[1], a[2], a[3], job);
+        case JOB_MIGRATE:
+            return do_migrate_vm(a[0], a[1], a[2], a[3], job);
+        case JOB_COMMIT:
+            return do_snapshot_commit(a[0], a[1], job);
+        case JOB_BACKUP:
+            return do_backup_run(a[0], a[1], a[2], a[3], atoi(a[4]), job);
+        case JOB_RESTORE:
+            return do_backup_restore(a[0], a[1], a[2], a[3], job);
     }
+    return result_error("type de tâche inconnu");
+}
 
-    snprintf(msg, sizeof(msg),
-         "{\"message\":\"Console ouverte pour %s\", \"url\": \"\"}", name);
+static void *job_worker(void *arg) {
+    (void)arg;
 
-    virDomainFree(dom);
-    virConnectClose(conn);
-    return msg;
-}
+    for (;;) {
+        pthread_mutex_lock(&job_lock);
+        while (!job_head)
+            pthread_cond_wait(&job_queued, &job_lock);
 
+        struct job *job = job_head;
+        job_head = job->next;
+        if (!job_head)
+            job_tail = NULL;
+        job->next = NULL;
+        job->state = JOB_RUNNING;
+        job->started = time(NULL);
+        pthread_mutex_unlock(&job_lock);
 
-const char* clone_vm(const char *uri, const char *srcName, const char *dstName) {
-    static char msg[512];
+        char *result = job_run(job);
 
-    virConnectPtr conn = virConnectOpen(uri);
-    if (!conn) {
-        snprintf(msg, sizeof(msg), "Erreur: connexion libvirt");
-        return msg;
+        pthread_mutex_lock(&job_lock);
+        job->result = result;
+        job->finished = time(NULL);
+        if (job->cancel)
+            job->state = JOB_CANCELLED;
+        else if (!result || strncmp(result, "Erreur", 6) == 0)
+            job->state = JOB_FAILED;
+        else
+            job->state = JOB_DONE;
+        pthread_mutex_unlock(&job_lock);
     }
+    return NULL;
+}
 
-    virDomainPtr srcDom = virDomainLookupByName(conn, srcName);
-    if (!srcDom) {
-        snprintf(msg, sizeof(msg), "Erreur: VM source introuvable");
-        virConnectClose(conn);
-        return msg;
+static void job_workers_start(void) {
+    for (int i = 0; i < JOB_WORKERS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, job_worker, NULL) == 0)
+            pthread_detach(tid);
     }
+}
 
-    /* Lire le XML complet de la VM source */
-    char *xml = virDomainGetXMLDesc(srcDom, VIR_DOMAIN_XML_INACTIVE);
-    if (!xml) {
-        snprintf(msg, sizeof(msg), "Erreur: impossible de lire XML source");
-        virDomainFree(srcDom);
-        virConnectClose(conn);
-        return msg;
+static struct job *job_find(int id) {
+    for (int i = 0; i < JOB_MAX; i++) {
+        if (id > 0 && jobs[i].id == id)
+            return &jobs[i];
     }
+    return NULL;
+}
 
-    /* Extraire chemin ancien disque */
-    char oldDisk[512];
-    char *p = strstr(xml, "<source file='");
-    if (!p) {
-        snprintf(msg, sizeof(msg), "Erreur: disque source introuvable dans XML");
-        free(xml);
-        virDomainFree(srcDom);
-        virConnectClose(conn);
-        return msg;
+/* Emplacement libre, sinon la plus ancienne tâche terminée. */
+static struct job *job_alloc(void) {
+    struct job *victim = NULL;
+
+    for (int i = 0; i < JOB_MAX; i++) {
+        struct job *j = &jobs[i];
+        if (!j->id)
+            return j;
+        if (j->state >= JOB_DONE && (!victim || j->finished < victim->finished))
+            victim = j;
     }
-    sscanf(p, "<source file='%511[^']'", oldDisk);
+    if (victim) {
+        for (int i = 0; i < JOB_NARGS; i++)
+            free(victim->args[i]);
+        free(victim->result);
+    }
+    return victim;
+}
+
+/* Met une tâche en file. Retourne son identifiant, -1 si la table est pleine. */
+static int job_submit(enum job_kind kind, int nargs, const char *const *args) {
+    pthread_once(&job_once, job_workers_start);
+
+    pthread_mutex_lock(&job_lock);
+    struct job *job = job_alloc();
+    if (!job) {
+        pthread_mutex_unlock(&job_lock);
+        return -1;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->id = job_next_id++;
+    job->kind = kind;
+    job->state = JOB_QUEUED;
+    job->created = time(NULL);
+    for (int i = 0; i < nargs && i < JOB_NARGS; i++)
+        job->args[i] = strdup(args[i] ? args[i] : "");
+
+    if (job_tail)
+        job_tail->next = job;
+    else
+        job_head = job;
+    job_tail = job;
+
+    int id = job->id;
+    pthread_cond_signal(&job_queued);
+    pthread_mutex_unlock(&job_lock);
+    return id;
+}
+
+int job_submit_create(const char *uri, const char *name,
+                      const char *ram, const char *cpu,
+                      const char *disk, const char *iso, const char *osinfo) {
+    API_SCOPE(job_submit_create);
+    const char *args[] = { uri, name, ram, cpu, disk, iso, osinfo };
+    return job_submit(JOB_CREATE, 7, args);
+}
+
+int job_submit_clone(const char *uri, const char *srcName, const char *dstName,
+                     const char *mode) {
+    API_SCOPE(job_submit_clone);
+    const char *args[] = { uri, srcName, dstName, mode };
+    return job_submit(JOB_CLONE, 4, args);
+}
+
+int job_submit_migrate(const char *src_uri, const char *name, const char *dest_uri,
+                       const char *options) {
+    API_SCOPE(job_submit_migrate);
+    const char *args[] = { src_uri, name, dest_uri, options };
+    return job_submit(JOB_MIGRATE, 4, args);
+}
 
-    /* Nouveau disque */
-    char newDisk[512];
-    snprintf(newDisk, sizeof(newDisk),
-             "/var/lib/libvirt/images/%s.qcow2", dstName);
+int job_submit_commit(const char *uri, const char *name) {
+    API_SCOPE(job_submit_commit);
+    const char *args[] = { uri, name };
+    return job_submit(JOB_COMMIT, 2, args);
+}
+
+int job_submit_backup(const char *uri, const char *name, const char *dir,
+                      const char *mode, int keep) {
+    API_SCOPE(job_submit_backup);
+    char keep_s[16];
+    snprintf(keep_s, sizeof(keep_s), "%d", keep);
+    const char *args[] = { uri, name, dir, mode, keep_s };
+    return job_submit(JOB_BACKUP, 5, args);
+}
 
-    /* Copier le disque proprement */
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd),
-             "qemu-img convert -O qcow2 '%s' '%s'",
-             oldDisk, newDisk);
-    system(cmd);
+int job_submit_restore(const char *uri, const char *name, const char *dir,
+                       const char *checkpoint) {
+    API_SCOPE(job_submit_restore);
+    const char *args[] = { uri, name, dir, checkpoint };
+    return job_submit(JOB_RESTORE, 4, args);
+}
 
-    char newXML[8192];
-    strcpy(newXML, xml);
+/* Rafraîchit la progression d'une migration ou d'une sauvegarde depuis
+ * virDomainGetJobStats. */
+static void job_sample_domain(int id) {
+    pthread_mutex_lock(&job_lock);
+    struct job *job = job_find(id);
+    virDomainPtr dom = job && job->state == JOB_RUNNING ? job->dom : NULL;
+    if (dom)
+        virDomainRef(dom);
+    pthread_mutex_unlock(&job_lock);
+    if (!dom)
+        return;
 
-    /* changer <name> */
-    char *nameStart = strstr(newXML, "<name>");
-    if (nameStart) {
-        char *nameEnd = strstr(nameStart, "</name>");
-        if (nameEnd) {
-            sprintf(nameStart, "<name>%s</name>%s",
-                    dstName, nameEnd + 7);
+    int type, nparams = 0;
+    virTypedParameterPtr params = NULL;
+    if (virDomainGetJobStats(dom, &type, &params, &nparams, 0) == 0) {
+        unsigned long long done = 0, total = 0;
+        virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DATA_PROCESSED, &done);
+        virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DATA_TOTAL, &total);
+        if (!total) {
+            /* Sauvegarde : seuls les compteurs disque sont renseignés */
+            virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DISK_PROCESSED, &done);
+            virTypedParamsGetULLong(params, nparams, VIR_DOMAIN_JOB_DISK_TOTAL, &total);
         }
-    }
 
-    /* supprimer UUID */
-    char *uuidStart = strstr(newXML, "<uuid>");
-    if (uuidStart) {
-        char *uuidEnd = strstr(uuidStart, "</uuid>");
-        if (uuidEnd) {
-            sprintf(uuidStart, "%s", uuidEnd + 7);
+        pthread_mutex_lock(&job_lock);
+        if (job->id == id && job->state == JOB_RUNNING) {
+            job->done = done;
+            job->total = total;
         }
+        pthread_mutex_unlock(&job_lock);
+        virTypedParamsFree(params, nparams);
     }
+    virDomainFree(dom);
+}
 
-    /* remplacer disque */
-    while ((p = strstr(newXML, oldDisk))) {
-        memmove(p, newDisk, strlen(newDisk));
-        memmove(p + strlen(newDisk),
-                p + strlen(oldDisk),
-                strlen(p + strlen(oldDisk)) + 1);
-    }
+static void job_json(struct jw *w, const struct job *job) {
+    double progress = 0;
+    if (job->state == JOB_DONE)
+        progress = 100;
+    else if (job->total)
+        progress = 100.0 * job->done / job->total;
 
-    /* Définir la nouvelle VM */
-    virDomainPtr newDom = virDomainDefineXML(conn, newXML);
-    if (!newDom) {
-        snprintf(msg, sizeof(msg), "Erreur: impossible de créer VM clone");
-        free(xml);
-        virDomainFree(srcDom);
-        virConnectClose(conn);
-        return msg;
+    jw_object_begin(w);
+    jw_kint(w, "id", job->id);
+    jw_kstr(w, "kind", job_kind_name(job->kind));
+    jw_kstr(w, "vm", job->args[1] ? job->args[1] : "");
+    jw_kstr(w, "state", job_state_name(job->state));
+    jw_kdouble(w, "progress", progress, 1);
+    jw_kuint(w, "done", job->done);
+    jw_kuint(w, "total", job->total);
+    jw_kint(w, "created", job->created);
+    jw_kint(w, "started", job->started);
+    jw_kint(w, "finished", job->finished);
+    if (job->kind == JOB_MIGRATE && job->mig.samples) {
+        jw_key(w, "migration");
+        jw_object_begin(w);
+        jw_kuint(w, "data_remaining", job->mig.data_remaining);
+        jw_kuint(w, "bps", job->mig.bps);
+        jw_kuint(w, "dirty_bps", job->mig.dirty_bps);
+        jw_kuint(w, "iteration", job->mig.iteration);
+        jw_kuint(w, "downtime_ms", job->mig.downtime_ms);
+        jw_kint(w, "throttle", job->mig.throttle);
+        jw_kbool(w, "postcopy", job->mig.postcopy);
+        jw_object_end(w);
     }
+    if (job->result)
+        jw_kstr(w, "message", job->result);
+    jw_object_end(w);
+}
 
-    /* Lancer la VM clonée */
-    virDomainCreate(newDom);
-
-    snprintf(msg, sizeof(msg),
-             "Clone créé avec succès : %s → %s",
-             srcName, dstName);
+char* job_status(int id) {
+    API_SCOPE(job_status);
+    job_sample_domain(id);
 
-    free(xml);
-    virDomainFree(newDom);
-    virDomainFree(srcDom);
-    virConnectClose(conn);
+    pthread_mutex_lock(&job_lock);
+    struct job *job = job_find(id);
+    if (!job) {
+        pthread_mutex_unlock(&job_lock);
+        return json_error("Tâche %d introuvable", id);
+    }
 
-    return msg;
+    struct jw w = {0};
+    job_json(&w, job);
+    pthread_mutex_unlock(&job_lock);
+    return jw_finish(&w);
 }
 
-char* migrate_vm(const char* src_uri, const char* name, const char* dest_uri)
-{
-    virConnectPtr src = NULL;
-    virConnectPtr dest = NULL;
-    virDomainPtr dom = NULL;
-    virDomainPtr newDom = NULL;
+char* job_list(void) {
+    API_SCOPE(job_list);
+    int ids[JOB_MAX];
+    int n = 0;
 
-    /* Connexion source */
-    src = virConnectOpen(src_uri);
-    if (!src) {
-        const virError *e = virGetLastError();
-        return strdup(e ? e->message : "Erreur : impossible de se connecter à la source");
+    pthread_mutex_lock(&job_lock);
+    for (int i = 0; i < JOB_MAX; i++) {
+        if (jobs[i].id && jobs[i].state == JOB_RUNNING && jobs[i].dom)
+            ids[n++] = jobs[i].id;
     }
+    pthread_mutex_unlock(&job_lock);
+    for (int i = 0; i < n; i++)
+        job_sample_domain(ids[i]);
 
-    /* Connexion destination */
-    dest = virConnectOpen(dest_uri);
-    if (!dest) {
-        const virError *e = virGetLastError();
-        virConnectClose(src);
-        return strdup(e ? e->message : "Erreur : impossible de se connecter à la destination");
+    struct jw w = {0};
+    jw_object_begin(&w);
+    jw_key(&w, "jobs");
+    jw_array_begin(&w);
+    pthread_mutex_lock(&job_lock);
+    for (int i = 0; i < JOB_MAX; i++) {
+        if (jobs[i].id)
+            job_json(&w, &jobs[i]);
     }
+    pthread_mutex_unlock(&job_lock);
+    jw_array_end(&w);
+    jw_object_end(&w);
+    return jw_finish(&w);
+}
 
-    /* Recherche de la VM */
-    dom = virDomainLookupByName(src, name);
-    if (!dom) {
-        const virError *e = virGetLastError();
-        virConnectClose(dest);
-        virConnectClose(src);
-        return strdup(e ? e->message : "Erreur : VM introuvable");
+/*
+ * Annule une tâche : retirée de la file si elle n'a pas démarré, sinon
+ * la copie en cours est interrompue ou le job libvirt avorté.
+ */
+char* job_cancel(int id) {
+    API_SCOPE(job_cancel);
+    pthread_mutex_lock(&job_lock);
+    struct job *job = job_find(id);
+    if (!job) {
+        pthread_mutex_unlock(&job_lock);
+        return result_error("tâche %d introuvable", id);
     }
 
-    /* Flags identiques à ton exercice */
-    int flags = VIR_MIGRATE_LIVE |
-                VIR_MIGRATE_UNSAFE |
-                VIR_MIGRATE_UNDEFINE_SOURCE |
-                VIR_MIGRATE_PERSIST_DEST;
+    if (job->state == JOB_QUEUED) {
+        struct job **pp = &job_head;
+        job_tail = NULL;
+        while (*pp) {
+            if (*pp == job)
+                *pp = job->next;
+            else {
+                job_tail = *pp;
+                pp = &(*pp)->next;
+            }
+        }
+        job->next = NULL;
+        job->state = JOB_CANCELLED;
+        job->finished = time(NULL);
+        job->result = result_printf("Tâche %d annulée avant démarrage", id);
+        pthread_mutex_unlock(&job_lock);
+        return result_printf("Tâche %d annulée.", id);
+    }
+    if (job->state != JOB_RUNNING) {
+        pthread_mutex_unlock(&job_lock);
+        return result_error("tâche %d déjà terminée", id);
+    }
 
-    /* Migration CONNECT-TO-CONNECT */
-    newDom = virDomainMigrate(dom, dest, flags, NULL, NULL, 0);
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+    pid_t pids[PAR_WORKERS];
+    memcpy(pids, job->pids, sizeof(pids));
+    virDomainPtr dom = job->dom;
+    if (dom)
+        virDomainRef(dom);
+    pthread_mutex_unlock(&job_lock);
 
-    if (!newDom) {
-        const virError *e = virGetLastError();
+    for (int i = 0; i < PAR_WORKERS; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+    if (dom) {
+        virDomainAbortJob(dom);
         virDomainFree(dom);
-        virConnectClose(dest);
-        virConnectClose(src);
-        return strdup(e ? e->message : "Erreur : migration impossible");
     }
-
-    /* Succès */
-    virDomainFree(newDom);
-    virDomainFree(dom);
-    virConnectClose(dest);
-    virConnectClose(src);
-
-    return strdup("Migration effectuée avec succès");
+    return result_printf("Annulation de la tâche %d demandée.", id);
 }
 
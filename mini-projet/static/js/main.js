@@ -1,19 +1,67 @@
+// Vue locale des VMs (clé : UUID), tenue à jour par le flux /api/events
+let vmsParUuid = {};
+let fluxEvenements = null;
+// Noms cochés pour les actions par lot (conservés entre deux affichages)
+const vmsSelectionnees = new Set();
+// Derniers débits par VM (clé : nom), lus dans les anneaux du collecteur C
+let telemetrieParNom = {};
+
 async function chargerVMs() {
   const uri = encodeURIComponent(document.getElementById("uri").value);
-  const res = await fetch(`/api/vms?uri=${uri}`);
+  const res = await fetch(`/api/vms?uri=${uri}&fields=uuid,state,vcpus,memory`);
   const data = await res.json();
 
+  if (data.error) {
+    document.getElementById("active").innerHTML = `<p style='color:red'>${data.error}</p>`;
+    document.getElementById("inactive").innerHTML = "";
+    return;
+  }
+
+  vmsParUuid = {};
+  (data.vms || []).forEach(vm => { vmsParUuid[vm.uuid || vm.name] = vm; });
+  afficherVMs();
+
+  if (data.generation !== undefined) ecouterEvenements(uri, data.generation);
+}
+
+// Applique les deltas poussés par le serveur au lieu de recharger la liste
+function ecouterEvenements(uri, generation) {
+  if (fluxEvenements) fluxEvenements.close();
+  fluxEvenements = new EventSource(`/api/events?uri=${uri}&since=${generation}`);
+
+  fluxEvenements.addEventListener("domain", e => {
+    const ev = JSON.parse(e.data);
+    const vm = vmsParUuid[ev.uuid];
+    if (ev.removed) {
+      delete vmsParUuid[ev.uuid];
+    } else if (!vm) {
+      return chargerVMs();  // nouvelle VM : on relit ses caractéristiques
+    } else {
+      vm.name = ev.name;
+      vm.state = ev.state;
+    }
+    afficherVMs();
+  });
+  fluxEvenements.addEventListener("resync", () => chargerVMs());
+  // Pilote sans événements : retour au rechargement après chaque action
+  fluxEvenements.addEventListener("unavailable", () => {
+    fluxEvenements.close();
+    fluxEvenements = null;
+  });
+}
+
+// Recharge la liste seulement si le flux d'événements n'est pas actif
+function rafraichirVMs() {
+  if (!fluxEvenements) chargerVMs();
+}
+
+function afficherVMs() {
   const activeDiv = document.getElementById("active");
   const inactiveDiv = document.getElementById("inactive");
   activeDiv.innerHTML = "";
   inactiveDiv.innerHTML = "";
 
-  if (data.error) {
-    activeDiv.innerHTML = `<p style='color:red'>${data.error}</p>`;
-    return;
-  }
-
-  (data.vms || []).forEach(vm => {
+  Object.values(vmsParUuid).forEach(vm => {
     const card = document.createElement("div");
     card.className = "vm-card";
 
@@ -29,25 +77,37 @@ async function chargerVMs() {
         <button style="background:#e74c3c" onclick="arreterVM('${vm.name}')">Stop</button>
         <button style="background:#f39c12" onclick="restartVM('${vm.name}')">Restart</button>
         <button style="background:#2980b9" onclick="listSnapshots('${vm.name}')">Snapshots</button>
+        <button style="background:#3498db" onclick="snapshotVM('${vm.name}')">Snapshot</button>
+        <button style="background:#2c3e50" onclick="fusionnerOverlays('${vm.name}')">Fusionner</button>
+        <button style="background:#27ae60" onclick="sauvegarderVM('${vm.name}')">Sauvegarder</button>
+        <button style="background:#7f8c8d" onclick="mettreEnVeille('${vm.name}')">Veille</button>
       `;
     } else if (vm.state === "paused") {
       badgeClass = "paused";
       actions = `
         <button style="background:#3498db" onclick="reprendreVM('${vm.name}')">Reprendre</button>
+        <button style="background:#7f8c8d" onclick="mettreEnVeille('${vm.name}')">Veille</button>
         <button style="background:#e74c3c" onclick="arreterVM('${vm.name}')">Stop</button>
       `;
     } else {
       actions = `
         <button style="background:#8e44ad" onclick="clonerVM('${vm.name}')">Clone</button>
         <button style="background:#2ecc71" onclick="demarrerVM('${vm.name}')">Démarrer</button>
+        <button style="background:#7f8c8d" onclick="sortirDeVeille('${vm.name}')">Réveiller</button>
         <button style="background:#e74c3c" onclick="detruireVM('${vm.name}')">Supprimer</button>
         <button style="background:#3498db" onclick="snapshotVM('${vm.name}')">Snapshot</button>
+        <button style="background:#16a085" onclick="modeleVM('${vm.name}')">Modèle</button>
+        <button style="background:#27ae60" onclick="restaurerVM('${vm.name}')">Restaurer</button>
       `;
     }
 
     card.innerHTML = `
+      <input type="checkbox" class="vm-select" ${vmsSelectionnees.has(vm.name) ? "checked" : ""}
+             onchange="selectionnerVM('${vm.name}', this.checked)">
       <div class="badge ${badgeClass}">${vm.state}</div>
       <div class="vm-name">${vm.name}</div>
+      <div class="vm-info">${vm.vcpus || vm.max_vcpus || "?"} vCPU · ${Math.round((vm.memory_kib || vm.max_memory_kib || 0) / 1024)} MiB</div>
+      <div class="vm-info vm-metrics" data-vm="${vm.name}">${texteMetriques(telemetrieParNom[vm.name])}</div>
       <div class="actions">${actions}</div>
     `;
 
@@ -55,6 +115,35 @@ async function chargerVMs() {
     else inactiveDiv.appendChild(card);
   });
 }
+function selectionnerVM(name, coche) {
+  if (coche) vmsSelectionnees.add(name);
+  else vmsSelectionnees.delete(name);
+  document.getElementById("batchCount").textContent = `${vmsSelectionnees.size} sélectionnée(s)`;
+}
+
+// Une seule requête pour toutes les VMs cochées, traitées en parallèle côté C
+async function actionLot(action) {
+  const names = [...vmsSelectionnees];
+  if (!names.length) return alert("Aucune VM sélectionnée");
+  if (action === "destroy" && !confirm(`Supprimer ${names.length} VM(s) et leurs disques ?`)) return;
+
+  const uri = document.getElementById("uri").value;
+  const res = await fetch("/api/batch", {
+    method: "POST",
+    headers: { "Content-Type": "application/json" },
+    body: JSON.stringify({ uri, action, names })
+  });
+  const data = await res.json();
+  if (data.error) return alert(data.error);
+
+  const echecs = data.results.filter(r => !r.ok).map(r => r.message);
+  alert(`${data.ok}/${data.total} réussie(s) en ${data.elapsed_ms} ms` +
+        (echecs.length ? "\n" + echecs.join("\n") : ""));
+  if (action === "destroy") names.forEach(n => vmsSelectionnees.delete(n));
+  selectionnerVM(null, false);
+  rafraichirVMs();
+}
+
 async function detruireVM(nameParam) {
   const uri = document.getElementById("uri").value;
   const name = nameParam || document.getElementById("vmDelete").value;
@@ -65,7 +154,7 @@ async function detruireVM(nameParam) {
   });
   const data = await res.json();
   alert(data.message);
-  chargerVMs();
+  rafraichirVMs();
 }
 
 async function demarrerVM(name) {
@@ -77,7 +166,7 @@ async function demarrerVM(name) {
   });
   const data = await res.json();
   alert(data.message);
-  chargerVMs();
+  rafraichirVMs();
 }
 
 async function arreterVM(name) {
@@ -89,7 +178,7 @@ async function arreterVM(name) {
   });
   const data = await res.json();
   alert(data.message);
-  chargerVMs();
+  rafraichirVMs();
 }
 
 async function pauseVM(name) {
@@ -101,7 +190,7 @@ async function pauseVM(name) {
   });
   const data = await res.json();
   alert(data.message);
-  chargerVMs();
+  rafraichirVMs();
 }
 
 async function reprendreVM(name) {
@@ -113,24 +202,69 @@ async function reprendreVM(name) {
   });
   const data = await res.json();
   alert(data.message);
-  chargerVMs();
+  rafraichirVMs();
+}
+
+// Écrit la RAM de la VM sur disque et libère sa mémoire sur l'hôte
+async function mettreEnVeille(name) {
+  const uri = document.getElementById("uri").value;
+  const res = await fetch("/api/save", {
+    method: "POST",
+    headers: { "Content-Type": "application/json" },
+    body: JSON.stringify({ uri, name })
+  });
+  const data = await res.json();
+  alert(data.error || data.message);
+  rafraichirVMs();
+}
+
+async function sortirDeVeille(name) {
+  const uri = document.getElementById("uri").value;
+  const res = await fetch("/api/restore", {
+    method: "POST",
+    headers: { "Content-Type": "application/json" },
+    body: JSON.stringify({ uri, name })
+  });
+  const data = await res.json();
+  alert(data.message);
+  rafraichirVMs();
 }
 
 // Chargement des ISO
 async function chargerISOs() {
-  const res = await fetch("/api/iso");
-  const files = await res.json();
+  const uri = encodeURIComponent(document.getElementById("uri").value);
+  const res = await fetch(`/api/iso?uri=${uri}`);
+  const isos = await res.json();
   const select = document.getElementById("vmISO");
   select.innerHTML = "";
+  if (!Array.isArray(isos)) return;
 
-  files.forEach(fname => {
+  isos.forEach(iso => {
     const opt = document.createElement("option");
-    opt.value = "/var/lib/libvirt/images/" + fname;
-    opt.textContent = fname;
+    opt.value = iso.path;
+    opt.textContent = `${iso.name} (${iso.pool})`;
     select.appendChild(opt);
   });
 }
 
+// Téléverse le fichier choisi dans le pool "default" : le navigateur
+// envoie le fichier brut, le serveur l'écrit directement dans le volume
+async function televerserISO() {
+  const fichier = document.getElementById("isoFichier").files[0];
+  if (!fichier) return alert("Choisissez un fichier !");
+
+  const uri = encodeURIComponent(document.getElementById("uri").value);
+  const nom = encodeURIComponent(fichier.name);
+  const res = await fetch(`/api/iso/upload?uri=${uri}&pool=default&name=${nom}`, {
+    method: "PUT",
+    headers: { "Content-Type": "application/octet-stream" },
+    body: fichier
+  });
+  const data = await res.json();
+  alert(data.error ? "Erreur : " + data.error : data.message);
+  chargerISOs();
+}
+
 async function submitCreateVM() {
   const uri  = document.getElementById("uri").value;
 
@@ -140,20 +274,52 @@ async function submitCreateVM() {
   const disk = parseInt(document.getElementById("vmDisk").value);
   const iso  = document.getElementById("vmISO").value;
   const osinfo = document.getElementById("vmOS").value;
+  const policy = document.getElementById("vmPlacement").value;
 
   if (!name) return alert("Veuillez entrer un nom !");
 
-  const res = await fetch("/api/create", {
+  closeCreateVM();
+  // uri "auto" : le serveur choisit l'hôte parmi SCHED_HOSTS
+  await lancerTache({ kind: "create", uri: policy ? "auto" : uri, policy,
+                      name, ram, cpu, disk, iso, osinfo });
+}
+
+// Soumet une opération longue comme tâche puis suit sa progression
+async function lancerTache(params) {
+  const res = await fetch("/api/jobs", {
     method: "POST",
-    headers: {"Content-Type": "application/json"},
-    body: JSON.stringify({ uri, name, ram, cpu, disk, iso, osinfo  })
+    headers: { "Content-Type": "application/json" },
+    body: JSON.stringify(params)
   });
-
   const data = await res.json();
-  alert(data.message);
+  if (data.error) return alert(data.error);
 
-  closeCreateVM();
-  chargerVMs();
+  const job = await suivreTache(data.id);
+  alert(job.message || `Tâche ${job.id} : ${job.state}`);
+  rafraichirVMs();
+}
+
+async function suivreTache(id) {
+  const etat = document.getElementById("jobs");
+  for (;;) {
+    const res = await fetch(`/api/jobs/${id}`);
+    const job = await res.json();
+    if (job.error) return job;
+
+    etat.textContent = `${job.kind} ${job.vm} : ${job.state} (${job.progress.toFixed(1)} %)`;
+    if (job.migration) {
+      const m = job.migration;
+      const mib = n => (n / 1048576).toFixed(0);
+      etat.textContent += ` · ${mib(m.bps)} MiB/s, salies ${mib(m.dirty_bps)} MiB/s, ` +
+                          `reste ${mib(m.data_remaining)} MiB, passe ${m.iteration}` +
+                          (m.postcopy ? ", post-copy" : "");
+    }
+    if (["done", "failed", "cancelled"].includes(job.state)) {
+      etat.textContent = "";
+      return job;
+    }
+    await new Promise(r => setTimeout(r, 1000));
+  }
 }
 
 function openCreateVM() {
@@ -187,36 +353,63 @@ async function clonerVM(srcName) {
     const dstName = prompt("Nom du clone :");
     if (!dstName) return;
 
+    // Clone lié : overlay qcow2 instantané (la source doit être éteinte)
+    const lie = confirm("Clone lié (instantané, partage le disque source) ?\nAnnuler = copie complète.");
+    const mode = lie ? "linked" : "full";
+
+    const uri = document.getElementById("uri").value;
+
+    await lancerTache({ kind: "clone", uri, src: srcName, dst: dstName, mode });
+}
+
+// Enregistre la VM comme modèle puis propose d'en créer des instances
+async function modeleVM(name) {
     const uri = document.getElementById("uri").value;
 
-    const res = await fetch("/api/clone", {
+    const res = await fetch("/api/templates", {
         method: "POST",
-        headers: {"Content-Type":"application/json"},
-        body: JSON.stringify({ uri, src: srcName, dst: dstName })
+        headers: { "Content-Type": "application/json" },
+        body: JSON.stringify({ uri, name })
     });
-
     const data = await res.json();
     alert(data.message);
-    chargerVMs();
+    if (data.message.startsWith("Erreur")) return;
+
+    const count = parseInt(prompt("Nombre d'instances à créer (0 = aucune) :", "0"), 10);
+    if (count > 0) await instancierModele(name, count);
 }
 
-async function migrerVM(name) {
-    const dest = prompt("URI de destination ?");
-    const uri  = document.getElementById("uri").value;
+async function instancierModele(name, count) {
+    const uri = document.getElementById("uri").value;
 
-    const res = await fetch("/api/migrate", {
+    const res = await fetch(`/api/templates/${encodeURIComponent(name)}/instances`, {
         method: "POST",
         headers: { "Content-Type": "application/json" },
-        body: JSON.stringify({
-            uri: uri,
-            name: name,
-            dest: dest
-        })
+        body: JSON.stringify({ uri, count })
     });
-
     const data = await res.json();
-    alert(data.message);
-    chargerVMs();
+    if (data.error) {
+        alert(data.error);
+        return;
+    }
+    alert(data.instances
+        .map(i => i.ok ? `${i.name} (${i.mac})` : `${i.name} : ${i.error}`)
+        .join("\n"));
+    rafraichirVMs();
+}
+
+async function migrerVM(name) {
+    const dest = prompt("URI de destination ?");
+    const uri  = document.getElementById("uri").value;
+
+    if (!dest) return;
+    // Plafond de bande passante (MiB/s) ; post-copy automatique si la VM
+    // salit sa mémoire plus vite que le lien ne la transfère
+    const bandwidth = prompt("Bande passante max (MiB/s, vide = illimitée) ?") || "";
+    await lancerTache({
+        kind: "migrate", uri, name, dest,
+        bandwidth, parallel: 4, auto_converge: true, postcopy: "auto"
+    });
 }
 
 async function restartVM(name) {
@@ -231,7 +424,7 @@ async function restartVM(name) {
   const data = await res.json();
   alert(data.message || data.error);
 
-  chargerVMs();
+  rafraichirVMs();
 }
 
 async function snapshotVM(name) {
@@ -239,17 +432,19 @@ async function snapshotVM(name) {
 
     const snap = prompt("Nom du snapshot :");
     if (!snap) return;
+    const mode = prompt("Mode (internal, disk-only, live) :", "disk-only");
+    if (!mode) return;
 
     const res = await fetch("/api/snapshot", {
         method: "POST",
         headers: { "Content-Type": "application/json" },
-        body: JSON.stringify({ uri, name, snapshot: snap })
+        body: JSON.stringify({ uri, name, snapshot: snap, mode })
     });
 
     const data = await res.json();
     alert(data.message || data.error);
 
-    chargerVMs();
+    rafraichirVMs();
 }
 
 async function listSnapshots(name) {
@@ -262,10 +457,46 @@ async function listSnapshots(name) {
     const data = await res.json();
     if (data.error) return alert(data.error);
 
-    const snap = prompt("Snapshots disponibles:\n" + data.snapshots.join("\n") + "\nNom du snapshot à restaurer :");
+    // Arbre indenté par profondeur, snapshot courant marqué d'une étoile
+    const lignes = data.snapshots.map(s =>
+        "  ".repeat(s.depth) + s.name + (s.current ? " *" : "") +
+        ` (${new Date(s.created * 1000).toLocaleString()}, ${s.disk_only ? "disque seul" : s.state})`);
+    const snap = prompt("Snapshots disponibles:\n" + lignes.join("\n") + "\nNom du snapshot à restaurer :");
     if (snap) revertSnapshot(name, snap);
 }
 
+// Refusionne les overlays des snapshots externes (tâche asynchrone)
+async function fusionnerOverlays(name) {
+    const uri = document.getElementById("uri").value;
+    if (!confirm(`Fusionner les overlays de ${name} dans leurs images de base ?`)) return;
+    await lancerTache({ kind: "commit", uri, name });
+}
+
+// Sauvegarde complète ou incrémentale (tâche asynchrone)
+async function sauvegarderVM(name) {
+    const uri = document.getElementById("uri").value;
+    const mode = prompt("Type de sauvegarde : auto, full ou incremental", "auto");
+    if (!mode) return;
+    await lancerTache({ kind: "backup", uri, name, mode });
+}
+
+// Restaure une VM éteinte à l'une de ses sauvegardes
+async function restaurerVM(name) {
+    const uri = document.getElementById("uri").value;
+    const res = await fetch(`/api/backups/${encodeURIComponent(name)}`);
+    const data = await res.json();
+    if (data.error) return alert(data.error);
+    if (!data.backups.length) return alert(`Aucune sauvegarde pour ${name}`);
+
+    const lignes = data.backups.map(b =>
+        `${b.checkpoint} (${b.kind === "full" ? "complète" : "incrémentale"}, ` +
+        `${new Date(b.created * 1000).toLocaleString()}, ${(b.bytes / 1048576).toFixed(0)} MiB)`);
+    const checkpoint = prompt("Sauvegardes :\n" + lignes.join("\n") + "\nSauvegarde à restaurer :",
+                              data.backups[data.backups.length - 1].checkpoint);
+    if (!checkpoint) return;
+    await lancerTache({ kind: "restore", uri, name, checkpoint });
+}
+
 async function revertSnapshot(name, snapname) {
     const uri = document.getElementById("uri").value;
     const res = await fetch("/api/revert_snapshot", {
@@ -275,10 +506,61 @@ async function revertSnapshot(name, snapname) {
     });
     const data = await res.json();
     alert(data.message);
-    chargerVMs();
+    rafraichirVMs();
+}
+
+// ---------- Télémétrie ----------
+
+function debit(octetsParSeconde) {
+  const unites = ["o/s", "Ko/s", "Mo/s", "Go/s"];
+  let v = octetsParSeconde || 0, i = 0;
+  while (v >= 1024 && i < unites.length - 1) { v /= 1024; i++; }
+  return `${v.toFixed(i ? 1 : 0)} ${unites[i]}`;
+}
+
+function texteMetriques(m) {
+  if (!m || m.cpu_percent === undefined) return "";
+  const iops = Math.round((m.rd_iops || 0) + (m.wr_iops || 0));
+  return `CPU ${m.cpu_percent.toFixed(1)} % · disque ${debit(m.rd_bps + m.wr_bps)} (${iops} IOPS)` +
+         ` · réseau ${debit(m.rx_bps + m.tx_bps)}`;
+}
+
+// Courbe SVG d'une série de pourcentages (0–100)
+function tracerCourbe(svg, valeurs) {
+  const l = svg.clientWidth || 300, h = svg.clientHeight || 60;
+  const pas = valeurs.length > 1 ? l / (valeurs.length - 1) : 0;
+  const points = valeurs.map((v, i) => `${(i * pas).toFixed(1)},${(h - v / 100 * h).toFixed(1)}`);
+  svg.innerHTML = `<polyline points="${points.join(" ")}"/>`;
+}
+
+async function chargerTelemetrie() {
+  const uri = encodeURIComponent(document.getElementById("uri").value);
+  try {
+    const res = await fetch(`/api/telemetry?uri=${uri}&window=30`);
+    const data = await res.json();
+    if (data.error) return;
+
+    telemetrieParNom = {};
+    (data.vms || []).forEach(m => { telemetrieParNom[m.name] = m; });
+    document.querySelectorAll(".vm-metrics").forEach(div => {
+      div.textContent = texteMetriques(telemetrieParNom[div.dataset.vm]);
+    });
+
+    const hote = data.host || {};
+    document.getElementById("hostMetrics").textContent =
+      `CPU ${(hote.cpu_percent || 0).toFixed(1)} % · iowait ${(hote.iowait_percent || 0).toFixed(1)} %` +
+      ` · mémoire ${(hote.mem_used_percent || 0).toFixed(1)} % de ${Math.round((hote.mem_total_kib || 0) / 1048576)} Gio`;
+
+    const serie = await (await fetch(`/api/telemetry/host?uri=${uri}&window=600`)).json();
+    if (!serie.error) tracerCourbe(document.getElementById("hostGraph"), serie.cpu_percent);
+  } catch (e) {
+    // Serveur indisponible : nouvel essai au prochain tour
+  }
 }
 
 window.onload = function() {
   chargerVMs();
   chargerISOs();
+  chargerTelemetrie();
+  setInterval(chargerTelemetrie, 5000);
 };